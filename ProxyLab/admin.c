@@ -0,0 +1,142 @@
+/*
+ * admin.c
+ *
+ * the admin port. Requests are answered in the order they come, so two
+ * purges never run at once, and a long one makes the next wait.
+ */
+
+#include "csapp.h"
+#include "admin.h"
+#include "purge.h"
+#include "logger.h"
+
+/* the routes of the admin port */
+static struct {
+    char *path;
+    int scope;
+    int soft;
+} routes[] = {
+    {"/purge/url/", PURGE_URL, 0},
+    {"/purge/prefix/", PURGE_PREFIX, 0},
+    {"/purge/host/", PURGE_HOST, 0},
+    {"/soft-purge/url/", PURGE_URL, 1},
+    {"/soft-purge/prefix/", PURGE_PREFIX, 1},
+    {"/soft-purge/host/", PURGE_HOST, 1},
+    {NULL, 0, 0}
+};
+
+/*
+ * answer
+ *
+ * write a response with a line of text as its body.
+ */
+static void answer(int fd, char *status, char *text) {
+    char buf[MAXLINE];
+    int n;
+
+    n = snprintf(buf, MAXLINE, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\n"
+                 "Content-Length: %d\r\n\r\n%s\n", status,
+                 (int)strlen(text) + 1, text);
+    rio_writen(fd, buf, n < MAXLINE ? n : MAXLINE - 1);
+}
+
+/*
+ * admin_serve
+ *
+ * read one request and do what it asks.
+ */
+static void admin_serve(int fd) {
+    char buf[MAXLINE], method[MAXLINE], target[MAXLINE], text[MAXLINE];
+    long count;
+    rio_t rio;
+    int i;
+
+    Rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0 ||
+        sscanf(buf, "%s %s", method, target) != 2) {
+        return;
+    }
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+        ;
+    }
+    if (strcmp(method, "POST") != 0 && strcmp(method, "PURGE") != 0) {
+        answer(fd, "405 Method Not Allowed", "use POST or PURGE");
+        return;
+    }
+    for (i = 0; routes[i].path != NULL; i++) {
+        if (strncmp(target, routes[i].path, strlen(routes[i].path)) == 0) {
+            break;
+        }
+    }
+    if (routes[i].path == NULL) {
+        answer(fd, "404 Not Found", "no such admin request");
+        return;
+    }
+    if ((count = purge(target + strlen(routes[i].path), routes[i].scope,
+                       routes[i].soft)) == -1) {
+        answer(fd, "400 Bad Request", "not a URL or host");
+        return;
+    }
+    snprintf(text, MAXLINE, "%s %ld", routes[i].soft ? "stale" : "purged",
+             count);
+    answer(fd, "200 OK", text);
+}
+
+/*
+ * admin_thread
+ *
+ * accept the clients of the admin port one by one.
+ */
+static void *admin_thread(void *vargp) {
+    int listenfd = *(int *)vargp, fd;
+    struct timeval tv = {ADMIN_TIMEOUT, 0};
+
+    Free(vargp);
+    Pthread_detach(pthread_self());
+    while (1) {
+        if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        admin_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * admin_init
+ *
+ * listen on port of the loopback interface and start answering. The port
+ * is shared with SO_REUSEPORT, so a hot upgrade can start its own while
+ * the old process still has it. return -1 if failed.
+ */
+int admin_init(int port) {
+    struct sockaddr_in addr;
+    int *listenfd, optval = 1;
+    pthread_t tid;
+
+    if ((listenfd = (int *)Malloc(sizeof(int))) == NULL) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short)port);
+    if ((*listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(*listenfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                   sizeof(optval)) < 0 ||
+        setsockopt(*listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                   sizeof(optval)) < 0 ||
+        bind(*listenfd, (SA *)&addr, sizeof(addr)) < 0 ||
+        listen(*listenfd, LISTENQ) < 0 ||
+        pthread_create(&tid, NULL, admin_thread, listenfd) != 0) {
+        log_error("admin_init: can not listen on port %d\n", port);
+        if (*listenfd >= 0) {
+            close(*listenfd);
+        }
+        Free(listenfd);
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,24 @@
+/*
+ * admin.h
+ *
+ * the admin port of the proxy, on the loopback interface only. A thread of
+ * its own answers one request per connection, one at a time:
+ *
+ *   POST /purge/url/URL          purge the responses of URL
+ *   POST /purge/prefix/PREFIX    and of every URL starting with PREFIX
+ *   POST /purge/host/HOST        and of every URL of HOST
+ *
+ * with /soft-purge/ instead of /purge/ they are only marked stale, see
+ * purge.h. PURGE works as well as POST. The answer says how many cached
+ * ids were purged.
+ */
+
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+/* seconds a client of the admin port has to send its request */
+#define ADMIN_TIMEOUT 5
+
+int admin_init(int port);
+
+#endif /* __ADMIN_H__ */
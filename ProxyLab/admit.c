@@ -0,0 +1,341 @@
+/*
+ * admit.c
+ *
+ * admission control of the fetches from origins. Every limit is kept as
+ * a fraction, the whole part of it is how many fetches may run at once.
+ * A fetch that answers in time adds 1/limit, about one more per round of
+ * fetches, a slow or failed one takes ADMIT_BACKOFF of it away. Slow is
+ * against a baseline of the origin that follows its fastest times to 
+ * first byte and drifts up slowly, so an origin that became slower for
+ * good is learned. The global limit only shrinks when fetches fail, a
+ * slow origin is held back by its own limit and does not hold back the
+ * others.
+ * All the state is under one mutex, a fetch only takes it twice, and the
+ * waiters are woken with a broadcast whenever a fetch is done.
+ */
+
+#include "csapp.h"
+#include "admit.h"
+#include "stats.h"
+
+/* a fetch this many times slower than the baseline is too slow */
+#define ADMIT_TOLERANCE 2
+/* what a slow or failed fetch leaves of a limit */
+#define ADMIT_BACKOFF 0.9
+/* the baseline moves 1/ADMIT_DRIFT of the way to a slower time */
+#define ADMIT_DRIFT 256
+
+/* one adaptive limit */
+typedef struct limiter {
+    double limit;              /* fetches at once, whole part counts */
+    int max;                   /* the limit never grows beyond */
+    int inflight;              /* fetches running */
+} limiter;
+
+/* the limit of one origin */
+typedef struct admit_origin {
+    char *key;                 /* host:port */
+    unsigned int hash;         /* hash of the key */
+    limiter lim;               /* its limit */
+    long baseline;             /* ns to first byte when all is well */
+    struct admit_origin *next; /* next origin in the same bucket */
+} admit_origin;
+
+static int enabled = 0;
+static int max_queue;          /* fetches that may wait at once */
+static int max_wait;           /* ms a fetch may wait */
+static int per_origin;         /* max of the limit of each origin */
+static int waiting;            /* fetches waiting now */
+static limiter global;         /* all origins together */
+static admit_origin *buckets[ADMIT_BUCKETS];
+static admit_origin other;     /* origins beyond ADMIT_ORIGINS */
+static int norigins;           /* origins in the table */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+
+/* start a limit at its max, it comes down once the origin is slow */
+static void limiter_init(limiter *lim, int max) {
+    lim->limit = max;
+    lim->max = max;
+    lim->inflight = 0;
+}
+
+/*
+ * admit_init
+ *
+ * let at most global_max fetches run at once, and origin_max to one
+ * origin, with at most queue of them waiting up to wait_ms each. A
+ * global_max of 0 lets everything in.
+ */
+void admit_init(int global_max, int origin_max, int queue, int wait_ms) {
+    if (global_max <= 0) {
+        return;
+    }
+    limiter_init(&global, global_max);
+    per_origin = origin_max > 0 ? origin_max : global_max;
+    other.key = "other";
+    other.baseline = 0;
+    limiter_init(&other.lim, per_origin);
+    max_queue = queue;
+    max_wait = wait_ms;
+    enabled = 1;
+}
+
+/* FNV-1a hash of a key */
+static unsigned int key_hash(char *key) {
+    unsigned int h = 2166136261U;
+
+    for (; *key != '\0'; key++) {
+        h = (h ^ (unsigned char)*key) * 16777619U;
+    }
+    return h;
+}
+
+/*
+ * find_origin
+ *
+ * the limit of host:port, made on first use. Caller holds the lock.
+ */
+static admit_origin *find_origin(char *host, char *port) {
+    char key[MAXLINE];
+    admit_origin *origin;
+    unsigned int hash;
+
+    snprintf(key, MAXLINE, "%.4000s:%.64s", host, port);
+    hash = key_hash(key);
+    for (origin = buckets[hash % ADMIT_BUCKETS]; origin != NULL;
+         origin = origin->next) {
+        if (origin->hash == hash && strcmp(origin->key, key) == 0) {
+            return origin;
+        }
+    }
+    if (norigins >= ADMIT_ORIGINS ||
+        (origin = (admit_origin *)Malloc(sizeof(admit_origin))) == NULL) {
+        return &other;
+    }
+    if ((origin->key = (char *)Malloc(strlen(key) + 1)) == NULL) {
+        Free(origin);
+        return &other;
+    }
+    strcpy(origin->key, key);
+    origin->hash = hash;
+    origin->baseline = 0;
+    limiter_init(&origin->lim, per_origin);
+    origin->next = buckets[hash % ADMIT_BUCKETS];
+    buckets[hash % ADMIT_BUCKETS] = origin;
+    norigins++;
+    return origin;
+}
+
+/* room for one more fetch to origin, caller holds the lock */
+static int fits(admit_origin *origin) {
+    return origin->lim.inflight < (int)origin->lim.limit &&
+           global.inflight < (int)global.limit;
+}
+
+/*
+ * admit_acquire
+ *
+ * ask to fetch from host:port, waiting for room if the limits are
+ * reached and the queue is not full. return 1 if let in, the ticket goes
+ * to admit_release once the fetch is done, -1 if it is to be shed.
+ */
+int admit_acquire(admit_ticket *ticket, char *host, char *port) {
+    admit_origin *origin;
+    struct timespec deadline;
+    int rc = 0;
+
+    ticket->origin = NULL;
+    ticket->latency = 0;
+    if (!enabled) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&lock);
+    origin = find_origin(host, port);
+    if (!fits(origin)) {
+        if (waiting >= max_queue) {
+            pthread_mutex_unlock(&lock);
+            stat_add(STAT_ADMIT_SHED, 1);
+            return -1;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += max_wait / 1000;
+        deadline.tv_nsec += (max_wait % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        stat_add(STAT_ADMIT_QUEUED, 1);
+        waiting++;
+        while (!fits(origin) && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&done, &lock, &deadline);
+        }
+        waiting--;
+        if (!fits(origin)) {
+            pthread_mutex_unlock(&lock);
+            stat_add(STAT_ADMIT_SHED, 1);
+            return -1;
+        }
+    }
+    origin->lim.inflight++;
+    global.inflight++;
+    pthread_mutex_unlock(&lock);
+
+    ticket->origin = origin;
+    clock_gettime(CLOCK_MONOTONIC, &ticket->start);
+    return 1;
+}
+
+/*
+ * admit_first_byte
+ *
+ * the origin of a fetch started to answer, which is what it is timed by.
+ */
+void admit_first_byte(admit_ticket *ticket) {
+    struct timespec now;
+
+    if (ticket->origin == NULL || ticket->latency > 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ticket->latency = (now.tv_sec - ticket->start.tv_sec) * 1000000000L +
+                      (now.tv_nsec - ticket->start.tv_nsec);
+    if (ticket->latency <= 0) {
+        ticket->latency = 1;
+    }
+}
+
+/*
+ * on_time
+ *
+ * judge a fetch from origin that took latency ns to its first byte, or
+ * failed if ok is 0, and move the baseline of the origin. return 1 if it
+ * was in time. Caller holds the lock.
+ */
+static int on_time(admit_origin *origin, long latency, int ok) {
+    if (!ok || latency <= 0) {
+        return 0;
+    }
+    if (origin->baseline == 0 || latency < origin->baseline) {
+        origin->baseline = latency;
+    } else {
+        origin->baseline += (latency - origin->baseline) / ADMIT_DRIFT;
+    }
+    return latency <= ADMIT_TOLERANCE * origin->baseline;
+}
+
+/*
+ * adapt
+ *
+ * grow a limit after a fetch in time, shrink it after one that was not.
+ * Caller holds the lock.
+ */
+static void adapt(limiter *lim, int in_time) {
+    if (in_time) {
+        lim->limit += 1.0 / lim->limit;
+        if (lim->limit > lim->max) {
+            lim->limit = lim->max;
+        }
+        return;
+    }
+    lim->limit *= ADMIT_BACKOFF;
+    if (lim->limit < 1) {
+        lim->limit = 1;
+    }
+    stat_add(STAT_ADMIT_BACKOFFS, 1);
+}
+
+/*
+ * admit_release
+ *
+ * a fetch let in by admit_acquire is done, ok is 0 if it failed. Its
+ * limits learn from it and the waiters are woken.
+ */
+void admit_release(admit_ticket *ticket, int ok) {
+    admit_origin *origin = ticket->origin;
+    int in_time;
+
+    if (origin == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    origin->lim.inflight--;
+    global.inflight--;
+    in_time = on_time(origin, ticket->latency, ok);
+    adapt(&origin->lim, in_time);
+    adapt(&global, ok);
+    pthread_cond_broadcast(&done);
+    pthread_mutex_unlock(&lock);
+    ticket->origin = NULL;
+}
+
+/*
+ * admit_extra
+ *
+ * let the fetch of ticket open one more connection to its origin, a hedge,
+ * if the limits have room for it now. It never waits. return 1 if let in,
+ * it goes to admit_extra_release once the connection is closed, -1 if not.
+ */
+int admit_extra(admit_ticket *ticket) {
+    admit_origin *origin = ticket->origin;
+
+    if (origin == NULL) {
+        return 1;
+    }
+    pthread_mutex_lock(&lock);
+    if (!fits(origin)) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    origin->lim.inflight++;
+    global.inflight++;
+    pthread_mutex_unlock(&lock);
+    return 1;
+}
+
+/*
+ * admit_extra_release
+ *
+ * the extra connection of the fetch of ticket is closed. The limits do not
+ * learn from it, the fetch is judged once, by admit_release.
+ */
+void admit_extra_release(admit_ticket *ticket) {
+    admit_origin *origin = ticket->origin;
+
+    if (origin == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    origin->lim.inflight--;
+    global.inflight--;
+    pthread_cond_broadcast(&done);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * admit_cancel
+ *
+ * a fetch let in by admit_acquire never got to its origin, for a reason
+ * of our own. Its place is given back and the limits learn nothing.
+ */
+void admit_cancel(admit_ticket *ticket) {
+    admit_extra_release(ticket);
+    ticket->origin = NULL;
+}
+
+/*
+ * admit_report
+ *
+ * print the global limit and how many fetches are running and waiting.
+ */
+void admit_report(FILE *fp) {
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    fprintf(fp, "limits: upstream %.1f of %d, %d fetching %d waiting, "
+            "%d origins\n", global.limit, global.max, global.inflight,
+            waiting, norigins);
+    pthread_mutex_unlock(&lock);
+}
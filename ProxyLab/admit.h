@@ -0,0 +1,41 @@
+/*
+ * admit.h
+ *
+ * admission control of the fetches from origins. Each origin, and all of
+ * them together, have a limit of fetches at once that adapts to how the
+ * origin answers: it grows by one per limit of fetches answered in time,
+ * and shrinks by a fraction whenever one is slow against the usual time
+ * to first byte, or fails (AIMD). A fetch over the limit waits in a short
+ * bounded queue, and is shed when the queue is full or the wait too long,
+ * so the caller can answer 503 at once. Cache hits never come here, they
+ * are served whatever the origins do.
+ */
+
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <stdio.h>
+#include <time.h>
+
+/* most origins with a limit of their own, the rest share one */
+#define ADMIT_ORIGINS 4096
+/* buckets of the table of origins */
+#define ADMIT_BUCKETS 1024
+
+/* a fetch that was let in, released when it is done */
+typedef struct admit_ticket {
+    struct admit_origin *origin; /* its origin, NULL if not limited */
+    struct timespec start;     /* when it was let in */
+    long latency;              /* ns to the first byte, 0 if none yet */
+} admit_ticket;
+
+void admit_init(int global_max, int origin_max, int queue, int wait_ms);
+int admit_acquire(admit_ticket *ticket, char *host, char *port);
+void admit_first_byte(admit_ticket *ticket);
+void admit_release(admit_ticket *ticket, int ok);
+void admit_cancel(admit_ticket *ticket);
+int admit_extra(admit_ticket *ticket);
+void admit_extra_release(admit_ticket *ticket);
+void admit_report(FILE *fp);
+
+#endif /* __ADMIT_H__ */
@@ -3,186 +3,1197 @@
  *
  * Name: Kaiyuan Tang
  * AndrewID: kaiyuant
- * 
- * this is the cache for the tiny proxy, it could search the cache and 
- * forward back the cached response. And the eviction policy is LRU.
- * The cache is maintained as a single linked list. New item is always 
- * inserted in the back, and when a item is used, create a new item and
- * add it to the last. This could seem inefficient, but it greatly reduce 
- * the risk of messing up the whole cache system. As all operations are 
- * on the front or the back. And the result shows that it is indeed 
- * a better solution than manipulating the list ops say: deleting
- * it and insert back. And repeatly request for one small content is rare. 
- * Evicting LRU item can simply evict the head of the list.
- */
- 
+ *
+ * this is the cache for the tiny proxy, it could search the cache and
+ * forward back the cached response. The items are kept in a hash table
+ * whose chains are published with atomic stores, so readers walk it without
+ * taking any lock. Writers are still serialized by one semaphore. An item
+ * that is unlinked by a writer is not freed at once: it waits in a limbo
+ * list until every reader that might still see it has left (epoch based
+ * reclamation). Eviction is CLOCK, an approximation of LRU: a hit only sets
+ * the referenced bit of the item, and the writer gives referenced items a
+ * second chance before evicting them from the head of the insertion list.
+ *
+ * An item can also be pinned: every pin holds a reference, and the memory
+ * of an unlinked item stays until the last reference is gone. Each item
+ * gets a new generation number when it is inserted, which drops to 0 when
+ * it is unlinked, so whoever keeps a pin can tell it went stale.
+ *
+ * If on_evict is set, every evicted item is passed to it after the write
+ * lock is released, e.g. to demote it to the disk tier.
+ *
+ * The content of an item is a chain of chunks of at most CACHE_CHUNK_SIZE
+ * bytes, filled while the response streams in, so a large object never
+ * needs one big allocation. The chunks may also point into a read only
+ * mapping, like a snapshot loaded at startup. Such items are checked
+ * against their checksum on the first hit, and the mapping goes away with
+ * the last item.
+ *
+ * The chunks after the header block are a body, deduplicated through a
+ * store keyed by a hash of the bytes. The store is only used by writers
+ * under the write lock, readers just follow the chunks. An item holds a
+ * reference on its body, the last one frees it, while the store only
+ * keeps bodies that linked items use.
+ */
+
 #include "cache.h"
- 
- 
+#include "lz.h"
+
+/* reader slot for the epoch based reclamation, one cache line each */
+typedef struct epoch_slot {
+    atomic_ulong epoch;        /* epoch the reader entered in, 0 if idle */
+    atomic_int in_use;         /* 1 if the slot is owned by a thread */
+} __attribute__((aligned(64))) epoch_slot;
+
+static epoch_slot slots[EPOCH_SLOTS];
+/* the global epoch has its own line, readers only ever load it */
+static _Alignas(64) atomic_ulong global_epoch = 1;
+
+static __thread epoch_slot *my_slot = NULL;
+static __thread int holds_write = 0;  /* reader fell back to write lock */
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+
+/*
+ * cache_hash
+ *
+ * FNV-1a hash of the cache id.
+ */
+unsigned int cache_hash(char *cache_id) {
+    unsigned int hash = 2166136261u;
+    while (*cache_id) {
+        hash ^= (unsigned char)*cache_id++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * release_slot
+ *
+ * thread exit destructor, give the reader slot back.
+ */
+static void release_slot(void *arg) {
+    epoch_slot *slot = (epoch_slot *)arg;
+    atomic_store(&slot->epoch, 0);
+    atomic_store(&slot->in_use, 0);
+}
+
+static void make_slot_key() {
+    pthread_key_create(&slot_key, release_slot);
+}
+
+/*
+ * claim_slot
+ *
+ * find a free reader slot for the calling thread. A thread claims it once
+ * and keeps it until it exits. return NULL if all slots are taken.
+ */
+static epoch_slot *claim_slot() {
+    int i, start, expected;
+    epoch_slot *slot;
+
+    Pthread_once(&slot_once, make_slot_key);
+    /* start somewhere different for each thread to spread the CAS */
+    start = (int)(((unsigned long)pthread_self() >> 12) % EPOCH_SLOTS);
+    for (i = 0; i < EPOCH_SLOTS; i++) {
+        slot = &slots[(start + i) % EPOCH_SLOTS];
+        expected = 0;
+        if (atomic_load_explicit(&slot->in_use, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&slot->in_use, &expected, 1)) {
+            pthread_setspecific(slot_key, slot);
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * read_begin
+ *
+ * enter the read side. Publish the current epoch in our own slot, nothing
+ * shared is written. If no slot is left, fall back to the write lock.
+ */
+static void read_begin(cache *pcache) {
+    if (my_slot == NULL && (my_slot = claim_slot()) == NULL) {
+        P(&(pcache->write));
+        holds_write = 1;
+        return;
+    }
+    atomic_store_explicit(&my_slot->epoch, atomic_load(&global_epoch),
+                          memory_order_relaxed);
+    /* the epoch must be visible before we load any bucket */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * read_end
+ *
+ * leave the read side, items we saw may be freed after this.
+ */
+static void read_end(cache *pcache) {
+    if (holds_write) {
+        holds_write = 0;
+        V(&(pcache->write));
+        return;
+    }
+    atomic_store_explicit(&my_slot->epoch, 0, memory_order_release);
+}
+
+/*
+ * free_chunks
+ *
+ * Free a chain of chunks.
+ */
+static void free_chunks(cache_chunk *chunk) {
+    cache_chunk *next;
+    while (chunk != NULL) {
+        next = chunk->next;
+        Free(chunk);
+        chunk = next;
+    }
+}
+
 /*
- * init_cache  
- * 
+ * chunks_hash
+ *
+ * fast 64 bit hash of size bytes in a chain of chunks, eight bytes at a
+ * time. The result does not depend on how the bytes are cut into chunks,
+ * a word split over two chunks is put together first.
+ */
+static unsigned long chunks_hash(cache_chunk *chunks, long size) {
+    unsigned long hash = 0x9e3779b97f4a7c15ul ^ size, word;
+    unsigned char tail[8];     /* bytes of a word split over two chunks */
+    int have = 0, i;
+    cache_chunk *chunk;
+    unsigned char *p;
+    long len;
+
+    for (chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        p = (unsigned char *)chunk->data;
+        len = chunk->len;
+        while (have > 0 && len > 0) {
+            tail[have++] = *p++;
+            len--;
+            if (have == 8) {
+                memcpy(&word, tail, 8);
+                hash = (hash ^ word) * 0xff51afd7ed558ccdul;
+                hash ^= hash >> 32;
+                have = 0;
+            }
+        }
+        while (len >= 8) {
+            memcpy(&word, p, 8);
+            hash = (hash ^ word) * 0xff51afd7ed558ccdul;
+            hash ^= hash >> 32;
+            p += 8;
+            len -= 8;
+        }
+        while (len-- > 0) {
+            tail[have++] = *p++;
+        }
+    }
+    for (i = 0; i < have; i++) {
+        hash = (hash ^ tail[i]) * 0x100000001b3ul;
+    }
+    return hash ^ (hash >> 29);
+}
+
+/*
+ * free_item
+ *
+ * Free what we allocated for one item.
+ */
+static void free_item(cache_item *item) {
+    cache_chunk *chunk, *next;
+    cache_body *body = item->body;
+
+    /* the chunks up to the body are the item's own */
+    for (chunk = item->chunks; chunk != NULL &&
+         (body == NULL || chunk != body->chunks); chunk = next) {
+        next = chunk->next;
+        Free(chunk);
+    }
+    if (body != NULL && atomic_fetch_sub(&body->refcnt, 1) == 1) {
+        free_chunks(body->chunks);
+        Free(body);
+    }
+    if (item->map != NULL) {
+        cache_map_put(item->map);
+    }
+    Free(item->id);
+    Free(item);
+}
+
+/*
+ * cache_map_put
+ *
+ * drop a reference on a mapping, the last one unmaps it.
+ */
+void cache_map_put(cache_map *map) {
+    if (atomic_fetch_sub(&map->refcnt, 1) == 1) {
+        Munmap(map->addr, map->len);
+        Free(map);
+    }
+}
+
+/*
+ * list_append
+ *
+ * put the item at the back of the clock list. Caller holds write lock.
+ */
+static void list_append(cache_item *item, cache *pcache) {
+    item->next = NULL;
+    item->prev = pcache->foot;
+    if (pcache->foot == NULL) {
+        pcache->head = item;
+    } else {
+        pcache->foot->next = item;
+    }
+    pcache->foot = item;
+}
+
+/*
+ * list_remove
+ *
+ * take the item out of the clock list. Caller holds write lock.
+ */
+static void list_remove(cache_item *item, cache *pcache) {
+    if (item->prev == NULL) {
+        pcache->head = item->next;
+    } else {
+        item->prev->next = item->next;
+    }
+    if (item->next == NULL) {
+        pcache->foot = item->prev;
+    } else {
+        item->next->prev = item->prev;
+    }
+}
+
+/*
+ * chunks_equal
+ *
+ * compare two chains of chunks byte for byte, however they are cut.
+ * return 1 if they hold the same bytes.
+ */
+static int chunks_equal(cache_chunk *a, cache_chunk *b) {
+    int a_off = 0, b_off = 0, n;
+
+    while (a != NULL && b != NULL) {
+        n = a->len - a_off < b->len - b_off ? a->len - a_off
+                                            : b->len - b_off;
+        if (memcmp(a->data + a_off, b->data + b_off, n) != 0) {
+            return 0;
+        }
+        a_off += n;
+        b_off += n;
+        if (a_off == a->len) {
+            a = a->next;
+            a_off = 0;
+        }
+        if (b_off == b->len) {
+            b = b->next;
+            b_off = 0;
+        }
+    }
+    /* skip empty chunks at the end */
+    while (a != NULL && a->len == 0) {
+        a = a->next;
+    }
+    while (b != NULL && b->len == 0) {
+        b = b->next;
+    }
+    return a == NULL && b == NULL;
+}
+
+/*
+ * body_link
+ *
+ * a new item is about to be published, look for its body in the store.
+ * If the same bytes are there, point the item at that body and drop its
+ * own copy, else add its body to the store. The item is charged for the
+ * body only in the second case. Caller holds write lock.
+ */
+static void body_link(cache_item *item, cache *pcache) {
+    cache_body *body = item->body, *found, **bucket;
+    cache_chunk **link;
+
+    bucket = &pcache->bodies[body->hash % CACHE_BUCKETS];
+    for (found = *bucket; found != NULL; found = found->next) {
+        if (found->hash == body->hash && found->size == body->size &&
+            found->compressed == body->compressed &&
+            chunks_equal(found->chunks, body->chunks)) {
+            break;
+        }
+    }
+    if (found == NULL) {
+        body->next = *bucket;
+        *bucket = body;
+        body->linked = 1;
+        pcache->nbodies++;
+        return;
+    }
+
+    /* share the one in the store, nobody has seen this item yet */
+    for (link = &item->chunks; *link != body->chunks;
+         link = &(*link)->next) {
+        ;
+    }
+    *link = found->chunks;
+    free_chunks(body->chunks);
+    Free(body);
+    atomic_fetch_add(&found->refcnt, 1);
+    found->linked++;
+    item->body = found;
+    pcache->size -= found->size;
+    pcache->nshared++;
+}
+
+/*
+ * body_unlink
+ *
+ * an item is unlinked, drop its body from the store if no linked item
+ * uses it any more. Caller holds write lock.
+ */
+static void body_unlink(cache_item *item, cache *pcache) {
+    cache_body *body = item->body, **link;
+
+    pcache->size += body->size;
+    if (--body->linked > 0) {
+        pcache->nshared--;
+        return;
+    }
+    for (link = &pcache->bodies[body->hash % CACHE_BUCKETS];
+         *link != body; link = &(*link)->next) {
+        ;
+    }
+    *link = body->next;
+    pcache->size -= body->size;
+    pcache->nbodies--;
+}
+
+/*
+ * unlink_item
+ *
+ * remove the item from its hash chain and the clock list and put it into
+ * limbo. Readers that are already on it can still follow its hnext. Caller
+ * holds write lock.
+ */
+static void unlink_item(cache_item *item, cache *pcache) {
+    cache_item *_Atomic *link = &pcache->buckets[item->hash % CACHE_BUCKETS];
+    cache_item *tmp;
+
+    while ((tmp = atomic_load_explicit(link, memory_order_relaxed)) != item) {
+        link = &tmp->hnext;
+    }
+    atomic_store_explicit(link, atomic_load_explicit(&item->hnext,
+                          memory_order_relaxed), memory_order_release);
+    list_remove(item, pcache);
+    pcache->size -= item->size;
+    pcache->content_size -= item->size;
+    if (item->body != NULL) {
+        body_unlink(item, pcache);
+    }
+    atomic_store_explicit(&item->gen, 0, memory_order_release);
+    if (pcache->on_unlink != NULL) {
+        pcache->on_unlink(item->id);
+    }
+
+    item->retired = atomic_load(&global_epoch);
+    item->next = pcache->limbo;
+    pcache->limbo = item;
+}
+
+/*
+ * reclaim
+ *
+ * open a new epoch and free every item in limbo that was unlinked before
+ * the oldest epoch a reader is still in. Caller holds write lock.
+ */
+static void reclaim(cache *pcache) {
+    unsigned long oldest, epoch;
+    cache_item *item, **link;
+    int i;
+
+    if (pcache->limbo == NULL) {
+        return;
+    }
+    /* readers entering from now on can not reach anything in limbo */
+    oldest = atomic_fetch_add(&global_epoch, 1) + 1;
+    atomic_thread_fence(memory_order_seq_cst);
+    for (i = 0; i < EPOCH_SLOTS; i++) {
+        epoch = atomic_load_explicit(&slots[i].epoch, memory_order_relaxed);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    link = &pcache->limbo;
+    while ((item = *link) != NULL) {
+        if (item->retired < oldest) {
+            *link = item->next;
+            /* drop the reference of the cache, pins may keep it alive */
+            cache_unpin(item);
+        } else {
+            link = &item->next;
+        }
+    }
+}
+
+/*
+ * init_cache
+ *
  * initialize the whole cache structure and return the pointer to
  * the structure.
  */
 cache *init_cache() {
+    int i;
     cache *pcache = (cache *)Malloc(sizeof(cache));
     if (pcache == NULL) {
         return NULL;
     }
-    
+
     /* initialize the struct and the semaphore */
+    for (i = 0; i < CACHE_BUCKETS; i++) {
+        atomic_init(&pcache->buckets[i], NULL);
+    }
     pcache->head = NULL;
     pcache->foot = NULL;
     pcache->size = 0;
-    Sem_init(&pcache->read, 0, 1);
+    pcache->max_size = MAX_CACHE_SIZE;
+    pcache->limbo = NULL;
+    pcache->next_gen = 1;
+    pcache->demote = NULL;
+    pcache->on_evict = NULL;
+    pcache->on_link = NULL;
+    pcache->on_unlink = NULL;
+    for (i = 0; i < CACHE_BUCKETS; i++) {
+        pcache->bodies[i] = NULL;
+    }
+    pcache->content_size = 0;
+    pcache->nbodies = 0;
+    pcache->nshared = 0;
     Sem_init(&pcache->write, 0, 1);
-    pcache->readcnt = 0;
     return pcache;
 }
 
 /*
- * find_in_cache 
- * 
- * look the link list to find match, return the pointer to the item if found
- * return NULL otherwise.
+ * find_in_cache
+ *
+ * look the hash chain to find match, return the pointer to the item if
+ * found return NULL otherwise. The caller must be on the read side or
+ * hold the write lock.
  */
 cache_item *find_in_cache(char *cache_id, cache *pcache) {
+    unsigned int hash = cache_hash(cache_id);
     cache_item *tmp;
-    tmp = pcache->head;
-    /* Go through the whole list */
+    tmp = atomic_load_explicit(&pcache->buckets[hash % CACHE_BUCKETS],
+                               memory_order_acquire);
+    /* Go through the chain */
     while (tmp != NULL) {
-        if (strcmp(tmp->id, cache_id) == 0) {
+        if (tmp->hash == hash && strcmp(tmp->id, cache_id) == 0) {
             return tmp;
         }
-        tmp = tmp->next;
+        tmp = atomic_load_explicit(&tmp->hnext, memory_order_acquire);
     }
     return NULL;
 }
 
 /*
- * insert_item 
- * 
- * create a new cache item and insert it to the back of the linked list. 
- * This is the writer function. return -1 if failed.
+ * new_item
+ *
+ * allocate an item and its id, the content is left to the caller. return
+ * NULL if failed.
  */
-
-int insert_item(char *cache_id, char *content, cache *pcache, int size) {
-    /* lock it using write lock, no other could write or read */
-    P(&(pcache->write));
-    
+static cache_item *new_item(char *cache_id, int size) {
     /* malloc space for the struct */
-    cache_item *new_item = (cache_item *)Malloc(sizeof(cache_item));
-    if (new_item == NULL){
-        V(&(pcache->write));
-        return -1;
+    cache_item *item = (cache_item *)Malloc(sizeof(cache_item));
+    if (item == NULL){
+        return NULL;
     }
-    
+
     /* malloc space for the cache id */
-    new_item->id = (char *)Malloc(strlen(cache_id)+1);
-    if (new_item->id == NULL) {
-        Free(new_item);
-        V(&(pcache->write));
-        return -1;
+    item->id = (char *)Malloc(strlen(cache_id)+1);
+    if (item->id == NULL) {
+        Free(item);
+        return NULL;
     }
 
-    /* malloc space for the cache content */
-    new_item->content = (char *)Malloc(size);
-    if (new_item->content == NULL) {
-        Free(new_item->id);
-        Free(new_item);
-        V(&(pcache->write));
-        return -1;
+    strcpy(item->id, cache_id);
+    item->chunks = NULL;
+    item->size = size;
+    item->hash = cache_hash(cache_id);
+    item->map = NULL;
+    item->checksum = 0;
+    item->meta.header_len = 0;
+    item->meta.date = 0;
+    item->meta.raw_size = 0;
+    item->meta.vary = 0;
+    item->meta.vary_hash = 0;
+    item->meta.expires = 0;
+    item->body = NULL;
+    atomic_init(&item->unverified, 0);
+    atomic_init(&item->stale, 0);
+    atomic_init(&item->prefetched, 0);
+    atomic_init(&item->referenced, 0);
+    atomic_init(&item->refcnt, 1);
+    return item;
+}
+
+/*
+ * publish_item
+ *
+ * publish a new item in the hash index and append it to the back of the
+ * clock list, evicting as needed. This is the writer function. If the id
+ * is already cached the new item is dropped, unless that one is stale.
+ */
+static int publish_item(cache_item *new_item, cache *pcache) {
+    cache_item *_Atomic *bucket;
+    cache_item *demote, *next, *old;
+
+    /* lock it using write lock, no other could write */
+    P(&(pcache->write));
+
+    /* another thread filled it while we were fetching, keep that one,
+     * unless it is stale */
+    if ((old = find_in_cache(new_item->id, pcache)) != NULL) {
+        if (!atomic_load(&old->stale)) {
+            V(&(pcache->write));
+            free_item(new_item);
+            return 1;
+        }
+        unlink_item(old, pcache);
+    }
+    if (new_item->body != NULL) {
+        body_link(new_item, pcache);
     }
-        
-    /* copy data into the item struct */
-    strcpy(new_item->id, cache_id);
-    memcpy(new_item->content, content, size);
-    new_item->size = size;
 
     /* if the exceeds the max cache size, evict! */
-    if ((pcache->size + size) > MAX_CACHE_SIZE) {
-        evict_lru(size, pcache);
+    if ((pcache->size + new_item->size) > pcache->max_size) {
+        evict_lru(new_item->size, pcache);
     }
+
+    atomic_init(&new_item->gen, pcache->next_gen++);
+
+    /* publish it, readers see either the old chain or the whole item */
+    bucket = &pcache->buckets[new_item->hash % CACHE_BUCKETS];
+    atomic_init(&new_item->hnext,
+                atomic_load_explicit(bucket, memory_order_relaxed));
+    atomic_store_explicit(bucket, new_item, memory_order_release);
+
     /* insert the item into the back */
-    new_item->next = NULL;
-    if (pcache->foot == NULL) {
-        pcache->head = new_item;
-        pcache->foot = new_item;
-    } else {
-        pcache->foot->next = new_item;
-        pcache->foot = new_item;
+    list_append(new_item, pcache);
+    pcache->size += new_item->size;
+    pcache->content_size += new_item->size;
+    if (pcache->on_link != NULL) {
+        pcache->on_link(new_item->id);
     }
-    pcache->size += size;
+
+    reclaim(pcache);
+    demote = pcache->demote;
+    pcache->demote = NULL;
     /* unlock this section */
     V(&(pcache->write));
+
+    /* hand the evicted items over, they are pinned until then */
+    while (demote != NULL) {
+        next = demote->dnext;
+        pcache->on_evict(demote);
+        cache_unpin(demote);
+        demote = next;
+    }
     return 1;
+}
+
+/*
+ * insert_item
+ *
+ * create a new cache item with a copy of the content and publish it.
+ * return -1 if failed.
+ */
 
+int insert_item(char *cache_id, char *content, cache *pcache, int size) {
+    cache_fill fill;
+
+    /* copy the content into chunks, outside of the lock */
+    fill_init(&fill, size);
+    if (fill_append(&fill, content, size) == -1) {
+        return -1;
+    }
+    return fill_commit(&fill, cache_id, pcache);
+}
+
+/*
+ * fill_init
+ *
+ * start collecting content for a new item, at most max bytes.
+ */
+void fill_init(cache_fill *fill, long max) {
+    fill->head = NULL;
+    fill->tail = NULL;
+    fill->size = 0;
+    fill->max = max;
+    fill->sealed = 0;
+    fill->meta.header_len = 0;
+    fill->meta.date = 0;
+    fill->meta.raw_size = 0;
+    fill->meta.vary = 0;
+    fill->meta.vary_hash = 0;
+    fill->meta.expires = 0;
+}
+
+/*
+ * fill_header
+ *
+ * start the content with the header block of a response, in a chunk of its
+ * own, made at date. The body goes in the chunks after it. return -1 if
+ * failed, the fill is aborted then.
+ */
+int fill_header(cache_fill *fill, char *buf, int len, long date) {
+    cache_chunk *chunk;
+
+    if (fill->head != NULL || len > fill->max ||
+        (chunk = (cache_chunk *)Malloc(sizeof(cache_chunk) + len)) == NULL) {
+        fill_abort(fill);
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->data = (char *)(chunk + 1);
+    chunk->len = len;
+    memcpy(chunk->data, buf, len);
+    fill->head = chunk;
+    fill->tail = chunk;
+    fill->size = len;
+    fill->sealed = 1;
+    fill->meta.header_len = len;
+    fill->meta.date = date;
+    return 1;
+}
+
+/*
+ * fill_append
+ *
+ * copy a piece of content into the chunks, adding chunks as needed. If
+ * the content gets larger than max or we run out of memory, everything
+ * collected is freed. return -1 then.
+ */
+int fill_append(cache_fill *fill, char *buf, int len) {
+    cache_chunk *chunk;
+    int n;
+
+    if (fill->size + len > fill->max) {
+        fill_abort(fill);
+        return -1;
+    }
+    fill->size += len;
+    while (len > 0) {
+        chunk = fill->tail;
+        /* the last chunk is full, add one */
+        if (chunk == NULL || fill->sealed || chunk->len == CACHE_CHUNK_SIZE) {
+            if ((chunk = (cache_chunk *)Malloc(sizeof(cache_chunk) +
+                                               CACHE_CHUNK_SIZE)) == NULL) {
+                fill_abort(fill);
+                return -1;
+            }
+            chunk->next = NULL;
+            chunk->data = (char *)(chunk + 1);
+            chunk->len = 0;
+            if (fill->tail == NULL) {
+                fill->head = chunk;
+            } else {
+                fill->tail->next = chunk;
+            }
+            fill->tail = chunk;
+            fill->sealed = 0;
+        }
+        n = CACHE_CHUNK_SIZE - chunk->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(chunk->data + chunk->len, buf, n);
+        chunk->len += n;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+ * fill_compress
+ *
+ * compress the body of the collected content, each chunk after the header
+ * block into a block in a chunk of its own. If that does not save at least
+ * an eighth, or memory runs out, the content is kept as it is. The fill
+ * must start with a header block from fill_header. return 1 if the body
+ * was compressed, 0 if not.
+ */
+int fill_compress(cache_fill *fill) {
+    cache_chunk *header = fill->head, *blocks = NULL, *last = header;
+    cache_chunk **link = &blocks, *chunk, *block, *tmp;
+    long size;
+    int n;
+
+    if (header == NULL || header->len != fill->meta.header_len ||
+        fill->meta.raw_size > 0) {
+        return 0;
+    }
+    size = header->len;
+    for (chunk = header->next; chunk != NULL; chunk = chunk->next) {
+        if ((block = (cache_chunk *)Malloc(sizeof(cache_chunk) + 2 +
+                                LZ_BOUND(CACHE_CHUNK_SIZE))) == NULL) {
+            free_chunks(blocks);
+            return 0;
+        }
+        block->next = NULL;
+        block->data = (char *)(block + 1);
+        if ((n = lz_compress(chunk->data, chunk->len, block->data + 2,
+                             LZ_BOUND(CACHE_CHUNK_SIZE))) == -1) {
+            Free(block);
+            free_chunks(blocks);
+            return 0;
+        }
+        block->data[0] = n & 0xff;
+        block->data[1] = n >> 8;
+        block->len = n + 2;
+        /* give back what the block did not need */
+        if ((tmp = (cache_chunk *)Realloc(block, sizeof(cache_chunk) +
+                                          block->len)) != NULL) {
+            block = tmp;
+            block->data = (char *)(block + 1);
+        }
+        *link = block;
+        link = &block->next;
+        last = block;
+        size += block->len;
+    }
+    if (size > fill->size - (fill->size - header->len) / 8) {
+        free_chunks(blocks);
+        return 0;
+    }
+
+    free_chunks(header->next);
+    header->next = blocks;
+    fill->tail = last;
+    fill->sealed = 1;
+    fill->meta.raw_size = fill->size;
+    fill->size = size;
+    return 1;
+}
+
+/*
+ * cache_decompress
+ *
+ * put the content of a compressed item back together in buf, which has
+ * room for meta.raw_size bytes: the header block as it is, then every
+ * block of the body decompressed. return the size, -1 if the content is
+ * corrupt.
+ */
+int cache_decompress(cache_item *item, char *buf) {
+    int raw_size = item->meta.raw_size, header_len = item->meta.header_len;
+    unsigned char *p, *end;
+    cache_chunk *chunk;
+    int out = 0, n, len;
+
+    for (chunk = item->chunks; chunk != NULL; chunk = chunk->next) {
+        p = (unsigned char *)chunk->data;
+        end = p + chunk->len;
+        /* the header block comes first, it is not compressed */
+        if (out < header_len) {
+            n = header_len - out < chunk->len ? header_len - out
+                                              : chunk->len;
+            memcpy(buf + out, p, n);
+            out += n;
+            p += n;
+        }
+        while (p < end) {
+            if (end - p < 2) {
+                return -1;
+            }
+            len = p[0] | p[1] << 8;
+            p += 2;
+            if (len > end - p || (n = lz_decompress((char *)p, len,
+                                    buf + out, raw_size - out)) == -1) {
+                return -1;
+            }
+            out += n;
+            p += len;
+        }
+    }
+    return out == raw_size ? out : -1;
+}
+
+/*
+ * fill_commit
+ *
+ * turn the collected content into a new item and publish it. The last
+ * chunk is shrunk to what it holds. return -1 if failed.
+ */
+int fill_commit(cache_fill *fill, char *cache_id, cache *pcache) {
+    cache_item *item;
+    cache_chunk **link, *chunk;
+
+    if ((item = new_item(cache_id, fill->size)) == NULL) {
+        fill_abort(fill);
+        return -1;
+    }
+    /* give back the unused end of the last chunk */
+    for (link = &fill->head; *link != NULL && (*link)->next != NULL;
+         link = &(*link)->next) {
+        ;
+    }
+    if (*link != NULL && (*link)->len < CACHE_CHUNK_SIZE &&
+        (chunk = (cache_chunk *)Realloc(*link, sizeof(cache_chunk) +
+                                        (*link)->len)) != NULL) {
+        chunk->data = (char *)(chunk + 1);
+        *link = chunk;
+    }
+    item->chunks = fill->head;
+    item->meta = fill->meta;
+    fill->head = NULL;
+    fill->tail = NULL;
+
+    /* what comes after a header block of its own is a body */
+    if ((chunk = item->chunks) != NULL && item->meta.header_len > 0 &&
+        chunk->len == item->meta.header_len) {
+        chunk = chunk->next;
+    }
+    if (chunk != NULL &&
+        (item->body = (cache_body *)Malloc(sizeof(cache_body))) != NULL) {
+        item->body->chunks = chunk;
+        item->body->size = 0;
+        for (; chunk != NULL; chunk = chunk->next) {
+            item->body->size += chunk->len;
+        }
+        item->body->hash = chunks_hash(item->body->chunks,
+                                       item->body->size);
+        item->body->compressed = item->meta.raw_size > 0;
+        atomic_init(&item->body->refcnt, 1);
+        item->body->linked = 0;
+        item->body->next = NULL;
+    }
+    return publish_item(item, pcache);
+}
+
+/*
+ * fill_abort
+ *
+ * drop the collected content.
+ */
+void fill_abort(cache_fill *fill) {
+    free_chunks(fill->head);
+    fill->head = NULL;
+    fill->tail = NULL;
+}
+
+/*
+ * chunk_iovec
+ *
+ * an iovec array over a chain of chunks, to be freed by the caller.
+ * return NULL if failed.
+ */
+struct iovec *chunk_iovec(cache_chunk *chunks, int *count) {
+    struct iovec *iov;
+    cache_chunk *chunk;
+    int n = 0;
+
+    for (chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        n++;
+    }
+    if ((iov = (struct iovec *)Malloc((n + 1) * sizeof(struct iovec)))
+        == NULL) {
+        return NULL;
+    }
+    n = 0;
+    for (chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        iov[n].iov_base = chunk->data;
+        iov[n].iov_len = chunk->len;
+        n++;
+    }
+    *count = n;
+    return iov;
+}
+
+/*
+ * insert_mapped
+ *
+ * create a new cache item whose content stays in a mapping and publish it.
+ * The content is only checked against the checksum on the first hit.
+ * return -1 if failed.
+ */
+int insert_mapped(char *cache_id, char *content, int size,
+                  unsigned long checksum, cache_meta *meta, cache_map *map,
+                  cache *pcache) {
+    cache_item *item = new_item(cache_id, size);
+    if (item == NULL) {
+        return -1;
+    }
+
+    /* one chunk that points into the mapping */
+    if ((item->chunks = (cache_chunk *)Malloc(sizeof(cache_chunk)))
+        == NULL) {
+        Free(item->id);
+        Free(item);
+        return -1;
+    }
+    item->chunks->next = NULL;
+    item->chunks->data = content;
+    item->chunks->len = size;
+    atomic_fetch_add(&map->refcnt, 1);
+    item->map = map;
+    item->checksum = checksum;
+    item->meta = *meta;
+    atomic_init(&item->unverified, 1);
+    return publish_item(item, pcache);
+}
+
+/*
+ * cache_remove
+ *
+ * unlink an item, if it is still in the cache. return 1 if removed.
+ */
+int cache_remove(cache_item *item, cache *pcache) {
+    int removed = 0;
+
+    P(&(pcache->write));
+    if (atomic_load(&item->gen) != 0) {
+        unlink_item(item, pcache);
+        reclaim(pcache);
+        removed = 1;
+    }
+    V(&(pcache->write));
+    return removed;
+}
+
+/*
+ * cache_purge
+ *
+ * unlink the item of an id, or with soft, mark it stale. return 1 if it
+ * was there.
+ */
+int cache_purge(char *cache_id, int soft, cache *pcache) {
+    cache_item *item;
+
+    P(&(pcache->write));
+    if ((item = find_in_cache(cache_id, pcache)) != NULL) {
+        if (soft) {
+            atomic_store(&item->stale, 1);
+        } else {
+            unlink_item(item, pcache);
+            reclaim(pcache);
+        }
+    }
+    V(&(pcache->write));
+    return item != NULL;
+}
+
+/*
+ * verify_item
+ *
+ * first hit of a mapped item, check the content. A bad one is removed.
+ * The caller holds a pin. return -1 if the content is bad.
+ */
+static int verify_item(cache_item *item, cache *pcache) {
+    if (cache_checksum(item) != item->checksum) {
+        cache_remove(item, pcache);
+        return -1;
+    }
+    atomic_store(&item->unverified, 0);
+    return 1;
+}
+
+/*
+ * cache_checksum
+ *
+ * checksum of the content of an item.
+ */
+unsigned long cache_checksum(cache_item *item) {
+    return chunks_hash(item->chunks, item->size);
+}
+
+/*
+ * cache_report
+ *
+ * print how much the shared bodies save.
+ */
+void cache_report(cache *pcache, FILE *fp) {
+    long size, content_size, nbodies, nshared;
+
+    P(&(pcache->write));
+    size = pcache->size;
+    content_size = pcache->content_size;
+    nbodies = pcache->nbodies;
+    nshared = pcache->nshared;
+    V(&(pcache->write));
+    fprintf(fp, "dedup: bodies %ld shared by %ld more items, "
+            "%ld KB of content in %ld KB, ratio %.2f\n",
+            nbodies, nshared, content_size / 1024, size / 1024,
+            size > 0 ? (double)content_size / size : 1.0);
+    fflush(fp);
+}
+
+/*
+ * copy_content
+ *
+ * copy the content of an item into a flat buffer.
+ */
+static void copy_content(cache_item *item, char *content) {
+    cache_chunk *chunk;
+
+    for (chunk = item->chunks; chunk != NULL; chunk = chunk->next) {
+        memcpy(content, chunk->data, chunk->len);
+        content += chunk->len;
+    }
+}
+
+/*
+ * cache_pin_all
+ *
+ * pin every item in clock order, oldest first. Unpin each of them and free
+ * the array when done. return NULL if failed.
+ */
+cache_item **cache_pin_all(cache *pcache, int *count) {
+    cache_item **items, *item;
+    int n = 0;
+
+    P(&(pcache->write));
+    for (item = pcache->head; item != NULL; item = item->next) {
+        n++;
+    }
+    if ((items = (cache_item **)Malloc((n + 1) * sizeof(cache_item *)))
+        == NULL) {
+        V(&(pcache->write));
+        return NULL;
+    }
+    n = 0;
+    for (item = pcache->head; item != NULL; item = item->next) {
+        atomic_fetch_add(&item->refcnt, 1);
+        items[n++] = item;
+    }
+    V(&(pcache->write));
+    *count = n;
+    return items;
 }
 
 /*
  * read_from_cache
- * 
- * given the pointer, read the content from the cache into a given buffer.
- * after reading, duplicate a same item and put into the back of the list.
+ *
+ * given the id, read the content from the cache into a given buffer.
+ * No lock is taken: the item can not be freed while we are on the read
+ * side, and a hit only marks the item as referenced for the clock.
  * return -1 if failed
  */
 
 int read_from_cache(char *cache_id, char *content, cache *pcache) {
-    /* lock and update readcnt */
-    P(&(pcache->read));
-    pcache->readcnt++;
-    /* first in lock the write lock*/
-    if (pcache->readcnt == 1) {
-        P(&(pcache->write));
-    }
-    V(&pcache->read);
-    
-    /* look for item from the linked list */
     cache_item *item;
+    int size;
+
+    read_begin(pcache);
+
+    /* look for item from the hash index */
     if ((item = find_in_cache(cache_id, pcache)) == NULL) {
-        P(&(pcache->read));
-        pcache->readcnt--;
-        if (pcache->readcnt == 0) {
-            V(&(pcache->write));
-        }
-        V(&pcache->read);
+        read_end(pcache);
         return -1;
     }
-    
-    /* copy the data to given buffer*/
-    memcpy(content, item->content, item->size);
-    int size = item->size;
-    /* lock and update readcnt */
-    P(&(pcache->read));
-    pcache->readcnt--;
-    if (pcache->readcnt == 0) {
-        V(&(pcache->write));
+
+    /* first hit of a mapped item, take the slow way to check it */
+    if (atomic_load_explicit(&item->unverified, memory_order_relaxed)) {
+        read_end(pcache);
+        if ((item = cache_pin(cache_id, pcache)) == NULL) {
+            return -1;
+        }
+        copy_content(item, content);
+        size = item->size;
+        cache_unpin(item);
+        return size;
     }
-    V(&pcache->read);
-    
-    /* insert a new item to the back of the list */
-    insert_item(item->id, item->content, pcache, item->size);
+
+    /* copy the data to given buffer*/
+    copy_content(item, content);
+    size = item->size;
+
+    cache_touch(item);
+    read_end(pcache);
 
     return size;
 }
 
+/*
+ * cache_pin
+ *
+ * look for the item and take a reference on it, so it can be used after
+ * we left the read side. Release it with cache_unpin. return NULL if not
+ * found.
+ */
+cache_item *cache_pin(char *cache_id, cache *pcache) {
+    cache_item *item;
+
+    read_begin(pcache);
+    /* the reference of the cache is not dropped while we are in here */
+    if ((item = find_in_cache(cache_id, pcache)) != NULL) {
+        atomic_fetch_add_explicit(&item->refcnt, 1, memory_order_relaxed);
+        cache_touch(item);
+    }
+    read_end(pcache);
+
+    if (item != NULL && atomic_load(&item->unverified) &&
+        verify_item(item, pcache) == -1) {
+        cache_unpin(item);
+        return NULL;
+    }
+    return item;
+}
+
+/*
+ * cache_unpin
+ *
+ * drop a reference, the last one frees the item.
+ */
+void cache_unpin(cache_item *item) {
+    if (atomic_fetch_sub_explicit(&item->refcnt, 1,
+                                  memory_order_acq_rel) == 1) {
+        free_item(item);
+    }
+}
+
+/*
+ * cache_touch
+ *
+ * mark the item as recently used for the clock. Only write the shared
+ * line if the bit is not set yet.
+ */
+void cache_touch(cache_item *item) {
+    if (atomic_load_explicit(&item->referenced, memory_order_relaxed) == 0) {
+        atomic_store_explicit(&item->referenced, 1, memory_order_relaxed);
+    }
+}
+
 /*
  * evict_lru
- * 
- * keep evicting the first item until the free size meets our demands. 
- * Using LRU policy.
+ *
+ * keep moving the clock hand over the head of the list until the free size
+ * meets our demands. A referenced item loses its bit and goes to the back,
+ * an unreferenced one is evicted. Caller holds write lock.
  */
 
 void evict_lru(int new_size, cache *pcache) {
     /* keep evicting until get enough free size*/
-    while ((pcache->size + new_size) > MAX_CACHE_SIZE) {
+    while (pcache->head != NULL &&
+           (pcache->size + new_size) > pcache->max_size) {
         cache_item *tmp = pcache->head;
-        pcache->head = pcache->head->next;
-        pcache->size -= tmp->size;
-        /* Free what we allocated*/
-        Free(tmp->content);
-        Free(tmp->id);
-        Free(tmp);
-    }
-}
\ No newline at end of file
+
+        /* second chance: clear the bit and move it to the back */
+        if (atomic_load_explicit(&tmp->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&tmp->referenced, 0, memory_order_relaxed);
+            list_remove(tmp, pcache);
+            list_append(tmp, pcache);
+            continue;
+        }
+        if (pcache->on_evict != NULL) {
+            atomic_fetch_add(&tmp->refcnt, 1);
+            tmp->dnext = pcache->demote;
+            pcache->demote = tmp;
+        }
+        unlink_item(tmp, pcache);
+    }
+}
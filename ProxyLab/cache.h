@@ -4,41 +4,170 @@
  * Name: Kaiyuan Tang
  * AndrewID: kaiyuant
  *
- * this is the cache for the tiny proxy, it could search the cache and 
- * forward back the cached response. And the eviction policy is LRU.
- * The cache is maintained as a single linked list. New item is always 
- * inserted in the back, and when a item is used, create a new item and
- * add it to the last. This could seem inefficient, but it greatly reduce 
- * the risk of messing up the whole cache system. As all operations are 
- * on the front or the back. And the result shows that it is indeed 
- * a better solution than manipulating the list ops say: deleting
- * it and insert back. And repeatly request for one small content is rare. 
- * Evicting LRU item can simply evict the head of the list.
+ * this is the cache for the tiny proxy, it could search the cache and
+ * forward back the cached response. The items are kept in a hash table
+ * whose chains are published with atomic stores, so readers walk it without
+ * taking any lock. Writers are still serialized by one semaphore. An item
+ * that is unlinked by a writer is not freed at once: it waits in a limbo
+ * list until every reader that might still see it has left (epoch based
+ * reclamation). Eviction is CLOCK, an approximation of LRU: a hit only sets
+ * the referenced bit of the item, and the writer gives referenced items a
+ * second chance before evicting them from the head of the insertion list.
+ *
+ * An item can also be pinned: every pin holds a reference, and the memory
+ * of an unlinked item stays until the last reference is gone. Each item
+ * gets a new generation number when it is inserted, which drops to 0 when
+ * it is unlinked, so whoever keeps a pin can tell it went stale.
+ *
+ * If on_evict is set, every evicted item is passed to it after the write
+ * lock is released, e.g. to demote it to the disk tier.
+ *
+ * The content of an item is a chain of chunks of at most CACHE_CHUNK_SIZE
+ * bytes, filled while the response streams in, so a large object never
+ * needs one big allocation. The chunks may also point into a read only
+ * mapping, like a snapshot loaded at startup. Such items are checked
+ * against their checksum on the first hit, and the mapping goes away with
+ * the last item.
+ *
+ * A response is stored with its header block rewritten once, when it is
+ * fetched: hop-by-hop headers are gone and Via is added. The header block
+ * is the first chunk of the content, and its length and the date of the
+ * response are kept in the meta of the item, so a hit can add Age without
+ * touching the stored bytes.
+ *
+ * The body can be stored compressed, see lz.h: every chunk after the header
+ * block is then one block of the codec, prefixed by its compressed length
+ * in 2 bytes, and meta.raw_size is the size of the whole content before.
+ * A block never spans two chunks, a mapped item has all of them in one.
+ *
+ * Bodies are deduplicated: the chunks after the header block are a body,
+ * kept in a store keyed by a hash of its bytes. An item whose body is
+ * byte for byte one that is cached already links its header chunk to the
+ * chunks of that body and holds a reference on it, so identical bodies
+ * under different ids take memory once. The size of the cache counts every
+ * body once.
+ *
+ * A response with Vary is one of the variants of its id. The id itself
+ * then holds a Vary item: no response, only the list of the header names,
+ * and each variant is an item of its own, under the id and a slot number
+ * taken from a hash of the values of those headers in the request. The
+ * hash is kept in meta.vary_hash, so a lookup checks it is the variant the
+ * request asks for, and a new variant in the same slot replaces it.
+ *
+ * Error responses are only cached for a while, see negative.h. When one
+ * expires is in meta.expires, lookups drop it once it is past.
+ *
+ * An item can be purged by its id, or marked stale, and then it is only
+ * used again once the origin said it did not change. If on_link and
+ * on_unlink are set, they are told the id of every item that goes into
+ * the index and out of it, with the write lock held, e.g. to keep an
+ * index of the ids by URL, see purge.h.
  */
- 
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
 #include <string.h>
+#include <stdatomic.h>
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
-    
+
+/* largest piece of content in one chunk */
+#define CACHE_CHUNK_SIZE 16384
+/* number of buckets in the hash index */
+#define CACHE_BUCKETS 4096
+/* max threads that can be inside the lock-free read path at once */
+#define EPOCH_SLOTS 256
+
+/* a read only mapping the content of items can point into */
+typedef struct cache_map {
+    void *addr;                /* start of the mapping */
+    size_t len;                /* length of the mapping */
+    atomic_int refcnt;         /* items using it, plus the creator */
+} cache_map;
+
+/* a piece of the content of an item */
+typedef struct cache_chunk {
+    struct cache_chunk *next;  /* next piece, NULL for the last one */
+    char *data;                /* right after this header, or in a map */
+    int len;                   /* bytes in this piece */
+} cache_chunk;
+
+/* what is known about an object besides its content */
+typedef struct cache_meta {
+    int header_len;            /* header block at the start, 0 if none */
+    long date;                 /* when the origin made it, by our clock */
+    int raw_size;              /* size before compression, 0 if stored raw */
+    int vary;                  /* the content is the Vary list of the id */
+    unsigned long vary_hash;   /* of the request headers of a variant */
+    long expires;              /* ms of the wall clock it goes, 0 never */
+} cache_meta;
+
+/* content being collected for a new item */
+typedef struct cache_fill {
+    cache_chunk *head;         /* first chunk */
+    cache_chunk *tail;         /* chunk being filled */
+    long size;                 /* bytes collected so far */
+    long max;                  /* give up beyond this */
+    int sealed;                /* the tail chunk takes no more bytes */
+    cache_meta meta;           /* passed on to the item */
+} cache_fill;
+
+/* a body shared by all items with the same bytes after the header */
+typedef struct cache_body {
+    unsigned long hash;        /* hash of the bytes */
+    long size;                 /* bytes in its chunks */
+    int compressed;            /* chunks are lz blocks */
+    cache_chunk *chunks;       /* the bytes */
+    atomic_int refcnt;         /* items holding it, linked or not */
+    int linked;                /* items in the index holding it */
+    struct cache_body *next;   /* next body in the same store bucket */
+} cache_body;
+
 /* struct for cache item*/
 typedef struct cache_item {
     char *id;                  /* id of the cache block */
-    struct cache_item *next;   /* pointer to the next cache block*/
-    void *content;             /* cached content */
+    unsigned int hash;         /* hash of the id */
+    struct cache_item *_Atomic hnext; /* next item in the same bucket */
+    struct cache_item *next;   /* next item in clock order, or in limbo */
+    struct cache_item *prev;   /* previous item in clock order */
+    cache_chunk *chunks;       /* cached content */
     int size;                  /* size of the content */
+    atomic_int referenced;     /* clock bit, set on every hit */
+    atomic_int refcnt;         /* the cache holds one, each pin one more */
+    atomic_ulong gen;          /* generation, 0 once unlinked */
+    unsigned long retired;     /* epoch in which the item was unlinked */
+    struct cache_item *dnext;  /* next evicted item to pass to on_evict */
+    cache_map *map;            /* mapping the content is in, or NULL */
+    atomic_int unverified;     /* content not checked against checksum */
+    unsigned long checksum;    /* checksum of a mapped content */
+    cache_meta meta;           /* header block and date of the response */
+    cache_body *body;          /* shared end of chunks, or NULL */
+    atomic_int stale;          /* purged softly, revalidate before use */
+    atomic_int prefetched;     /* prefetched and not hit yet */
 } cache_item;
 
-/* struct for the whole linked list*/
+/* struct for the whole cache*/
 typedef struct cache {
-    cache_item *head;          /* first one of the list */
+    cache_item *_Atomic buckets[CACHE_BUCKETS]; /* the hash index */
+    cache_item *head;          /* oldest item, where the clock hand is */
     cache_item *foot;          /* last one of the list */
-    int size;                  /* whole size used */
-    sem_t read;                /* semaphore for read */
-    sem_t write;               /* semaphore for write */
-    int readcnt;               /* how many thread are reading*/
+    long size;                 /* whole size used, shared bodies once */
+    long content_size;         /* what it would be without sharing */
+    long max_size;             /* evict beyond this, MAX_CACHE_SIZE */
+    sem_t write;               /* semaphore for writers */
+    cache_item *limbo;         /* unlinked items not yet freed */
+    unsigned long next_gen;    /* generation of the next insert */
+    cache_item *demote;        /* evicted items for on_evict */
+    void (*on_evict)(cache_item *item); /* called for evicted items */
+    void (*on_link)(char *id); /* called for items put in the index */
+    void (*on_unlink)(char *id); /* and taken out of it */
+    cache_body *bodies[CACHE_BUCKETS]; /* the body store */
+    long nbodies;              /* bodies in the store */
+    long nshared;              /* items using a body another one brought */
 } cache;
 
 /* functions*/
@@ -46,4 +175,27 @@ cache *init_cache();
 cache_item *find_in_cache(char *cache_id, cache *pcache);
 int insert_item(char *cache_id, char *content, cache *pcache, int size);
 int read_from_cache(char *cache_id, char *content, cache *pcache);
-void evict_lru(int new_size, cache *pcache);
\ No newline at end of file
+void evict_lru(int new_size, cache *pcache);
+unsigned int cache_hash(char *cache_id);
+cache_item *cache_pin(char *cache_id, cache *pcache);
+void cache_unpin(cache_item *item);
+void cache_touch(cache_item *item);
+int insert_mapped(char *cache_id, char *content, int size,
+                  unsigned long checksum, cache_meta *meta, cache_map *map,
+                  cache *pcache);
+void fill_init(cache_fill *fill, long max);
+int fill_header(cache_fill *fill, char *buf, int len, long date);
+int fill_append(cache_fill *fill, char *buf, int len);
+int fill_compress(cache_fill *fill);
+int fill_commit(cache_fill *fill, char *cache_id, cache *pcache);
+void fill_abort(cache_fill *fill);
+struct iovec *chunk_iovec(cache_chunk *chunks, int *count);
+void cache_map_put(cache_map *map);
+int cache_remove(cache_item *item, cache *pcache);
+int cache_purge(char *cache_id, int soft, cache *pcache);
+cache_item **cache_pin_all(cache *pcache, int *count);
+unsigned long cache_checksum(cache_item *item);
+int cache_decompress(cache_item *item, char *buf);
+void cache_report(cache *pcache, FILE *fp);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,102 @@
+/*
+ * cachebench.c
+ *
+ * Scalability benchmark for the cache read path. It fills a cache with
+ * small objects and then lets 1, 2, 4 ... 64 threads hit it as fast as they
+ * can. For every thread count it prints the total hit rate and the CPU time
+ * one hit costs a thread. With the lock-free read path the cost per hit
+ * should stay flat as the number of threads goes up; growth means readers
+ * are fighting over a shared cache line.
+ *
+ * How to use: ./cachebench [hits per thread]
+ */
+
+#include <time.h>
+#include "csapp.h"
+#include "cache.h"
+
+#define BENCH_KEYS 256         /* distinct objects in the cache */
+#define BENCH_OBJECT 2048      /* size of each object */
+#define BENCH_MAX_THREADS 64
+
+static cache *pcache;
+static long hits_per_thread = 200000;
+
+/* per thread result */
+typedef struct bench_arg {
+    int seed;
+    long hits;
+    double cpu_ns;             /* thread CPU time spent in the loop */
+} bench_arg;
+
+static double now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * reader
+ *
+ * look up random keys, all of them are hits.
+ */
+static void *reader(void *vargp) {
+    bench_arg *arg = (bench_arg *)vargp;
+    char key[MAXLINE];
+    char content[MAX_OBJECT_SIZE];
+    unsigned int seed = arg->seed;
+    double start;
+    long i;
+
+    start = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    for (i = 0; i < hits_per_thread; i++) {
+        sprintf(key, "GET http://bench/%d HTTP/1.0\r\n",
+                rand_r(&seed) % BENCH_KEYS);
+        if (read_from_cache(key, content, pcache) > 0) {
+            arg->hits++;
+        }
+    }
+    arg->cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    char key[MAXLINE], object[BENCH_OBJECT];
+    pthread_t tids[BENCH_MAX_THREADS];
+    bench_arg args[BENCH_MAX_THREADS];
+    int i, nthreads;
+    long hits;
+    double start, wall, cpu;
+
+    if (argc > 1) {
+        hits_per_thread = atol(argv[1]);
+    }
+
+    pcache = init_cache();
+    memset(object, 'x', sizeof(object));
+    for (i = 0; i < BENCH_KEYS; i++) {
+        sprintf(key, "GET http://bench/%d HTTP/1.0\r\n", i);
+        insert_item(key, object, pcache, sizeof(object));
+    }
+
+    printf("%8s %14s %14s\n", "threads", "hits/sec", "cpu ns/hit");
+    for (nthreads = 1; nthreads <= BENCH_MAX_THREADS; nthreads *= 2) {
+        start = now_ns(CLOCK_MONOTONIC);
+        for (i = 0; i < nthreads; i++) {
+            args[i].seed = i + 1;
+            args[i].hits = 0;
+            Pthread_create(&tids[i], NULL, reader, &args[i]);
+        }
+        hits = 0;
+        cpu = 0;
+        for (i = 0; i < nthreads; i++) {
+            Pthread_join(tids[i], NULL);
+            hits += args[i].hits;
+            cpu += args[i].cpu_ns;
+        }
+        wall = now_ns(CLOCK_MONOTONIC) - start;
+        printf("%8d %14.0f %14.1f\n", nthreads, hits / (wall / 1e9),
+               cpu / hits);
+    }
+    return 0;
+}
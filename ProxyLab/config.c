@@ -0,0 +1,377 @@
+/*
+ * config.c
+ *
+ * run time options of the proxy, parsed from the command line. The port
+ * is the only required argument, every other option has a default that
+ * behaves like the plain proxy.
+ */
+
+#include <getopt.h>
+#include <limits.h>
+#include "csapp.h"
+#include "config.h"
+#include "cache.h"
+#include "negative.h"
+
+/* the options in use, with their defaults */
+config conf = {
+    0,                         /* port */
+    0,                         /* workers */
+    0,                         /* listeners */
+    0,                         /* ipv6 */
+    0,                         /* io_uring */
+    0,                         /* l1_entries */
+    MAX_CACHE_SIZE,            /* cache_size */
+    MAX_OBJECT_SIZE,           /* max_object */
+    64L << 10,                 /* zerocopy_min */
+    0,                         /* compress */
+    0,                         /* range_block */
+    8,                         /* vary_max */
+    NEGATIVE_DEFAULT,          /* error_ttl */
+    10,                        /* ttl_jitter */
+    0,                         /* upstream_limit */
+    0,                         /* origin_limit */
+    64,                        /* upstream_queue */
+    1000,                      /* upstream_wait */
+    0,                         /* hedge */
+    5,                         /* hedge_budget */
+    0,                         /* prefetch */
+    0,                         /* slow_ms */
+    0,                         /* trace_sample */
+    0,                         /* header_timeout */
+    0,                         /* connect_timeout */
+    0,                         /* first_byte_timeout */
+    0,                         /* idle_timeout */
+    0,                         /* client_buffer */
+    64L << 20,                 /* client_spill */
+    NULL,                      /* access_log */
+    64L << 20,                 /* log_rotate */
+    NULL,                      /* record */
+    NULL,                      /* disk_dir */
+    1024L << 20,               /* disk_size */
+    64L << 20,                 /* disk_max_object */
+    NULL,                      /* snapshot */
+    0,                         /* processes */
+    64L << 20,                 /* shared_size */
+    0,                         /* hot_upgrade */
+    0,                         /* admin_port */
+    NULL,                      /* peers */
+    NULL,                      /* peer_self */
+};
+
+static struct option long_options[] = {
+    {"workers", required_argument, NULL, 'w'},
+    {"listeners", required_argument, NULL, 'L'},
+    {"ipv6", no_argument, NULL, '6'},
+    {"io-uring", no_argument, NULL, 'u'},
+    {"l1-entries", required_argument, NULL, 'l'},
+    {"cache-size", required_argument, NULL, 'c'},
+    {"max-object", required_argument, NULL, 'm'},
+    {"zerocopy-min", required_argument, NULL, 'z'},
+    {"compress", no_argument, NULL, 'C'},
+    {"range-block", required_argument, NULL, 'R'},
+    {"vary-max", required_argument, NULL, 'V'},
+    {"error-ttl", required_argument, NULL, 'E'},
+    {"ttl-jitter", required_argument, NULL, 'J'},
+    {"upstream-limit", required_argument, NULL, 'U'},
+    {"origin-limit", required_argument, NULL, 'o'},
+    {"upstream-queue", required_argument, NULL, 'q'},
+    {"upstream-wait", required_argument, NULL, 'W'},
+    {"hedge", required_argument, NULL, 'g'},
+    {"hedge-budget", required_argument, NULL, 'G'},
+    {"prefetch", required_argument, NULL, 'p'},
+    {"slow-ms", required_argument, NULL, 'S'},
+    {"trace-sample", required_argument, NULL, 'T'},
+    {"header-timeout", required_argument, NULL, 'h'},
+    {"connect-timeout", required_argument, NULL, 'k'},
+    {"first-byte-timeout", required_argument, NULL, 'f'},
+    {"idle-timeout", required_argument, NULL, 'i'},
+    {"client-buffer", required_argument, NULL, 'b'},
+    {"client-spill", required_argument, NULL, 'B'},
+    {"access-log", required_argument, NULL, 'a'},
+    {"log-rotate", required_argument, NULL, 'r'},
+    {"record", required_argument, NULL, 'x'},
+    {"disk-dir", required_argument, NULL, 'd'},
+    {"disk-size", required_argument, NULL, 'D'},
+    {"disk-max-object", required_argument, NULL, 'O'},
+    {"snapshot", required_argument, NULL, 's'},
+    {"processes", required_argument, NULL, 'P'},
+    {"shared-cache", required_argument, NULL, 'M'},
+    {"hot-upgrade", no_argument, NULL, 'H'},
+    {"admin-port", required_argument, NULL, 'A'},
+    {"peers", required_argument, NULL, 'y'},
+    {"peer-self", required_argument, NULL, 'Y'},
+    {NULL, 0, NULL, 0}
+};
+
+/*
+ * usage
+ *
+ * print how to use the proxy.
+ */
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s <port> [options]\n", prog);
+    fprintf(stderr,
+        "  --workers=N      serve with N worker threads instead of one\n"
+        "                   thread per connection\n"
+        "  --listeners=N    N SO_REUSEPORT listeners, one per core, each\n"
+        "                   with its own workers\n"
+        "  --ipv6           listen on IPv6, dual-stack with IPv4\n"
+        "  --io-uring       accept, connect and relay misses through\n"
+        "                   io_uring if the kernel has it\n"
+        "  --l1-entries=N   per-thread front cache of N hot objects\n"
+        "  --cache-size=KB  size of the memory cache (1024)\n"
+        "  --max-object=KB  largest object kept in memory (100)\n"
+        "  --zerocopy-min=KB\n"
+        "                   send hits of at least KB with MSG_ZEROCOPY,\n"
+        "                   0 never (64)\n"
+        "  --compress       keep bodies compressed in the memory cache,\n"
+        "                   except types that are compressed already\n"
+        "  --range-block=KB fetch and cache the objects of range requests\n"
+        "                   in aligned blocks of KB, 0 never (0)\n"
+        "  --vary-max=N     keep up to N variants of a response with Vary,\n"
+        "                   0 never cache those (8)\n"
+        "  --error-ttl=LIST seconds error responses are cached, by status,\n"
+        "                   like 404:60,5xx:10, and connect:S for origins\n"
+        "                   that can not be reached. Other errors are not\n"
+        "                   cached (" NEGATIVE_DEFAULT ")\n"
+        "  --ttl-jitter=PCT spread those by up to PCT percent (10)\n"
+        "  --upstream-limit=N\n"
+        "                   at most N fetches from origins at once, less\n"
+        "                   while they fail, 0 no limit (0)\n"
+        "  --origin-limit=N at most N to one origin, less while it is slow\n"
+        "                   or fails, 0 the upstream limit (0)\n"
+        "  --upstream-queue=N\n"
+        "                   N fetches may wait for room, more get 503 (64)\n"
+        "  --upstream-wait=MS\n"
+        "                   longest wait before a fetch gets 503 (1000)\n"
+        "  --hedge=PCT      ask an origin a second time, on another address\n"
+        "                   or connection, when the first byte takes longer\n"
+        "                   than PCT percent of its fetches, 0 never (0)\n"
+        "  --hedge-budget=PCT\n"
+        "                   hedges add at most PCT percent fetches (5)\n"
+        "  --prefetch=N     fetch the scripts, styles and images of the\n"
+        "                   same origin HTML pages link to into the cache,\n"
+        "                   N at once while the proxy is not busy, 0 off (0)\n"
+        "  --slow-ms=MS     log the time of each phase of requests that\n"
+        "                   take longer than MS, 0 never (0)\n"
+        "  --trace-sample=N log it for one request in N, 0 never (0)\n"
+        "  --header-timeout=MS\n"
+        "                   close clients that take longer to send the\n"
+        "                   request line and headers, 0 never (0)\n"
+        "  --connect-timeout=MS\n"
+        "                   give up connecting to an origin after MS (0)\n"
+        "  --first-byte-timeout=MS\n"
+        "                   give up on an origin that does not start its\n"
+        "                   response within MS of the request (0)\n"
+        "  --idle-timeout=MS\n"
+        "                   cut a response that moves no byte for MS (0)\n"
+        "  --client-buffer=KB\n"
+        "                   read origins at their pace into a buffer of\n"
+        "                   KB per response, at least 16, and give them\n"
+        "                   back before slow clients have it all, 0 off.\n"
+        "                   Not with --io-uring (0)\n"
+        "  --client-spill=MB\n"
+        "                   beyond the buffer, up to MB per response go to\n"
+        "                   a temporary file, 0 none (64)\n"
+        "  --access-log=FILE\n"
+        "                   log every request to FILE, and print errors\n"
+        "                   from the log thread\n"
+        "  --log-rotate=MB  rotate the access log at MB, 0 never (64)\n"
+        "  --record=FILE    append a binary record of every request to\n"
+        "                   FILE, to replay it with ./replay\n"
+        "  --disk-dir=DIR   keep a second cache tier in DIR\n"
+        "  --disk-size=MB   size of the disk tier (1024)\n"
+        "  --disk-max-object=MB\n"
+        "                   largest object kept on disk (64)\n"
+        "  --snapshot=FILE  load the cache from FILE at startup, save it\n"
+        "                   there on SIGUSR2 and on exit\n"
+        "  --processes=N    serve with N worker processes, each pinned to a\n"
+        "                   core, restarted if one dies. Not with the disk\n"
+        "                   tier or a snapshot\n"
+        "  --shared-cache=MB\n"
+        "                   size of the cache those share, or that is kept\n"
+        "                   over hot upgrades, 0 none (64)\n"
+        "  --hot-upgrade    on SIGHUP run the binary again and hand it the\n"
+        "                   port and the shared cache, then drain and exit.\n"
+        "                   Not with --processes, the disk tier or io_uring\n"
+        "  --admin-port=N   purge the cache over HTTP on port N of the\n"
+        "                   loopback interface, see admin.h. Not with\n"
+        "                   --processes (0)\n"
+        "  --peers=LIST     share the cache with the proxies of LIST,\n"
+        "                   host:port apart by commas, this one included.\n"
+        "                   Each URL is cached by one of them, see peer.h\n"
+        "  --peer-self=HOST:PORT\n"
+        "                   which of them this proxy is, if not the one on\n"
+        "                   its port. Needed when several are on it\n");
+}
+
+/*
+ * parse_config
+ *
+ * fill conf from the command line. return -1 if it is not valid.
+ */
+int parse_config(int argc, char *argv[]) {
+    int c;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'w':
+            conf.workers = atoi(optarg);
+            break;
+        case 'L':
+            conf.listeners = atoi(optarg);
+            break;
+        case '6':
+            conf.ipv6 = 1;
+            break;
+        case 'u':
+            conf.io_uring = 1;
+            break;
+        case 'l':
+            conf.l1_entries = atoi(optarg);
+            break;
+        case 'c':
+            conf.cache_size = atol(optarg) << 10;
+            break;
+        case 'm':
+            conf.max_object = atol(optarg) << 10;
+            break;
+        case 'z':
+            conf.zerocopy_min = atol(optarg) << 10;
+            break;
+        case 'C':
+            conf.compress = 1;
+            break;
+        case 'R':
+            conf.range_block = atol(optarg) << 10;
+            break;
+        case 'V':
+            conf.vary_max = atoi(optarg);
+            break;
+        case 'E':
+            conf.error_ttl = optarg;
+            break;
+        case 'J':
+            conf.ttl_jitter = atoi(optarg);
+            break;
+        case 'U':
+            conf.upstream_limit = atoi(optarg);
+            break;
+        case 'o':
+            conf.origin_limit = atoi(optarg);
+            break;
+        case 'q':
+            conf.upstream_queue = atoi(optarg);
+            break;
+        case 'W':
+            conf.upstream_wait = atoi(optarg);
+            break;
+        case 'g':
+            conf.hedge = atoi(optarg);
+            break;
+        case 'G':
+            conf.hedge_budget = atoi(optarg);
+            break;
+        case 'p':
+            conf.prefetch = atoi(optarg);
+            break;
+        case 'S':
+            conf.slow_ms = atol(optarg);
+            break;
+        case 'T':
+            conf.trace_sample = atoi(optarg);
+            break;
+        case 'h':
+            conf.header_timeout = atol(optarg);
+            break;
+        case 'k':
+            conf.connect_timeout = atol(optarg);
+            break;
+        case 'f':
+            conf.first_byte_timeout = atol(optarg);
+            break;
+        case 'i':
+            conf.idle_timeout = atol(optarg);
+            break;
+        case 'b':
+            conf.client_buffer = atol(optarg) << 10;
+            break;
+        case 'B':
+            conf.client_spill = atol(optarg) << 20;
+            break;
+        case 'a':
+            conf.access_log = optarg;
+            break;
+        case 'r':
+            conf.log_rotate = atol(optarg) << 20;
+            break;
+        case 'x':
+            conf.record = optarg;
+            break;
+        case 'd':
+            conf.disk_dir = optarg;
+            break;
+        case 'D':
+            conf.disk_size = atol(optarg) << 20;
+            break;
+        case 'O':
+            conf.disk_max_object = atol(optarg) << 20;
+            break;
+        case 's':
+            conf.snapshot = optarg;
+            break;
+        case 'P':
+            conf.processes = atoi(optarg);
+            break;
+        case 'M':
+            conf.shared_size = atol(optarg) << 20;
+            break;
+        case 'H':
+            conf.hot_upgrade = 1;
+            break;
+        case 'A':
+            conf.admin_port = atoi(optarg);
+            break;
+        case 'y':
+            conf.peers = optarg;
+            break;
+        case 'Y':
+            conf.peer_self = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
+    /* the port is what is left */
+    if (optind != argc - 1 || (conf.port = atoi(argv[optind])) <= 0) {
+        return -1;
+    }
+    if (conf.workers < 0 || conf.listeners < 0 || conf.l1_entries < 0 ||
+        conf.zerocopy_min < 0 || conf.range_block < 0 ||
+        conf.range_block >= conf.max_object || conf.vary_max < 0 ||
+        conf.upstream_limit < 0 || conf.origin_limit < 0 ||
+        conf.upstream_queue < 0 || conf.upstream_wait < 0 ||
+        conf.hedge < 0 || conf.hedge > 99 || conf.hedge_budget < 0 ||
+        conf.hedge_budget > 100 || conf.prefetch < 0 ||
+        conf.slow_ms < 0 || conf.trace_sample < 0 ||
+        conf.header_timeout < 0 || conf.connect_timeout < 0 ||
+        conf.first_byte_timeout < 0 || conf.idle_timeout < 0 ||
+        conf.log_rotate < 0 || conf.client_spill < 0 ||
+        (conf.client_buffer != 0 && conf.client_buffer < 16L << 10) ||
+        (conf.client_buffer != 0 && conf.io_uring) ||
+        conf.disk_size <= 0 || conf.disk_max_object <= 0 ||
+        conf.max_object <= 0 || conf.max_object > conf.cache_size ||
+        conf.max_object > INT_MAX || conf.processes < 0 ||
+        conf.shared_size < 0 || (conf.processes > 0 &&
+        (conf.disk_dir != NULL || conf.snapshot != NULL)) ||
+        (conf.hot_upgrade && (conf.processes > 0 || conf.disk_dir != NULL ||
+        conf.io_uring)) ||
+        conf.admin_port < 0 || conf.admin_port > 65535 ||
+        (conf.admin_port > 0 && conf.processes > 0) ||
+        (conf.peer_self != NULL && conf.peers == NULL) ||
+        negative_init(conf.error_ttl, conf.ttl_jitter) == -1) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,61 @@
+/*
+ * config.h
+ *
+ * run time options of the proxy, parsed from the command line.
+ */
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+/* all options, see usage() for what they mean */
+typedef struct config {
+    int port;                  /* port to listen on */
+    int workers;               /* worker threads, 0 for one per connection */
+    int listeners;             /* SO_REUSEPORT listeners, 0 for one socket */
+    int ipv6;                  /* listen dual-stack on IPv6 and IPv4 */
+    int io_uring;              /* network I/O through io_uring */
+    int l1_entries;            /* front cache entries per thread, 0 is off */
+    long cache_size;           /* bytes of the memory cache */
+    long max_object;           /* largest object kept in memory */
+    long zerocopy_min;         /* hits this large use MSG_ZEROCOPY, 0 off */
+    int compress;              /* store bodies compressed in memory */
+    long range_block;          /* cache ranges in blocks this large, 0 off */
+    int vary_max;              /* variants kept per id, 0 caches none */
+    char *error_ttl;           /* seconds errors are cached, see negative.h */
+    int ttl_jitter;            /* percent those are spread by */
+    int upstream_limit;        /* most origin fetches at once, 0 no limit */
+    int origin_limit;          /* most to one origin, 0 same as above */
+    int upstream_queue;        /* fetches that may wait for room */
+    int upstream_wait;         /* ms one may wait before it is shed */
+    int hedge;                 /* percentile of first bytes to hedge at */
+    int hedge_budget;          /* percent of extra fetches hedges may add */
+    int prefetch;              /* prefetches at once from pages, 0 none */
+    long slow_ms;              /* log requests slower than this, 0 never */
+    int trace_sample;          /* log one request in this many, 0 never */
+    long header_timeout;       /* ms a client has for the request head */
+    long connect_timeout;      /* ms an origin has to accept */
+    long first_byte_timeout;   /* ms it has to start the response */
+    long idle_timeout;         /* ms a transfer may stall, 0s are off */
+    long client_buffer;        /* bytes of a body buffered for the client */
+    long client_spill;         /* and spilled to a file beyond, 0s are off */
+    char *access_log;          /* file of the access log, NULL is off */
+    long log_rotate;           /* bytes it is rotated at, 0 never */
+    char *record;              /* file of the request record, NULL is off */
+    char *disk_dir;            /* directory of the disk tier, NULL is off */
+    long disk_size;            /* bytes of the disk tier */
+    long disk_max_object;      /* largest object kept on disk */
+    char *snapshot;            /* snapshot file of the cache, NULL is off */
+    int processes;             /* worker processes, 0 for this one only */
+    long shared_size;          /* bytes of the cache they share, 0 none */
+    int hot_upgrade;           /* SIGHUP hands over to a new binary */
+    int admin_port;            /* loopback port of purges, 0 is off */
+    char *peers;               /* host:port of the cluster, NULL is none */
+    char *peer_self;           /* which of them this is, NULL by port */
+} config;
+
+extern config conf;
+
+int parse_config(int argc, char *argv[]);
+void usage(char *prog);
+
+#endif /* __CONFIG_H__ */
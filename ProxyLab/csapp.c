@@ -572,6 +572,141 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - robustly write an iovec array (unbuffered)
+ *    The array is updated as it is written, so it is garbage after.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t n = 0, nleft;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+    nleft = n;
+    while (nleft > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+	    if (errno == EINTR)  /* interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errorno set by writev() */
+	}
+	nleft -= nwritten;
+	/* skip what was written */
+	while (iovcnt > 0 && nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return n;
+}
+
+/*
+ * zerocopy_wait - wait for the kernel to report that it is done with the
+ *     pages of the first calls sends done with MSG_ZEROCOPY on fd. The
+ *     reports come on the error queue of the socket.
+ */
+static int zerocopy_wait(int fd, unsigned int calls) 
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct pollfd pfd;
+    unsigned int done = 0;
+
+    pfd.fd = fd;
+    pfd.events = 0;            /* POLLERR is always reported */
+    while (done < calls) {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+	    if (errno == EAGAIN || errno == EINTR) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		    return -1;
+		continue;
+	    }
+	    return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	    serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+	    if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+		done += serr->ee_data - serr->ee_info + 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * rio_zerocopy_enable - let the socket fd send with MSG_ZEROCOPY, once
+ *    for the life of the socket. Returns -1 if it can not.
+ */
+int rio_zerocopy_enable(int fd) 
+{
+    int optval = 1;
+
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(optval));
+}
+
+/*
+ * rio_sendv_zerocopy - robustly send an iovec array with MSG_ZEROCOPY,
+ *    so the kernel sends from the pages instead of copying them. Returns
+ *    only once the kernel is done with the pages, the caller may free or
+ *    change them after. fd must have been through rio_zerocopy_enable,
+ *    otherwise the kernel copies and never reports done. The array is 
+ *    garbage after.
+ */
+ssize_t rio_sendv_zerocopy(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t n = 0, nleft;
+    ssize_t nsent;
+    struct msghdr msg;
+    unsigned int calls = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+	n += iov[i].iov_len;
+    nleft = n;
+    while (nleft > 0) {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	if ((nsent = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL)) < 0) {
+	    if (errno == EINTR)
+		nsent = 0;
+	    else if (errno == ENOBUFS)   /* out of pinned memory, copy */
+		break;
+	    else
+		return -1;
+	}
+	else
+	    calls++;
+	nleft -= nsent;
+	/* skip what was sent */
+	while (iovcnt > 0 && nsent >= iov->iov_len) {
+	    nsent -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + nsent;
+	    iov->iov_len -= nsent;
+	}
+    }
+    if (zerocopy_wait(fd, calls) < 0)
+	return -1;
+    if (nleft > 0 && rio_writev(fd, iov, iovcnt) < 0)
+	return -1;
+    return n;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -786,6 +921,59 @@ int open_listenfd(int port)
 }
 /* $end open_listenfd */
 
+/*
+ * open_listenfd_reuseport - open a nonblocking listening socket on port
+ *     with SO_REUSEPORT, so several sockets can share the port and the
+ *     kernel spreads new connections over them. With ipv6 the socket is
+ *     dual-stack and takes IPv4 connections too.
+ *     Returns -1 and sets errno on Unix error.
+ */
+static int bind_reuseport(int listenfd, int port, int ipv6) 
+{
+    int optval=1, v6only=0;
+    struct sockaddr_in serveraddr;
+    struct sockaddr_in6 serveraddr6;
+
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, 
+		   (const void *)&optval , sizeof(int)) < 0)
+	return -1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+		   (const void *)&optval , sizeof(int)) < 0)
+	return -1;
+
+    if (ipv6) {
+	/* take IPv4 connections too, as mapped addresses */
+	if (setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, 
+		       (const void *)&v6only, sizeof(int)) < 0)
+	    return -1;
+	bzero((char *) &serveraddr6, sizeof(serveraddr6));
+	serveraddr6.sin6_family = AF_INET6; 
+	serveraddr6.sin6_addr = in6addr_any; 
+	serveraddr6.sin6_port = htons((unsigned short)port); 
+	return bind(listenfd, (SA *)&serveraddr6, sizeof(serveraddr6));
+    }
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET; 
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY); 
+    serveraddr.sin_port = htons((unsigned short)port); 
+    return bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr));
+}
+
+int open_listenfd_reuseport(int port, int ipv6) 
+{
+    int listenfd;
+  
+    if ((listenfd = socket(ipv6 ? AF_INET6 : AF_INET, 
+			   SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+	return -1;
+    if (bind_reuseport(listenfd, port, ipv6) < 0 || 
+	listen(listenfd, LISTENQ) < 0) {
+	close(listenfd);
+	return -1;
+    }
+    return listenfd;
+}
+
 /******************************************
  * Wrappers for the client/server helper routines 
  ******************************************/
@@ -810,6 +998,15 @@ int Open_listenfd(int port)
 	unix_error("Open_listenfd error");
     return rc;
 }
+
+int Open_listenfd_reuseport(int port, int ipv6) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port, ipv6)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
 /* $end csapp.c */
 
 
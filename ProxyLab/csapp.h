@@ -23,6 +23,9 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/errqueue.h>
 
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
@@ -145,6 +148,9 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
+int rio_zerocopy_enable(int fd);
+ssize_t rio_sendv_zerocopy(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
@@ -159,10 +165,12 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 /* Client/server helper functions */
 int open_clientfd(char *hostname, int portno);
 int open_listenfd(int portno);
+int open_listenfd_reuseport(int portno, int ipv6);
 
 /* Wrappers for client/server helper functions */
 int Open_clientfd(char *hostname, int port);
 int Open_listenfd(int port); 
+int Open_listenfd_reuseport(int port, int ipv6);
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
@@ -0,0 +1,451 @@
+/*
+ * disk_cache.c
+ *
+ * second tier of the cache on local disk. Objects are appended to a set of
+ * large segment files, an index in memory maps the cache id to the segment
+ * and offset of the object. Objects evicted from memory are demoted here,
+ * and objects too large for memory go here directly. When all segments are
+ * full the one with the fewest live bytes is reclaimed and its objects are
+ * dropped from the index.
+ *
+ * Every object is written as one record: a disk_record header, the cache
+ * id and the object. The space of a record is reserved under the lock and
+ * written without it, the index entry is only added once the write is
+ * done, so a reader never sees a half written object. A segment that is
+ * being read or written can not be reclaimed. The tier starts empty, the
+ * segment files of a previous run are truncated. Ids that come and go are
+ * told to the index of purges, see purge.h.
+ */
+
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "disk_cache.h"
+#include "cache.h"
+#include "stats.h"
+#include "purge.h"
+
+/* header written in front of every object */
+typedef struct disk_record {
+    unsigned int magic;        /* DISK_MAGIC */
+    unsigned int id_len;       /* length of the cache id that follows */
+    long size;                 /* size of the object after the id */
+    cache_meta meta;           /* meta of the object */
+} disk_record;
+
+/* index entry of an object on disk */
+typedef struct disk_entry {
+    char *id;                  /* cache id of the object */
+    unsigned int hash;         /* hash of the id */
+    int seg;                   /* segment the record is in */
+    long offset;               /* offset of the object in the segment */
+    long size;                 /* size of the object */
+    long rec_size;             /* size of the whole record */
+    cache_meta meta;           /* meta of the object */
+    struct disk_entry *next;   /* next entry in the same bucket */
+} disk_entry;
+
+/* one segment file */
+typedef struct segment {
+    int fd;                    /* descriptor of the file */
+    long written;              /* bytes reserved so far */
+    long live;                 /* bytes of records still in the index */
+    int users;                 /* readers and writers, pinned if > 0 */
+} segment;
+
+static int enabled = 0;
+static segment *segs;          /* all segments */
+static int nsegs;              /* number of segments */
+static long seg_size;          /* size of each segment */
+static int active;             /* segment new records go to */
+static disk_entry **buckets;   /* the index */
+static int nbuckets;           /* number of buckets of the index */
+static sem_t lock;             /* protects everything above */
+
+/*
+ * disk_init
+ *
+ * create the segment files in dir, size bytes in total. return -1 if
+ * failed.
+ */
+int disk_init(char *dir, long size) {
+    char path[MAXLINE];
+    int i;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        unix_error("disk_init mkdir error");
+        return -1;
+    }
+
+    /* at least four segments, so reclaiming one does not lose much */
+    seg_size = DISK_SEGMENT_SIZE;
+    if (size / 4 < seg_size) {
+        seg_size = size / 4;
+    }
+    if (seg_size < MAXBUF) {
+        app_error("disk_init: disk tier too small");
+        return -1;
+    }
+    nsegs = size / seg_size;
+    if ((segs = (segment *)Calloc(nsegs, sizeof(segment))) == NULL) {
+        return -1;
+    }
+    for (i = 0; i < nsegs; i++) {
+        snprintf(path, MAXLINE, "%s/seg.%04d", dir, i);
+        if ((segs[i].fd = open(path, O_RDWR | O_CREAT | O_TRUNC,
+                               DEF_MODE)) < 0) {
+            unix_error("disk_init open error");
+            return -1;
+        }
+    }
+
+    /* about one bucket per 16 KB of disk */
+    for (nbuckets = 1024; nbuckets < size / 16384; nbuckets *= 2) {
+        ;
+    }
+    if ((buckets = (disk_entry **)Calloc(nbuckets,
+                                         sizeof(disk_entry *))) == NULL) {
+        return -1;
+    }
+    Sem_init(&lock, 0, 1);
+    active = 0;
+    enabled = 1;
+    return 1;
+}
+
+/*
+ * disk_enabled
+ *
+ * return 1 if there is a disk tier.
+ */
+int disk_enabled() {
+    return enabled;
+}
+
+/* find the entry of an id, caller holds the lock */
+static disk_entry *find_entry(char *cache_id, unsigned int hash) {
+    disk_entry *entry;
+
+    for (entry = buckets[hash % nbuckets]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->id, cache_id) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * drop_segment
+ *
+ * remove every entry of a segment from the index. Caller holds the lock.
+ */
+static void drop_segment(int seg) {
+    disk_entry **link, *entry;
+    int i;
+
+    for (i = 0; i < nbuckets; i++) {
+        link = &buckets[i];
+        while ((entry = *link) != NULL) {
+            if (entry->seg == seg) {
+                *link = entry->next;
+                purge_index_del(entry->id, PURGE_DISK);
+                Free(entry->id);
+                Free(entry);
+                stat_add(STAT_DISK_DROPPED, 1);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+/*
+ * rotate
+ *
+ * the active segment is full, pick the next one. An empty segment is
+ * taken first, otherwise the one with the fewest live bytes is reclaimed.
+ * Segments in use are skipped. Caller holds the lock. return -1 if no
+ * segment can be taken now.
+ */
+static int rotate() {
+    int i, victim = -1;
+
+    for (i = 0; i < nsegs; i++) {
+        if (i == active || segs[i].users > 0) {
+            continue;
+        }
+        if (victim == -1 || segs[i].live < segs[victim].live) {
+            victim = i;
+        }
+        if (segs[victim].live == 0) {
+            break;
+        }
+    }
+    if (victim == -1) {
+        return -1;
+    }
+    if (segs[victim].written > 0) {
+        if (segs[victim].live > 0) {
+            drop_segment(victim);
+        }
+        stat_add(STAT_DISK_RECLAIMED, 1);
+    }
+    segs[victim].written = 0;
+    segs[victim].live = 0;
+    active = victim;
+    return 1;
+}
+
+/*
+ * write_pieces
+ *
+ * write iovcnt pieces at offset, at most UIO_MAXIOV per call. return the
+ * number of bytes written, -1 if failed.
+ */
+static long write_pieces(int fd, struct iovec *iov, int iovcnt, long offset) {
+    long total = 0;
+    ssize_t n;
+    int batch, i;
+
+    while (iovcnt > 0) {
+        batch = iovcnt < UIO_MAXIOV ? iovcnt : UIO_MAXIOV;
+        if ((n = pwritev(fd, iov, batch, offset + total)) < 0) {
+            return -1;
+        }
+        for (i = 0; i < batch; i++) {
+            n -= iov[i].iov_len;
+        }
+        /* a short write to a regular file means the disk is full */
+        if (n != 0) {
+            return -1;
+        }
+        for (i = 0; i < batch; i++) {
+            total += iov[i].iov_len;
+        }
+        iov += batch;
+        iovcnt -= batch;
+    }
+    return total;
+}
+
+/*
+ * disk_insert
+ *
+ * append an object, given as iovcnt pieces, and its meta to the active
+ * segment and add it to the index. If the id is already on disk, nothing
+ * is written. return -1 if failed.
+ */
+int disk_insert(char *cache_id, struct iovec *iov, int iovcnt, long size,
+                cache_meta *meta) {
+    disk_record rec;
+    struct iovec head[2];
+    disk_entry *entry = NULL;
+    unsigned int hash;
+    long rec_size, offset;
+    int seg, rc = -1;
+
+    if (!enabled) {
+        return -1;
+    }
+    rec.magic = DISK_MAGIC;
+    rec.id_len = strlen(cache_id);
+    rec.size = size;
+    rec.meta = *meta;
+    rec_size = sizeof(rec) + rec.id_len + size;
+    if (rec_size > seg_size) {
+        return -1;
+    }
+    hash = cache_hash(cache_id);
+
+    /* reserve the space */
+    P(&lock);
+    if (find_entry(cache_id, hash) != NULL) {
+        V(&lock);
+        return 1;
+    }
+    if (segs[active].written + rec_size > seg_size && rotate() == -1) {
+        V(&lock);
+        stat_add(STAT_DISK_FULL, 1);
+        return -1;
+    }
+    seg = active;
+    offset = segs[seg].written;
+    segs[seg].written += rec_size;
+    segs[seg].users++;
+    V(&lock);
+
+    /* write the record without holding the lock */
+    head[0].iov_base = &rec;
+    head[0].iov_len = sizeof(rec);
+    head[1].iov_base = cache_id;
+    head[1].iov_len = rec.id_len;
+    if (write_pieces(segs[seg].fd, head, 2, offset) == rec_size - size &&
+        write_pieces(segs[seg].fd, iov, iovcnt, offset + rec_size - size)
+        == size &&
+        (entry = (disk_entry *)Malloc(sizeof(disk_entry))) != NULL) {
+        if ((entry->id = (char *)Malloc(rec.id_len + 1)) == NULL) {
+            Free(entry);
+            entry = NULL;
+        } else {
+            strcpy(entry->id, cache_id);
+            entry->hash = hash;
+            entry->seg = seg;
+            entry->offset = offset + sizeof(rec) + rec.id_len;
+            entry->size = size;
+            entry->rec_size = rec_size;
+            entry->meta = *meta;
+        }
+    }
+
+    /* now readers may see it */
+    P(&lock);
+    segs[seg].users--;
+    if (entry != NULL && find_entry(cache_id, hash) == NULL) {
+        entry->next = buckets[hash % nbuckets];
+        buckets[hash % nbuckets] = entry;
+        purge_index_add(cache_id, PURGE_DISK);
+        segs[seg].live += rec_size;
+        entry = NULL;
+        rc = 1;
+    }
+    V(&lock);
+
+    if (entry != NULL) {
+        Free(entry->id);
+        Free(entry);
+    }
+    if (rc == 1) {
+        stat_add(STAT_DISK_WRITES, 1);
+        stat_add(STAT_DISK_BYTES, rec_size);
+    }
+    return rc;
+}
+
+/*
+ * disk_lookup
+ *
+ * look for an object on disk. If found, fill ref and pin its segment
+ * until disk_release. return -1 if not found.
+ */
+int disk_lookup(char *cache_id, disk_ref *ref) {
+    unsigned int hash;
+    disk_entry *entry;
+
+    if (!enabled) {
+        return -1;
+    }
+    hash = cache_hash(cache_id);
+    P(&lock);
+    if ((entry = find_entry(cache_id, hash)) != NULL) {
+        ref->seg = entry->seg;
+        ref->offset = entry->offset;
+        ref->size = entry->size;
+        ref->meta = entry->meta;
+        segs[entry->seg].users++;
+    }
+    V(&lock);
+
+    if (entry == NULL) {
+        stat_add(STAT_DISK_MISSES, 1);
+        return -1;
+    }
+    stat_add(STAT_DISK_HITS, 1);
+    return 1;
+}
+
+/*
+ * disk_remove
+ *
+ * drop an object from the index, e.g. when a newer one has to take its
+ * id. Its bytes stay until the segment is reclaimed, so a reader that
+ * found it before can still send it. return -1 if it was not there.
+ */
+int disk_remove(char *cache_id) {
+    disk_entry **link, *entry;
+    unsigned int hash;
+
+    if (!enabled) {
+        return -1;
+    }
+    hash = cache_hash(cache_id);
+    P(&lock);
+    for (link = &buckets[hash % nbuckets]; (entry = *link) != NULL;
+         link = &entry->next) {
+        if (entry->hash == hash && strcmp(entry->id, cache_id) == 0) {
+            *link = entry->next;
+            segs[entry->seg].live -= entry->rec_size;
+            purge_index_del(cache_id, PURGE_DISK);
+            break;
+        }
+    }
+    V(&lock);
+
+    if (entry == NULL) {
+        return -1;
+    }
+    Free(entry->id);
+    Free(entry);
+    return 1;
+}
+
+/*
+ * disk_read
+ *
+ * read n bytes at offset of a found object into buf. return the number of
+ * bytes read, -1 if failed.
+ */
+ssize_t disk_read(disk_ref *ref, void *buf, long offset, size_t n) {
+    size_t nleft = n;
+    ssize_t nread;
+    char *bufp = buf;
+
+    while (nleft > 0) {
+        if ((nread = pread(segs[ref->seg].fd, bufp, nleft,
+                           ref->offset + offset)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (nread == 0) {
+            break;
+        }
+        nleft -= nread;
+        offset += nread;
+        bufp += nread;
+    }
+    return n - nleft;
+}
+
+/*
+ * disk_send
+ *
+ * send n bytes at offset of a found object to out_fd without copying them
+ * through user space. return -1 if failed.
+ */
+int disk_send(disk_ref *ref, int out_fd, long offset, long n) {
+    off_t pos = ref->offset + offset;
+    long nleft = n;
+    ssize_t nsent;
+
+    while (nleft > 0) {
+        if ((nsent = sendfile(out_fd, segs[ref->seg].fd, &pos,
+                              nleft)) <= 0) {
+            if (nsent < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        nleft -= nsent;
+    }
+    return 1;
+}
+
+/*
+ * disk_release
+ *
+ * done with a found object, its segment may be reclaimed again.
+ */
+void disk_release(disk_ref *ref) {
+    P(&lock);
+    segs[ref->seg].users--;
+    V(&lock);
+}
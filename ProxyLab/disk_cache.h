@@ -0,0 +1,41 @@
+/*
+ * disk_cache.h
+ *
+ * second tier of the cache on local disk. Objects are appended to a set of
+ * large segment files, an index in memory maps the cache id to the segment
+ * and offset of the object. Objects evicted from memory are demoted here,
+ * and objects too large for memory go here directly. When all segments are
+ * full the one with the fewest live bytes is reclaimed and its objects are
+ * dropped from the index.
+ */
+
+#ifndef __DISK_CACHE_H__
+#define __DISK_CACHE_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* largest segment file, smaller if the whole tier is small */
+#define DISK_SEGMENT_SIZE (64L << 20)
+/* marks the start of a record in a segment */
+#define DISK_MAGIC 0x70726f78
+
+/* a found object, the segment can not be reclaimed until released */
+typedef struct disk_ref {
+    int seg;                   /* segment the object is in */
+    long offset;               /* offset of the object in the segment */
+    long size;                 /* size of the object */
+    cache_meta meta;           /* meta of the object */
+} disk_ref;
+
+int disk_init(char *dir, long size);
+int disk_enabled();
+int disk_insert(char *cache_id, struct iovec *iov, int iovcnt, long size,
+                cache_meta *meta);
+int disk_lookup(char *cache_id, disk_ref *ref);
+int disk_remove(char *cache_id);
+ssize_t disk_read(disk_ref *ref, void *buf, long offset, size_t n);
+int disk_send(disk_ref *ref, int out_fd, long offset, long n);
+void disk_release(disk_ref *ref);
+
+#endif /* __DISK_CACHE_H__ */
@@ -0,0 +1,177 @@
+/*
+ * hedge.c
+ *
+ * the histograms and the budget of hedged fetches. A bucket of a histogram
+ * is a quarter of a power of 2 of us wide, so a percentile is within 25%
+ * of the true one. The buckets are counted without a lock, the percentile
+ * is worked out again every HEDGE_UPDATE first bytes by the thread that
+ * counted the last of them, and the counts halved every HEDGE_DECAY, so
+ * the histogram weighs recent fetches the most. The odd count lost to a
+ * race does not matter here.
+ *
+ * The budget is in hundredths of a hedge: every fetch adds the percent of
+ * extra fetches allowed, and a hedge takes 100 of it.
+ */
+
+#include "csapp.h"
+#include "hedge.h"
+#include "stats.h"
+
+static hedge_origin origins[HEDGE_ORIGINS];
+static int enabled = 0;
+static int percentile;         /* of first bytes to hedge at */
+static int budget;             /* hundredths of a hedge a fetch adds */
+static atomic_long credit;     /* hundredths of a hedge saved up */
+
+/*
+ * hedge_init
+ *
+ * hedge fetches slower than pct percent of those of their origin, with
+ * at most extra percent of extra fetches. A pct of 0 never hedges.
+ */
+void hedge_init(int pct, int extra) {
+    if (pct <= 0) {
+        return;
+    }
+    percentile = pct;
+    budget = extra;
+    atomic_init(&credit, 0);
+    enabled = 1;
+}
+
+/* FNV-1a hash of host:port */
+static unsigned int origin_hash(char *host, char *port) {
+    unsigned int h = 2166136261U;
+    char *s;
+
+    for (s = host; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619U;
+    }
+    h = (h ^ ':') * 16777619U;
+    for (s = port; *s != '\0'; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619U;
+    }
+    return h;
+}
+
+/*
+ * hedge_find
+ *
+ * the histogram of host:port, NULL if hedging is off.
+ */
+hedge_origin *hedge_find(char *host, char *port) {
+    if (!enabled) {
+        return NULL;
+    }
+    return &origins[origin_hash(host, port) & (HEDGE_ORIGINS - 1)];
+}
+
+/*
+ * hedge_delay
+ *
+ * a fetch from origin was sent, which adds to the budget. return the ms
+ * to wait for its first byte before hedging it, -1 if it is not hedged.
+ */
+long hedge_delay(hedge_origin *origin) {
+    long old, new, us;
+
+    if (origin == NULL) {
+        return -1;
+    }
+    old = atomic_load(&credit);
+    do {
+        new = old + budget;
+        if (new > HEDGE_BURST * 100) {
+            new = HEDGE_BURST * 100;
+        }
+    } while (new != old &&
+             !atomic_compare_exchange_weak(&credit, &old, new));
+    if ((us = atomic_load(&origin->delay_us)) == 0) {
+        return -1;
+    }
+    return (us + 999) / 1000;
+}
+
+/*
+ * hedge_allow
+ *
+ * take a hedge from the budget. return 1 if there was one.
+ */
+int hedge_allow() {
+    long old = atomic_load(&credit);
+
+    do {
+        if (old < 100) {
+            stat_add(STAT_HEDGE_DENIED, 1);
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&credit, &old, old - 100));
+    return 1;
+}
+
+/* the bucket of us, exact below 4 */
+static int bucket_of(long us) {
+    int msb, i;
+
+    if (us < 4) {
+        return us < 0 ? 0 : us;
+    }
+    msb = 63 - __builtin_clzl(us);
+    i = (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+    return i < HEDGE_BUCKETS ? i : HEDGE_BUCKETS - 1;
+}
+
+/* the first us beyond bucket i */
+static long bucket_end(int i) {
+    if (i < 4) {
+        return i + 1;
+    }
+    return (long)(4 + i % 4 + 1) << (i / 4 - 1);
+}
+
+/*
+ * update
+ *
+ * work out the percentile of origin from its histogram.
+ */
+static void update(hedge_origin *origin) {
+    long total = 0, seen = 0;
+    int i;
+
+    for (i = 0; i < HEDGE_BUCKETS; i++) {
+        total += atomic_load(&origin->counts[i]);
+    }
+    for (i = 0; i < HEDGE_BUCKETS; i++) {
+        seen += atomic_load(&origin->counts[i]);
+        if (seen * 100 >= total * percentile) {
+            break;
+        }
+    }
+    atomic_store(&origin->delay_us, bucket_end(i < HEDGE_BUCKETS ? i :
+                                               HEDGE_BUCKETS - 1));
+}
+
+/*
+ * hedge_observe
+ *
+ * a fetch from origin got its first byte us after it was sent.
+ */
+void hedge_observe(hedge_origin *origin, long us) {
+    long n;
+    int i;
+
+    if (origin == NULL) {
+        return;
+    }
+    atomic_fetch_add(&origin->counts[bucket_of(us)], 1);
+    n = atomic_fetch_add(&origin->samples, 1) + 1;
+    if (n % HEDGE_DECAY == 0) {
+        for (i = 0; i < HEDGE_BUCKETS; i++) {
+            atomic_store(&origin->counts[i],
+                         atomic_load(&origin->counts[i]) / 2);
+        }
+    }
+    if (n % HEDGE_UPDATE == 0) {
+        update(origin);
+    }
+}
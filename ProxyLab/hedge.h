@@ -0,0 +1,41 @@
+/*
+ * hedge.h
+ *
+ * hedged fetches from origins. The times to first byte of each origin are
+ * kept in a histogram, and a fetch that has not started to answer by the
+ * chosen percentile of them is sent a second time, on another address of
+ * the origin or another connection to it. The answer that starts first is
+ * used and the other closed. A budget keeps the extra fetches to a share
+ * of all of them, so a slow origin is not asked twice for everything.
+ */
+
+#ifndef __HEDGE_H__
+#define __HEDGE_H__
+
+#include <stdatomic.h>
+
+/* slots of origins, a power of 2, origins that hash alike share one */
+#define HEDGE_ORIGINS 256
+/* buckets of a histogram, 4 per power of 2 of us */
+#define HEDGE_BUCKETS 112
+/* first bytes between two updates of the percentile */
+#define HEDGE_UPDATE 32
+/* first bytes after which a histogram is halved, to follow changes */
+#define HEDGE_DECAY 1024
+/* hedges the budget saves up at most */
+#define HEDGE_BURST 10
+
+/* the times to first byte of an origin */
+typedef struct hedge_origin {
+    atomic_long counts[HEDGE_BUCKETS];
+    atomic_long samples;       /* first bytes counted in all */
+    atomic_long delay_us;      /* the percentile, 0 until it is known */
+} hedge_origin;
+
+void hedge_init(int pct, int extra);
+hedge_origin *hedge_find(char *host, char *port);
+long hedge_delay(hedge_origin *origin);
+int hedge_allow();
+void hedge_observe(hedge_origin *origin, long us);
+
+#endif /* __HEDGE_H__ */
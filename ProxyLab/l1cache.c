@@ -0,0 +1,144 @@
+/*
+ * l1cache.c
+ *
+ * optional per-thread front cache in front of the shared cache. Each
+ * thread keeps a small direct mapped table of pinned items, so a hit on a
+ * hot object costs no chain walk and no reference count traffic. An entry
+ * remembers the generation of its item and is dropped as soon as the shared
+ * cache has unlinked it (evicted or replaced). Only useful when threads
+ * serve more than one request, i.e. with worker threads.
+ *
+ * An item held here keeps its memory after the shared cache evicted it,
+ * until the thread looks at that entry again or exits. That is at most
+ * entries * MAX_OBJECT_SIZE per thread on top of MAX_CACHE_SIZE.
+ */
+
+#include "l1cache.h"
+#include "stats.h"
+
+/* one entry of the front cache */
+typedef struct l1_entry {
+    unsigned int hash;         /* hash of the id of the item */
+    unsigned long gen;         /* generation of the item when pinned */
+    cache_item *item;          /* pinned item, NULL if empty */
+} l1_entry;
+
+static int l1_entries = 0;     /* entries per thread, 0 if disabled */
+static pthread_key_t table_key;
+static __thread l1_entry *table = NULL;
+
+/*
+ * release_table
+ *
+ * thread exit destructor, unpin everything the thread held.
+ */
+static void release_table(void *arg) {
+    l1_entry *entries = (l1_entry *)arg;
+    int i;
+
+    for (i = 0; i < l1_entries; i++) {
+        if (entries[i].item != NULL) {
+            cache_unpin(entries[i].item);
+        }
+    }
+    Free(entries);
+}
+
+/*
+ * l1_init
+ *
+ * enable the front cache with given entries per thread. Call it before
+ * any thread is created.
+ */
+void l1_init(int entries) {
+    l1_entries = entries;
+    if (entries > 0) {
+        pthread_key_create(&table_key, release_table);
+    }
+}
+
+/*
+ * shared_get
+ *
+ * look in the shared cache and count the result.
+ */
+static cache_item *shared_get(char *cache_id, cache *pcache) {
+    cache_item *item;
+
+    if ((item = cache_pin(cache_id, pcache)) == NULL) {
+        stat_add(STAT_CACHE_MISSES, 1);
+    } else {
+        stat_add(STAT_CACHE_HITS, 1);
+    }
+    return item;
+}
+
+/*
+ * l1_get
+ *
+ * look for the item in the front cache of this thread first, then in the
+ * shared cache. A shared hit replaces whatever was in its entry. The item
+ * stays valid until l1_put. return NULL if not found.
+ */
+cache_item *l1_get(char *cache_id, cache *pcache) {
+    unsigned int hash;
+    l1_entry *entry;
+    cache_item *item;
+    unsigned long gen;
+
+    if (l1_entries == 0) {
+        return shared_get(cache_id, pcache);
+    }
+    if (table == NULL) {
+        if ((table = (l1_entry *)Calloc(l1_entries,
+                                        sizeof(l1_entry))) == NULL) {
+            return shared_get(cache_id, pcache);
+        }
+        pthread_setspecific(table_key, table);
+    }
+
+    hash = cache_hash(cache_id);
+    entry = &table[hash % l1_entries];
+    if (entry->item != NULL && entry->hash == hash &&
+        strcmp(entry->item->id, cache_id) == 0) {
+        /* still the same item in the shared cache? */
+        if (atomic_load_explicit(&entry->item->gen,
+                                 memory_order_acquire) == entry->gen) {
+            stat_add(STAT_L1_HITS, 1);
+            cache_touch(entry->item);
+            return entry->item;
+        }
+        stat_add(STAT_L1_STALE, 1);
+        cache_unpin(entry->item);
+        entry->item = NULL;
+    }
+    stat_add(STAT_L1_MISSES, 1);
+
+    if ((item = shared_get(cache_id, pcache)) == NULL) {
+        return NULL;
+    }
+    /* unlinked between the lookup and now, do not keep it */
+    if ((gen = atomic_load_explicit(&item->gen, memory_order_acquire)) == 0) {
+        return item;
+    }
+    if (entry->item != NULL) {
+        cache_unpin(entry->item);
+    }
+    entry->item = item;
+    entry->hash = hash;
+    entry->gen = gen;
+    return item;
+}
+
+/*
+ * l1_put
+ *
+ * done with an item from l1_get. Items kept in the front cache stay
+ * pinned, others are unpinned.
+ */
+void l1_put(cache_item *item) {
+    if (table != NULL && table[item->hash % l1_entries].item == item) {
+        return;
+    }
+    cache_unpin(item);
+}
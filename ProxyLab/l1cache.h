@@ -0,0 +1,21 @@
+/*
+ * l1cache.h
+ *
+ * optional per-thread front cache in front of the shared cache. Each
+ * thread keeps a small direct mapped table of pinned items, so a hit on a
+ * hot object costs no chain walk and no reference count traffic. An entry
+ * remembers the generation of its item and is dropped as soon as the shared
+ * cache has unlinked it (evicted or replaced). Only useful when threads
+ * serve more than one request, i.e. with worker threads.
+ */
+
+#ifndef __L1CACHE_H__
+#define __L1CACHE_H__
+
+#include "cache.h"
+
+void l1_init(int entries);
+cache_item *l1_get(char *cache_id, cache *pcache);
+void l1_put(cache_item *item);
+
+#endif /* __L1CACHE_H__ */
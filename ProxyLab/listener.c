@@ -0,0 +1,409 @@
+/*
+ * listener.c
+ *
+ * accept connections and hand them to the threads that serve them. By
+ * default there is one listening socket, accepted from in the main thread.
+ * With several listeners every one has its own SO_REUSEPORT socket on the
+ * same port and its own thread pinned to a core, the kernel spreads new
+ * connections over the sockets, and each listener serves its connections
+ * on its own core with its own workers, nothing is handed across cores.
+ *
+ * The listening sockets are nonblocking: a listener waits in poll, then
+ * accepts until the queue is empty. With io_uring it instead keeps one
+ * multishot accept armed and takes the connections in batches. Each wakeup
+ * also samples the accept queue of the socket, so a report shows how close
+ * it came to the backlog.
+ *
+ * For a hot upgrade the sockets can come from the process before us
+ * instead of being opened, and be given to the one after us: then every
+ * listener stops accepting, and the connections accepted so far are
+ * counted until they are served, so they can be drained.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <netinet/tcp.h>
+#include "csapp.h"
+#include "sbuf.h"
+#include "listener.h"
+#include "uring.h"
+
+/* most connections taken from io_uring at once */
+#define ACCEPT_BATCH 64
+
+/* one listening socket and what serves its connections */
+typedef struct listener {
+    int fd;                    /* the listening socket */
+    int cpu;                   /* core it is pinned to, -1 if not pinned */
+    sbuf_t sbuf;               /* connections for its workers */
+    atomic_long accepted;      /* connections accepted */
+    atomic_long full;          /* wakeups that found the queue full */
+    atomic_int max_queue;      /* longest accept queue seen */
+    atomic_int backlog;        /* length the queue may grow to */
+    long last_accepted;        /* accepted at the last report */
+} listener;
+
+static listener *listeners;    /* all listeners */
+static int nlisteners;         /* number of listeners */
+static int workers;            /* worker threads per listener, 0 for none */
+static void (*serve)(int client_fd); /* serves one connection */
+static struct timeval last_report; /* when accept rates were last shown */
+static int *inherited;         /* sockets to use instead of opening them */
+static int ninherited;         /* number of them */
+static int stop_pipe[2] = {-1, -1}; /* readable once listeners must stop */
+static atomic_int stopping;    /* listeners stop accepting */
+static atomic_long active;     /* connections accepted and not yet served */
+
+/*
+ * conn_thread
+ *
+ * one thread per connection, serve it and exit.
+ */
+static void *conn_thread(void *vargp) {
+    int client_fd = *((int *)vargp);
+
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    serve(client_fd);
+    atomic_fetch_sub(&active, 1);
+    return NULL;
+}
+
+/*
+ * worker
+ *
+ * worker thread of a listener, serve the connections from its sbuf one
+ * after another. The thread lives on, so does its front cache.
+ */
+static void *worker(void *vargp) {
+    listener *l = (listener *)vargp;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        serve(sbuf_remove(&l->sbuf));
+        atomic_fetch_sub(&active, 1);
+    }
+    return NULL;
+}
+
+/*
+ * dispatch
+ *
+ * give an accepted connection to a worker of the listener, or to a new
+ * thread. Threads start on the cores of the thread creating them, so they
+ * stay on the core of the listener.
+ */
+static void dispatch(listener *l, int connfd) {
+    pthread_t tid;
+    int *connfdp;
+
+    atomic_fetch_add(&active, 1);
+    if (workers > 0) {
+        sbuf_insert(&l->sbuf, connfd);
+        return;
+    }
+    if ((connfdp = (int *)Malloc(sizeof(int))) == NULL) {
+        Close(connfd);
+        atomic_fetch_sub(&active, 1);
+        return;
+    }
+    *connfdp = connfd;
+    Pthread_create(&tid, NULL, conn_thread, connfdp);
+}
+
+/*
+ * sample_queue
+ *
+ * look at the accept queue of the socket. For a listening socket TCP_INFO
+ * gives the queue length in tcpi_unacked and the backlog in tcpi_sacked.
+ */
+static void sample_queue(listener *l) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(l->fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return;
+    }
+    if ((int)info.tcpi_unacked > atomic_load(&l->max_queue)) {
+        atomic_store(&l->max_queue, info.tcpi_unacked);
+    }
+    atomic_store(&l->backlog, info.tcpi_sacked);
+    if (info.tcpi_unacked >= info.tcpi_sacked) {
+        atomic_store(&l->full, atomic_load(&l->full) + 1);
+    }
+}
+
+/*
+ * run_listener
+ *
+ * pin to the core of the listener, start its workers and accept until
+ * the listeners are stopped.
+ */
+static void run_listener(listener *l) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    struct pollfd pfd[2];
+    cpu_set_t set;
+    pthread_t tid;
+    int fds[ACCEPT_BATCH];
+    int connfd, i, n;
+
+    if (l->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(l->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "listener: can not pin to cpu %d\n", l->cpu);
+        }
+    }
+    if (workers > 0) {
+        sbuf_init(&l->sbuf, SBUF_SIZE);
+        for (i = 0; i < workers; i++) {
+            Pthread_create(&tid, NULL, worker, l);
+        }
+    }
+
+    if (uring_enabled()) {
+        while ((n = uring_accept(l->fd, fds, ACCEPT_BATCH)) >= 0) {
+            sample_queue(l);
+            for (i = 0; i < n; i++) {
+                atomic_store(&l->accepted, atomic_load(&l->accepted) + 1);
+                dispatch(l, fds[i]);
+            }
+        }
+        fprintf(stderr, "listener: io_uring accept failed, using poll\n");
+    }
+
+    pfd[0].fd = l->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = stop_pipe[0];
+    pfd[1].events = POLLIN;
+    while (!atomic_load(&stopping)) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno != EINTR) {
+                unix_error("poll error");
+            }
+            continue;
+        }
+        if (atomic_load(&stopping)) {
+            break;
+        }
+        sample_queue(l);
+        while (1) {
+            clientlen = sizeof(clientaddr);
+            if ((connfd = accept4(l->fd, (SA *)&clientaddr, &clientlen,
+                                  SOCK_CLOEXEC)) < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR && errno != ECONNABORTED) {
+                    unix_error("accept4 error");
+                }
+                break;
+            }
+            atomic_store(&l->accepted, atomic_load(&l->accepted) + 1);
+            dispatch(l, connfd);
+        }
+    }
+}
+
+/* thread of every listener but the first, which runs in the caller */
+static void *listener_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    run_listener((listener *)vargp);
+    return NULL;
+}
+
+/*
+ * listeners_run
+ *
+ * open count listening sockets on port, or one plain socket if count is
+ * 0, and serve every connection with serve_fn, from workers threads per
+ * listener or from one thread per connection. With ipv6 the sockets are
+ * dual-stack. Sockets that were inherited are used instead. Never 
+ * returns, exits if a socket can not be opened. Once stopped, the calling
+ * thread exits and the process lives on in its other threads.
+ */
+void listeners_run(int port, int count, int ipv6, int nworkers,
+                   void (*serve_fn)(int client_fd)) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int n = ninherited > 0 ? ninherited : count > 0 ? count : 1;
+    int ncpus = 0, i;
+    pthread_t tid;
+    listener *l;
+
+    serve = serve_fn;
+    workers = nworkers;
+    if ((listeners = (listener *)Calloc(n, sizeof(listener))) == NULL ||
+        pipe2(stop_pipe, O_CLOEXEC) < 0) {
+        exit(1);
+    }
+
+    /* the cores we may run on, listeners go round robin over them */
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed)) {
+            cpus[ncpus++] = i;
+        }
+    }
+
+    /* open every socket before accepting on any of them */
+    for (i = 0; i < n; i++) {
+        l = &listeners[i];
+        if (i < ninherited) {
+            l->fd = inherited[i];
+        } else if (count == 0 && !ipv6) {
+            if ((l->fd = Open_listenfd(port)) >= 0) {
+                fcntl(l->fd, F_SETFL, fcntl(l->fd, F_GETFL) | O_NONBLOCK);
+            }
+        } else {
+            l->fd = Open_listenfd_reuseport(port, ipv6);
+        }
+        if (l->fd < 0) {
+            exit(1);
+        }
+        l->cpu = count > 0 && ncpus > 0 ? cpus[i % ncpus] : -1;
+        atomic_init(&l->accepted, 0);
+        atomic_init(&l->full, 0);
+        atomic_init(&l->max_queue, 0);
+        atomic_init(&l->backlog, 0);
+    }
+    gettimeofday(&last_report, NULL);
+    nlisteners = n;
+
+    for (i = 1; i < n; i++) {
+        Pthread_create(&tid, NULL, listener_thread, &listeners[i]);
+    }
+    run_listener(&listeners[0]);
+    /* stopped for an upgrade, what was accepted is drained elsewhere */
+    pthread_exit(NULL);
+}
+
+/*
+ * listeners_inherit
+ *
+ * use these listening sockets instead of opening new ones, they are still
+ * listening from the process we take over from.
+ */
+void listeners_inherit(int *fds, int count) {
+    if (count <= 0 ||
+        (inherited = (int *)Malloc(count * sizeof(int))) == NULL) {
+        return;
+    }
+    memcpy(inherited, fds, count * sizeof(int));
+    ninherited = count;
+}
+
+/*
+ * listeners_fds
+ *
+ * put the listening sockets in fds, at most max. return how many.
+ */
+int listeners_fds(int *fds, int max) {
+    int i;
+
+    for (i = 0; i < nlisteners && i < max; i++) {
+        fds[i] = listeners[i].fd;
+    }
+    return i;
+}
+
+/*
+ * listeners_stop
+ *
+ * make every listener stop accepting. The sockets stay open, another
+ * process may be accepting from them.
+ */
+void listeners_stop() {
+    char c = 0;
+
+    atomic_store(&stopping, 1);
+    if (stop_pipe[1] >= 0 && write(stop_pipe[1], &c, 1) < 0) {
+        unix_error("listeners_stop write error");
+    }
+}
+
+/*
+ * listeners_active
+ *
+ * number of connections accepted and not yet served.
+ */
+long listeners_active() {
+    return atomic_load(&active);
+}
+
+/*
+ * listen_drops
+ *
+ * read the counters of connections the kernel dropped because an accept
+ * queue was full. They are kept for the whole host, not per socket.
+ * return -1 if they can not be read.
+ */
+static int listen_drops(long *overflows, long *drops) {
+    char names[MAXBUF], values[MAXBUF];
+    char *name, *value, *nsave, *vsave;
+    FILE *fp;
+    int rc = -1;
+
+    if ((fp = fopen("/proc/net/netstat", "r")) == NULL) {
+        return -1;
+    }
+    /* lines come in pairs, the names and then the values */
+    while (fgets(names, MAXBUF, fp) != NULL &&
+           fgets(values, MAXBUF, fp) != NULL) {
+        if (strncmp(names, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        name = strtok_r(names, " \n", &nsave);
+        value = strtok_r(values, " \n", &vsave);
+        while (name != NULL && value != NULL) {
+            if (strcmp(name, "ListenOverflows") == 0) {
+                *overflows = atol(value);
+                rc = 1;
+            } else if (strcmp(name, "ListenDrops") == 0) {
+                *drops = atol(value);
+            }
+            name = strtok_r(NULL, " \n", &nsave);
+            value = strtok_r(NULL, " \n", &vsave);
+        }
+        break;
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * listeners_report
+ *
+ * print for every listener how many connections it accepted, how many per
+ * second since the last report, and how full its accept queue got.
+ */
+void listeners_report(FILE *fp) {
+    struct timeval now;
+    long accepted, overflows = 0, drops = 0;
+    double secs;
+    listener *l;
+    int i;
+
+    gettimeofday(&now, NULL);
+    secs = (now.tv_sec - last_report.tv_sec) +
+           (now.tv_usec - last_report.tv_usec) / 1000000.0;
+    for (i = 0; i < nlisteners; i++) {
+        l = &listeners[i];
+        accepted = atomic_load(&l->accepted);
+        fprintf(fp, "listener %d: cpu %d accepted %ld (%.1f/s) "
+                "queue max %d of %d full %ld\n",
+                i, l->cpu, accepted,
+                secs > 0 ? (accepted - l->last_accepted) / secs : 0.0,
+                atomic_load(&l->max_queue), atomic_load(&l->backlog),
+                atomic_load(&l->full));
+        l->last_accepted = accepted;
+    }
+    last_report = now;
+    if (listen_drops(&overflows, &drops) == 1) {
+        fprintf(fp, "listen: queue overflows %ld drops %ld (whole host)\n",
+                overflows, drops);
+    }
+    fflush(fp);
+}
@@ -0,0 +1,28 @@
+/*
+ * listener.h
+ *
+ * accept connections and hand them to the threads that serve them. By
+ * default there is one listening socket, accepted from in the main thread.
+ * With several listeners every one has its own SO_REUSEPORT socket on the
+ * same port and its own thread pinned to a core, the kernel spreads new
+ * connections over the sockets, and each listener serves its connections
+ * on its own core with its own workers, nothing is handed across cores.
+ *
+ * The sockets can also be inherited from the process a hot upgrade took
+ * over from, see upgrade.h, and the listeners stopped to hand them on.
+ */
+
+#ifndef __LISTENER_H__
+#define __LISTENER_H__
+
+#include <stdio.h>
+
+void listeners_run(int port, int count, int ipv6, int workers,
+                   void (*serve_fn)(int client_fd));
+void listeners_report(FILE *fp);
+void listeners_inherit(int *fds, int count);
+int listeners_fds(int *fds, int max);
+void listeners_stop();
+long listeners_active();
+
+#endif /* __LISTENER_H__ */
@@ -0,0 +1,528 @@
+/*
+ * logger.c
+ *
+ * the rings of the request threads and the log thread. An access line
+ * looks like
+ *
+ *   2026-10-18 11:34:02.123 "GET http://a/b HTTP/1.1" 200 5120 miss 12.402 3.118
+ *
+ * with the status and the bytes sent to the client, how the request was
+ * served, the ms it took and the ms until the origin started to answer,
+ * "-" if it was not asked or the phases were not timed.
+ *
+ * A ring belongs to one thread at a time. When its thread exits it goes
+ * to the unused ones and the next new thread takes it, so with a thread
+ * per connection there are only as many rings as connections at once.
+ * Rings are never freed, the log thread walks their list without a lock.
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "csapp.h"
+#include "logger.h"
+#include "record.h"
+#include "cache.h"
+#include "stats.h"
+
+#define LOG_MASK (LOG_RING_SIZE - 1)
+/* bytes of lines collected before they are written */
+#define LOG_BUF (64 << 10)
+
+/* the ring of one thread */
+typedef struct log_ring {
+    atomic_ulong head;         /* next record to put, by its thread */
+    unsigned long tail_seen;   /* tail as its thread last looked */
+    _Alignas(64) atomic_ulong tail; /* next record to take, by the log thread */
+    struct log_ring *next;     /* in the list of all rings */
+    struct log_ring *next_free; /* in the list of unused ones */
+    log_record records[LOG_RING_SIZE];
+} log_ring;
+
+/* lines on their way to a descriptor */
+typedef struct log_out {
+    int fd;
+    long len;
+    char buf[LOG_BUF];
+} log_out;
+
+static int enabled = 0;
+static int recording = 0;      /* requests go to the record too */
+static char *log_path;         /* of the access log, NULL if none */
+static long rotate_size;       /* rotate it at this size, 0 never */
+static long file_size;         /* its size as far as we know */
+static ino_t file_ino;         /* the file we have open */
+static log_out access_out, error_out, record_out;
+
+static _Atomic(log_ring *) rings = NULL; /* all of them, newest first */
+static log_ring *free_rings = NULL;      /* not used by a thread */
+static int nrings = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER; /* of the two */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER; /* one reader */
+static pthread_key_t ring_key;
+static __thread log_ring *my_ring = NULL;
+
+/*
+ * release_ring
+ *
+ * thread exit destructor, the ring goes to the next new thread.
+ */
+static void release_ring(void *arg) {
+    log_ring *ring = (log_ring *)arg;
+
+    pthread_mutex_lock(&ring_lock);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+/*
+ * get_ring
+ *
+ * the ring of the calling thread, an unused one or a new one the first
+ * time. return NULL if there are LOG_MAX_RINGS in use.
+ */
+static log_ring *get_ring() {
+    log_ring *ring;
+
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+    pthread_mutex_lock(&ring_lock);
+    if ((ring = free_rings) != NULL) {
+        free_rings = ring->next_free;
+    } else if (nrings < LOG_MAX_RINGS &&
+               (ring = (log_ring *)Calloc(1, sizeof(log_ring))) != NULL) {
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        ring->next = atomic_load(&rings);
+        atomic_store_explicit(&rings, ring, memory_order_release);
+        nrings++;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    if (ring != NULL) {
+        pthread_setspecific(ring_key, ring);
+    }
+    my_ring = ring;
+    return ring;
+}
+
+/*
+ * claim
+ *
+ * the next free record of the ring of the calling thread, in *ringp.
+ * return NULL if the ring is full, the record is dropped then.
+ */
+static log_record *claim(log_ring **ringp) {
+    log_ring *ring;
+    unsigned long head;
+
+    if ((ring = get_ring()) == NULL) {
+        stat_add(STAT_LOG_DROPPED, 1);
+        return NULL;
+    }
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    /* the tail is only read again when the ring looks full */
+    if (head - ring->tail_seen >= LOG_RING_SIZE) {
+        ring->tail_seen = atomic_load_explicit(&ring->tail,
+                                               memory_order_acquire);
+        if (head - ring->tail_seen >= LOG_RING_SIZE) {
+            stat_add(STAT_LOG_DROPPED, 1);
+            return NULL;
+        }
+    }
+    *ringp = ring;
+    return &ring->records[head & LOG_MASK];
+}
+
+/*
+ * publish
+ *
+ * hand the claimed record to the log thread.
+ */
+static void publish(log_ring *ring) {
+    atomic_store_explicit(&ring->head, atomic_load_explicit(&ring->head,
+                          memory_order_relaxed) + 1, memory_order_release);
+}
+
+/* ms of the wall clock, as of the last tick */
+static long wall_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * log_access
+ *
+ * log a request that was served, line is its request line. object is the
+ * length of the body of what was asked for, -1 if it is not known.
+ */
+void log_access(char *line, int status, long bytes, long object,
+                const char *outcome, long total_us, long first_us) {
+    log_record *r;
+    log_ring *ring;
+    size_t n;
+
+    if (!enabled || (r = claim(&ring)) == NULL) {
+        return;
+    }
+    r->type = LOG_ACCESS;
+    r->status = status;
+    r->bytes = bytes;
+    r->object = object;
+    r->when = wall_ms();
+    r->total_us = total_us;
+    r->first_us = first_us;
+    r->outcome = outcome;
+    r->key = recording ? cache_hash(line) : 0;
+    if ((n = strlen(line)) >= LOG_TEXT) {
+        n = LOG_TEXT - 1;
+    }
+    memcpy(r->text, line, n);
+    r->text[n] = '\0';
+    publish(ring);
+}
+
+/*
+ * log_error
+ *
+ * print a message to stderr, from the log thread if there is one. A line
+ * end at its end is left out, the log thread puts one there.
+ */
+void log_error(const char *fmt, ...) {
+    log_record *r;
+    log_ring *ring;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    if (!enabled) {
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        return;
+    }
+    if ((r = claim(&ring)) == NULL) {
+        va_end(ap);
+        return;
+    }
+    if ((n = vsnprintf(r->text, LOG_TEXT, fmt, ap)) >= LOG_TEXT) {
+        n = LOG_TEXT - 1;
+    }
+    va_end(ap);
+    while (n > 0 && r->text[n - 1] == '\n') {
+        r->text[--n] = '\0';
+    }
+    r->type = LOG_ERROR;
+    r->when = wall_ms();
+    publish(ring);
+}
+
+/*
+ * open_log
+ *
+ * open the access log for appending. return -1 if failed.
+ */
+static int open_log() {
+    struct stat st;
+    int fd;
+
+    if ((fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0644)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "log: can not open %s: %s\n", log_path,
+                strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    access_out.fd = fd;
+    file_size = st.st_size;
+    file_ino = st.st_ino;
+    return 1;
+}
+
+/*
+ * open_record
+ *
+ * open the request record for appending, with a header if it is new.
+ * return -1 if failed.
+ */
+static int open_record(char *path) {
+    record_header header;
+    int fd;
+
+    header.magic = RECORD_MAGIC;
+    header.version = RECORD_VERSION;
+    /* the one process that creates it writes the header */
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                   0644)) >= 0) {
+        if (rio_writen(fd, &header, sizeof(header)) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    } else if (errno == EEXIST) {
+        fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "log: can not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    record_out.fd = fd;
+    return 1;
+}
+
+/*
+ * reopen_log
+ *
+ * go on in a new file at the path, keep the old one if that fails.
+ */
+static void reopen_log() {
+    int fd = access_out.fd;
+
+    if (open_log() == 1) {
+        close(fd);
+    }
+}
+
+/*
+ * rotate_log
+ *
+ * move FILE.N to FILE.N+1, the last one is lost, and FILE to FILE.1, and
+ * start a new FILE. If another process got to it first, only reopen.
+ */
+static void rotate_log() {
+    char from[MAXLINE], to[MAXLINE];
+    struct stat st;
+    int i;
+
+    if (stat(log_path, &st) == 0 && st.st_ino == file_ino) {
+        for (i = LOG_KEEP - 1; i >= 1; i--) {
+            snprintf(from, MAXLINE, "%s.%d", log_path, i);
+            snprintf(to, MAXLINE, "%s.%d", log_path, i + 1);
+            rename(from, to);
+        }
+        snprintf(to, MAXLINE, "%s.1", log_path);
+        rename(log_path, to);
+    }
+    reopen_log();
+}
+
+/*
+ * check_log
+ *
+ * reopen the access log if it was moved away, and take the size it got
+ * from the other processes writing to it.
+ */
+static void check_log() {
+    struct stat st;
+
+    if (log_path == NULL) {
+        return;
+    }
+    if (stat(log_path, &st) < 0 || st.st_ino != file_ino) {
+        reopen_log();
+    } else {
+        file_size = st.st_size;
+    }
+}
+
+/*
+ * out_write
+ *
+ * write the lines collected for out, rotating the access log when it got
+ * too large.
+ */
+static void out_write(log_out *out) {
+    if (out->len == 0) {
+        return;
+    }
+    rio_writen(out->fd, out->buf, out->len);
+    if (out == &access_out) {
+        file_size += out->len;
+        if (rotate_size > 0 && file_size >= rotate_size) {
+            rotate_log();
+        }
+    }
+    out->len = 0;
+}
+
+/*
+ * record
+ *
+ * add the entry of a request to the record. Its size is that of the
+ * object, what was sent to the client may have been a part of it or only
+ * a header block. An answer the proxy made up itself has no object, what
+ * was sent is kept then.
+ */
+static void record(log_record *r) {
+    record_entry *e;
+
+    if (record_out.len + sizeof(record_entry) > LOG_BUF) {
+        out_write(&record_out);
+    }
+    e = (record_entry *)(record_out.buf + record_out.len);
+    e->when_us = r->when * 1000 - r->total_us;
+    e->key = r->key;
+    e->size = r->object >= 0 ? r->object : r->bytes;
+    e->latency_us = r->total_us;
+    e->status = r->status;
+    e->hit = strcmp(r->outcome, "hit") == 0;
+    e->unused = 0;
+    record_out.len += sizeof(record_entry);
+}
+
+/*
+ * format
+ *
+ * add the line of a record to the lines for its descriptor, and a request
+ * to the record.
+ */
+static void format(log_record *r) {
+    static time_t stamp_sec = -1;
+    static char stamp[32];
+    log_out *out = r->type == LOG_ACCESS ? &access_out : &error_out;
+    char first[32];
+    time_t sec = r->when / 1000;
+    struct tm tm;
+
+    if (r->type == LOG_ACCESS && recording) {
+        record(r);
+    }
+    if (r->type == LOG_ACCESS && log_path == NULL) {
+        return;
+    }
+    if (out->len + LOG_TEXT + 128 > LOG_BUF) {
+        out_write(out);
+    }
+    /* the date only changes once a second */
+    if (sec != stamp_sec) {
+        localtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        stamp_sec = sec;
+    }
+    if (r->type == LOG_ERROR) {
+        out->len += sprintf(out->buf + out->len, "%s.%03ld %s\n", stamp,
+                            r->when % 1000, r->text);
+        return;
+    }
+    if (r->first_us >= 0) {
+        sprintf(first, "%.3f", r->first_us / 1e3);
+    } else {
+        strcpy(first, "-");
+    }
+    out->len += sprintf(out->buf + out->len,
+                        "%s.%03ld \"%s\" %d %ld %s %.3f %s\n", stamp,
+                        r->when % 1000, r->text, r->status, r->bytes,
+                        r->outcome, r->total_us / 1e3, first);
+}
+
+/*
+ * drain
+ *
+ * format and write what is in the rings, and with check, look whether
+ * the access log was moved. return the number of records.
+ */
+static long drain(int check) {
+    unsigned long tail, head;
+    log_ring *ring;
+    long n = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (ring = atomic_load_explicit(&rings, memory_order_acquire);
+         ring != NULL; ring = ring->next) {
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            format(&ring->records[tail & LOG_MASK]);
+            n++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    out_write(&access_out);
+    out_write(&error_out);
+    out_write(&record_out);
+    if (check) {
+        check_log();
+    }
+    pthread_mutex_unlock(&drain_lock);
+    stat_add(STAT_LOG_LINES, n);
+    return n;
+}
+
+/*
+ * log_thread
+ *
+ * write what the request threads logged, in batches. It only sleeps when
+ * a pass found less than a ring full, so a busy proxy is kept up with.
+ */
+static void *log_thread(void *vargp) {
+    struct timespec ts;
+    time_t checked = 0, now;
+
+    Pthread_detach(pthread_self());
+    ts.tv_sec = 0;
+    ts.tv_nsec = LOG_FLUSH_MS * 1000000L;
+    while (1) {
+        now = time(NULL);
+        if (drain(now != checked) < LOG_RING_SIZE) {
+            nanosleep(&ts, NULL);
+        }
+        checked = now;
+    }
+    return NULL;
+}
+
+/*
+ * log_flush
+ *
+ * write out everything logged so far, at exit.
+ */
+void log_flush() {
+    if (enabled) {
+        drain(0);
+    }
+}
+
+/*
+ * log_init
+ *
+ * write the access log to path, rotated at rotate bytes, 0 never, the
+ * request record to record, and the messages through the log thread.
+ * With neither file nothing is logged and messages are printed right
+ * away. return -1 if failed.
+ */
+int log_init(char *path, long rotate, char *record) {
+    pthread_t tid;
+
+    if (path == NULL && record == NULL) {
+        return 0;
+    }
+    log_path = path;
+    rotate_size = rotate;
+    error_out.fd = STDERR_FILENO;
+    if ((path != NULL && open_log() == -1) ||
+        (record != NULL && open_record(record) == -1)) {
+        return -1;
+    }
+    recording = record != NULL;
+    pthread_key_create(&ring_key, release_ring);
+    if (pthread_create(&tid, NULL, log_thread, NULL) != 0) {
+        fprintf(stderr, "log_init: can not start the log thread\n");
+        return -1;
+    }
+    enabled = 1;
+    atexit(log_flush);
+    return 1;
+}
+
+/*
+ * log_enabled
+ *
+ * return 1 if requests are logged.
+ */
+int log_enabled() {
+    return enabled;
+}
@@ -0,0 +1,57 @@
+/*
+ * logger.h
+ *
+ * the access log and the error messages of the request threads, written
+ * by a thread of their own. Each request thread puts fixed size binary
+ * records into a ring of its own, one producer and one consumer, so
+ * logging takes no lock and makes no system call: a copy and a release
+ * store. The log thread empties the rings, formats the records and writes
+ * them in batches, access lines to the log file and messages to stderr.
+ * A record that finds its ring full is dropped and counted. The log file
+ * is rotated by size, FILE to FILE.1 and so on, and reopened when another
+ * process rotated or moved it. The same records can go to a request
+ * record too, see record.h.
+ */
+
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+/* records in the ring of a thread, a power of 2 */
+#define LOG_RING_SIZE 256
+/* most rings, threads beyond get their records dropped */
+#define LOG_MAX_RINGS 1024
+/* bytes of the request line or message a record keeps */
+#define LOG_TEXT 200
+/* ms the log thread sleeps when there was little to write */
+#define LOG_FLUSH_MS 10
+/* rotated files kept, FILE.1 is the newest */
+#define LOG_KEEP 4
+
+/* what a record is */
+enum log_type {
+    LOG_ACCESS,                /* a request that was served */
+    LOG_ERROR                  /* a message for stderr */
+};
+
+/* a record, as a request thread leaves it for the log thread */
+typedef struct log_record {
+    int type;                  /* LOG_ACCESS or LOG_ERROR */
+    int status;                /* of the response, 0 if none was sent */
+    long bytes;                /* sent to the client */
+    long object;               /* of body of the object, -1 if not known */
+    long when;                 /* ms of the wall clock it was logged */
+    long total_us;             /* the request took */
+    long first_us;             /* until the first byte of the origin, or -1 */
+    const char *outcome;       /* hit, miss, ..., a constant string */
+    unsigned int key;          /* cache_hash of the line, if recorded */
+    char text[LOG_TEXT];       /* the request line, or the message */
+} log_record;
+
+int log_init(char *path, long rotate, char *record);
+int log_enabled();
+void log_access(char *line, int status, long bytes, long object,
+                const char *outcome, long total_us, long first_us);
+void log_error(const char *fmt, ...);
+void log_flush();
+
+#endif /* __LOGGER_H__ */
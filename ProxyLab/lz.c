@@ -0,0 +1,245 @@
+/*
+ * lz.c
+ *
+ * a small LZ77 codec in the manner of LZ4, for storing cached content
+ * compressed. A block is a list of sequences, each a token byte, some
+ * literals and a match:
+ *
+ *   token     the literal count in the high 4 bits, the match length
+ *             minus LZ_MIN_MATCH in the low 4 bits. A nibble of 15 is
+ *             continued by bytes that add to it, the last one below 255
+ *   literals  copied as they are
+ *   offset    2 bytes, little endian, how far back the match starts
+ *   more      length bytes of the match, if its nibble was 15
+ *
+ * The last sequence only has literals and ends the block. The decoder
+ * checks every length against both buffers, so a corrupt block is refused
+ * and never read or written out of bounds.
+ */
+
+#include <string.h>
+#include "lz.h"
+
+/* shortest match worth a sequence */
+#define LZ_MIN_MATCH 4
+/* entries of the match finder, 2^LZ_HASH_BITS */
+#define LZ_HASH_BITS 12
+/* misses in a row before the finder starts skipping ahead */
+#define LZ_SKIP_TRIGGER 6
+/* wild copies go up to this many bytes past their end */
+#define LZ_WILD 8
+
+/* hash of the 4 bytes at p */
+static unsigned int lz_hash(const unsigned char *p) {
+    unsigned int v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * put_length
+ *
+ * write the part of a length that did not fit in its nibble. return the
+ * end of what was written, NULL if it does not fit before end.
+ */
+static unsigned char *put_length(unsigned char *out, unsigned char *end,
+                                 int n) {
+    for (; n >= 255; n -= 255) {
+        if (out >= end) {
+            return NULL;
+        }
+        *out++ = 255;
+    }
+    if (out >= end) {
+        return NULL;
+    }
+    *out++ = n;
+    return out;
+}
+
+/*
+ * put_sequence
+ *
+ * write one sequence: nlit literals and a match of mlen bytes offset back,
+ * or only the literals if mlen is 0. return the end of what was written,
+ * NULL if it does not fit before end.
+ */
+static unsigned char *put_sequence(unsigned char *out, unsigned char *end,
+                                   const unsigned char *lit, int nlit,
+                                   int offset, int mlen) {
+    unsigned char *token = out++;
+    int m = mlen > 0 ? mlen - LZ_MIN_MATCH : 0;
+
+    if (out > end) {
+        return NULL;
+    }
+    *token = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15 && (out = put_length(out, end, nlit - 15)) == NULL) {
+        return NULL;
+    }
+    if (nlit > end - out) {
+        return NULL;
+    }
+    memcpy(out, lit, nlit);
+    out += nlit;
+    if (mlen == 0) {
+        return out;
+    }
+    if (end - out < 2) {
+        return NULL;
+    }
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    if (m >= 15 && (out = put_length(out, end, m - 15)) == NULL) {
+        return NULL;
+    }
+    return out;
+}
+
+/*
+ * lz_compress
+ *
+ * compress len bytes of src into dst, which has room for cap bytes.
+ * LZ_BOUND(len) is always enough. return the compressed size, -1 if it
+ * does not fit or len is more than LZ_MAX_BLOCK.
+ */
+int lz_compress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst, *end = out + cap;
+    int table[1 << LZ_HASH_BITS];
+    int pos = 0, anchor = 0, misses = 0, ref, mlen, h;
+
+    if (len < 0 || len > LZ_MAX_BLOCK) {
+        return -1;
+    }
+    memset(table, 0xff, sizeof(table));
+    while (pos + LZ_MIN_MATCH <= len) {
+        h = lz_hash(in + pos);
+        ref = table[h];
+        table[h] = pos;
+        if (ref < 0 || memcmp(in + ref, in + pos, LZ_MIN_MATCH) != 0) {
+            /* data that does not compress is passed over faster */
+            pos += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        mlen = LZ_MIN_MATCH;
+        while (pos + mlen < len && in[ref + mlen] == in[pos + mlen]) {
+            mlen++;
+        }
+        if ((out = put_sequence(out, end, in + anchor, pos - anchor,
+                                pos - ref, mlen)) == NULL) {
+            return -1;
+        }
+        pos += mlen;
+        anchor = pos;
+        misses = 0;
+    }
+    if ((out = put_sequence(out, end, in + anchor, len - anchor,
+                            0, 0)) == NULL) {
+        return -1;
+    }
+    return out - (unsigned char *)dst;
+}
+
+/*
+ * get_length
+ *
+ * read the part of a length that did not fit in its nibble and add it to
+ * n. return -1 if the block ends first.
+ */
+static int get_length(const unsigned char **in, const unsigned char *end,
+                      int n) {
+    const unsigned char *p = *in;
+
+    do {
+        if (p >= end || n > LZ_MAX_BLOCK) {
+            return -1;
+        }
+        n += *p;
+    } while (*p++ == 255);
+    *in = p;
+    return n;
+}
+
+/*
+ * wild_copy
+ *
+ * copy n bytes 8 at a time, writing up to LZ_WILD bytes past the end. If
+ * the source overlaps, it must be at least LZ_WILD bytes behind.
+ */
+static void wild_copy(unsigned char *dst, const unsigned char *src, int n) {
+    unsigned char *end = dst + n;
+
+    do {
+        memcpy(dst, src, LZ_WILD);
+        dst += LZ_WILD;
+        src += LZ_WILD;
+    } while (dst < end);
+}
+
+/*
+ * lz_decompress
+ *
+ * decompress the block of len bytes at src into dst, which has room for
+ * cap bytes. return the decompressed size, -1 if the block is corrupt or
+ * does not fit.
+ */
+int lz_decompress(const char *src, int len, char *dst, int cap) {
+    const unsigned char *in = (const unsigned char *)src, *in_end = in + len;
+    unsigned char *out = (unsigned char *)dst, *out_end = out + cap;
+    unsigned char *from;
+    int token, n, offset;
+
+    while (in < in_end) {
+        token = *in++;
+        /* the literals */
+        n = token >> 4;
+        if (n == 15 && (n = get_length(&in, in_end, n)) == -1) {
+            return -1;
+        }
+        if (n > in_end - in || n > out_end - out) {
+            return -1;
+        }
+        /* short copies are the common case, most have room to spare */
+        if (in_end - in >= n + LZ_WILD && out_end - out >= n + LZ_WILD) {
+            wild_copy(out, in, n);
+        } else {
+            memcpy(out, in, n);
+        }
+        in += n;
+        out += n;
+        if (in == in_end) {
+            break;
+        }
+
+        /* the match, it may overlap what it produces */
+        if (in_end - in < 2) {
+            return -1;
+        }
+        offset = in[0] | in[1] << 8;
+        in += 2;
+        n = token & 15;
+        if (n == 15 && (n = get_length(&in, in_end, n)) == -1) {
+            return -1;
+        }
+        n += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out - (unsigned char *)dst ||
+            n > out_end - out) {
+            return -1;
+        }
+        from = out - offset;
+        if (offset >= LZ_WILD && out_end - out >= n + LZ_WILD) {
+            wild_copy(out, from, n);
+            out += n;
+        } else if (offset >= n) {
+            memcpy(out, from, n);
+            out += n;
+        } else {
+            while (n-- > 0) {
+                *out++ = *from++;
+            }
+        }
+    }
+    return out - (unsigned char *)dst;
+}
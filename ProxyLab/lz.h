@@ -0,0 +1,21 @@
+/*
+ * lz.h
+ *
+ * a small LZ77 codec in the manner of LZ4, for storing cached content
+ * compressed. It trades ratio for speed: matches are found through one
+ * hash table probe, there is no entropy coding, and decompressing is a
+ * loop of copies. Blocks are compressed on their own, at most 64 KB each.
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+/* largest block that can be compressed */
+#define LZ_MAX_BLOCK 65535
+/* room the compressed form of n bytes may need */
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+int lz_compress(const char *src, int len, char *dst, int cap);
+int lz_decompress(const char *src, int len, char *dst, int cap);
+
+#endif /* __LZ_H__ */
@@ -0,0 +1,124 @@
+/*
+ * negative.c
+ *
+ * negative caching. A spec like "5xx:10,404:60,connect:5" gives the
+ * seconds each error status is cached, a whole class of them with "4xx"
+ * or "5xx", and "connect" the seconds a failure to reach an origin is.
+ * An error status that is in no entry is not cached at all, it may depend
+ * on the client, like 401. Every other status is cached as before, with
+ * no expiry. Expiry times are kept in meta.expires, in milliseconds of
+ * the wall clock, so they survive a snapshot.
+ */
+
+#include <time.h>
+#include "csapp.h"
+#include "negative.h"
+
+/* seconds each status is cached, -1 for not cached */
+static int ttl[600];
+/* percent the times to live are spread by */
+static int spread;
+
+/*
+ * negative_init
+ *
+ * parse the times to live of spec and the jitter, in percent. return -1
+ * if the spec is not valid.
+ */
+int negative_init(char *spec, int jitter) {
+    char copy[MAXLINE], *entry, *save, *colon;
+    int first, last, seconds, i;
+
+    if (strlen(spec) >= MAXLINE || jitter < 0 || jitter > 100) {
+        return -1;
+    }
+    for (i = 0; i < 600; i++) {
+        ttl[i] = -1;
+    }
+    spread = jitter;
+    strcpy(copy, spec);
+    for (entry = strtok_r(copy, ",", &save); entry != NULL;
+         entry = strtok_r(NULL, ",", &save)) {
+        if ((colon = strchr(entry, ':')) == NULL ||
+            (seconds = atoi(colon + 1)) < 0) {
+            return -1;
+        }
+        *colon = '\0';
+        if (strcmp(entry, "connect") == 0) {
+            first = last = NEGATIVE_CONNECT;
+        } else if (strlen(entry) == 3 && (entry[0] == '4' || 
+                   entry[0] == '5') && strcmp(entry + 1, "xx") == 0) {
+            first = (entry[0] - '0') * 100;
+            last = first + 99;
+        } else if ((first = last = atoi(entry)) < 400 || first > 599) {
+            return -1;
+        }
+        for (i = first; i <= last; i++) {
+            ttl[i] = seconds;
+        }
+    }
+    return 1;
+}
+
+/* milliseconds of the wall clock */
+static long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * negative_expiry
+ *
+ * when a response of status made now has to go, with the jitter, in the
+ * milliseconds of meta.expires. return 0 if it does not expire, -1 if it
+ * is not to be cached.
+ */
+long negative_expiry(int status) {
+    static __thread unsigned int seed;
+    long ms, range;
+
+    if (status != NEGATIVE_CONNECT && status < 400) {
+        return 0;
+    }
+    if (status >= 600 || ttl[status] < 0) {
+        return -1;
+    }
+    if (seed == 0) {
+        seed = (unsigned int)pthread_self() ^ (unsigned int)now_ms();
+    }
+    /* anywhere within spread percent either side */
+    ms = ttl[status] * 1000L;
+    range = ms * spread / 100;
+    if (range > 0) {
+        ms += rand_r(&seed) % (2 * range + 1) - range;
+    }
+    return now_ms() + ms;
+}
+
+/*
+ * negative_expired
+ *
+ * return 1 if an object with meta has expired, 0 if not or never does.
+ */
+int negative_expired(cache_meta *meta) {
+    return meta->expires != 0 && now_ms() >= meta->expires;
+}
+
+/*
+ * negative_response
+ *
+ * write the 502 response for an origin that can not be reached into buf
+ * of size bytes. return its length, -1 if it does not fit.
+ */
+int negative_response(char *buf, int size, char *host, char *port) {
+    char body[MAXLINE];
+    int n;
+
+    snprintf(body, MAXLINE, "Could not connect to %s:%s\n", host, port);
+    n = snprintf(buf, size, "HTTP/1.0 502 Bad Gateway\r\n"
+                 "Content-Type: text/plain\r\n"
+                 "Content-Length: %d\r\n\r\n%s", (int)strlen(body), body);
+    return n < size ? n : -1;
+}
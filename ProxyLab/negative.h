@@ -0,0 +1,26 @@
+/*
+ * negative.h
+ *
+ * negative caching: error responses of the origin, and failures to reach
+ * it at all, are cached for a short time only, so a broken link on a busy
+ * page does not cost a lookup and a connect on every request, and a fixed
+ * one is seen again soon. Each status has its own time to live, spread by
+ * a random jitter so entries made together do not expire together.
+ */
+
+#ifndef __NEGATIVE_H__
+#define __NEGATIVE_H__
+
+#include "cache.h"
+
+/* the status a failure to resolve or connect to the origin is kept as */
+#define NEGATIVE_CONNECT 0
+/* time to live of each status that is cached, later ones win */
+#define NEGATIVE_DEFAULT "5xx:10,404:60,410:300,connect:5"
+
+int negative_init(char *spec, int jitter);
+long negative_expiry(int status);
+int negative_expired(cache_meta *meta);
+int negative_response(char *buf, int size, char *host, char *port);
+
+#endif /* __NEGATIVE_H__ */
@@ -0,0 +1,165 @@
+/*
+ * peer.c
+ *
+ * the peers of the cluster and the owners of URLs. The list does not
+ * change once read, only whether a peer is left out, so owners are picked
+ * without a lock. A URL is scored against each peer that is not left out
+ * by mixing the hash of the URL with that of the peer, which spreads the
+ * URLs evenly over any set of peers.
+ */
+
+#include "csapp.h"
+#include "peer.h"
+#include "stats.h"
+
+static peer peers[PEER_MAX];
+static int npeers = 0;
+static peer *self_peer;        /* this proxy, in peers */
+
+/* FNV-1a hash of the n bytes at s */
+static unsigned long hash_bytes(char *s, int n) {
+    unsigned long h = 14695981039346656037UL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+/* the finalizer of splitmix64, every bit of x moves every bit out */
+static unsigned long mix(unsigned long x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * peer_init
+ *
+ * read list, host:port of every peer apart by commas. This proxy is the
+ * one that is self, or if self is NULL, the one on port. return -1 if the
+ * list is not valid, this proxy is not in it, or self is NULL and more
+ * than one peer is on port, which would make each of them think it is
+ * that one.
+ */
+int peer_init(char *list, char *self, int port) {
+    char buf[MAXLINE], *name, *colon, *save;
+    peer *p;
+    int i, on_port = 0;
+
+    if (list == NULL) {
+        return 1;
+    }
+    snprintf(buf, MAXLINE, "%s", list);
+    for (name = strtok_r(buf, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        if (npeers == PEER_MAX || (colon = strrchr(name, ':')) == NULL ||
+            colon == name || colon - name >= (int)sizeof(p->host) ||
+            atoi(colon + 1) <= 0 || strlen(colon + 1) >= sizeof(p->port)) {
+            fprintf(stderr, "peer_init: bad peer %s\n", name);
+            return -1;
+        }
+        p = &peers[npeers++];
+        snprintf(p->host, sizeof(p->host), "%.*s", (int)(colon - name), name);
+        strcpy(p->port, colon + 1);
+        p->seed = hash_bytes(name, strlen(name));
+        atomic_init(&p->down_until, 0);
+    }
+    for (i = 0; i < npeers; i++) {
+        p = &peers[i];
+        snprintf(buf, MAXLINE, "%s:%s", p->host, p->port);
+        if (self != NULL ? strcmp(buf, self) == 0 : atoi(p->port) == port) {
+            on_port++;
+            if (self_peer == NULL) {
+                self_peer = p;
+            }
+        }
+    }
+    if (self == NULL && on_port > 1) {
+        fprintf(stderr, "peer_init: %d peers are on port %d, "
+                "give --peer-self\n", on_port, port);
+        self_peer = NULL;
+        return -1;
+    }
+    if (self_peer == NULL) {
+        fprintf(stderr, "peer_init: this proxy is not one of the peers\n");
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * peer_enabled
+ *
+ * return 1 if this proxy is in a cluster.
+ */
+int peer_enabled() {
+    return self_peer != NULL;
+}
+
+/*
+ * peer_owner
+ *
+ * the peer that owns the URL of cache_id, a request line. return NULL if
+ * it is this proxy, or there is no cluster.
+ */
+peer *peer_owner(char *cache_id) {
+    unsigned long h, score, best_score = 0;
+    peer *best = NULL;
+    time_t now;
+    char *url;
+    int i;
+
+    if (self_peer == NULL || (url = strchr(cache_id, ' ')) == NULL) {
+        return NULL;
+    }
+    url++;
+    h = hash_bytes(url, strcspn(url, " \r\n"));
+    now = time(NULL);
+    for (i = 0; i < npeers; i++) {
+        if (&peers[i] != self_peer &&
+            atomic_load(&peers[i].down_until) > now) {
+            continue;
+        }
+        score = mix(h ^ peers[i].seed);
+        if (best == NULL || score > best_score) {
+            best = &peers[i];
+            best_score = score;
+        }
+    }
+    return best == self_peer ? NULL : best;
+}
+
+/*
+ * peer_failed
+ *
+ * p could not be reached, leave it out for a while.
+ */
+void peer_failed(peer *p) {
+    atomic_store(&p->down_until, time(NULL) + PEER_RETRY);
+    stat_add(STAT_PEER_FAILED, 1);
+}
+
+/*
+ * peer_report
+ *
+ * print the peers left out at the moment.
+ */
+void peer_report(FILE *fp) {
+    time_t now = time(NULL);
+    int i, down = 0;
+
+    if (self_peer == NULL) {
+        return;
+    }
+    fprintf(fp, "peers: %d, this one %s:%s", npeers, self_peer->host,
+            self_peer->port);
+    for (i = 0; i < npeers; i++) {
+        if (atomic_load(&peers[i].down_until) > now) {
+            fprintf(fp, "%s %s:%s", down++ ? "," : ", left out",
+                    peers[i].host, peers[i].port);
+        }
+    }
+    fprintf(fp, "\n");
+}
@@ -0,0 +1,46 @@
+/*
+ * peer.h
+ *
+ * a cluster of proxies sharing their caches. Every proxy is given the same
+ * list of peers, itself included, and each URL has one owner among them,
+ * chosen by rendezvous hashing: the peer whose hash with the URL is the
+ * highest. Adding or removing a peer only moves the URLs it owns or gets.
+ *
+ * A miss on a URL another peer owns is asked of that peer rather than of
+ * the origin, and the answer is relayed without being cached here, so a
+ * response is fetched and kept once in the cluster. The peer is spoken to
+ * in HTTP, as to a proxy, with the request line of the client, which is
+ * the cache id there too, and a PEER_HEADER line that makes it serve the
+ * request itself, from its cache or from the origin, and never send it on.
+ * A peer that can not be reached is left out for PEER_RETRY seconds, its
+ * URLs go to the next owner meanwhile, or to the origin.
+ */
+
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+/* most peers in a cluster */
+#define PEER_MAX 64
+/* seconds a peer that failed is left out */
+#define PEER_RETRY 5
+/* the header line of requests from peers */
+#define PEER_HEADER "Proxy-Peer: 1\r\n"
+
+/* a proxy of the cluster */
+typedef struct peer {
+    char host[256];
+    char port[16];
+    unsigned long seed;        /* hash of host:port, scores are mixed from */
+    atomic_long down_until;    /* time it is left out until, 0 if it is not */
+} peer;
+
+int peer_init(char *list, char *self, int port);
+int peer_enabled();
+peer *peer_owner(char *cache_id);
+void peer_failed(peer *p);
+void peer_report(FILE *fp);
+
+#endif /* __PEER_H__ */
@@ -0,0 +1,540 @@
+/*
+ * prefetch.c
+ *
+ * the scan of pages and the threads that prefetch what they link to. The
+ * scan is a small state machine over the markup that keeps what it needs
+ * between two pieces of a body, so a tag or a URL may be cut anywhere.
+ * It is not a parser: comments, scripts and the like are read as markup,
+ * which at worst prefetches a URL of the same origin that looked like a
+ * link. Links with dot segments are left alone, the browser would ask for
+ * them by another URL than the one written.
+ *
+ * zlib allocates what it needs to inflate a page from an arena in the
+ * scan, so a scan is dropped with the fetch it belongs to, however that
+ * ends, without a call to free anything. zlib is only used if the build
+ * found it, see the Makefile, otherwise compressed pages are not scanned.
+ */
+
+#include "csapp.h"
+#include "prefetch.h"
+#include "listener.h"
+#include "stats.h"
+
+/* where in the markup the scan is */
+enum {
+    SCAN_TEXT,                 /* between tags */
+    SCAN_TAG,                  /* in the name of a tag */
+    SCAN_SKIP,                 /* in a tag of no interest, to its > */
+    SCAN_IN_TAG,               /* between attributes */
+    SCAN_ATTR,                 /* in the name of an attribute */
+    SCAN_AFTER_ATTR,           /* after it, before a = if any */
+    SCAN_BEFORE_VALUE,         /* after the = */
+    SCAN_VALUE                 /* in the value */
+};
+
+static int enabled = 0;
+static cache *prefetch_cache;
+static int idle_max;           /* connections under which to prefetch */
+static struct sockaddr_storage self; /* the port of the proxy */
+static socklen_t self_len;
+static atomic_int running;     /* prefetches under way */
+
+/* the queue of ids to prefetch, the request lines of their URLs */
+static char *queue[PREFETCH_QUEUE];
+static int head = 0, count = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nonempty = PTHREAD_COND_INITIALIZER;
+
+static void *prefetch_thread(void *vargp);
+
+/*
+ * prefetch_init
+ *
+ * start threads prefetching from the proxy on port, at most that many at
+ * once, while fewer than idle connections are served. A cached item is
+ * not prefetched again. With 0 threads pages are not scanned.
+ */
+void prefetch_init(int threads, int idle, cache *pcache, int port,
+                   int ipv6) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)&self;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&self;
+    pthread_t tid;
+    int i;
+
+    if (threads <= 0) {
+        return;
+    }
+    prefetch_cache = pcache;
+    idle_max = idle;
+    memset(&self, 0, sizeof(self));
+    if (ipv6) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_loopback;
+        sin6->sin6_port = htons((unsigned short)port);
+        self_len = sizeof(*sin6);
+    } else {
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin->sin_port = htons((unsigned short)port);
+        self_len = sizeof(*sin);
+    }
+    atomic_init(&running, 0);
+    for (i = 0; i < threads; i++) {
+        Pthread_create(&tid, NULL, prefetch_thread, NULL);
+    }
+    enabled = 1;
+}
+
+#ifdef HAVE_ZLIB
+/*
+ * arena_alloc
+ *
+ * zalloc of the z_stream of a scan, from its arena. return Z_NULL if it
+ * is used up.
+ */
+static voidpf arena_alloc(voidpf opaque, uInt items, uInt size) {
+    prefetch_scan *scan = (prefetch_scan *)opaque;
+    long n = ((long)items * size + 15) & ~15L;
+    char *p;
+
+    if (scan->arena_used + n > PREFETCH_INFLATE) {
+        return Z_NULL;
+    }
+    p = scan->arena + scan->arena_used;
+    scan->arena_used += n;
+    return p;
+}
+
+/* zfree of the z_stream of a scan, the arena goes with the scan */
+static void arena_free(voidpf opaque, voidpf address) {
+}
+#endif /* HAVE_ZLIB */
+
+/*
+ * inflate_start
+ *
+ * get the scan ready to inflate a body in encoding. return 1 if it is,
+ * 0 if the body is not in an encoding that can be.
+ */
+static int inflate_start(prefetch_scan *scan, char *encoding) {
+    scan->inflating = 0;
+    if (encoding == NULL || strcasecmp(encoding, "identity") == 0) {
+        return 1;
+    }
+#ifdef HAVE_ZLIB
+    if (strcasecmp(encoding, "gzip") != 0 &&
+        strcasecmp(encoding, "x-gzip") != 0 &&
+        strcasecmp(encoding, "deflate") != 0) {
+        return 0;
+    }
+    memset(&scan->zs, 0, sizeof(scan->zs));
+    scan->zs.zalloc = arena_alloc;
+    scan->zs.zfree = arena_free;
+    scan->zs.opaque = scan;
+    scan->arena_used = 0;
+    /* 32 more window bits take a gzip or a zlib header, whichever it is */
+    if (inflateInit2(&scan->zs, 15 + 32) != Z_OK) {
+        return 0;
+    }
+    scan->inflating = 1;
+    return 1;
+#else /* !HAVE_ZLIB */
+    return 0;
+#endif
+}
+
+/*
+ * prefetch_start
+ *
+ * get ready to scan the page of cache_id, the request line it was asked
+ * with, its body in encoding, NULL if none. return 1 if it is to be
+ * scanned, 0 if prefetching is off, the URL is not one to resolve links
+ * against or the encoding is not one to inflate.
+ */
+int prefetch_start(prefetch_scan *scan, char *cache_id, char *encoding) {
+    char method[16], url[MAXLINE], *p, *path;
+
+    if (!enabled || sscanf(cache_id, "%15s %8191s %15s", method, url,
+                           scan->version) != 3 ||
+        strncasecmp(url, "http://", 7) != 0 ||
+        strlen(url) > MAXLINE - PREFETCH_URL) {
+        return 0;
+    }
+    if (!inflate_start(scan, encoding)) {
+        stat_add(STAT_PREFETCH_ENCODED, 1);
+        return 0;
+    }
+    if (scan->inflating) {
+        stat_add(STAT_PREFETCH_INFLATED, 1);
+    }
+    /* links are resolved against the directory of the page */
+    if ((path = strchr(url + 7, '/')) == NULL) {
+        scan->origin_len = strlen(url);
+        strcpy(scan->base, url);
+        strcat(scan->base, "/");
+    } else {
+        scan->origin_len = path - url;
+        if ((p = strchr(path, '?')) != NULL) {
+            *p = '\0';
+        }
+        *(strrchr(path, '/') + 1) = '\0';
+        strcpy(scan->base, url);
+    }
+    scan->state = SCAN_TEXT;
+    scan->found = 0;
+    return 1;
+}
+
+/*
+ * push
+ *
+ * queue the id of url, unless it is queued already or the queue is full.
+ */
+static void push(char *url, char *version) {
+    char id[MAXLINE];
+    int i;
+
+    if (snprintf(id, MAXLINE, "GET %s %s\r\n", url, version) >= MAXLINE) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < count; i++) {
+        if (strcmp(queue[(head + i) % PREFETCH_QUEUE], id) == 0) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+    }
+    if (count == PREFETCH_QUEUE) {
+        pthread_mutex_unlock(&lock);
+        stat_add(STAT_PREFETCH_DROPPED, 1);
+        return;
+    }
+    if ((queue[(head + count) % PREFETCH_QUEUE] = Malloc(strlen(id) + 1))
+        != NULL) {
+        strcpy(queue[(head + count) % PREFETCH_QUEUE], id);
+        count++;
+        stat_add(STAT_PREFETCH_QUEUED, 1);
+        pthread_cond_signal(&nonempty);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * same_origin
+ *
+ * return 1 if the authorities a and b, of alen and blen, are the same
+ * host and port.
+ */
+static int same_origin(char *a, int alen, char *b, int blen) {
+    if (alen > 3 && strncmp(a + alen - 3, ":80", 3) == 0) {
+        alen -= 3;
+    }
+    if (blen > 3 && strncmp(b + blen - 3, ":80", 3) == 0) {
+        blen -= 3;
+    }
+    return alen == blen && strncasecmp(a, b, alen) == 0;
+}
+
+/*
+ * take
+ *
+ * resolve the link of a tag against the page and queue it if it is of the
+ * same origin.
+ */
+static void take(prefetch_scan *scan, char *link) {
+    char url[MAXLINE + PREFETCH_URL + 8], clean[PREFETCH_URL + 8];
+    char *s, *d, *rest;
+    int len;
+
+    if (scan->found >= PREFETCH_PAGE) {
+        return;
+    }
+    /* &amp; is the one entity URLs have, a fragment is not asked for */
+    for (s = link, d = clean; *s != '\0' && *s != '#'; d++) {
+        if ((unsigned char)*s <= ' ' || (unsigned char)*s >= 0x7f) {
+            return;
+        }
+        *d = *s;
+        s += strncmp(s, "&amp;", 5) == 0 ? 5 : 1;
+    }
+    *d = '\0';
+    if (clean[0] == '\0') {
+        return;
+    }
+    if (strncmp(clean, "//", 2) == 0) {
+        memmove(clean + 5, clean, strlen(clean) + 1);
+        memcpy(clean, "http:", 5);
+    }
+    if (strncasecmp(clean, "http://", 7) == 0) {
+        len = strcspn(clean + 7, "/?");
+        if (!same_origin(clean + 7, len, scan->base + 7,
+                         scan->origin_len - 7)) {
+            return;
+        }
+        rest = clean + 7 + len;
+        snprintf(url, sizeof(url), "%.*s%s%s", scan->origin_len, scan->base,
+                 rest[0] == '/' ? "" : "/", rest);
+    } else if (strchr(clean, ':') != NULL &&
+               strchr(clean, ':') < clean + strcspn(clean, "/?")) {
+        return;
+    } else if (clean[0] == '/') {
+        snprintf(url, sizeof(url), "%.*s%s", scan->origin_len, scan->base,
+                 clean);
+    } else {
+        snprintf(url, sizeof(url), "%s%s", scan->base, clean);
+    }
+    len = strlen(url);
+    if (strstr(url, "/./") != NULL || strstr(url, "/../") != NULL ||
+        (len >= 2 && strcmp(url + len - 2, "/.") == 0) ||
+        (len >= 3 && strcmp(url + len - 3, "/..") == 0)) {
+        return;
+    }
+    scan->found++;
+    push(url, scan->version);
+}
+
+/*
+ * end_value
+ *
+ * an attribute value is complete, keep it if the tag needs it.
+ */
+static void end_value(prefetch_scan *scan) {
+    char *tag = scan->tag, *attr = scan->attr, *p;
+
+    scan->value[scan->value_len < PREFETCH_URL ? scan->value_len : 0] = '\0';
+    if (((strcmp(tag, "script") == 0 || strcmp(tag, "img") == 0) &&
+         strcmp(attr, "src") == 0) ||
+        (strcmp(tag, "link") == 0 && strcmp(attr, "href") == 0)) {
+        strcpy(scan->link, scan->value);
+    } else if (strcmp(tag, "link") == 0 && strcmp(attr, "rel") == 0) {
+        for (p = scan->value; *p != '\0'; p++) {
+            *p = tolower((unsigned char)*p);
+        }
+        scan->stylesheet = strstr(scan->value, "stylesheet") != NULL;
+    }
+}
+
+/*
+ * end_tag
+ *
+ * the > of a tag, take its link if it has one.
+ */
+static void end_tag(prefetch_scan *scan) {
+    if (scan->link[0] != '\0' &&
+        (strcmp(scan->tag, "link") != 0 || scan->stylesheet)) {
+        take(scan, scan->link);
+    }
+    scan->state = SCAN_TEXT;
+}
+
+/*
+ * name_add
+ *
+ * add c to a tag or attribute name of size, in lower case. A name too
+ * long is cleared, it is none that matters.
+ */
+static void name_add(char *name, int *len, int size, char c) {
+    if (*len < size - 1) {
+        name[(*len)++] = tolower((unsigned char)c);
+        name[*len] = '\0';
+    } else {
+        name[0] = '\0';
+        *len = size;
+    }
+}
+
+/*
+ * scan_markup
+ *
+ * scan the next len bytes of the markup of a page.
+ */
+static void scan_markup(prefetch_scan *scan, char *buf, int len) {
+    int i, space;
+    char c;
+
+    for (i = 0; i < len; i++) {
+        c = buf[i];
+        space = isspace((unsigned char)c);
+        switch (scan->state) {
+        case SCAN_TEXT:
+            if (c == '<') {
+                scan->state = SCAN_TAG;
+                scan->tag[0] = '\0';
+                scan->tag_len = 0;
+                scan->link[0] = '\0';
+                scan->stylesheet = 0;
+            }
+            break;
+        case SCAN_TAG:
+            if (isalnum((unsigned char)c)) {
+                name_add(scan->tag, &scan->tag_len, sizeof(scan->tag), c);
+            } else if (scan->tag_len == 0) {
+                scan->state = c == '<' ? SCAN_TAG :
+                              c == '/' || c == '!' ? SCAN_SKIP : SCAN_TEXT;
+            } else if (c == '>') {
+                end_tag(scan);
+            } else {
+                scan->state = space || c == '/' ? SCAN_IN_TAG : SCAN_SKIP;
+            }
+            break;
+        case SCAN_SKIP:
+            if (c == '>') {
+                scan->state = SCAN_TEXT;
+            }
+            break;
+        case SCAN_AFTER_ATTR:
+            if (c == '=') {
+                scan->state = SCAN_BEFORE_VALUE;
+                break;
+            }
+            /* fall through, an attribute without a value */
+        case SCAN_IN_TAG:
+            if (c == '>') {
+                end_tag(scan);
+            } else if (!space && c != '/') {
+                scan->attr[0] = '\0';
+                scan->attr_len = 0;
+                name_add(scan->attr, &scan->attr_len, sizeof(scan->attr), c);
+                scan->state = SCAN_ATTR;
+            }
+            break;
+        case SCAN_ATTR:
+            if (c == '=') {
+                scan->state = SCAN_BEFORE_VALUE;
+            } else if (c == '>') {
+                end_tag(scan);
+            } else if (space) {
+                scan->state = SCAN_AFTER_ATTR;
+            } else {
+                name_add(scan->attr, &scan->attr_len, sizeof(scan->attr), c);
+            }
+            break;
+        case SCAN_BEFORE_VALUE:
+            if (space) {
+                break;
+            }
+            if (c == '>') {
+                end_tag(scan);
+                break;
+            }
+            scan->quote = c == '"' || c == '\'' ? c : 0;
+            scan->value_len = 0;
+            scan->state = SCAN_VALUE;
+            if (scan->quote != 0) {
+                break;
+            }
+            /* fall through, the first character of an unquoted value */
+        case SCAN_VALUE:
+            if (scan->quote != 0 ? c == scan->quote : space || c == '>') {
+                end_value(scan);
+                scan->state = SCAN_IN_TAG;
+                if (c == '>') {
+                    end_tag(scan);
+                }
+            } else if (scan->value_len < PREFETCH_URL - 1) {
+                scan->value[scan->value_len++] = c;
+            } else {
+                scan->value_len = PREFETCH_URL;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * prefetch_feed
+ *
+ * scan the next len bytes of the body of a page, inflating them first if
+ * it is compressed. A body that does not inflate is scanned no further.
+ */
+void prefetch_feed(prefetch_scan *scan, char *buf, int len) {
+#ifdef HAVE_ZLIB
+    char out[MAXLINE];
+    int rc;
+#endif
+
+    if (!scan->inflating) {
+        scan_markup(scan, buf, len);
+        return;
+    }
+#ifdef HAVE_ZLIB
+    scan->zs.next_in = (Bytef *)buf;
+    scan->zs.avail_in = len;
+    do {
+        scan->zs.next_out = (Bytef *)out;
+        scan->zs.avail_out = sizeof(out);
+        rc = inflate(&scan->zs, Z_NO_FLUSH);
+        /* after an error inflate only returns it again */
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            return;
+        }
+        scan_markup(scan, out, sizeof(out) - scan->zs.avail_out);
+    } while (rc == Z_OK && scan->zs.avail_out == 0);
+#endif
+}
+
+/*
+ * prefetch_one
+ *
+ * ask the proxy for id, the request line of a URL, and read the response
+ * to the end, which puts it into the cache.
+ */
+static void prefetch_one(char *id) {
+    char request[MAXLINE], url[MAXLINE], buf[MAXLINE];
+    struct timeval tv = {PREFETCH_TIMEOUT, 0};
+    int fd, len;
+
+    sscanf(id, "GET %8191s", url);
+    len = strcspn(url + 7, "/?");
+    snprintf(request, MAXLINE, "%sHost: %.*s\r\nPurpose: prefetch\r\n\r\n",
+             id, len, url + 7);
+    if ((fd = socket(self.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (SA *)&self, self_len) == 0 &&
+        rio_writen(fd, request, strlen(request)) != -1) {
+        while (read(fd, buf, MAXLINE) > 0) {
+            ;
+        }
+        stat_add(STAT_PREFETCHED, 1);
+    }
+    close(fd);
+}
+
+/*
+ * prefetch_thread
+ *
+ * take ids from the queue and prefetch those not cached, while the proxy
+ * has the time for it.
+ */
+static void *prefetch_thread(void *vargp) {
+    cache_item *item;
+    char *id;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (count == 0) {
+            pthread_cond_wait(&nonempty, &lock);
+        }
+        id = queue[head];
+        head = (head + 1) % PREFETCH_QUEUE;
+        count--;
+        pthread_mutex_unlock(&lock);
+
+        /* the prefetches under way are connections being served too */
+        if (listeners_active() - atomic_load(&running) >= idle_max) {
+            stat_add(STAT_PREFETCH_BUSY, 1);
+        } else if ((item = cache_pin(id, prefetch_cache)) != NULL) {
+            cache_unpin(item);
+        } else {
+            atomic_fetch_add(&running, 1);
+            prefetch_one(id);
+            atomic_fetch_sub(&running, 1);
+        }
+        Free(id);
+    }
+    return NULL;
+}
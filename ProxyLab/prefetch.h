@@ -0,0 +1,67 @@
+/*
+ * prefetch.h
+ *
+ * prefetching what an HTML page links to. The body of a text/html response
+ * from an origin is scanned as it streams through, for the src of script
+ * and img tags and the href of stylesheet links. Those of the same origin
+ * as the page go into a queue, and a few threads of their own fetch them
+ * into the cache by asking the proxy itself, with a Purpose: prefetch
+ * header, before the browser has parsed its way to them. The number of
+ * threads is the most prefetches at once, and a prefetch is only started
+ * while the proxy is not busy serving clients. A prefetched item counts as
+ * used when a client hits it, which tells whether prefetching pays off.
+ * A page in gzip or deflate is inflated as it streams through and the
+ * markup that comes out is scanned, if the proxy is built with zlib. One
+ * in any other encoding, or in those without zlib, is not.
+ */
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "cache.h"
+
+/* URLs waiting to be prefetched */
+#define PREFETCH_QUEUE 256
+/* URLs taken from one page at most */
+#define PREFETCH_PAGE 32
+/* longest link that is followed */
+#define PREFETCH_URL 1024
+/* connections served at once under which prefetches start, without a
+ * pool of workers, with one it is half of the workers */
+#define PREFETCH_IDLE 8
+/* seconds a prefetch may take */
+#define PREFETCH_TIMEOUT 10
+/* bytes zlib may allocate to inflate a page, its state and window */
+#define PREFETCH_INFLATE (48 * 1024)
+
+/* the state of the scan of a page, between two pieces of its body */
+typedef struct prefetch_scan {
+    char base[MAXLINE];        /* the URL of the page up to its last / */
+    int origin_len;            /* of which the scheme and host:port */
+    char version[16];          /* the HTTP version it was asked with */
+    int state;                 /* where in the markup the scan is */
+    char tag[8];               /* name of the tag it is in */
+    char attr[8];              /* name of the attribute */
+    char value[PREFETCH_URL];  /* its value so far */
+    int tag_len, attr_len, value_len;
+    char quote;                /* the quote the value is in, 0 if none */
+    int stylesheet;            /* a link tag has rel=stylesheet */
+    char link[PREFETCH_URL];   /* the src or href of the tag */
+    int found;                 /* URLs taken from the page */
+    int inflating;             /* 1 if the body goes through zs first */
+#ifdef HAVE_ZLIB
+    z_stream zs;               /* inflating it */
+    long arena_used;           /* of arena, which zs allocates from */
+    char arena[PREFETCH_INFLATE];
+#endif
+} prefetch_scan;
+
+void prefetch_init(int threads, int idle, cache *pcache, int port,
+                   int ipv6);
+int prefetch_start(prefetch_scan *scan, char *cache_id, char *encoding);
+void prefetch_feed(prefetch_scan *scan, char *buf, int len);
+
+#endif /* __PREFETCH_H__ */
@@ -0,0 +1,163 @@
+/*
+ * prefork.c
+ *
+ * fork the worker processes and keep them running. Only the workers
+ * return from prefork_run, the parent stays in it until it is told to
+ * exit, and then waits for all of them to exit first.
+ *
+ * A worker that dies right after it was forked is forked again one second
+ * later, so a worker that can not start does not spin the parent.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/wait.h>
+#include "csapp.h"
+#include "prefork.h"
+
+/* a worker that lived less than this is restarted after a pause */
+#define PREFORK_MIN_LIFE 1
+
+/* a worker process */
+typedef struct worker {
+    pid_t pid;                 /* its process, 0 if not running */
+    time_t started;            /* when it was forked */
+} worker;
+
+static worker *workers;        /* all workers */
+static int nworkers;           /* number of workers */
+static int cpus[CPU_SETSIZE];  /* the cores we may run on */
+static int ncpus;              /* number of them */
+
+/*
+ * spawn
+ *
+ * fork worker i. return 0 in the worker, 1 in the parent, -1 if failed.
+ */
+static int spawn(int i, sigset_t *mask) {
+    cpu_set_t set;
+    pid_t pid;
+
+    if ((pid = fork()) < 0) {
+        unix_error("prefork fork error");
+        return -1;
+    }
+    if (pid > 0) {
+        workers[i].pid = pid;
+        workers[i].started = time(NULL);
+        return 1;
+    }
+
+    /* the worker takes its signals like a proxy of its own */
+    sigprocmask(SIG_UNBLOCK, mask, NULL);
+    if (ncpus > 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % ncpus], &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            fprintf(stderr, "prefork: can not pin worker %d to cpu %d\n",
+                    i, cpus[i % ncpus]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * reap
+ *
+ * wait for the workers that exited and fork them again, unless the parent
+ * is stopping. return the number of a new worker in that worker, -1 in
+ * the parent.
+ */
+static int reap(sigset_t *mask, int stopping) {
+    pid_t pid;
+    int status, i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < nworkers && workers[i].pid != pid; i++)
+            ;
+        if (i == nworkers) {
+            continue;
+        }
+        workers[i].pid = 0;
+        if (stopping) {
+            continue;
+        }
+        fprintf(stderr, "prefork: worker %d (pid %d) %s %d, restarting\n",
+                i, (int)pid, WIFSIGNALED(status) ? "killed by signal"
+                : "exited with", WIFSIGNALED(status) ? WTERMSIG(status)
+                : WEXITSTATUS(status));
+        if (time(NULL) - workers[i].started < PREFORK_MIN_LIFE) {
+            sleep(1);
+        }
+        if (spawn(i, mask) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * prefork_run
+ *
+ * fork count workers and watch them. SIGCHLD restarts the ones that die,
+ * SIGUSR1 and SIGUSR2 are passed on, SIGINT and SIGTERM too, and then the
+ * parent exits once all workers are gone. return the number of the worker
+ * in each worker, the parent never returns. -1 if nothing could be forked.
+ */
+int prefork_run(int count) {
+    cpu_set_t allowed;
+    sigset_t mask;
+    int sig, i, running;
+
+    if ((workers = (worker *)Calloc(count, sizeof(worker))) == NULL) {
+        return -1;
+    }
+    nworkers = count;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed)) {
+            cpus[ncpus++] = i;
+        }
+    }
+
+    /* the signals are taken with sigwait, none may get lost before */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    for (i = 0; i < count; i++) {
+        if (spawn(i, &mask) == 0) {
+            return i;
+        }
+    }
+
+    while (sigwait(&mask, &sig) == 0) {
+        if (sig == SIGCHLD) {
+            if ((i = reap(&mask, 0)) >= 0) {
+                return i;
+            }
+            continue;
+        }
+        for (i = 0; i < count; i++) {
+            if (workers[i].pid > 0) {
+                kill(workers[i].pid, sig);
+            }
+        }
+        if (sig == SIGUSR1 || sig == SIGUSR2) {
+            continue;
+        }
+        /* stopping, wait for the workers to save and exit */
+        do {
+            running = 0;
+            reap(&mask, 1);
+            for (i = 0; i < count; i++) {
+                running += workers[i].pid > 0;
+            }
+        } while (running > 0 && sigwait(&mask, &sig) == 0);
+        exit(0);
+    }
+    return -1;
+}
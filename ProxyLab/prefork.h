@@ -0,0 +1,16 @@
+/*
+ * prefork.h
+ *
+ * run the proxy as several worker processes. The parent forks them before
+ * anything else is set up, each worker is pinned to a core of its own and
+ * goes on like a whole proxy, on a SO_REUSEPORT socket of the same port.
+ * The parent only watches them: a worker that dies is forked again, and
+ * the signals the parent gets are passed on to all of them.
+ */
+
+#ifndef __PREFORK_H__
+#define __PREFORK_H__
+
+int prefork_run(int count);
+
+#endif /* __PREFORK_H__ */
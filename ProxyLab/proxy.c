@@ -9,13 +9,13 @@
  * into the cache to see if there is a cache copy. If not found, the proxy
  * will connect to the remote host and send request for client. The response
  * will be transfer back to client and store a copy into cache if the size is
- * not too large. The cache is maintained as a single linked list. New item is
- * always inserted in the back, and when a item is used, create a new item and 
- * add it to the last. This could seem inefficient, but it greatly reduce the 
- * risk of messing up the whole cache system. Thus, evicting LRU item can 
- * simply evict the head of the list.
+ * not too large. The cache is a hash table that readers search without
+ * taking any lock, see cache.h. Eviction is CLOCK, an approximation of LRU.
+ * With --processes the proxy runs as several worker processes, which share
+ * a second cache in shared memory, see shm_cache.h.
  * 
- * How to use: provide an argument as the port you want to use
+ * How to use: provide an argument as the port you want to use, see
+ * config.c for the options.
  * CSAPP lib: modified it so that process will not exit due to error. This 
  * keeps the server from being crash.
  */
@@ -24,12 +24,100 @@
 #include <stdlib.h>
 #include "csapp.h"
 #include <string.h>
+#include <sys/sendfile.h>
 #include "cache.h"
+#include "l1cache.h"
+#include "config.h"
+#include "listener.h"
+#include "stats.h"
+#include "disk_cache.h"
+#include "snapshot.h"
+#include "uring.h"
+#include "range.h"
+#include "negative.h"
+#include "admit.h"
+#include "trace.h"
+#include "shm_cache.h"
+#include "prefork.h"
+#include "upgrade.h"
+#include "timer.h"
+#include "logger.h"
+#include "hedge.h"
+#include "purge.h"
+#include "admin.h"
+#include "prefetch.h"
+#include "peer.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* chunks sent with one writev on a hit */
+#define SEND_IOV 64
+/* largest header block of a response, it fits in one cache chunk */
+#define HEADER_MAX CACHE_CHUNK_SIZE
+/* name of the proxy in the Via header */
+#define VIA_NAME "proxylab"
+
+/* where fetch_server collects a body relayed by io_uring */
+typedef struct body_sink {
+    cache_fill *fill;          /* the content for the cache */
+    int cache_it;              /* still collecting or not */
+} body_sink;
+
+/* a soft purged response the origin is asked about */
+typedef struct revalidation {
+    char id[MAXLINE];          /* its cache id, empty if none */
+    char headers[MAXLINE];     /* the conditional request headers */
+} revalidation;
+
+/* the connection to the origin of a fetch, given back once it is done */
+typedef struct upstream {
+    int fd;                    /* the socket, -1 once given back */
+    admit_ticket *ticket;      /* the fetch was let in with */
+    struct timespec since;     /* when it was connected */
+    char *host, *port;         /* of the origin */
+    hedge_origin *hedge;       /* its times to first byte, NULL if off */
+    struct sockaddr_in spare;  /* where a hedge connects, or AF_UNSPEC */
+    revalidation *rv;          /* what the fetch revalidates */
+    int peer;                  /* it is a peer, see peer.h */
+} upstream;
+
+/* a body on its way from an origin read at full speed to a slow client */
+typedef struct relay_buf {
+    char *mem;                 /* conf.client_buffer bytes */
+    long start, end;           /* what is in there, not sent yet */
+    int spill_fd;              /* file for what does not fit, -1 if none */
+    long spill_start, spill_end; /* what is in that, not sent yet */
+    int spill_ok;              /* the file can be used */
+} relay_buf;
+
+/* deadlines on the sockets of the request a thread serves */
+static __thread io_timer client_timer, origin_timer;
+/* the scan of the page a thread fetches, NULL if it is none */
+static __thread prefetch_scan *page_scan;
+/* SO_ZEROCOPY on the client socket: 0 not tried yet, 1 on, -1 refused */
+static __thread int client_zerocopy;
+
+/* the Range and If-Range a client sent, empty if none */
+typedef struct range_req {
+    char range[MAXLINE];       /* value of Range */
+    char if_range[MAXLINE];    /* value of If-Range */
+} range_req;
+
+/* a cached response to send ranges of, from memory, the shared cache or
+ * the disk tier */
+typedef struct stored {
+    cache_item *item;          /* in memory, or NULL */
+    disk_ref *ref;             /* on the disk tier, or NULL */
+    cache_chunk flat;          /* a compressed item, decompressed, or the
+                                  entry of the shared cache */
+    cache_meta meta;           /* meta of the response */
+    char *header;              /* its header block */
+    long length;               /* bytes of the body after it */
+    char buf[HEADER_MAX];      /* the header block read from disk */
+} stored;
+
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
@@ -37,89 +125,382 @@ static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_conn_hdr = "Proxy-Connection: close\r\n";
 static const char *http_version = "HTTP/1.0\r\n";
+/* the answer to a request shed because the origins are too busy */
+static const char *unavailable_response = "HTTP/1.0 503 Service Unavailable"
+    "\r\nRetry-After: 1\r\nContent-Type: text/plain\r\n"
+    "Content-Length: 20\r\n\r\nOrigin overloaded.\r\n";
+/* the answer when the proxy is out of sockets or the like */
+static const char *local_error_response = "HTTP/1.0 503 Service Unavailable"
+    "\r\nRetry-After: 1\r\nContent-Type: text/plain\r\n"
+    "Content-Length: 17\r\n\r\nProxy too busy.\r\n";
+/* the answer when a stale item was evicted while it was revalidated */
+static const char *lost_response = "HTTP/1.0 503 Service Unavailable"
+    "\r\nRetry-After: 0\r\nContent-Type: text/plain\r\n"
+    "Content-Length: 19\r\n\r\nCached copy lost.\r\n";
+/* response headers that only concern one connection, never forwarded */
+static const char *hop_headers = ",connection,keep-alive,proxy-connection,"
+    "proxy-authenticate,proxy-authorization,te,trailer,upgrade,";
+/* content types that are compressed already, besides image, audio, video */
+static const char *packed_types = ",application/zip,application/gzip,"
+    "application/x-gzip,application/x-bzip2,application/x-xz,"
+    "application/x-7z-compressed,application/zstd,application/pdf,"
+    "font/woff,font/woff2,";
 
 /* functions */
-void *thread(void *arg);
+void *signal_thread(void *vargp);
+void save_snapshot();
+void load_snapshot();
+void serve_client(int client_fd);
+void serve_request(int client_fd);
 int parse_url(char *url, char *protocol, char *remote_host,
                             char *remote_port, char *uri);
 void read_headers(rio_t *rp, char *buf, char *request_headers,
-                            char *remote_host, char *remote_port);
-int open_clientfd_r(char *hostname, char *port);
-int fetch_server(int server_fd, int client_fd, char *cache_id);
-int fetch_cache(char *cache_id, int client_fd);
+                            char *remote_host, char *remote_port,
+                            range_req *rr, int *from_peer);
+void forward_range(char *request, range_req *rr);
+int open_clientfd_r(char *hostname, char *port, struct sockaddr_in *spare);
+int open_send_r(char *hostname, char *port, char *request, 
+                struct sockaddr_in *spare);
+void pick_spare(struct addrinfo *list, struct sockaddr *used, 
+                struct sockaddr_in *spare);
+int fetch_peer(peer *owner, int client_fd, char *cache_id, char *request);
+int fetch_failure(char *origin_id, int client_fd);
+void origin_failed(char *origin_id, int client_fd, char *hostname, 
+                   char *port);
+void collect_body(void *arg, char *buf, int len);
+void scan_page(char *buf, int len);
+int is_prefetch(char *request);
+void mark_prefetched(char *cache_id);
+int fetch_server(upstream *up, int client_fd, char *cache_id, 
+                 char *request);
+int relay_raw(int client_fd, rio_t *rp, char *raw, int raw_len, char *line,
+              int line_len);
+long elapsed_us(struct timespec *since);
+void upstream_release(upstream *up, int ok);
+void hedge_race(upstream *up, char *request);
+int hedge_connect(upstream *up);
+int relay_buffered(upstream *up, rio_t *rp, int client_fd, 
+                   cache_fill *fill, int *cache_it);
+long relay_room(relay_buf *rb);
+int relay_take(upstream *up, relay_buf *rb, char *buf, cache_fill *fill,
+               int *cache_it);
+int relay_give(relay_buf *rb, int client_fd);
+int spill_open();
+int vary_names(char *value, char *names);
+void variant_key(char *names, char *request, char *cache_id, 
+                 char *variant_id, unsigned long *hash);
+cache_item *pick_variant(cache_item *marker, char *cache_id, char *request,
+                         char *variant_id, unsigned long *hash);
+void vary_store(char *cache_id, char *names, char *variant_id, 
+                unsigned long hash);
+int header_name(char *line, char *name);
+int rewrite_header(char *raw, char *hdr, long *age);
+int compressible(char *raw);
+void compress_body(cache_fill *fill, char *raw);
+long response_age(cache_meta *meta);
+void age_line(char *buf, long age);
+int header_iovec(struct iovec *iov, char *data, int len, int header_len,
+                 long age, char *buf);
+int fetch_cache(char *cache_id, int client_fd, char *request, 
+                range_req *rr, revalidation *rv);
+void revalidate_headers(cache_item *item, char *cache_id, revalidation *rv);
+void revalidate_request(char *request, revalidation *rv);
+int revalidated(char *cache_id, int client_fd, long age);
+int refill(cache_fill *fill, cache_item *item);
+int fetch_shared(char *cache_id, int client_fd, char *request,
+                 unsigned long vary_hash, range_req *rr);
+int fetch_disk(char *cache_id, int client_fd, unsigned long vary_hash,
+               range_req *rr);
+int stored_open(stored *obj, cache_item *item, disk_ref *ref);
+int stored_shared(stored *obj, shm_ref *ref);
+void stored_close(stored *obj);
+int send_body(int client_fd, stored *obj, char *prefix, int prefix_len,
+              long offset, long n);
+void make_boundary(char *boundary);
+int send_ranges(int client_fd, stored *obj, range_req *rr);
+int send_stored_ranges(int client_fd, cache_item *item, disk_ref *ref,
+                       range_req *rr);
+int fetch_blocks(char *hostname, char *port, char *request, char *cache_id,
+                 int client_fd, range_req *rr);
+cache_item *get_block(char *hostname, char *port, char *request, 
+                      char *cache_id, long start);
+int fetch_block(int server_fd, char *block_id);
+int promote(char *cache_id, disk_ref *ref);
+long block_total(stored *obj, long start);
+int send_item(int client_fd, cache_item *item);
+int send_compressed(int client_fd, cache_item *item);
+int send_disk(disk_ref *ref, int client_fd);
+void demote(cache_item *item);
 
 /* Make the cache structure global so that it could be easily accessed*/
 cache *pcache = NULL;
+/* number of this worker process, -1 if there are none */
+int worker_id = -1;
 
 int main(int argc, char *argv[])
 {
-    int listenfd, *connfdp, port;
-    socklen_t clientlen = sizeof(struct sockaddr_in);
-    struct sockaddr_in clientaddr;
+    int fds[UPGRADE_MAX_FDS];
+    int shared_fd = -1;
     pthread_t tid;
+    sigset_t mask;
     
     /* ignore SIGPIPE */
     Signal(SIGPIPE, SIG_IGN);
     
-    if(argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (parse_config(argc, argv) == -1) {
+        usage(argv[0]);
         exit(0);
     }
     
+    /* the workers are forked before any thread, and share the region */
+    if (conf.processes > 0) {
+        if (conf.shared_size > 0 && shm_init(conf.shared_size) == -1) {
+            exit(1);
+        }
+        if ((worker_id = prefork_run(conf.processes)) == -1) {
+            exit(1);
+        }
+        /* every worker needs a socket of its own on the port */
+        if (conf.listeners == 0) {
+            conf.listeners = 1;
+        }
+    }
+    
+    /* the process we take over from hands us its sockets and cache */
+    if (conf.hot_upgrade) {
+        upgrade_init(argv);
+        listeners_inherit(fds, upgrade_inherit(fds, UPGRADE_MAX_FDS, 
+                                               &shared_fd));
+        if (shared_fd >= 0 && shm_attach(shared_fd) == -1) {
+            fprintf(stderr, "upgrade: the shared cache is not usable\n");
+            Close(shared_fd);
+        }
+        if (!shm_enabled() && conf.shared_size > 0 && 
+            shm_init(conf.shared_size) == -1) {
+            exit(1);
+        }
+    }
+    
+    /* block the signals we act on, every thread created from now on 
+     * inherits the mask, and take them in one thread */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTERM);
+    if (conf.hot_upgrade) {
+        Sigaddset(&mask, SIGHUP);
+    }
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    Pthread_create(&tid, NULL, signal_thread, &mask);
+    
     /* initialize the cache struct*/
     pcache = init_cache();
+    pcache->max_size = conf.cache_size;
+    if (conf.admin_port > 0) {
+        purge_init(pcache);
+    }
+    l1_init(conf.l1_entries);
+    admit_init(conf.upstream_limit, conf.origin_limit, conf.upstream_queue,
+               conf.upstream_wait);
+    hedge_init(conf.hedge, conf.hedge_budget);
+    prefetch_init(conf.prefetch, conf.workers > 0 ? (conf.workers + 1) / 2 :
+                  PREFETCH_IDLE, pcache, conf.port, conf.ipv6);
+    if (peer_init(conf.peers, conf.peer_self, conf.port) == -1) {
+        exit(1);
+    }
+    if (log_init(conf.access_log, conf.log_rotate, conf.record) == -1) {
+        exit(1);
+    }
+    trace_init(conf.slow_ms, conf.trace_sample);
+    if ((conf.header_timeout > 0 || conf.connect_timeout > 0 || 
+         conf.first_byte_timeout > 0 || conf.idle_timeout > 0) &&
+        timers_init() == -1) {
+        exit(1);
+    }
+    
+    /* evicted objects go to the disk tier if there is one */
+    if (conf.disk_dir != NULL) {
+        if (disk_init(conf.disk_dir, conf.disk_size) == -1) {
+            exit(1);
+        }
+        pcache->on_evict = demote;
+    }
+    
+    /* network I/O through io_uring, if the kernel has it */
+    if (conf.io_uring && uring_init() == -1) {
+        fprintf(stderr, "io_uring not available, using plain system calls\n");
+    }
     
-    /* Begin listening on port given*/
-    port = atoi(argv[1]);
-    listenfd = Open_listenfd(port);
-    while(1) {
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Pthread_create(&tid, NULL, thread, connfdp);
+    /* warm up from the last snapshot */
+    if (conf.snapshot != NULL) {
+        load_snapshot();
     }
+    
+    /* purges come in on the admin port */
+    if (conf.admin_port > 0 && admin_init(conf.admin_port) == -1) {
+        exit(1);
+    }
+    
+    /* Begin listening on port given, serve until killed */
+    upgrade_ready();
+    listeners_run(conf.port, conf.listeners, conf.ipv6, conf.workers,
+                  serve_client);
     Free(pcache);
     return 0;
 }
 
 
 /*
- * thread
+ * signal_thread
  * 
- * the thread will get request from client and try to fetch data from
- * cache. If failed, it will connect to specified server and send request
- * for user and get response to user and maybe make a copy to cache.
+ * take the signals blocked everywhere else: SIGUSR1 prints the counters,
+ * what dedup saves, the shared cache and the accept rates,
+ * SIGUSR2 saves a snapshot of the cache, SIGINT and SIGTERM save one and
+ * exit. SIGHUP hands over to a new binary, with --hot-upgrade.
  *
  */
-void *thread(void *vargp) {
-    /* detach the thread to avoid memory leaks*/
+void *signal_thread(void *vargp) {
+    sigset_t *mask = (sigset_t *)vargp;
+    int sig;
+    
     Pthread_detach(pthread_self());
-    int client_fd = *((int *)vargp);
-    Free(vargp);
+    while (sigwait(mask, &sig) == 0) {
+        if (sig == SIGUSR1) {
+            if (worker_id >= 0) {
+                fprintf(stderr, "worker %d (pid %d):\n", worker_id, 
+                        (int)getpid());
+            }
+            stats_report(stderr);
+            cache_report(pcache, stderr);
+            shm_report(stderr);
+            admit_report(stderr);
+            purge_report(stderr);
+            peer_report(stderr);
+            listeners_report(stderr);
+            continue;
+        }
+        if (sig == SIGHUP) {
+            upgrade_start();
+            continue;
+        }
+        if (conf.snapshot != NULL) {
+            save_snapshot();
+        }
+        if (sig != SIGUSR2) {
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * save_snapshot
+ * 
+ * write the cache to the snapshot file.
+ *
+ */
+void save_snapshot() {
+    struct timeval start, end;
+    int count;
+    
+    gettimeofday(&start, NULL);
+    if ((count = snapshot_save(pcache, conf.snapshot)) == -1) {
+        fprintf(stderr, "Error saving snapshot to %s\n", conf.snapshot);
+        return;
+    }
+    gettimeofday(&end, NULL);
+    fprintf(stderr, "snapshot: saved %d objects to %s in %ld ms\n", 
+            count, conf.snapshot, (end.tv_sec - start.tv_sec) * 1000 + 
+            (end.tv_usec - start.tv_usec) / 1000);
+}
+
+/*
+ * load_snapshot
+ * 
+ * load the cache from the snapshot file, if there is one.
+ *
+ */
+void load_snapshot() {
+    struct timeval start, end;
+    int count;
+    
+    gettimeofday(&start, NULL);
+    if ((count = snapshot_load(pcache, conf.snapshot)) == -1) {
+        fprintf(stderr, "snapshot: no valid snapshot in %s\n", 
+                conf.snapshot);
+        return;
+    }
+    gettimeofday(&end, NULL);
+    fprintf(stderr, "snapshot: loaded %d objects from %s in %ld us\n", 
+            count, conf.snapshot, (end.tv_sec - start.tv_sec) * 1000000 + 
+            (end.tv_usec - start.tv_usec));
+}
+
+/*
+ * serve_client
+ * 
+ * serve the request of a client, timed phase by phase if slow requests
+ * are logged or traces sampled, and logged to the access log if any.
+ */
+void serve_client(int client_fd) {
+    req_trace trace;
     
-    int server_fd = -1;
+    trace_begin(&trace);
+    client_zerocopy = 0;
+    serve_request(client_fd);
+    trace_end();
+}
+
+/*
+ * serve_request
+ * 
+ * get request from client and try to fetch data from cache. If failed, 
+ * it will connect to specified server and send request for user and get 
+ * response to user and maybe make a copy to cache.
+ *
+ */
+void serve_request(int client_fd) {
+    int server_fd = -1, rc, from_peer = 0;
     rio_t client_rio;
     
     char protocol[MAXLINE];
     char buf[MAXLINE], method[MAXLINE], url[MAXLINE], version[MAXLINE];
     char remote_host[MAXLINE], remote_port[MAXLINE], uri[MAXLINE];
-    char request_lines[MAXLINE], cache_id[MAXLINE];
+    char request_lines[MAXLINE], cache_id[MAXLINE], origin_id[MAXLINE];
+    admit_ticket ticket;
+    revalidation rv;
+    upstream up;
+    range_req rr;
+    peer *owner;
+    
+    /* the whole request head must come in time */
+    io_timer_init(&client_timer);
+    io_timer_init(&origin_timer);
+    io_timer_arm(&client_timer, client_fd, conf.header_timeout, 0, 
+                 STAT_TIMEOUT_HEADER);
     
     Rio_readinitb(&client_rio, client_fd);
     /* read the request line into buf */
-    if(rio_readlineb(&client_rio, buf, MAXLINE) == -1) {
+    if(rio_readlineb(&client_rio, buf, MAXLINE) <= 0) {
+        io_timer_cancel(&client_timer);
         Close(client_fd);
-        pthread_exit(NULL);
+        return;
     }
     
     /* Get request method, url and version and make it cache id*/
+    trace_line(buf);
+    trace_outcome("bad request");
     sscanf(buf, "%s %s %s", method, url, version);
     strcpy(cache_id, buf);
+    stat_add(STAT_REQUESTS, 1);
 
     /* parse the request to get key information */
     if (parse_url(url, protocol, remote_host, remote_port, uri) == -1) {
+        io_timer_cancel(&client_timer);
         Close(client_fd);
-        fprintf(stderr, "Bad url %s at %lu\n", url, pthread_self());
-        pthread_exit(NULL);
+        log_error("Bad url %s at %lu\n", url, pthread_self());
+        return;
     }
 
     /* generate request line */
@@ -132,47 +513,147 @@ void *thread(void *vargp) {
     /* only support GET method. If is GET, get request headers */
     if (strstr(method, "GET") != NULL) {
         read_headers(&client_rio, buf, request_lines, 
-                                remote_host, remote_port);
+                                remote_host, remote_port, &rr, &from_peer);
+        trace_mark(TRACE_REQUEST);
     }
-    else {
+    io_timer_cancel(&client_timer);
+    /* a head cut short by the timeout is no request */
+    if (io_timer_fired(&client_timer)) {
+        trace_outcome("timeout");
+        Close(client_fd);
+        return;
+    }
+    if (strstr(method, "GET") == NULL) {
         Close(client_fd);
-        fprintf(stderr, "Only support GET method at %lu\n", pthread_self());
-        pthread_exit(NULL);
+        log_error("Only support GET method at %lu\n", pthread_self());
+        return;
+    }
+    if (from_peer) {
+        stat_add(STAT_PEER_SERVED, 1);
     }
 
     /* if found from cache, transfer to client and exit */
-    if (fetch_cache(cache_id, client_fd) == 1) {
+    rv.id[0] = '\0';
+    rc = fetch_cache(cache_id, client_fd, request_lines, &rr, &rv);
+    trace_mark(TRACE_CACHE);
+    if (rc == 1) {
+        trace_outcome("hit");
+        Close(client_fd);
+        return;
+    }
+    /* part of the hit went out, a fetch can not follow it */
+    if (rc == -1) {
+        trace_outcome("error");
+        Close(client_fd);
+        log_error("Error sending cached data of:%s\n", remote_host);
+        return;
+    }
+    
+    /* a range of an object not cached whole, maybe from cached blocks */
+    if (conf.range_block > 0 && rr.range[0] != '\0' && rv.id[0] == '\0') {
+        switch (fetch_blocks(remote_host, remote_port, request_lines, 
+                             cache_id, client_fd, &rr)) {
+        case 1:
+            trace_outcome("blocks");
+            Close(client_fd);
+            return;
+        case -1:
+            Close(client_fd);
+            log_error("Error sending blocks of:%s\n", remote_host);
+            return;
+        }
+    }
+    forward_range(request_lines, &rr);
+    revalidate_request(request_lines, &rv);
+    
+    /* in a cluster the peer that owns the URL is asked, see peer.h */
+    if (!from_peer && rv.id[0] == '\0' && 
+        (owner = peer_owner(cache_id)) != NULL &&
+        (rc = fetch_peer(owner, client_fd, cache_id, request_lines)) != 0) {
+        trace_outcome(rc == 1 ? "peer" : "error");
+        Close(client_fd);
+        if (rc == -1) {
+            log_error("Error fetching data from peer:%s\n", owner->host);
+        }
+        return;
+    }
+    
+    /* an origin that could not be reached a moment ago is not tried */
+    snprintf(origin_id, MAXLINE, "connect %.4000s:%.64s", 
+             remote_host, remote_port);
+    if (fetch_failure(origin_id, client_fd) == 1) {
+        trace_outcome("unreachable");
+        Close(client_fd);
+        return;
+    }
+    
+    /* with the origins too busy to wait for, the client hears it at once */
+    if (admit_acquire(&ticket, remote_host, remote_port) == -1) {
+        trace_outcome("shed");
+        trace_status((char *)unavailable_response);
+        trace_sent(rio_writen(client_fd, (char *)unavailable_response, 
+                              strlen(unavailable_response)));
         Close(client_fd);
-        pthread_exit(NULL);
+        return;
     }
+    trace_mark(TRACE_ADMIT);
+    trace_outcome("error");
     
-    /* not found, connect to remote host */
-    if ((server_fd = open_clientfd_r(remote_host, remote_port)) == -1){
+    /* not found, connect to remote host and send request for user */
+    server_fd = open_send_r(remote_host, remote_port, request_lines, 
+                            &up.spare);
+    /* a failure of our own says nothing about the origin, and is not
+     * cached as one */
+    if (server_fd == -3) {
+        admit_cancel(&ticket);
+        log_error("No socket for remote host:%s: %s\n", remote_host, 
+                  strerror(errno));
+        trace_status((char *)local_error_response);
+        trace_sent(rio_writen(client_fd, (char *)local_error_response, 
+                              strlen(local_error_response)));
         Close(client_fd);
-        fprintf(stderr, "Error connecting to remote host:%s at %s\n", 
-                                remote_host, remote_port);
-        pthread_exit(NULL);
+        return;
     }
-    /* send request for user */
-    if (rio_writen(server_fd, request_lines, strlen(request_lines)) == -1) {
+    if (server_fd == -1) {
+        admit_release(&ticket, 0);
+        trace_outcome("unreachable");
+        origin_failed(origin_id, client_fd, remote_host, remote_port);
         Close(client_fd);
-        Close(server_fd);
-        fprintf(stderr, "Error writing to remote host:%s at %s\n", 
-                                remote_host, remote_port);
-        pthread_exit(NULL);
+        log_error("Error connecting to remote host:%s at %s\n", 
+                  remote_host, remote_port);
+        return;
     }
-    /* get response */
-    if (fetch_server(server_fd, client_fd, cache_id) == -1) {
+    if (server_fd == -2) {
+        admit_release(&ticket, 0);
         Close(client_fd);
-        Close(server_fd);
-        fprintf(stderr, "Error fetching data from:%s\n", remote_host);
-        pthread_exit(NULL);
+        log_error("Error writing to remote host:%s at %s\n", 
+                  remote_host, remote_port);
+        return;
+    }
+    /* get response, the origin may be given back before the client 
+     * has it all */
+    up.fd = server_fd;
+    up.ticket = &ticket;
+    clock_gettime(CLOCK_MONOTONIC, &up.since);
+    up.host = remote_host;
+    up.port = remote_port;
+    up.hedge = hedge_find(remote_host, remote_port);
+    up.rv = &rv;
+    up.peer = 0;
+    rc = fetch_server(&up, client_fd, cache_id, request_lines);
+    io_timer_cancel(&client_timer);
+    if (rc < 0) {
+        /* a client that went away says nothing about the origin */
+        upstream_release(&up, rc == -2);
+        Close(client_fd);
+        log_error("Error fetching data from:%s\n", remote_host);
+        return;
     }
     
     /* Close fd after using */
+    trace_outcome(rc == 2 ? "revalidated" : "miss");
+    upstream_release(&up, 1);
     Close(client_fd);
-    Close(server_fd);
-    return NULL;
 }
 
 
@@ -214,11 +695,17 @@ int parse_url(char *url, char *protocol, char *remote_host,
  * 
  * After parse the first line, continue to get the request headers. This 
  * function will read request headers from client and change some important
- * ones to default ones except for the port. Other headers will be unchanged.
+ * ones to default ones except for the port. Other headers will be unchanged,
+ * except Range and If-Range, which are kept in rr as we may serve them,
+ * and the PEER_HEADER of a request from a peer, which sets from_peer.
  *
  */    
 void read_headers(rio_t *rp, char *buf, char *request_lines, 
-                        char *remote_host, char *remote_port) {
+                        char *remote_host, char *remote_port,
+                        range_req *rr, int *from_peer) {
+    rr->range[0] = '\0';
+    rr->if_range[0] = '\0';
+    *from_peer = 0;
     /* first add default ones into the request */
     strcat(request_lines, user_agent_hdr);
     strcat(request_lines, accept_hdr);
@@ -241,6 +728,16 @@ void read_headers(rio_t *rp, char *buf, char *request_lines,
             continue;
         } else if (strstr(buf, "Proxy Connection:") != NULL) {
             continue;
+        } else if (strncasecmp(buf, "Range:", 6) == 0) {
+            header_value(buf, strlen(buf), "Range", rr->range, MAXLINE);
+            continue;
+        } else if (strncasecmp(buf, "If-Range:", 9) == 0) {
+            header_value(buf, strlen(buf), "If-Range", rr->if_range, 
+                         MAXLINE);
+            continue;
+        } else if (strcmp(buf, PEER_HEADER) == 0) {
+            *from_peer = 1;
+            continue;
         }
         /* others shoule be unchanged copied*/
         else {
@@ -259,77 +756,397 @@ void read_headers(rio_t *rp, char *buf, char *request_lines,
     strcat(request_lines, "\r\n");
 }    
 
+/*
+ * forward_range
+ * 
+ * put the Range and If-Range of the client back into the request, before
+ * the empty line, when the origin has to answer it. If they do not fit 
+ * they are left out and the whole response is passed on.
+ */
+void forward_range(char *request, range_req *rr) {
+    int len = strlen(request) - 2;
+    
+    if (rr->range[0] == '\0' || len < 0 ||
+        len + strlen(rr->range) + strlen(rr->if_range) + 32 >= MAXLINE) {
+        return;
+    }
+    len += sprintf(request + len, "Range: %s\r\n", rr->range);
+    if (rr->if_range[0] != '\0') {
+        len += sprintf(request + len, "If-Range: %s\r\n", rr->if_range);
+    }
+    strcpy(request + len, "\r\n");
+}
+
 /*
  * open_clientfd_r - thread-safe version of open_clientfd
- * copied from the given file, is thread-safe.
+ * copied from the given file, is thread-safe. spare, if not NULL, gets
+ * the address a hedge would connect to. return -3 if no socket could be
+ * made, -1 if the origin could not be reached.
  */
-int open_clientfd_r(char *hostname, char *port) {
+int open_clientfd_r(char *hostname, char *port, struct sockaddr_in *spare) {
     int clientfd;
     struct addrinfo *addlist, *p;
     int rv;
 
     /* Create the socket descriptor */
     if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
+        return -3;
     }
 
     /* Get a list of addrinfo structs */
     if ((rv = getaddrinfo(hostname, port, NULL, &addlist)) != 0) {
+        close(clientfd);
         return -1;
     }
+    trace_mark(TRACE_DNS);
   
-    /* Walk the list, using each addrinfo to try to connect */
+    /* Walk the list, using each addrinfo to try to connect, all of them
+     * in the connect timeout, which cuts the connect short */
+    io_timer_arm(&origin_timer, clientfd, conf.connect_timeout, 0,
+                 STAT_TIMEOUT_CONNECT);
     for (p = addlist; p; p = p->ai_next) {
         if ((p->ai_family == AF_INET)) {
             if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0) {
                 break; /* success */
             }
         }
+        if (io_timer_fired(&origin_timer)) {
+            p = NULL;
+            break;
+        }
     } 
+    io_timer_cancel(&origin_timer);
 
     /* Clean up */
+    if (p != NULL) {
+        pick_spare(addlist, p->ai_addr, spare);
+    }
     freeaddrinfo(addlist);
     if (!p) { /* all connects failed */
         close(clientfd);
         return -1;
     }
     else { /* one of the connects succeeded */
+        trace_mark(TRACE_CONNECT);
         return clientfd;
     }
 }    
     
+/*
+ * open_send_r
+ * 
+ * connect to the remote host and send it the request. With io_uring the
+ * connect and the send are one submission. spare, if not NULL, gets the
+ * address a hedge of the fetch would connect to, the origin is not looked
+ * up again then. return the connected fd, -1 if failed to connect, -2 if
+ * failed to send, -3 if no socket could be made, which is no fault of the
+ * origin.
+ */
+int open_send_r(char *hostname, char *port, char *request, 
+                struct sockaddr_in *spare) {
+    struct addrinfo *addlist, *p;
+    int clientfd = -1, rc = -1;
+    
+    if (spare != NULL) {
+        spare->sin_family = AF_UNSPEC;
+    }
+    if (!uring_enabled()) {
+        if ((clientfd = open_clientfd_r(hostname, port, spare)) < 0) {
+            return clientfd;
+        }
+        if (rio_writen(clientfd, request, strlen(request)) == -1) {
+            Close(clientfd);
+            return -2;
+        }
+        return clientfd;
+    }
+    
+    if (getaddrinfo(hostname, port, NULL, &addlist) != 0) {
+        return -1;
+    }
+    trace_mark(TRACE_DNS);
+    for (p = addlist; p; p = p->ai_next) {
+        if (p->ai_family != AF_INET) {
+            continue;
+        }
+        if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            rc = -3;
+            break;
+        }
+        if ((rc = uring_connect_send(clientfd, p->ai_addr, p->ai_addrlen,
+                                     request, strlen(request))) == 1) {
+            pick_spare(addlist, p->ai_addr, spare);
+            break;
+        }
+        close(clientfd);
+        /* connected but the send failed, do not try another address */
+        if (rc == -2) {
+            break;
+        }
+    }
+    freeaddrinfo(addlist);
+    if (rc == 1) {
+        trace_mark(TRACE_CONNECT);
+    }
+    return rc == 1 ? clientfd : rc;
+}
+
+/*
+ * pick_spare
+ * 
+ * put into spare an IPv4 address of list other than used, the one the 
+ * fetch connected to, or used itself if there is no other. Nothing if 
+ * spare is NULL.
+ */
+void pick_spare(struct addrinfo *list, struct sockaddr *used, 
+                struct sockaddr_in *spare) {
+    struct addrinfo *p;
+    
+    if (spare == NULL) {
+        return;
+    }
+    memcpy(spare, used, sizeof(*spare));
+    for (p = list; p; p = p->ai_next) {
+        if (p->ai_family == AF_INET && 
+            ((struct sockaddr_in *)p->ai_addr)->sin_addr.s_addr != 
+            spare->sin_addr.s_addr) {
+            memcpy(spare, p->ai_addr, sizeof(*spare));
+            return;
+        }
+    }
+}
+
+/*
+ * fetch_peer
+ * 
+ * ask owner, a peer, for the response to request, a request from a client
+ * of cache_id, and relay it to the client without caching it. return 1 if
+ * it was relayed, -1 if that failed, 0 if owner could not be asked and
+ * the origin has to be.
+ */
+int fetch_peer(peer *owner, int client_fd, char *cache_id, char *request) {
+    char peer_request[MAXLINE];
+    char *headers = strstr(request, "\r\n") + 2;
+    admit_ticket ticket;
+    revalidation rv;
+    upstream up;
+    int rc;
+    
+    /* the request line of the client, which is the cache id there too, 
+     * the headers, and the line that stops it there */
+    if (snprintf(peer_request, MAXLINE, "%s%.*s%s\r\n", cache_id, 
+                 (int)strlen(headers) - 2, headers, PEER_HEADER) >= MAXLINE) {
+        return 0;
+    }
+    if ((up.fd = open_send_r(owner->host, owner->port, peer_request, 
+                             NULL)) < 0) {
+        if (up.fd != -3) {
+            peer_failed(owner);
+        }
+        return 0;
+    }
+    stat_add(STAT_PEER_FETCHES, 1);
+    ticket.origin = NULL;
+    rv.id[0] = '\0';
+    up.ticket = &ticket;
+    clock_gettime(CLOCK_MONOTONIC, &up.since);
+    up.host = owner->host;
+    up.port = owner->port;
+    up.hedge = NULL;
+    up.rv = &rv;
+    up.peer = 1;
+    rc = fetch_server(&up, client_fd, cache_id, peer_request);
+    io_timer_cancel(&client_timer);
+    upstream_release(&up, rc != -1);
+    return rc < 0 ? -1 : 1;
+}
+
+/*
+ * fetch_failure
+ * 
+ * if connecting to the origin of origin_id failed a moment ago, send the
+ * client the 502 that was cached for it. return 1 if it was sent.
+ */
+int fetch_failure(char *origin_id, int client_fd) {
+    cache_item *item;
+    
+    if ((item = cache_pin(origin_id, pcache)) == NULL) {
+        return -1;
+    }
+    if (negative_expired(&item->meta)) {
+        stat_add(STAT_NEG_EXPIRED, 1);
+        cache_remove(item, pcache);
+        cache_unpin(item);
+        return -1;
+    }
+    stat_add(STAT_NEG_HITS, 1);
+    send_item(client_fd, item);
+    cache_unpin(item);
+    return 1;
+}
+
+/*
+ * origin_failed
+ * 
+ * the origin could not be resolved or connected to: answer 502, and keep
+ * the answer under origin_id for the time to live of connect failures.
+ */
+void origin_failed(char *origin_id, int client_fd, char *hostname, 
+                   char *port) {
+    char buf[MAXLINE];
+    long expires = negative_expiry(NEGATIVE_CONNECT);
+    cache_fill fill;
+    int n, header_len;
+    
+    if ((n = negative_response(buf, MAXLINE, hostname, port)) == -1) {
+        return;
+    }
+    trace_status(buf);
+    trace_sent(rio_writen(client_fd, buf, n));
+    if (expires <= 0) {
+        return;
+    }
+    header_len = strstr(buf, "\r\n\r\n") + 4 - buf;
+    fill_init(&fill, n);
+    if (fill_header(&fill, buf, header_len, time(NULL)) == -1 ||
+        fill_append(&fill, buf + header_len, n - header_len) == -1) {
+        return;
+    }
+    fill.meta.expires = expires;
+    if (fill_commit(&fill, origin_id, pcache) == 1) {
+        stat_add(STAT_NEG_STORED, 1);
+    }
+}
+
+/*
+ * collect_body
+ * 
+ * on_data of uring_relay, collect a piece of the body for the cache.
+ */
+void collect_body(void *arg, char *buf, int len) {
+    body_sink *sink = (body_sink *)arg;
+    
+    io_timer_touch(&origin_timer);
+    io_timer_touch(&client_timer);
+    scan_page(buf, len);
+    if (sink->cache_it == 1 && fill_append(sink->fill, buf, len) == -1) {
+        sink->cache_it = 0;
+    }
+}
+    
+/*
+ * scan_page
+ * 
+ * a piece of the body, scanned for links if it is of a page.
+ */
+void scan_page(char *buf, int len) {
+    if (page_scan != NULL) {
+        prefetch_feed(page_scan, buf, len);
+    }
+}
+
+/*
+ * is_prefetch
+ * 
+ * return 1 if request comes from a prefetch, see prefetch.h.
+ */
+int is_prefetch(char *request) {
+    char value[MAXLINE];
+    
+    return header_value(request, strlen(request), "Purpose", value, 
+                        MAXLINE) && strcmp(value, "prefetch") == 0;
+}
+
+/*
+ * mark_prefetched
+ * 
+ * mark the item just cached for cache_id as prefetched, the first hit on 
+ * it counts as a prefetch that was used.
+ */
+void mark_prefetched(char *cache_id) {
+    cache_item *item;
+    
+    if ((item = cache_pin(cache_id, pcache)) != NULL) {
+        atomic_store(&item->prefetched, 1);
+        cache_unpin(item);
+    }
+}
+
 /*
  * fetch_server
  * 
- * Fetch response from server and forward it to client. If the response is 
- * smaller than max object size, also cache it. return -1 if failed.
+ * Fetch response from server and forward it to client. While it streams
+ * through, also collect it into cache chunks. If the response is at most
+ * the max object size, cache it. Larger ones are kept on the disk tier, if
+ * there is one and they fit. A response with Vary is cached as the variant
+ * for the headers of request. The ticket of the fetch is timed to the end
+ * of the header block. The origin has the first byte timeout for the 
+ * header block, and both sockets the idle timeout for every read and
+ * write after it. With conf.client_buffer the body is buffered for the
+ * client, and the origin given back as soon as it sent all of it. return
+ * -1 if failed, or timed out, -2 if only the client side did.
  */
-int fetch_server(int server_fd, int client_fd, char *cache_id) {
-    char buf[MAXLINE], tmp[MAXLINE];
-    char cache[MAX_OBJECT_SIZE]; /* for storing content to cache */
-    char *runner;
-    runner = cache;
+int fetch_server(upstream *up, int client_fd, char *cache_id, 
+                 char *request) {
+    char buf[MAXLINE], tmp[MAXLINE], age[MAXLINE];
+    char names[MAXLINE];       /* header names in Vary, empty if none */
+    char variant_id[MAXLINE];  /* where the response is cached */
+    char raw[HEADER_MAX + 1];  /* header block as the origin sent it */
+    char hdr[HEADER_MAX];      /* and as rewritten */
+    struct iovec head[3];
+    int raw_len = 0, hdr_len, n;
+    long origin_age;
+    cache_fill fill;           /* for storing content to cache */
+    body_sink sink;            /* the same, when relayed by io_uring */
+    long cache_max;            /* largest response we could cache */
+    struct iovec *iov;
+    int server_fd = up->fd;
     rio_t server_rio;
+    long expires;              /* when an error response goes, 0 never */
+    prefetch_scan scan;        /* of the page for what it links to */
+    long sent;                 /* bytes sent to the client at once */
     int length = 0;            /* how much data read */
-    int size = 0;              /* keep track of the whole size */
     int cache_it = 1;          /* this response should be cached or not */
+    int oversize = 0;          /* the header block did not fit in raw */
+    int shared = 0;            /* it went to the shared cache */
+    int kept;                  /* it went to a cache in memory */
+    int count;
+    
+    /* with a disk tier, responses too large for memory are kept too */
+    cache_max = conf.max_object;
+    if (disk_enabled() && conf.disk_max_object > cache_max) {
+        cache_max = conf.disk_max_object;
+    }
+    fill_init(&fill, cache_max);
+    page_scan = NULL;
+    /* what a peer owns is cached there, not here as well */
+    if (up->peer) {
+        fill_abort(&fill);
+        cache_it = 0;
+    }
     
+    io_timer_arm(&origin_timer, server_fd, conf.first_byte_timeout, 0,
+                 STAT_TIMEOUT_FIRST_BYTE);
+    /* a slow origin may be asked again, the answer that starts first wins */
+    hedge_race(up, request);
+    server_fd = up->fd;
     Rio_readinitb(&server_rio, server_fd);
     /* To get the response size as early as possible to avoid useless memory
      * copy ops, we read the headers separately and try to get the size
 	 */
     while ((length = Rio_readlineb(&server_rio, buf, MAXLINE)) > 0) {
-        if (rio_writen(client_fd, buf, length) == -1) {
-            return -1;
+        if (raw_len + length > HEADER_MAX) {
+            oversize = 1;
+            break;
         }
-        size += length;
-        memcpy(runner, buf, length);    
-        runner += length;
+        memcpy(raw + raw_len, buf, length);
+        raw_len += length;
         /* get the size from the length header */
         if (strstr(buf, "Content-Length:") != NULL) {
             sscanf(buf, "Content-Length: %s",tmp);
             /* if already know it is too big, do not cache it */
-            if (atoi(tmp) > MAX_OBJECT_SIZE) {
+            if (cache_it == 1 && atol(tmp) > cache_max) {
+                fill_abort(&fill);
                 cache_it = 0;
             }
         }
@@ -337,52 +1154,1967 @@ int fetch_server(int server_fd, int client_fd, char *cache_id) {
             break;
         }
     }
+    raw[raw_len] = '\0';
+    if (io_timer_fired(&origin_timer)) {
+        trace_outcome("timeout");
+        fill_abort(&fill);
+        return -1;
+    }
+    admit_first_byte(up->ticket);
+    hedge_observe(up->hedge, elapsed_us(&up->since));
+    trace_mark(TRACE_HEADER);
+    io_timer_cancel(&origin_timer);
+    io_timer_arm(&origin_timer, server_fd, conf.idle_timeout, 1,
+                 STAT_TIMEOUT_IDLE);
+    io_timer_arm(&client_timer, client_fd, conf.idle_timeout, 1,
+                 STAT_TIMEOUT_IDLE);
+    
+    /* a stale item the origin says has not changed is sent, one that has
+     * is dropped for the response that comes */
+    if (up->rv->id[0] != '\0') {
+        if (response_status(raw) == 304) {
+            fill_abort(&fill);
+            return revalidated(up->rv->id, client_fd, 
+                               header_value(raw, raw_len, "Age", tmp, 
+                                            MAXLINE) ? atol(tmp) : 0) == -1 ?
+                   -2 : 2;
+        }
+        stat_add(STAT_REVALIDATE_CHANGED, 1);
+        cache_purge(up->rv->id, 0, pcache);
+    }
     
-    /* read the response body */
-    while ((length = Rio_readnb(&server_rio, buf, MAXLINE)) > 0) {
-        if (rio_writen(client_fd, buf, length) == -1) {
-            return -1;
+    /* rewrite the header block once, the client and the cache get the 
+     * same one, the client with the Age of the origin if there was one.
+     * One too large for that goes as the origin sent it, uncached */
+    if (oversize || (hdr_len = rewrite_header(raw, hdr, &origin_age)) == -1) {
+        fill_abort(&fill);
+        trace_status(raw);
+        return relay_raw(client_fd, &server_rio, raw, raw_len, buf, 
+                         oversize ? length : 0);
+    }
+    /* a part of the response is no response for the cache id */
+    if (response_status(raw) == 206) {
+        fill_abort(&fill);
+        cache_it = 0;
+    }
+    /* errors are only kept for a while, some not at all */
+    if (cache_it == 1 && 
+        (expires = negative_expiry(response_status(raw))) != 0) {
+        if (expires == -1) {
+            stat_add(STAT_NEG_REFUSED, 1);
+            fill_abort(&fill);
+            cache_it = 0;
+        } else {
+            fill.meta.expires = expires;
         }
-        size += length;
-        /* if whole size exceeds the limit, also do not cache it*/
-        if (size >= MAX_OBJECT_SIZE) {
+    }
+    /* a response that varies is kept as the variant for this request */
+    names[0] = '\0';
+    strcpy(variant_id, cache_id);
+    if (cache_it == 1 && header_value(raw, raw_len, "Vary", tmp, MAXLINE) &&
+        (n = vary_names(tmp, names)) != 0) {
+        if (n == -1 || conf.vary_max == 0) {
+            stat_add(STAT_VARY_REFUSED, 1);
+            fill_abort(&fill);
             cache_it = 0;
+        } else {
+            variant_key(names, request, cache_id, variant_id, 
+                        &fill.meta.vary_hash);
+        }
+    }
+    /* a page is scanned for what it links to as it streams through, 
+     * unless it was prefetched itself */
+    if (response_status(raw) == 200 && 
+        header_value(raw, raw_len, "Content-Type", tmp, MAXLINE) &&
+        strncasecmp(tmp, "text/html", 9) == 0 && !is_prefetch(request) &&
+        prefetch_start(&scan, cache_id, 
+                       header_value(raw, raw_len, "Content-Encoding", tmp, 
+                                    MAXLINE) ? tmp : NULL)) {
+        page_scan = &scan;
+    }
+    n = header_iovec(head, hdr, hdr_len, hdr_len, origin_age, age);
+    trace_status(hdr);
+    /* the record keeps the length of the object, not of a part of it */
+    if (header_value(raw, raw_len, "Content-Range", tmp, MAXLINE) &&
+        strchr(tmp, '/') != NULL && strchr(tmp, '/')[1] != '*') {
+        trace_object(atol(strchr(tmp, '/') + 1));
+    } else if (header_value(raw, raw_len, "Content-Length", tmp, MAXLINE)) {
+        trace_object(atol(tmp));
+    } else if (response_status(raw) == 304) {
+        trace_object(0);
+    }
+    if ((sent = rio_writev(client_fd, head, n)) == -1) {
+        fill_abort(&fill);
+        return -2;
+    }
+    trace_sent(sent);
+    if (cache_it == 1 && 
+        fill_header(&fill, hdr, hdr_len, 
+                    time(NULL) - (origin_age > 0 ? origin_age : 0)) == -1) {
+        cache_it = 0;
+    }
+    
+    /* with io_uring, what rio read ahead with the headers goes first, 
+     * the rest of the body is relayed in batches */
+    if (uring_enabled()) {
+        sink.fill = &fill;
+        sink.cache_it = cache_it;
+        if (server_rio.rio_cnt > 0) {
+            if (rio_writen(client_fd, server_rio.rio_bufptr, 
+                           server_rio.rio_cnt) == -1) {
+                fill_abort(&fill);
+                return -2;
+            }
+            trace_sent(server_rio.rio_cnt);
+            collect_body(&sink, server_rio.rio_bufptr, server_rio.rio_cnt);
+        }
+        if ((sent = uring_relay(server_fd, client_fd, collect_body, 
+                                &sink)) < 0) {
+            fill_abort(&fill);
+            return sent;
+        }
+        trace_sent(sent);
+        cache_it = sink.cache_it;
+    }
+    
+    /* read the response body, at the pace of the origin if buffered */
+    if (!uring_enabled() && conf.client_buffer > 0 &&
+        (n = relay_buffered(up, &server_rio, client_fd, &fill, 
+                            &cache_it)) < 0) {
+        fill_abort(&fill);
+        return n;
+    }
+    while (!uring_enabled() && conf.client_buffer == 0 &&
+           (length = Rio_readnb(&server_rio, buf, MAXLINE)) > 0) {
+        if (rio_writen(client_fd, buf, length) == -1) {
+            fill_abort(&fill);
+            return -2;
         }
-        /* do it while we still think the response should be cached */
-        if (cache_it == 1) {
-            memcpy(runner, buf, length);    
-            runner += length;
+        trace_sent(length);
+        io_timer_touch(&origin_timer);
+        io_timer_touch(&client_timer);
+        scan_page(buf, length);
+        /* if whole size exceeds the limit, do not cache it*/
+        if (cache_it == 1 && fill_append(&fill, buf, length) == -1) {
+            cache_it = 0;
         }
     }
     
+    /* a body cut short by the timeout is not cached */
+    if (io_timer_fired(&origin_timer) || io_timer_fired(&client_timer)) {
+        trace_outcome("timeout");
+        fill_abort(&fill);
+        return io_timer_fired(&origin_timer) ? -1 : -2;
+    }
+    
     /* if the response is at last should be cached, insert it! */
+    trace_mark(TRACE_BODY);
     if (cache_it == 1) {
-        insert_item(cache_id, cache, pcache, size);
+        trace_object(fill.size - hdr_len);
+        vary_store(cache_id, names, variant_id, fill.meta.vary_hash);
+        if (fill.size <= conf.max_object) {
+            /* the workers share it, none keeps a copy of its own */
+            if (shm_enabled() && 
+                (iov = chunk_iovec(fill.head, &count)) != NULL) {
+                shared = shm_insert(variant_id, iov, count, fill.size, 
+                                    &fill.meta) == 1;
+                Free(iov);
+            }
+            if (!shared && conf.compress) {
+                compress_body(&fill, raw);
+            }
+            kept = shared;
+            if (shared) {
+                fill_abort(&fill);
+            } else if (fill_commit(&fill, variant_id, pcache) == 1) {
+                kept = 1;
+                if (is_prefetch(request)) {
+                    mark_prefetched(variant_id);
+                }
+            }
+            if (kept && fill.meta.expires != 0) {
+                stat_add(STAT_NEG_STORED, 1);
+            }
+            trace_mark(TRACE_STORE);
+            return 1;
+        }
+        /* errors are not kept on disk, they would not live long there */
+        if (fill.meta.expires == 0 &&
+            (iov = chunk_iovec(fill.head, &count)) != NULL) {
+            disk_insert(variant_id, iov, count, fill.size, &fill.meta);
+            Free(iov);
+            trace_mark(TRACE_STORE);
+        }
+        fill_abort(&fill);
     }
     return 1;
 
 }
 
 /*
- * fetch_cache  
+ * relay_raw
  * 
- * Look for item in the cache and if found and successfully fetch data from
- * the cache, return 1.
+ * send the raw_len bytes of header lines read so far, and line_len more 
+ * of a line that did not fit with them, then stream the rest of the 
+ * response as it comes. return -1 if failed, -2 if only the client side
+ * did.
  */
-
-int fetch_cache(char *cache_id, int client_fd) {
-    char content[MAX_OBJECT_SIZE];
-    int size;
-    /* look for cache and write the cached response into content if found*/
-    if ((size = read_from_cache(cache_id, content, pcache)) == -1) {
-        return -1;
-    }
+int relay_raw(int client_fd, rio_t *rp, char *raw, int raw_len, char *line,
+              int line_len) {
+    char buf[MAXLINE];
+    int n;
     
-    /* write the content back to client */
-    if (rio_writen(client_fd, content, size) == -1) {
+    if (rio_writen(client_fd, raw, raw_len) == -1 ||
+        rio_writen(client_fd, line, line_len) == -1) {
+        return -2;
+    }
+    trace_sent(raw_len + line_len);
+    while ((n = rio_readnb(rp, buf, MAXLINE)) > 0) {
+        if (rio_writen(client_fd, buf, n) == -1) {
+            return -2;
+        }
+        trace_sent(n);
+        io_timer_touch(&origin_timer);
+        io_timer_touch(&client_timer);
+    }
+    if (n < 0 || io_timer_fired(&origin_timer)) {
         return -1;
     }
+    if (io_timer_fired(&client_timer)) {
+        return -2;
+    }
     return 1;
 }
-    
-    
\ No newline at end of file
+
+/*
+ * upstream_release
+ * 
+ * the fetch is done with its origin: close the connection, let the next
+ * fetch in and count how long the connection was held. Nothing happens if
+ * it was given back already.
+ */
+void upstream_release(upstream *up, int ok) {
+    if (up->fd < 0) {
+        return;
+    }
+    /* the timer must not shut down whatever gets the descriptor next */
+    io_timer_cancel(&origin_timer);
+    Close(up->fd);
+    up->fd = -1;
+    admit_release(up->ticket, ok);
+    stat_add(STAT_ORIGIN_HOLDS, 1);
+    stat_add(STAT_ORIGIN_HOLD_US, elapsed_us(&up->since));
+}
+
+/*
+ * hedge_race
+ * 
+ * with hedging on, wait for the origin to start answering up to its usual
+ * time, then, if the budget allows, send the request again on a second
+ * connection and keep whichever answer starts first in up. The loser is
+ * closed, the first byte timeout moves to the winner and still runs from
+ * the first request. A hedge that fails leaves the first one alone. The
+ * hedge counts against the admission limits while it is open, and is not
+ * sent when the origin is at its limit.
+ */
+void hedge_race(upstream *up, char *request) {
+    struct pollfd pfd[2];
+    long delay, left;
+    int fd, sent = 0;
+    char c;
+    
+    if ((delay = hedge_delay(up->hedge)) < 0) {
+        return;
+    }
+    pfd[0].fd = up->fd;
+    pfd[0].events = POLLIN;
+    if (poll(pfd, 1, delay) != 0) {
+        return;
+    }
+    if (admit_extra(up->ticket) == -1) {
+        stat_add(STAT_HEDGE_LIMITED, 1);
+        return;
+    }
+    if (!hedge_allow() || (fd = hedge_connect(up)) < 0) {
+        admit_extra_release(up->ticket);
+        return;
+    }
+    stat_add(STAT_HEDGES, 1);
+    pfd[1].fd = fd;
+    while (1) {
+        pfd[1].events = sent ? POLLIN : POLLOUT;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        /* the first request answered first, or its timeout fired */
+        if (pfd[0].revents || (pfd[1].revents & (POLLERR | POLLHUP))) {
+            break;
+        }
+        if (!sent) {
+            if (write(fd, request, strlen(request)) != strlen(request)) {
+                break;
+            }
+            sent = 1;
+            continue;
+        }
+        /* an origin that closes at once gives no answer to wait for */
+        if (recv(fd, &c, 1, MSG_PEEK) <= 0) {
+            break;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        if (conf.first_byte_timeout > 0) {
+            left = conf.first_byte_timeout - elapsed_us(&up->since) / 1000;
+            io_timer_arm(&origin_timer, fd, left > 0 ? left : 1, 0, 
+                         STAT_TIMEOUT_FIRST_BYTE);
+        }
+        Close(up->fd);
+        up->fd = fd;
+        admit_extra_release(up->ticket);
+        stat_add(STAT_HEDGE_WINS, 1);
+        return;
+    }
+    Close(fd);
+    admit_extra_release(up->ticket);
+}
+
+/*
+ * hedge_connect
+ * 
+ * start connecting a second socket to the origin of up, on the spare 
+ * address the first connect picked, so the origin is not looked up again
+ * mid-race. return the socket, not blocking, -1 if failed.
+ */
+int hedge_connect(upstream *up) {
+    int fd;
+    
+    if (up->spare.sin_family != AF_INET ||
+        (fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (SA *)&up->spare, sizeof(up->spare)) < 0 && 
+        errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * elapsed_us
+ * 
+ * us of the monotonic clock since since.
+ */
+long elapsed_us(struct timespec *since) {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L + 
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * relay_buffered
+ * 
+ * relay the body of a response without making the origin wait for the
+ * client. The origin is read as fast as it sends, into a buffer of 
+ * conf.client_buffer bytes and beyond that into a spill file of up to 
+ * conf.client_spill bytes, while the client is written what it takes.
+ * The origin is given back as soon as it sent the whole body, the client
+ * is served from the buffer after that. Only with both full does the 
+ * origin wait. rp has what was read ahead with the header block. return
+ * -1 if failed, -2 if only writing the client did.
+ */
+int relay_buffered(upstream *up, rio_t *rp, int client_fd, 
+                   cache_fill *fill, int *cache_it) {
+    char buf[MAXLINE];
+    struct pollfd pfd[2];
+    relay_buf rb;
+    int flags, rc = 1;
+    
+    if ((rb.mem = (char *)Malloc(conf.client_buffer)) == NULL) {
+        return -1;
+    }
+    rb.spill_fd = -1;
+    rb.spill_start = rb.spill_end = 0;
+    rb.spill_ok = conf.client_spill > 0;
+    /* the buffer holds at least what rio read ahead */
+    memcpy(rb.mem, rp->rio_bufptr, rp->rio_cnt);
+    rb.start = 0;
+    rb.end = rp->rio_cnt;
+    scan_page(rp->rio_bufptr, rp->rio_cnt);
+    if (*cache_it == 1 && 
+        fill_append(fill, rp->rio_bufptr, rp->rio_cnt) == -1) {
+        *cache_it = 0;
+    }
+    stat_add(STAT_RELAY_BUFFERED, 1);
+    
+    flags = fcntl(client_fd, F_GETFL);
+    fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
+    while (rc == 1 && (up->fd >= 0 || rb.start < rb.end || 
+                       rb.spill_start < rb.spill_end)) {
+        /* a negative descriptor is left out of the poll */
+        pfd[0].fd = up->fd >= 0 && relay_room(&rb) > 0 ? up->fd : -1;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = rb.start < rb.end || rb.spill_start < rb.spill_end ? 
+                    client_fd : -1;
+        pfd[1].events = POLLOUT;
+        if (poll(pfd, 2, -1) < 0) {
+            rc = errno == EINTR ? 1 : -1;
+            continue;
+        }
+        if (pfd[0].revents) {
+            rc = relay_take(up, &rb, buf, fill, cache_it);
+        }
+        if (rc == 1 && pfd[1].revents) {
+            rc = relay_give(&rb, client_fd);
+        }
+    }
+    fcntl(client_fd, F_SETFL, flags);
+    if (rb.spill_fd >= 0) {
+        stat_add(STAT_RELAY_SPILLED, 1);
+        Close(rb.spill_fd);
+    }
+    Free(rb.mem);
+    return rc;
+}
+
+/*
+ * relay_room
+ * 
+ * the bytes the origin may be read into now. The buffer is used while 
+ * nothing waits in the spill file, moving what is left to its start when
+ * it is full, the spill file after that.
+ */
+long relay_room(relay_buf *rb) {
+    if (rb->spill_start == rb->spill_end) {
+        if (rb->end == conf.client_buffer && rb->start > 0) {
+            memmove(rb->mem, rb->mem + rb->start, rb->end - rb->start);
+            rb->end -= rb->start;
+            rb->start = 0;
+        }
+        if (rb->end < conf.client_buffer) {
+            return conf.client_buffer - rb->end;
+        }
+    }
+    return rb->spill_ok ? conf.client_spill - rb->spill_end : 0;
+}
+
+/*
+ * relay_take
+ * 
+ * read what the origin sent into the buffer, or the spill file, and for
+ * the cache. At the end of the body the origin is given back. return -1
+ * if failed.
+ */
+int relay_take(upstream *up, relay_buf *rb, char *buf, cache_fill *fill,
+               int *cache_it) {
+    long room = relay_room(rb);
+    char *data;
+    ssize_t n;
+    
+    if (rb->spill_start == rb->spill_end && rb->end < conf.client_buffer) {
+        data = rb->mem + rb->end;
+        if ((n = read(up->fd, data, room)) > 0) {
+            rb->end += n;
+        }
+    } else {
+        if (rb->spill_fd < 0 && (rb->spill_fd = spill_open()) < 0) {
+            rb->spill_ok = 0;
+            return 1;
+        }
+        data = buf;
+        if ((n = read(up->fd, buf, room < MAXLINE ? room : MAXLINE)) > 0) {
+            if (pwrite(rb->spill_fd, buf, n, rb->spill_end) != n) {
+                return -1;
+            }
+            rb->spill_end += n;
+            stat_add(STAT_RELAY_SPILL_BYTES, n);
+        }
+    }
+    if (n < 0) {
+        return errno == EINTR ? 1 : -1;
+    }
+    if (n == 0) {
+        upstream_release(up, !io_timer_fired(&origin_timer));
+        return 1;
+    }
+    io_timer_touch(&origin_timer);
+    scan_page(data, n);
+    if (*cache_it == 1 && fill_append(fill, data, n) == -1) {
+        *cache_it = 0;
+    }
+    return 1;
+}
+
+/*
+ * relay_give
+ * 
+ * write the client what it takes, first from the buffer, then from the 
+ * spill file, which starts over once it is sent. return -2 if failed.
+ */
+int relay_give(relay_buf *rb, int client_fd) {
+    off_t offset;
+    ssize_t n;
+    
+    if (rb->start < rb->end) {
+        if ((n = write(client_fd, rb->mem + rb->start, 
+                       rb->end - rb->start)) > 0) {
+            rb->start += n;
+        }
+    } else {
+        offset = rb->spill_start;
+        if ((n = sendfile(client_fd, rb->spill_fd, &offset,
+                          rb->spill_end - rb->spill_start)) > 0) {
+            rb->spill_start += n;
+        }
+        /* sendfile leaves the pages in the socket, not a copy of them, so
+         * the file is cut rather than written over, new pages come then */
+        if (rb->spill_start == rb->spill_end && 
+            ftruncate(rb->spill_fd, 0) == 0) {
+            rb->spill_start = rb->spill_end = 0;
+        }
+    }
+    if (n < 0) {
+        return errno == EAGAIN || errno == EINTR ? 1 : -2;
+    }
+    trace_sent(n);
+    io_timer_touch(&client_timer);
+    return 1;
+}
+
+/*
+ * spill_open
+ * 
+ * a file without a name for bodies that do not fit in their buffer, in
+ * $TMPDIR or /tmp. return its descriptor, -1 if failed.
+ */
+int spill_open() {
+    char path[MAXLINE], *dir;
+    int fd;
+    
+    if ((dir = getenv("TMPDIR")) == NULL) {
+        dir = "/tmp";
+    }
+    snprintf(path, MAXLINE, "%s/proxylab.XXXXXX", dir);
+    if ((fd = mkstemp(path)) < 0) {
+        log_error("Error creating a spill file in %s\n", dir);
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+/*
+ * vary_names
+ * 
+ * turn the value of a Vary header into a list of the header names in it,
+ * in lower case and between commas, like hop_headers. return the number 
+ * of names, -1 if one is "*", which no request can be matched against, or
+ * the list does not fit.
+ */
+int vary_names(char *value, char *names) {
+    int len = 1, count = 0;
+    char *p = value;
+    
+    names[0] = ',';
+    while (1) {
+        p += strspn(p, " \t,");
+        if (*p == '\0') {
+            break;
+        }
+        if (*p == '*') {
+            return -1;
+        }
+        for (; *p != '\0' && strchr(" \t,", *p) == NULL; p++) {
+            if (len >= MAXLINE - 2) {
+                return -1;
+            }
+            names[len++] = tolower(*p);
+        }
+        names[len++] = ',';
+        count++;
+    }
+    names[count > 0 ? len : 0] = '\0';
+    return count;
+}
+
+/*
+ * variant_key
+ * 
+ * hash the values the request has for the header names of a Vary list, 
+ * and make the id of the slot of that variant: the cache id with the slot
+ * number, one of conf.vary_max. A header that is missing hashes apart
+ * from an empty one. The hash is never 0, which is for no variant.
+ */
+void variant_key(char *names, char *request, char *cache_id, 
+                 char *variant_id, unsigned long *hash) {
+    char name[MAXLINE], value[MAXLINE];
+    unsigned long h = 14695981039346656037UL;   /* FNV-1a */
+    int len = strlen(request), n;
+    char *p, *comma;
+    
+    for (p = names + 1; (comma = strchr(p, ',')) != NULL; p = comma + 1) {
+        n = comma - p;
+        memcpy(name, p, n);
+        name[n] = '\0';
+        if (header_value(request, len, name, value, MAXLINE) == 0) {
+            h = (h ^ 0xff) * 1099511628211UL;
+            continue;
+        }
+        for (n = 0; value[n] != '\0'; n++) {
+            h = (h ^ (unsigned char)value[n]) * 1099511628211UL;
+        }
+        h = (h ^ '\n') * 1099511628211UL;
+    }
+    *hash = h != 0 ? h : 1;
+    snprintf(variant_id, MAXLINE, "%.*s vary=%lu", 
+             (int)strcspn(cache_id, "\r\n"), cache_id, 
+             *hash % conf.vary_max);
+}
+
+/*
+ * pick_variant
+ * 
+ * the item of a cache id is the Vary list of its variants: find the one 
+ * for the headers of request, with two lookups whatever the number of 
+ * variants. The front cache pin on marker is dropped. Its slot id and 
+ * hash are put in variant_id and hash, for the disk tier to look there. 
+ * return the variant pinned, NULL if it is not in memory.
+ */
+cache_item *pick_variant(cache_item *marker, char *cache_id, char *request,
+                         char *variant_id, unsigned long *hash) {
+    cache_chunk *chunk = marker->chunks;
+    cache_item *item;
+    
+    /* a list that is not what vary_store put there matches nothing */
+    if (chunk != NULL && chunk->next == NULL && chunk->len > 0 && 
+        chunk->len < MAXLINE && chunk->data[chunk->len - 1] == '\0') {
+        variant_key(chunk->data, request, cache_id, variant_id, hash);
+    } else {
+        variant_key(",", request, cache_id, variant_id, hash);
+    }
+    l1_put(marker);
+    
+    if ((item = l1_get(variant_id, pcache)) != NULL && 
+        item->meta.vary_hash != *hash) {
+        l1_put(item);
+        item = NULL;
+    }
+    stat_add(item != NULL ? STAT_VARY_HITS : STAT_VARY_MISSES, 1);
+    return item;
+}
+
+/*
+ * vary_store
+ * 
+ * make room for a response about to be cached under variant_id. If it has
+ * Vary, the cache id gets the list of names, and the variant that had its
+ * slot, in memory or on disk, goes. If it has none, a list the cache id 
+ * had is dropped, the origin does not vary it anymore.
+ */
+void vary_store(char *cache_id, char *names, char *variant_id, 
+                unsigned long hash) {
+    int len = strlen(names) + 1, same = 0;
+    cache_item *item;
+    cache_fill fill;
+    struct iovec iov;
+    
+    if ((item = cache_pin(cache_id, pcache)) != NULL) {
+        same = item->meta.vary && item->chunks != NULL && 
+               item->chunks->len == len && 
+               memcmp(item->chunks->data, names, len) == 0;
+        if (!same && (item->meta.vary || names[0] != '\0')) {
+            cache_remove(item, pcache);
+        }
+        cache_unpin(item);
+    }
+    if (names[0] == '\0') {
+        return;
+    }
+    if (!same) {
+        fill_init(&fill, len);
+        if (fill_append(&fill, names, len) == 1) {
+            fill.meta.vary = 1;
+            iov.iov_base = names;
+            iov.iov_len = len;
+            if (shm_insert(cache_id, &iov, 1, len, &fill.meta) == 1) {
+                fill_abort(&fill);
+            } else {
+                fill_commit(&fill, cache_id, pcache);
+            }
+        }
+    }
+    
+    if ((item = cache_pin(variant_id, pcache)) != NULL) {
+        if (item->meta.vary_hash != hash) {
+            stat_add(STAT_VARY_REPLACED, 1);
+        }
+        cache_remove(item, pcache);
+        cache_unpin(item);
+    }
+    disk_remove(variant_id);
+    shm_remove(variant_id);
+}
+
+/*
+ * header_name
+ * 
+ * copy the field name of a header line into name, in lower case and 
+ * between commas, so it can be looked up in a list like hop_headers. 
+ * return -1 if the line has no field name.
+ */
+int header_name(char *line, char *name) {
+    char *colon = strchr(line, ':');
+    char *eol = strchr(line, '\n');
+    int i, n;
+    
+    if (colon == NULL || (eol != NULL && colon > eol) || 
+        colon - line > MAXLINE - 3) {
+        return -1;
+    }
+    n = colon - line;
+    name[0] = ',';
+    for (i = 0; i < n; i++) {
+        name[i + 1] = tolower((unsigned char)line[i]);
+    }
+    name[n + 1] = ',';
+    name[n + 2] = '\0';
+    return n;
+}
+
+/*
+ * rewrite_header
+ * 
+ * rewrite the header block of a response, raw, ending with the empty 
+ * line, into hdr: drop the hop-by-hop headers, those named in Connection,
+ * and Age, which is put back in when sent, and add Via. Put the Age the 
+ * origin sent in age, -1 if none. Transfer-Encoding stays, the body is 
+ * passed on as it is. return the length of hdr, -1 if raw is not a whole
+ * block or the result does not fit in HEADER_MAX.
+ */
+int rewrite_header(char *raw, char *hdr, long *age) {
+    char hop[MAXLINE], name[MAXLINE], value[MAXLINE], via[MAXLINE];
+    char version[16] = "1.0";
+    char *line, *next, *token, *save;
+    int len = 0, n, drop = 0;
+    
+    *age = -1;
+    if (strncmp(raw, "HTTP/", 5) == 0) {
+        sscanf(raw + 5, "%15[0-9.]", version);
+    }
+    snprintf(via, MAXLINE, "Via: %s %s\r\n", version, VIA_NAME);
+    
+    /* the names listed in Connection are hop-by-hop too */
+    strcpy(hop, hop_headers);
+    for (line = raw; *line != '\0'; line = next) {
+        next = strchr(line, '\n');
+        next = next != NULL ? next + 1 : line + strlen(line);
+        if ((n = header_name(line, name)) == -1 || 
+            strcmp(name, ",connection,") != 0) {
+            continue;
+        }
+        snprintf(value, MAXLINE, "%.*s", (int)(next - line - n - 1), 
+                 line + n + 1);
+        for (token = strtok_r(value, ", \t\r\n", &save); token != NULL;
+             token = strtok_r(NULL, ", \t\r\n", &save)) {
+            if (strlen(hop) + strlen(token) + 2 < MAXLINE) {
+                for (n = 0; token[n] != '\0'; n++) {
+                    token[n] = tolower((unsigned char)token[n]);
+                }
+                strcat(hop, token);
+                strcat(hop, ",");
+            }
+        }
+    }
+    
+    /* copy what stays, the status line first */
+    for (line = raw; *line != '\0'; line = next) {
+        next = strchr(line, '\n');
+        next = next != NULL ? next + 1 : line + strlen(line);
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            break;
+        }
+        /* a folded line goes with the header before it */
+        if (line != raw && *line != ' ' && *line != '\t') {
+            drop = header_name(line, name) != -1 && 
+                   (strstr(hop, name) != NULL || 
+                    strcmp(name, ",age,") == 0);
+            if (drop && strcmp(name, ",age,") == 0) {
+                *age = atol(strchr(line, ':') + 1);
+                if (*age < 0) {
+                    *age = 0;
+                }
+            }
+        }
+        if (drop) {
+            continue;
+        }
+        n = next - line;
+        if (len + n + strlen(via) + 2 > HEADER_MAX) {
+            return -1;
+        }
+        memcpy(hdr + len, line, n);
+        len += n;
+    }
+    if (*line == '\0') {
+        return -1;
+    }
+    n = strlen(via);
+    memcpy(hdr + len, via, n);
+    memcpy(hdr + len + n, "\r\n", 2);
+    return len + n + 2;
+}
+
+/*
+ * compressible
+ * 
+ * look at the header block of a response, raw, to tell if its body is
+ * worth compressing. Not if it has a Content-Encoding, the origin did it 
+ * already and it is passed on as it is, and not for types that are
+ * compressed by their format. return 1 if it is worth it.
+ */
+int compressible(char *raw) {
+    char name[MAXLINE], type[MAXLINE];
+    char *line, *next;
+    int n;
+    
+    for (line = raw; *line != '\0'; line = next) {
+        next = strchr(line, '\n');
+        next = next != NULL ? next + 1 : line + strlen(line);
+        if ((n = header_name(line, name)) == -1) {
+            continue;
+        }
+        if (strcmp(name, ",content-encoding,") == 0) {
+            if (sscanf(line + n + 1, " %[^; \t\r\n]", type) == 1 &&
+                strcasecmp(type, "identity") != 0) {
+                return 0;
+            }
+        } else if (strcmp(name, ",content-type,") == 0) {
+            type[0] = ',';
+            if (sscanf(line + n + 1, " %[^; \t\r\n]", type + 1) != 1 ||
+                strlen(type) + 2 > MAXLINE) {
+                continue;
+            }
+            for (n = 0; type[n] != '\0'; n++) {
+                type[n] = tolower((unsigned char)type[n]);
+            }
+            strcat(type, ",");
+            if ((strncmp(type, ",image/", 7) == 0 && 
+                 strcmp(type, ",image/svg+xml,") != 0) ||
+                strncmp(type, ",audio/", 7) == 0 ||
+                strncmp(type, ",video/", 7) == 0 ||
+                strstr(packed_types, type) != NULL) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/*
+ * compress_body
+ * 
+ * store the body of a response compressed, if its type is worth it and it
+ * gets smaller. raw is the header block as the origin sent it.
+ */
+void compress_body(cache_fill *fill, char *raw) {
+    long size = fill->size;
+    
+    if (!compressible(raw)) {
+        stat_add(STAT_COMPRESS_SKIPPED, 1);
+        return;
+    }
+    if (fill_compress(fill) != 1) {
+        stat_add(STAT_COMPRESS_NO_GAIN, 1);
+        return;
+    }
+    stat_add(STAT_COMPRESSED, 1);
+    stat_add(STAT_COMPRESS_RAW, size);
+    stat_add(STAT_COMPRESS_STORED, fill->size);
+}
+
+/*
+ * response_age
+ * 
+ * seconds since the origin made a stored response.
+ */
+long response_age(cache_meta *meta) {
+    long age = time(NULL) - meta->date;
+    
+    return age < 0 ? 0 : age;
+}
+
+/*
+ * age_line
+ * 
+ * put in buf what ends a header block: an Age line of age seconds and the
+ * empty line, or only the empty line if age is -1.
+ */
+void age_line(char *buf, long age) {
+    if (age < 0) {
+        strcpy(buf, "\r\n");
+    } else {
+        sprintf(buf, "Age: %ld\r\n\r\n", age);
+    }
+}
+
+/*
+ * header_iovec
+ * 
+ * point iov at a piece of content of len bytes that starts with a whole 
+ * header block of header_len bytes, with the Age line, made in buf, put 
+ * in before the empty line. return the number of iovecs used, at most 3.
+ */
+int header_iovec(struct iovec *iov, char *data, int len, int header_len,
+                 long age, char *buf) {
+    int n = 0;
+    
+    iov[n].iov_base = data;
+    iov[n++].iov_len = header_len - 2;
+    age_line(buf, age);
+    iov[n].iov_base = buf;
+    iov[n++].iov_len = strlen(buf);
+    if (len > header_len) {
+        iov[n].iov_base = data + header_len;
+        iov[n++].iov_len = len - header_len;
+    }
+    return n;
+}
+
+/*
+ * fetch_cache  
+ * 
+ * Look for item in the front cache, the memory cache and the one shared 
+ * by the worker processes, and if found and successfully sent to the
+ * client, return 1. If the client asked for
+ * ranges, only those are sent when the item allows it. If the response
+ * varies, the variant for the headers of request is looked for. A soft
+ * purged item is not sent, but what revalidates it is put into rv. 
+ * return 0 if nothing was sent and the origin is to be asked, -1 if 
+ * sending failed, the client can not be answered any more then.
+ */
+
+int fetch_cache(char *cache_id, int client_fd, char *request, 
+                range_req *rr, revalidation *rv) {
+    char variant_id[MAXLINE];
+    unsigned long vary_hash = 0;
+    cache_item *item;
+    int rc = 0;
+    /* look for cache, the item stays pinned while we send it */
+    if ((item = l1_get(cache_id, pcache)) != NULL && item->meta.vary) {
+        item = pick_variant(item, cache_id, request, variant_id, &vary_hash);
+        cache_id = variant_id;
+    }
+    /* an error response past its time to live is fetched again */
+    if (item != NULL && item->meta.expires != 0) {
+        if (negative_expired(&item->meta)) {
+            stat_add(STAT_NEG_EXPIRED, 1);
+            cache_remove(item, pcache);
+            l1_put(item);
+            return 0;
+        }
+        stat_add(STAT_NEG_HITS, 1);
+    }
+    if (item != NULL && atomic_load(&item->stale)) {
+        revalidate_headers(item, cache_id, rv);
+        l1_put(item);
+        return 0;
+    }
+    if (item == NULL && 
+        (rc = fetch_shared(cache_id, client_fd, request, vary_hash, rr)) != 0) {
+        return rc;
+    }
+    if (item == NULL) {
+        return fetch_disk(cache_id, client_fd, vary_hash, rr);
+    }
+    
+    /* write the content back to client straight from the cache */
+    if (rr->range[0] != '\0') {
+        rc = send_stored_ranges(client_fd, item, NULL, rr);
+    }
+    if (rc == 0) {
+        rc = send_item(client_fd, item);
+    }
+    if (rc == 1 && atomic_exchange(&item->prefetched, 0)) {
+        stat_add(STAT_PREFETCH_USED, 1);
+    }
+    l1_put(item);
+    return rc;
+}
+
+/*
+ * revalidate_headers
+ * 
+ * put the conditional headers for a stale item into rv, from the ETag and
+ * Last-Modified of its response. One with neither can not be revalidated
+ * and is dropped.
+ */
+void revalidate_headers(cache_item *item, char *cache_id, revalidation *rv) {
+    char value[MAXLINE];
+    int len = 0;
+    
+    rv->headers[0] = '\0';
+    if (item->chunks != NULL && item->chunks->len >= item->meta.header_len) {
+        if (header_value(item->chunks->data, item->meta.header_len, "ETag",
+                         value, MAXLINE)) {
+            len += snprintf(rv->headers + len, MAXLINE - len, 
+                            "If-None-Match: %s\r\n", value);
+        }
+        if (len < MAXLINE && 
+            header_value(item->chunks->data, item->meta.header_len, 
+                         "Last-Modified", value, MAXLINE)) {
+            len += snprintf(rv->headers + len, MAXLINE - len, 
+                            "If-Modified-Since: %s\r\n", value);
+        }
+    }
+    if (len == 0 || len >= MAXLINE) {
+        cache_purge(cache_id, 0, pcache);
+        return;
+    }
+    strcpy(rv->id, cache_id);
+}
+
+/*
+ * revalidate_request
+ * 
+ * put the conditional headers of rv at the end of the request. A request
+ * with conditions or ranges of the client's own, or with no room left, 
+ * can not tell about the item, which is dropped then.
+ */
+void revalidate_request(char *request, revalidation *rv) {
+    char value[MAXLINE];
+    size_t len, add;
+    
+    if (rv->id[0] == '\0') {
+        return;
+    }
+    len = strlen(request);
+    add = strlen(rv->headers);
+    if (header_value(request, len, "If-None-Match", value, MAXLINE) ||
+        header_value(request, len, "If-Modified-Since", value, MAXLINE) ||
+        header_value(request, len, "Range", value, MAXLINE) || len < 2 || 
+        len + add >= MAXLINE) {
+        cache_purge(rv->id, 0, pcache);
+        rv->id[0] = '\0';
+        return;
+    }
+    memcpy(request + len - 2, rv->headers, add);
+    strcpy(request + len - 2 + add, "\r\n");
+}
+
+/*
+ * revalidated
+ * 
+ * the origin said a stale item has not changed: it is fresh again, as of
+ * age seconds ago, the Age of the 304, and sent to the client. The item is
+ * read without locks, so a fresh copy is published in its place, and put
+ * in the shared cache for the other workers if there is one. One that was
+ * evicted meanwhile is answered with a 503, the client may ask again.
+ * return 2 if sent, -1 if failed.
+ */
+int revalidated(char *cache_id, int client_fd, long age) {
+    unsigned long vary_hash = 0;
+    cache_item *item;
+    cache_fill fill;
+    struct iovec *iov;
+    range_req rr;
+    int rc = 0, count, shared = 0;
+    
+    if ((item = cache_pin(cache_id, pcache)) != NULL) {
+        if (refill(&fill, item) == 1) {
+            fill.meta.date = time(NULL) - (age > 0 ? age : 0);
+            vary_hash = fill.meta.vary_hash;
+            if (shm_enabled() && fill.meta.raw_size == 0 &&
+                (iov = chunk_iovec(fill.head, &count)) != NULL) {
+                shared = shm_insert(cache_id, iov, count, fill.size, 
+                                    &fill.meta) == 1;
+                Free(iov);
+            }
+            if (shared) {
+                fill_abort(&fill);
+                cache_remove(item, pcache);
+            } else {
+                fill_commit(&fill, cache_id, pcache);
+            }
+            stat_add(STAT_REVALIDATED, 1);
+        }
+        cache_unpin(item);
+    }
+    
+    if (shared) {
+        rr.range[0] = '\0';
+        rr.if_range[0] = '\0';
+        rc = fetch_shared(cache_id, client_fd, "", vary_hash, &rr);
+    } else if ((item = cache_pin(cache_id, pcache)) != NULL) {
+        rc = send_item(client_fd, item);
+        cache_unpin(item);
+    }
+    if (rc == 0) {
+        trace_status((char *)lost_response);
+        trace_sent(rio_writen(client_fd, (char *)lost_response, 
+                              strlen(lost_response)));
+    }
+    return rc == 1 ? 2 : -1;
+}
+
+/*
+ * refill
+ * 
+ * copy the content and meta of an item into fill, with its header block
+ * in a chunk of its own, to publish a changed copy in its place. return
+ * -1 if failed.
+ */
+int refill(cache_fill *fill, cache_item *item) {
+    cache_chunk *chunk = item->chunks;
+    int header_len = item->meta.header_len, skip = 0;
+    
+    fill_init(fill, item->size);
+    if (header_len > 0) {
+        if (chunk == NULL || chunk->len < header_len) {
+            fill_abort(fill);
+            return -1;
+        }
+        if (fill_header(fill, chunk->data, header_len, 
+                        item->meta.date) == -1) {
+            return -1;
+        }
+        skip = header_len;
+    }
+    for (; chunk != NULL; chunk = chunk->next) {
+        if (chunk->len > skip && 
+            fill_append(fill, chunk->data + skip, chunk->len - skip) == -1) {
+            return -1;
+        }
+        skip = 0;
+    }
+    fill->meta = item->meta;
+    return 1;
+}
+
+/*
+ * fetch_shared
+ * 
+ * Look for item in the cache shared by the worker processes, and send it
+ * to the client straight from the region, where it stays pinned until it
+ * is sent. Nothing is copied into the memory cache, so an object is kept
+ * once for all the workers. If it varies, the variant for the headers of
+ * request is looked for, a variant must be the one of vary_hash. return 1
+ * if found and sent, 0 if nothing was sent, -1 if sending failed after it
+ * started.
+ */
+int fetch_shared(char *cache_id, int client_fd, char *request,
+                 unsigned long vary_hash, range_req *rr) {
+    char variant_id[MAXLINE], age[MAXLINE];
+    struct iovec iov[3];
+    shm_ref ref;
+    stored obj;
+    ssize_t sent;
+    int rc = 0, n;
+    
+    if (!shm_enabled()) {
+        return 0;
+    }
+    if (shm_pin(cache_id, &ref) == -1) {
+        stat_add(STAT_SHM_MISSES, 1);
+        return 0;
+    }
+    /* the list is read where it is, before its pin is dropped */
+    if (ref.meta.vary && vary_hash == 0) {
+        if (ref.size > 0 && ref.size < MAXLINE && 
+            ref.data[ref.size - 1] == '\0') {
+            variant_key(ref.data, request, cache_id, variant_id, &vary_hash);
+        } else {
+            variant_key(",", request, cache_id, variant_id, &vary_hash);
+        }
+        shm_unpin(&ref);
+        cache_id = variant_id;
+        rc = shm_pin(cache_id, &ref);
+        stat_add(rc == 1 && ref.meta.vary_hash == vary_hash ? 
+                 STAT_VARY_HITS : STAT_VARY_MISSES, 1);
+        if (rc == -1) {
+            stat_add(STAT_SHM_MISSES, 1);
+            return 0;
+        }
+        rc = 0;
+    }
+    if (ref.meta.vary_hash != vary_hash) {
+        shm_unpin(&ref);
+        stat_add(STAT_SHM_MISSES, 1);
+        return 0;
+    }
+    stat_add(STAT_SHM_HITS, 1);
+    
+    /* an error response past its time to live is fetched again */
+    if (ref.meta.expires != 0) {
+        if (negative_expired(&ref.meta)) {
+            stat_add(STAT_NEG_EXPIRED, 1);
+            shm_unpin(&ref);
+            shm_remove(cache_id);
+            return 0;
+        }
+        stat_add(STAT_NEG_HITS, 1);
+    }
+    
+    if (rr->range[0] != '\0' && stored_shared(&obj, &ref) == 1) {
+        rc = send_ranges(client_fd, &obj, rr);
+    }
+    if (rc == 0 && ref.meta.header_len > 0 && 
+        ref.meta.header_len <= ref.size) {
+        trace_status(ref.data);
+        trace_object(ref.size - ref.meta.header_len);
+        n = header_iovec(iov, ref.data, ref.size, ref.meta.header_len,
+                         response_age(&ref.meta), age);
+        trace_sent(sent = rio_writev(client_fd, iov, n));
+        rc = sent == -1 ? -1 : 1;
+    }
+    shm_unpin(&ref);
+    return rc;
+}
+
+/*
+ * send_item
+ * 
+ * write a cached item to the client, SEND_IOV chunks per writev, with the
+ * Age line put into the stored header block. Large items are sent with 
+ * MSG_ZEROCOPY, straight from the cache pages, the socket is set up for
+ * it on the first of them. return 1 if sent, -1 if failed, 0 if nothing 
+ * was sent, as send_compressed.
+ */
+int send_item(int client_fd, cache_item *item) {
+    ssize_t (*send_fn)(int fd, struct iovec *iov, int iovcnt) = rio_writev;
+    struct iovec iov[SEND_IOV];
+    cache_chunk *chunk = item->chunks;
+    char age[MAXLINE];
+    ssize_t sent;
+    int n = 0;
+    
+    if (item->meta.raw_size > 0) {
+        return send_compressed(client_fd, item);
+    }
+    if (conf.zerocopy_min > 0 && item->size >= conf.zerocopy_min) {
+        if (client_zerocopy == 0) {
+            client_zerocopy = rio_zerocopy_enable(client_fd) == 0 ? 1 : -1;
+        }
+        if (client_zerocopy == 1) {
+            send_fn = rio_sendv_zerocopy;
+        }
+    }
+    trace_object(item->size - item->meta.header_len);
+    if (chunk != NULL && item->meta.header_len > 0 && 
+        chunk->len >= item->meta.header_len) {
+        trace_status(chunk->data);
+        n = header_iovec(iov, chunk->data, chunk->len, 
+                         item->meta.header_len, 
+                         response_age(&item->meta), age);
+        chunk = chunk->next;
+    }
+    while (1) {
+        for (; chunk != NULL && n < SEND_IOV; chunk = chunk->next) {
+            iov[n].iov_base = chunk->data;
+            iov[n].iov_len = chunk->len;
+            n++;
+        }
+        if ((sent = send_fn(client_fd, iov, n)) == -1) {
+            return -1;
+        }
+        trace_sent(sent);
+        if (chunk == NULL) {
+            return 1;
+        }
+        n = 0;
+    }
+}
+
+/*
+ * send_compressed
+ * 
+ * decompress a cached item into a buffer of its own and write it to the
+ * client with one writev, with the Age line put into the header block. 
+ * return -1 if failed, 0 if the item is corrupt, it is dropped and 
+ * nothing was sent.
+ */
+int send_compressed(int client_fd, cache_item *item) {
+    struct timespec start, end;
+    struct iovec iov[3];
+    char age[MAXLINE];
+    ssize_t sent;
+    char *buf;
+    int n, rc = 1;
+    
+    if ((buf = (char *)Malloc(item->meta.raw_size)) == NULL) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((n = cache_decompress(item, buf)) == -1) {
+        log_error("Corrupt compressed item %s\n", item->id);
+        cache_remove(item, pcache);
+        Free(buf);
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stat_add(STAT_DECOMPRESS_HITS, 1);
+    stat_add(STAT_DECOMPRESS_NS, (end.tv_sec - start.tv_sec) * 1000000000L +
+                                 (end.tv_nsec - start.tv_nsec));
+    
+    trace_status(buf);
+    trace_object(item->meta.raw_size - item->meta.header_len);
+    n = header_iovec(iov, buf, n, item->meta.header_len, 
+                     response_age(&item->meta), age);
+    if ((sent = rio_writev(client_fd, iov, n)) == -1) {
+        rc = -1;
+    }
+    trace_sent(sent);
+    Free(buf);
+    return rc;
+}
+
+/*
+ * send_disk
+ * 
+ * send a whole object from the disk tier without copying it, with the Age
+ * line put into its header block. return -1 if failed.
+ */
+int send_disk(disk_ref *ref, int client_fd) {
+    int header_len = ref->meta.header_len;
+    char age[MAXLINE], line[16];
+    
+    trace_object(ref->size - header_len);
+    if (header_len <= 0) {
+        if (disk_send(ref, client_fd, 0, ref->size) == -1) {
+            return -1;
+        }
+        trace_sent(ref->size);
+        return 1;
+    }
+    /* the status line is only read for the access log */
+    if (log_enabled() && 
+        disk_read(ref, line, 0, sizeof(line) - 1) == sizeof(line) - 1) {
+        line[sizeof(line) - 1] = '\0';
+        trace_status(line);
+    }
+    age_line(age, response_age(&ref->meta));
+    if (disk_send(ref, client_fd, 0, header_len - 2) == -1 ||
+        rio_writen(client_fd, age, strlen(age)) == -1 ||
+        disk_send(ref, client_fd, header_len, 
+                  ref->size - header_len) == -1) {
+        return -1;
+    }
+    trace_sent(ref->size - 2 + strlen(age));
+    return 1;
+}
+
+/*
+ * fetch_disk
+ * 
+ * Look for item on the disk tier. A hit small enough for memory is read,
+ * sent and promoted back to the memory cache piece by piece, a larger one
+ * is sent from the segment file directly, and so are ranges of either. A
+ * variant must be the one of vary_hash. return 1 if found and sent, 0 if
+ * nothing was sent, -1 if sending failed after it started.
+ */
+int fetch_disk(char *cache_id, int client_fd, unsigned long vary_hash,
+               range_req *rr) {
+    char buf[CACHE_CHUNK_SIZE], age[MAXLINE];
+    struct iovec head[3];
+    disk_ref ref;
+    cache_fill fill;
+    long offset;
+    ssize_t n, sent;
+    int rc = 1, count;
+    
+    if (disk_lookup(cache_id, &ref) == -1) {
+        return 0;
+    }
+    if (ref.meta.vary_hash != vary_hash) {
+        disk_release(&ref);
+        return 0;
+    }
+    if (rr->range[0] != '\0' && 
+        (rc = send_stored_ranges(client_fd, NULL, &ref, rr)) != 0) {
+        disk_release(&ref);
+        return rc;
+    }
+    rc = 1;
+    
+    if (ref.size > conf.max_object) {
+        rc = send_disk(&ref, client_fd);
+        disk_release(&ref);
+        return rc;
+    }
+    
+    /* the header block fits in the first piece, Age goes in there */
+    fill_init(&fill, ref.size);
+    fill.meta = ref.meta;
+    trace_object(ref.size - ref.meta.header_len);
+    for (offset = 0; offset < ref.size; offset += n) {
+        n = ref.size - offset < CACHE_CHUNK_SIZE ? ref.size - offset
+                                                 : CACHE_CHUNK_SIZE;
+        if ((n = disk_read(&ref, buf, offset, n)) <= 0) {
+            rc = offset == 0 ? 0 : -1;
+            break;
+        }
+        if (offset == 0 && ref.meta.header_len > 0 && 
+            n >= ref.meta.header_len) {
+            trace_status(buf);
+            count = header_iovec(head, buf, n, ref.meta.header_len,
+                                 response_age(&ref.meta), age);
+            trace_sent(sent = rio_writev(client_fd, head, count));
+        } else {
+            trace_sent(sent = rio_writen(client_fd, buf, n));
+        }
+        if (sent == -1) {
+            rc = -1;
+            break;
+        }
+        fill_append(&fill, buf, n);
+    }
+    disk_release(&ref);
+    
+    if (rc == 1 && fill.size == ref.size) {
+        fill_commit(&fill, cache_id, pcache);
+        stat_add(STAT_DISK_PROMOTED, 1);
+    } else {
+        fill_abort(&fill);
+    }
+    return rc;
+}
+
+/*
+ * demote
+ * 
+ * the memory cache evicted an item, keep it on the disk tier. The tier
+ * keeps it uncompressed, so it can be sent from there as it is. A Vary 
+ * list is no response and is not kept, its variants are. Neither are 
+ * errors, which expire soon.
+ */
+void demote(cache_item *item) {
+    struct iovec *iov, flat;
+    cache_meta meta;
+    char *buf;
+    int count;
+    
+    if (item->meta.vary || item->meta.expires != 0) {
+        return;
+    }
+    if (item->meta.raw_size > 0) {
+        if ((buf = (char *)Malloc(item->meta.raw_size)) == NULL) {
+            return;
+        }
+        if (cache_decompress(item, buf) != -1) {
+            flat.iov_base = buf;
+            flat.iov_len = item->meta.raw_size;
+            meta = item->meta;
+            meta.raw_size = 0;
+            disk_insert(item->id, &flat, 1, item->meta.raw_size, &meta);
+        }
+        Free(buf);
+        return;
+    }
+    if ((iov = chunk_iovec(item->chunks, &count)) != NULL) {
+        disk_insert(item->id, iov, count, item->size, &item->meta);
+        Free(iov);
+    }
+}
+
+/*
+ * stored_open
+ * 
+ * get ready to send parts of a cached response, an item in memory or an
+ * object on the disk tier, by finding its header block. A compressed item
+ * is decompressed. return -1 if it has no header block of its own.
+ */
+int stored_open(stored *obj, cache_item *item, disk_ref *ref) {
+    long size;
+    
+    obj->item = item;
+    obj->ref = ref;
+    obj->flat.next = NULL;
+    obj->flat.data = NULL;
+    obj->flat.len = 0;
+    obj->meta = item != NULL ? item->meta : ref->meta;
+    if (obj->meta.header_len <= 0 || obj->meta.header_len > HEADER_MAX) {
+        return -1;
+    }
+    
+    if (item == NULL) {
+        size = ref->size;
+        if (disk_read(ref, obj->buf, 0, obj->meta.header_len) != 
+            obj->meta.header_len) {
+            return -1;
+        }
+        obj->header = obj->buf;
+    } else if (item->meta.raw_size > 0) {
+        size = item->meta.raw_size;
+        if ((obj->flat.data = (char *)Malloc(size)) == NULL) {
+            return -1;
+        }
+        if (cache_decompress(item, obj->flat.data) == -1) {
+            stored_close(obj);
+            return -1;
+        }
+        obj->flat.len = size;
+        obj->header = obj->flat.data;
+    } else {
+        size = item->size;
+        if (item->chunks == NULL || 
+            item->chunks->len < obj->meta.header_len) {
+            return -1;
+        }
+        obj->header = item->chunks->data;
+    }
+    obj->length = size - obj->meta.header_len;
+    return 1;
+}
+
+/*
+ * stored_shared
+ * 
+ * get ready to send parts of an entry of the shared cache, read from the
+ * region while it is pinned. return -1 if it has no header block.
+ */
+int stored_shared(stored *obj, shm_ref *ref) {
+    obj->item = NULL;
+    obj->ref = NULL;
+    obj->flat.next = NULL;
+    obj->flat.data = ref->data;
+    obj->flat.len = ref->size;
+    obj->meta = ref->meta;
+    if (obj->meta.header_len <= 0 || obj->meta.header_len > HEADER_MAX ||
+        obj->meta.header_len > ref->size) {
+        return -1;
+    }
+    obj->header = ref->data;
+    obj->length = ref->size - obj->meta.header_len;
+    return 1;
+}
+
+/*
+ * stored_close
+ * 
+ * done sending parts of a cached response.
+ */
+void stored_close(stored *obj) {
+    if (obj->item != NULL && obj->flat.data != NULL) {
+        Free(obj->flat.data);
+        obj->flat.data = NULL;
+    }
+}
+
+/*
+ * send_body
+ * 
+ * send prefix_len bytes of prefix, then n bytes of the body of a cached 
+ * response from offset, with as few writes as the chunks allow. A body on
+ * the disk tier is sent without copying. return -1 if failed.
+ */
+int send_body(int client_fd, stored *obj, char *prefix, int prefix_len,
+              long offset, long n) {
+    struct iovec iov[SEND_IOV];
+    cache_chunk *chunk;
+    long skip = obj->meta.header_len + offset, len;
+    ssize_t sent;
+    int count = 0;
+    
+    if (offset < 0 || n < 0 || offset + n > obj->length) {
+        return -1;
+    }
+    if (obj->ref != NULL) {
+        if ((prefix_len > 0 && 
+             rio_writen(client_fd, prefix, prefix_len) == -1) ||
+            disk_send(obj->ref, client_fd, skip, n) == -1) {
+            return -1;
+        }
+        trace_sent(prefix_len + n);
+        return 1;
+    }
+    
+    if (prefix_len > 0) {
+        iov[count].iov_base = prefix;
+        iov[count++].iov_len = prefix_len;
+    }
+    chunk = obj->flat.data != NULL ? &obj->flat : obj->item->chunks;
+    for (; chunk != NULL && n > 0; chunk = chunk->next) {
+        if (skip >= chunk->len) {
+            skip -= chunk->len;
+            continue;
+        }
+        len = chunk->len - skip < n ? chunk->len - skip : n;
+        iov[count].iov_base = chunk->data + skip;
+        iov[count++].iov_len = len;
+        n -= len;
+        skip = 0;
+        if (count == SEND_IOV) {
+            if ((sent = rio_writev(client_fd, iov, count)) == -1) {
+                return -1;
+            }
+            trace_sent(sent);
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        if ((sent = rio_writev(client_fd, iov, count)) == -1) {
+            return -1;
+        }
+        trace_sent(sent);
+    }
+    return 1;
+}
+
+/*
+ * make_boundary
+ * 
+ * a boundary for a multipart response that will not be in the body, 
+ * from a random number per thread.
+ */
+void make_boundary(char *boundary) {
+    static __thread unsigned long seed = 0;
+    
+    if (seed == 0) {
+        seed = ((unsigned long)time(NULL) << 32) ^ 
+               (unsigned long)pthread_self() ^ 0x9e3779b97f4a7c15ul;
+    }
+    /* xorshift64 */
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    snprintf(boundary, BOUNDARY_MAX, "%s_%016lx", VIA_NAME, seed);
+}
+
+/*
+ * send_ranges
+ * 
+ * answer a Range request from a cached response: a 206 with one range or
+ * a multipart/byteranges with several, or a 416 if none is in the body.
+ * Only a whole 200 response is cut into ranges, and only if If-Range, if
+ * any, matches it. return 1 if sent, -1 if failed, 0 if the whole 
+ * response should be sent instead.
+ */
+int send_ranges(int client_fd, stored *obj, range_req *rr) {
+    byte_range ranges[RANGE_MAX];
+    char hdr[HEADER_MAX + MAXLINE], part[MAXLINE], type[MAXLINE];
+    char boundary[BOUNDARY_MAX] = "";
+    int count, n, i;
+    
+    if (response_status(obj->header) != 200 ||
+        (rr->if_range[0] != '\0' && 
+         !if_range_matches(rr->if_range, obj->header, 
+                           obj->meta.header_len)) ||
+        (count = parse_ranges(rr->range, obj->length, ranges, 
+                              RANGE_MAX)) == -1) {
+        return 0;
+    }
+    if (count > 1) {
+        make_boundary(boundary);
+    }
+    if ((n = range_header(hdr, sizeof(hdr), obj->header, 
+                          obj->meta.header_len, ranges, count, obj->length,
+                          boundary, response_age(&obj->meta))) == -1) {
+        return 0;
+    }
+    stat_add(STAT_RANGE_HITS, 1);
+    trace_status(hdr);
+    trace_object(obj->length);
+    
+    if (count <= 1) {
+        return send_body(client_fd, obj, hdr, n, count == 1 ? 
+                         ranges[0].first : 0, count == 1 ? 
+                         ranges[0].last - ranges[0].first + 1 : 0);
+    }
+    if (!header_value(obj->header, obj->meta.header_len, "Content-Type",
+                      type, MAXLINE)) {
+        type[0] = '\0';
+    }
+    if (rio_writen(client_fd, hdr, n) == -1) {
+        return -1;
+    }
+    trace_sent(n);
+    for (i = 0; i < count; i++) {
+        n = part_header(part, type, &ranges[i], obj->length, boundary);
+        if (send_body(client_fd, obj, part, n, ranges[i].first,
+                      ranges[i].last - ranges[i].first + 1) == -1) {
+            return -1;
+        }
+    }
+    n = sprintf(part, "\r\n--%s--\r\n", boundary);
+    if (rio_writen(client_fd, part, n) == -1) {
+        return -1;
+    }
+    trace_sent(n);
+    return 1;
+}
+
+/*
+ * send_stored_ranges
+ * 
+ * answer a Range request from an item in memory or an object on the disk
+ * tier. return as send_ranges.
+ */
+int send_stored_ranges(int client_fd, cache_item *item, disk_ref *ref,
+                       range_req *rr) {
+    stored obj;
+    int rc;
+    
+    if (stored_open(&obj, item, ref) == -1) {
+        return 0;
+    }
+    rc = send_ranges(client_fd, &obj, rr);
+    stored_close(&obj);
+    return rc;
+}
+
+/*
+ * fetch_blocks
+ * 
+ * answer a request for one range of an object that is not cached whole
+ * from aligned blocks of conf.range_block bytes. Each block is fetched 
+ * from the origin with a Range of its own and cached under an id of its
+ * own, so a large file that is only read in parts gets cached part by 
+ * part. return 1 if sent, -1 if failed after the response was started, 0
+ * if nothing was sent and the request should go to the origin as it is.
+ */
+int fetch_blocks(char *hostname, char *port, char *request, char *cache_id,
+                 int client_fd, range_req *rr) {
+    char hdr[HEADER_MAX + MAXLINE];
+    long block = conf.range_block, first, last = -1, total, start, from, to;
+    byte_range range;
+    cache_item *item;
+    char *p, *end;
+    stored obj;
+    int n, rc;
+    
+    /* one range with a start, If-Range is left to the origin */
+    p = rr->range;
+    if (rr->if_range[0] != '\0' || strncasecmp(p, "bytes=", 6) != 0 ||
+        (first = strtol(p + 6, &end, 10)) < 0 || end == p + 6 || 
+        *end != '-') {
+        return 0;
+    }
+    p = end + 1;
+    if (*p != '\0') {
+        if ((last = strtol(p, &end, 10)) < first || *end != '\0') {
+            return 0;
+        }
+    }
+    
+    start = first / block * block;
+    if ((item = get_block(hostname, port, request, cache_id, start)) == NULL) {
+        return 0;
+    }
+    if (stored_open(&obj, item, NULL) == -1) {
+        cache_unpin(item);
+        return 0;
+    }
+    if ((total = block_total(&obj, start)) <= first) {
+        stored_close(&obj);
+        cache_unpin(item);
+        return 0;
+    }
+    if (last == -1 || last >= total) {
+        last = total - 1;
+    }
+    range.first = first;
+    range.last = last;
+    if ((n = range_header(hdr, sizeof(hdr), obj.header, 
+                          obj.meta.header_len, &range, 1, total, "",
+                          response_age(&obj.meta))) == -1) {
+        stored_close(&obj);
+        cache_unpin(item);
+        return 0;
+    }
+    trace_status(hdr);
+    trace_object(total);
+    
+    /* the part of every block in the range, the header with the first */
+    while (1) {
+        from = first > start ? first - start : 0;
+        to = last < start + block - 1 ? last - start : block - 1;
+        rc = -1;
+        if (block_total(&obj, start) == total) {
+            rc = send_body(client_fd, &obj, hdr, n, from, to - from + 1);
+        }
+        n = 0;
+        stored_close(&obj);
+        cache_unpin(item);
+        if (rc == -1 || start + block > last) {
+            return rc;
+        }
+        start += block;
+        if ((item = get_block(hostname, port, request, cache_id, 
+                              start)) == NULL) {
+            return -1;
+        }
+        if (stored_open(&obj, item, NULL) == -1) {
+            cache_unpin(item);
+            return -1;
+        }
+    }
+}
+
+/*
+ * block_total
+ * 
+ * check that a cached block is the one starting at start and return the
+ * length of the whole object from its Content-Range, -1 if it is not.
+ */
+long block_total(stored *obj, long start) {
+    char value[MAXLINE];
+    long first, last, total;
+    
+    if (response_status(obj->header) != 206 ||
+        !header_value(obj->header, obj->meta.header_len, "Content-Range",
+                      value, MAXLINE) ||
+        sscanf(value, "bytes %ld-%ld/%ld", &first, &last, &total) != 3 ||
+        first != start || last - first + 1 != obj->length) {
+        return -1;
+    }
+    return total;
+}
+
+/*
+ * get_block
+ * 
+ * pin the block of an object that starts at start, from the memory cache,
+ * the disk tier or else the origin. return NULL if it can not be had.
+ */
+cache_item *get_block(char *hostname, char *port, char *request, 
+                      char *cache_id, long start) {
+    char block_id[MAXLINE], block_request[MAXLINE];
+    long end = start + conf.range_block - 1;
+    admit_ticket ticket;
+    cache_item *item;
+    disk_ref ref;
+    int server_fd, rc, len = strlen(request) - 2;
+    
+    snprintf(block_id, MAXLINE, "%.*s range=%ld-%ld", 
+             (int)strcspn(cache_id, "\r\n"), cache_id, start, end);
+    if ((item = cache_pin(block_id, pcache)) != NULL) {
+        stat_add(STAT_RANGE_BLOCK_HITS, 1);
+        return item;
+    }
+    
+    /* a block the memory cache evicted, back from disk */
+    if (disk_lookup(block_id, &ref) != -1) {
+        rc = promote(block_id, &ref);
+        disk_release(&ref);
+        if (rc == 1 && (item = cache_pin(block_id, pcache)) != NULL) {
+            stat_add(STAT_RANGE_BLOCK_HITS, 1);
+            return item;
+        }
+    }
+    
+    if (len < 0 || len + 64 >= MAXLINE) {
+        return NULL;
+    }
+    sprintf(block_request, "%.*sRange: bytes=%ld-%ld\r\n\r\n", len, 
+            request, start, end);
+    if (admit_acquire(&ticket, hostname, port) == -1) {
+        return NULL;
+    }
+    if ((server_fd = open_send_r(hostname, port, block_request, NULL)) < 0) {
+        if (server_fd == -3) {
+            admit_cancel(&ticket);
+        } else {
+            admit_release(&ticket, 0);
+        }
+        return NULL;
+    }
+    /* a block is timed whole, it is short */
+    rc = fetch_block(server_fd, block_id);
+    admit_first_byte(&ticket);
+    Close(server_fd);
+    admit_release(&ticket, rc != -1);
+    if (rc == -1) {
+        return NULL;
+    }
+    stat_add(STAT_RANGE_BLOCK_FETCHES, 1);
+    return cache_pin(block_id, pcache);
+}
+
+/*
+ * fetch_block
+ * 
+ * read the answer of the origin to the request for a block and cache it
+ * under block_id. Only a 206 that fits in memory is taken, with a header 
+ * block that fits in HEADER_MAX. return -1 if failed, for the first 
+ * block of a range the request then goes to the origin as it is, and
+ * fetch_server passes a header block too large on uncached.
+ */
+int fetch_block(int server_fd, char *block_id) {
+    char buf[MAXLINE], raw[HEADER_MAX + 1], hdr[HEADER_MAX];
+    int raw_len = 0, hdr_len, length;
+    cache_fill fill;
+    rio_t server_rio;
+    long origin_age;
+    
+    Rio_readinitb(&server_rio, server_fd);
+    while ((length = Rio_readlineb(&server_rio, buf, MAXLINE)) > 0) {
+        if (raw_len + length > HEADER_MAX) {
+            return -1;
+        }
+        memcpy(raw + raw_len, buf, length);
+        raw_len += length;
+        if (strcmp(buf, "\r\n") == 0) {
+            break;
+        }
+    }
+    raw[raw_len] = '\0';
+    /* a block is kept for every client, so it may not vary */
+    if (response_status(raw) != 206 || 
+        header_value(raw, raw_len, "Vary", buf, MAXLINE) ||
+        (hdr_len = rewrite_header(raw, hdr, &origin_age)) == -1) {
+        return -1;
+    }
+    
+    fill_init(&fill, conf.max_object);
+    if (fill_header(&fill, hdr, hdr_len, 
+                    time(NULL) - (origin_age > 0 ? origin_age : 0)) == -1) {
+        return -1;
+    }
+    while ((length = Rio_readnb(&server_rio, buf, MAXLINE)) > 0) {
+        if (fill_append(&fill, buf, length) == -1) {
+            return -1;
+        }
+    }
+    if (length < 0) {
+        fill_abort(&fill);
+        return -1;
+    }
+    if (conf.compress) {
+        compress_body(&fill, raw);
+    }
+    return fill_commit(&fill, block_id, pcache);
+}
+
+/*
+ * promote
+ * 
+ * copy an object of the disk tier back into the memory cache, with its 
+ * header block in a chunk of its own. return -1 if failed.
+ */
+int promote(char *cache_id, disk_ref *ref) {
+    char buf[CACHE_CHUNK_SIZE];
+    long offset = ref->meta.header_len, n;
+    cache_fill fill;
+    
+    fill_init(&fill, ref->size);
+    if (offset <= 0 || offset > CACHE_CHUNK_SIZE || 
+        disk_read(ref, buf, 0, offset) != offset ||
+        fill_header(&fill, buf, offset, ref->meta.date) == -1) {
+        fill_abort(&fill);
+        return -1;
+    }
+    for (; offset < ref->size; offset += n) {
+        n = ref->size - offset < CACHE_CHUNK_SIZE ? ref->size - offset
+                                                  : CACHE_CHUNK_SIZE;
+        if (disk_read(ref, buf, offset, n) != n ||
+            fill_append(&fill, buf, n) == -1) {
+            fill_abort(&fill);
+            return -1;
+        }
+    }
+    stat_add(STAT_DISK_PROMOTED, 1);
+    return fill_commit(&fill, cache_id, pcache);
+}
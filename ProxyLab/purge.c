@@ -0,0 +1,514 @@
+/*
+ * purge.c
+ *
+ * the index of purges and the purges. A node of the radix tree has the
+ * bytes of its edge, its children in order of their first byte, and the
+ * ids whose normalized URL ends at it, mostly one, a few with variants,
+ * HTTP versions or range blocks. Removing the last id of a node removes
+ * it, and a node left with one child and no ids is merged with it, so the
+ * tree stays as small as the set of URLs.
+ *
+ * The caches tell the index of every id they take and drop, with their
+ * own lock held, so the lock of the index is always taken last. A purge
+ * only holds it to copy a batch of ids and remembers the URL it got to,
+ * the next batch starts after it. Items are removed from the caches with
+ * the index unlocked, which calls back into the index.
+ */
+
+#include <ctype.h>
+#include "csapp.h"
+#include "cache.h"
+#include "disk_cache.h"
+#include "shm_cache.h"
+#include "purge.h"
+#include "stats.h"
+
+/* an id and the tiers it is in */
+typedef struct index_id {
+    char *id;
+    int tiers;                 /* PURGE_MEMORY, PURGE_DISK */
+    struct index_id *next;
+} index_id;
+
+/* a node of the tree, its URL is the labels from the root down */
+typedef struct radix_node {
+    char *label;               /* the bytes of the edge to it */
+    int len;                   /* how many */
+    struct radix_node *child;  /* first child */
+    struct radix_node *sibling; /* next child of the parent */
+    index_id *ids;             /* ids with this URL */
+} radix_node;
+
+/* the ids a purge takes from the index at once, the ids of a URL are
+ * never split over two, so there can be more than PURGE_BATCH */
+typedef struct purge_batch {
+    char **ids;
+    int n, size;
+    char after[MAXLINE];       /* the URL the last batch ended at */
+    char last[MAXLINE];        /* the one this batch ends at */
+} purge_batch;
+
+static radix_node root;        /* its label is empty */
+static long nids, nnodes;      /* in the tree */
+static cache *purge_cache;     /* the memory cache */
+static int enabled = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void on_link(char *id) {
+    purge_index_add(id, PURGE_MEMORY);
+}
+
+static void on_unlink(char *id) {
+    purge_index_del(id, PURGE_MEMORY);
+}
+
+/*
+ * purge_init
+ *
+ * keep the index of the ids of pcache and of the disk tier. Before
+ * anything is cached.
+ */
+void purge_init(cache *pcache) {
+    purge_cache = pcache;
+    pcache->on_link = on_link;
+    pcache->on_unlink = on_unlink;
+    enabled = 1;
+}
+
+/*
+ * purge_enabled
+ *
+ * return 1 if ids are indexed.
+ */
+int purge_enabled() {
+    return enabled;
+}
+
+/*
+ * normalize
+ *
+ * write the URL of url into key as the index has it. The URL ends at a
+ * space or the end of the line. return its length, -1 if it has no host.
+ */
+static int normalize(char *url, char *key) {
+    char *p = url, *port;
+    int n = 0;
+
+    if (strncasecmp(p, "http://", 7) == 0) {
+        p += 7;
+    }
+    for (; *p != '\0' && strchr("/: \r\n", *p) == NULL && n < MAXLINE / 2;
+         p++) {
+        key[n++] = tolower((unsigned char)*p);
+    }
+    if (n == 0) {
+        return -1;
+    }
+    if (*p == ':') {
+        for (port = p++; isdigit((unsigned char)*p); p++)
+            ;
+        if (p - port != 3 || strncmp(port, ":80", 3) != 0) {
+            memcpy(key + n, port, p - port);
+            n += p - port;
+        }
+    }
+    if (*p != '/') {
+        key[n++] = '/';
+    }
+    for (; *p != '\0' && strchr(" \r\n", *p) == NULL && n < MAXLINE - 1;
+         p++) {
+        key[n++] = *p;
+    }
+    key[n] = '\0';
+    return n;
+}
+
+/*
+ * key_of
+ *
+ * the URL of a cache id, which starts with the request line. return -1 if
+ * it has none, like the ids of origins that failed.
+ */
+static int key_of(char *id, char *key) {
+    char *url;
+
+    if ((url = strchr(id, ' ')) == NULL) {
+        return -1;
+    }
+    return normalize(url + 1, key);
+}
+
+/* a node for len bytes of label, NULL if out of memory */
+static radix_node *node_new(char *label, int len) {
+    radix_node *node;
+
+    if ((node = (radix_node *)Malloc(sizeof(radix_node))) == NULL) {
+        return NULL;
+    }
+    if ((node->label = (char *)Malloc(len)) == NULL) {
+        Free(node);
+        return NULL;
+    }
+    memcpy(node->label, label, len);
+    node->len = len;
+    node->child = node->sibling = NULL;
+    node->ids = NULL;
+    nnodes++;
+    return node;
+}
+
+static void node_free(radix_node *node) {
+    Free(node->label);
+    Free(node);
+    nnodes--;
+}
+
+/* bytes a label and key have in common at their start */
+static int common(char *label, int len, char *key) {
+    int i;
+
+    for (i = 0; i < len && label[i] == key[i]; i++)
+        ;
+    return i;
+}
+
+/*
+ * child_link
+ *
+ * the link to the child of node starting with c, or where it would go.
+ */
+static radix_node **child_link(radix_node *node, char c) {
+    radix_node **link;
+
+    for (link = &node->child; *link != NULL &&
+         (unsigned char)(*link)->label[0] < (unsigned char)c;
+         link = &(*link)->sibling)
+        ;
+    return link;
+}
+
+/*
+ * tree_insert
+ *
+ * the node of key, made if needed, splitting the edge it branches off
+ * of. Caller holds the lock. return NULL if out of memory.
+ */
+static radix_node *tree_insert(char *key) {
+    radix_node *node = &root, **link, *child, *mid;
+    char *label;
+    int m;
+
+    while (*key != '\0') {
+        link = child_link(node, *key);
+        if ((child = *link) == NULL || child->label[0] != *key) {
+            if ((mid = node_new(key, strlen(key))) == NULL) {
+                return NULL;
+            }
+            mid->sibling = child;
+            *link = mid;
+            return mid;
+        }
+        if ((m = common(child->label, child->len, key)) < child->len) {
+            /* the edge is split where key leaves it */
+            if ((mid = node_new(key, m)) == NULL ||
+                (label = (char *)Malloc(child->len - m)) == NULL) {
+                if (mid != NULL) {
+                    node_free(mid);
+                }
+                return NULL;
+            }
+            memcpy(label, child->label + m, child->len - m);
+            Free(child->label);
+            child->label = label;
+            child->len -= m;
+            mid->sibling = child->sibling;
+            mid->child = child;
+            child->sibling = NULL;
+            *link = child = mid;
+        }
+        node = child;
+        key += m;
+    }
+    return node;
+}
+
+/*
+ * tree_remove
+ *
+ * take tier of id from the node of key below parent, with id NULL only
+ * tidy up its way there. A node left without ids and children goes, one
+ * left without ids and with one child is merged with it. Caller holds
+ * the lock.
+ */
+static void tree_remove(radix_node *parent, char *key, char *id, int tier) {
+    radix_node **link = child_link(parent, *key), *node = *link, *child;
+    index_id **idl, *ent;
+    char *label;
+
+    if (node == NULL || node->label[0] != *key ||
+        common(node->label, node->len, key) < node->len) {
+        return;
+    }
+    key += node->len;
+    if (*key != '\0') {
+        tree_remove(node, key, id, tier);
+    } else if (id != NULL) {
+        for (idl = &node->ids; (ent = *idl) != NULL; idl = &ent->next) {
+            if (strcmp(ent->id, id) == 0) {
+                if ((ent->tiers &= ~tier) == 0) {
+                    *idl = ent->next;
+                    Free(ent->id);
+                    Free(ent);
+                    nids--;
+                }
+                break;
+            }
+        }
+    }
+    if (node->ids == NULL && node->child == NULL) {
+        *link = node->sibling;
+        node_free(node);
+    } else if (node->ids == NULL && node->child->sibling == NULL &&
+               (label = (char *)Malloc(node->len +
+                                       node->child->len)) != NULL) {
+        child = node->child;
+        memcpy(label, node->label, node->len);
+        memcpy(label + node->len, child->label, child->len);
+        Free(node->label);
+        node->label = label;
+        node->len += child->len;
+        node->ids = child->ids;
+        node->child = child->child;
+        node_free(child);
+    }
+}
+
+/*
+ * purge_index_add
+ *
+ * an id went into a tier.
+ */
+void purge_index_add(char *id, int tier) {
+    char key[MAXLINE];
+    radix_node *node;
+    index_id *ent = NULL;
+
+    if (!enabled || key_of(id, key) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    if ((node = tree_insert(key)) != NULL) {
+        for (ent = node->ids; ent != NULL && strcmp(ent->id, id) != 0;
+             ent = ent->next)
+            ;
+        if (ent == NULL &&
+            (ent = (index_id *)Malloc(sizeof(index_id))) != NULL) {
+            if ((ent->id = (char *)Malloc(strlen(id) + 1)) == NULL) {
+                Free(ent);
+                ent = NULL;
+            } else {
+                strcpy(ent->id, id);
+                ent->tiers = 0;
+                ent->next = node->ids;
+                node->ids = ent;
+                nids++;
+            }
+        }
+    }
+    if (ent != NULL) {
+        ent->tiers |= tier;
+    } else {
+        /* out of memory, the node may be left empty */
+        tree_remove(&root, key, NULL, 0);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * purge_index_del
+ *
+ * an id left a tier.
+ */
+void purge_index_del(char *id, int tier) {
+    char key[MAXLINE];
+
+    if (!enabled || key_of(id, key) == -1) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    tree_remove(&root, key, id, tier);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * find_prefix
+ *
+ * the highest node whose URL starts with prefix, its URL into key and the
+ * length of that into len. Caller holds the lock. return NULL if none.
+ */
+static radix_node *find_prefix(char *prefix, char *key, int *len) {
+    radix_node *node = &root, *child;
+    int m;
+
+    *len = 0;
+    while (*prefix != '\0') {
+        child = *child_link(node, *prefix);
+        if (child == NULL || child->label[0] != *prefix ||
+            *len + child->len >= MAXLINE) {
+            return NULL;
+        }
+        m = common(child->label, child->len, prefix);
+        if (m < child->len && prefix[m] != '\0') {
+            return NULL;
+        }
+        memcpy(key + *len, child->label, child->len);
+        *len += child->len;
+        prefix += m;
+        node = child;
+    }
+    return node;
+}
+
+/*
+ * walk
+ *
+ * add the ids of node, and with deep of the nodes below it, to b in order
+ * of their URLs, those after b->after. key has the URL of node, len bytes
+ * of it. The ids of a node all go in one batch, the next batch starts
+ * after its URL. Caller holds the lock. return 1 once the batch is full.
+ */
+static int walk(radix_node *node, char *key, int len, int deep,
+                purge_batch *b) {
+    radix_node *child;
+    index_id *ent;
+    int c = 1, n = 0;
+
+    /* a subtree whose URLs all come before the batch is done */
+    if (b->after[0] != '\0' && (c = strncmp(key, b->after, len)) < 0) {
+        return 0;
+    }
+    if (c > 0 && node->ids != NULL) {
+        for (ent = node->ids; ent != NULL; ent = ent->next) {
+            n++;
+        }
+        if (b->n > 0 && b->n + n > PURGE_BATCH) {
+            return 1;
+        }
+        if (b->n + n > b->size) {
+            b->size = b->n + n > PURGE_BATCH ? b->n + n : PURGE_BATCH;
+            b->ids = (char **)Realloc(b->ids, b->size * sizeof(char *));
+        }
+        for (ent = node->ids; ent != NULL; ent = ent->next) {
+            if ((b->ids[b->n] = (char *)Malloc(strlen(ent->id) + 1))) {
+                strcpy(b->ids[b->n++], ent->id);
+            }
+        }
+        memcpy(b->last, key, len);
+        b->last[len] = '\0';
+    }
+    for (child = node->child; deep && child != NULL;
+         child = child->sibling) {
+        if (len + child->len < MAXLINE) {
+            memcpy(key + len, child->label, child->len);
+            if (walk(child, key, len + child->len, deep, b)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * purge_id
+ *
+ * purge an id from every tier, the memory cache softly if soft, the disk
+ * tier and the cache of the workers never. return 1 if it was in one.
+ */
+static int purge_id(char *id, int soft) {
+    int found;
+
+    found = cache_purge(id, soft, purge_cache) == 1;
+    found |= disk_remove(id) == 1;
+    if (shm_enabled()) {
+        found |= shm_remove(id) == 1;
+    }
+    return found;
+}
+
+/*
+ * purge
+ *
+ * purge what scope says of target, a URL, a URL prefix or a host. With
+ * soft the items are marked stale. return how many ids were purged, -1 if
+ * target is not valid.
+ */
+long purge(char *target, int scope, int soft) {
+    char key[MAXLINE], url[MAXLINE], *p;
+    radix_node *node;
+    purge_batch b;
+    long count = 0;
+    int pass, len, i;
+
+    if (!enabled) {
+        return -1;
+    }
+    /* a host is every URL of it, on the default port and on the others */
+    for (pass = 0; pass < (scope == PURGE_HOST ? 2 : 1); pass++) {
+        if (scope != PURGE_HOST) {
+            if (normalize(target, key) == -1) {
+                return -1;
+            }
+        } else {
+            if (*target == '\0' || strlen(target) > MAXLINE / 2 ||
+                strpbrk(target, "/ ") != NULL) {
+                return -1;
+            }
+            for (p = target, len = 0; *p != '\0'; p++) {
+                key[len++] = tolower((unsigned char)*p);
+            }
+            key[len++] = pass == 0 ? '/' : ':';
+            key[len] = '\0';
+        }
+        b.after[0] = '\0';
+        b.ids = NULL;
+        b.size = 0;
+        do {
+            b.n = 0;
+            pthread_mutex_lock(&lock);
+            if ((node = find_prefix(key, url, &len)) != NULL &&
+                (scope != PURGE_URL || len == strlen(key))) {
+                walk(node, url, len, scope != PURGE_URL, &b);
+            }
+            pthread_mutex_unlock(&lock);
+
+            /* the caches are locked item by item, the index not at all */
+            for (i = 0; i < b.n; i++) {
+                count += purge_id(b.ids[i], soft);
+                Free(b.ids[i]);
+            }
+            strcpy(b.after, b.last);
+        } while (b.n > 0);
+        Free(b.ids);
+    }
+    stat_add(soft ? STAT_PURGE_STALE : STAT_PURGED, count);
+    return count;
+}
+
+/*
+ * purge_report
+ *
+ * print the size of the index.
+ */
+void purge_report(FILE *fp) {
+    long ids, nodes;
+
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    ids = nids;
+    nodes = nnodes;
+    pthread_mutex_unlock(&lock);
+    fprintf(fp, "purge index: ids %ld nodes %ld\n", ids, nodes);
+    fflush(fp);
+}
@@ -0,0 +1,43 @@
+/*
+ * purge.h
+ *
+ * purging cached responses by URL. Every id in the memory cache or on the
+ * disk tier is kept in an index by the URL of its request, normalized: no
+ * scheme, the host in lower case and no :80, then the path as it came. The
+ * index is a radix tree, so the ids under a URL prefix, or a host, are a
+ * subtree and come out in order. A purge takes them PURGE_BATCH at a time,
+ * or all those of one URL if there are more, such as the range blocks of
+ * a large object, and removes them from the caches with the index
+ * unlocked, so even one of millions of ids only ever holds a lock for a
+ * batch or an item. A soft purge marks them stale instead, see cache.h:
+ * they are used again once the origin answered a conditional request
+ * with 304.
+ */
+
+#ifndef __PURGE_H__
+#define __PURGE_H__
+
+#include "cache.h"
+
+/* ids taken from the index at once */
+#define PURGE_BATCH 256
+
+/* the tiers an id of the index is in */
+#define PURGE_MEMORY 1
+#define PURGE_DISK 2
+
+/* what a purge takes */
+enum purge_scope {
+    PURGE_URL,                 /* the ids of one URL */
+    PURGE_PREFIX,              /* of every URL starting with it */
+    PURGE_HOST                 /* of every URL of a host, on any port */
+};
+
+void purge_init(cache *pcache);
+int purge_enabled();
+void purge_index_add(char *id, int tier);
+void purge_index_del(char *id, int tier);
+long purge(char *target, int scope, int soft);
+void purge_report(FILE *fp);
+
+#endif /* __PURGE_H__ */
@@ -0,0 +1,287 @@
+/*
+ * range.c
+ *
+ * byte range requests: parsing Range against the length of a stored body,
+ * checking If-Range against its validators, and rewriting its header block
+ * into the one of a 206 Partial Content response, a single part or a
+ * multipart/byteranges with several, or of a 416 if no range is in the
+ * body.
+ *
+ * A header block here is what the cache stores: the status line, the
+ * header lines and the empty line, hdr_len bytes that are not NUL
+ * terminated.
+ */
+
+#include "csapp.h"
+#include "range.h"
+
+/*
+ * skip_space
+ *
+ * the first character at p that is not a space or a tab.
+ */
+static char *skip_space(char *p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * parse_ranges
+ *
+ * parse the value of a Range header, spec, for a body of length bytes
+ * into at most max ranges. Ranges that start beyond the body are left
+ * out, the others are cut to it. return the number of ranges, 0 if none
+ * is satisfiable, -1 if spec is not a valid byte range set or has too
+ * many ranges, the whole body should be sent then.
+ */
+int parse_ranges(char *spec, long length, byte_range *ranges, int max) {
+    char *p = skip_space(spec), *end;
+    long first, last, total = 0;
+    int count = 0, parsed = 0;
+
+    if (strncasecmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+    p += 6;
+    while (1) {
+        p = skip_space(p);
+        if (*p == '-') {
+            /* the last n bytes */
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < 0) {
+                return -1;
+            }
+            first = length - last > 0 ? length - last : 0;
+            last = last > 0 ? length - 1 : -1;
+        } else {
+            first = strtol(p, &end, 10);
+            if (end == p || first < 0 || *end != '-') {
+                return -1;
+            }
+            p = end + 1;
+            if (*p >= '0' && *p <= '9') {
+                last = strtol(p, &end, 10);
+                if (last < first) {
+                    return -1;
+                }
+            } else {
+                end = p;
+                last = length - 1;
+            }
+            if (last > length - 1) {
+                last = length - 1;
+            }
+        }
+        p = skip_space(end);
+        if (++parsed > max) {
+            return -1;
+        }
+        if (first <= last) {
+            ranges[count].first = first;
+            ranges[count].last = last;
+            total += last - first + 1;
+            count++;
+        }
+        if (*p == '\0' || *p == '\r' || *p == '\n') {
+            break;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+    /* overlapping ranges asking for the body many times over */
+    if (total > 2 * length + 1) {
+        return -1;
+    }
+    return count;
+}
+
+/*
+ * header_value
+ *
+ * find the header name in the header block hdr and copy its value,
+ * without the spaces around it, into value of size bytes. return 1 if
+ * found, 0 if not.
+ */
+int header_value(char *hdr, int len, char *name, char *value, int size) {
+    char *line = hdr, *end = hdr + len, *next, *p;
+    int n = strlen(name);
+
+    for (; line < end; line = next) {
+        if ((next = memchr(line, '\n', end - line)) == NULL) {
+            break;
+        }
+        next++;
+        if (next - line <= n || line[n] != ':' ||
+            strncasecmp(line, name, n) != 0) {
+            continue;
+        }
+        p = skip_space(line + n + 1);
+        n = next - p;
+        while (n > 0 && (p[n - 1] == '\r' || p[n - 1] == '\n' ||
+                         p[n - 1] == ' ' || p[n - 1] == '\t')) {
+            n--;
+        }
+        if (n >= size) {
+            n = size - 1;
+        }
+        memcpy(value, p, n);
+        value[n] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * response_status
+ *
+ * the status code of a header block, -1 if its status line is not valid.
+ */
+int response_status(char *hdr) {
+    int status;
+
+    if (strncmp(hdr, "HTTP/", 5) != 0 ||
+        sscanf(hdr, "HTTP/%*s %d", &status) != 1) {
+        return -1;
+    }
+    return status;
+}
+
+/*
+ * if_range_matches
+ *
+ * check the value of If-Range against the stored header block: an entity
+ * tag must be the strong ETag of the response, a date the Last-Modified
+ * of it. return 1 if the ranges may be served from the stored body.
+ */
+int if_range_matches(char *if_range, char *hdr, int len) {
+    char value[MAXLINE];
+
+    if (strncmp(if_range, "W/", 2) == 0) {
+        return 0;
+    }
+    if (if_range[0] == '"') {
+        return header_value(hdr, len, "ETag", value, MAXLINE) &&
+               strcmp(value, if_range) == 0;
+    }
+    return header_value(hdr, len, "Last-Modified", value, MAXLINE) &&
+           strcmp(value, if_range) == 0;
+}
+
+/*
+ * part_header
+ *
+ * make in buf what comes before one range of a multipart/byteranges
+ * body. type is the Content-Type of the whole body, empty if it had none.
+ * return its length.
+ */
+int part_header(char *buf, char *type, byte_range *range, long length,
+                char *boundary) {
+    int n = sprintf(buf, "\r\n--%s\r\n", boundary);
+
+    if (type[0] != '\0') {
+        n += sprintf(buf + n, "Content-Type: %.*s\r\n",
+                     MAXLINE - BOUNDARY_MAX - 128, type);
+    }
+    n += sprintf(buf + n, "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                 range->first, range->last, length);
+    return n;
+}
+
+/*
+ * append
+ *
+ * add n bytes to buf of size bytes, which holds *len already. return -1
+ * if they do not fit.
+ */
+static int append(char *buf, int size, int *len, char *s, int n) {
+    if (*len + n > size) {
+        return -1;
+    }
+    memcpy(buf + *len, s, n);
+    *len += n;
+    return 1;
+}
+
+/*
+ * range_header
+ *
+ * rewrite the stored header block hdr of a body of length bytes into
+ * buf, of size bytes, for a response with count ranges of it: a 206 with
+ * Content-Range for one, a multipart/byteranges split by boundary for
+ * more, a 416 for none. The headers about the length and type of the body
+ * are replaced, and an Age line of age seconds is added unless age is -1.
+ * return the length of the new block, -1 if it does not fit.
+ */
+int range_header(char *buf, int size, char *hdr, int hdr_len,
+                 byte_range *ranges, int count, long length,
+                 char *boundary, long age) {
+    char line[MAXLINE], type[MAXLINE], version[16] = "1.0";
+    char *p, *next, *end = hdr + hdr_len;
+    long body = 0;
+    int len = 0, n, i, drop = 0;
+
+    sscanf(hdr, "HTTP/%15[0-9.]", version);
+    n = snprintf(line, MAXLINE, "HTTP/%s %s\r\n", version,
+                 count > 0 ? "206 Partial Content"
+                           : "416 Range Not Satisfiable");
+    if (append(buf, size, &len, line, n) == -1) {
+        return -1;
+    }
+    if (!header_value(hdr, hdr_len, "Content-Type", type, MAXLINE)) {
+        type[0] = '\0';
+    }
+
+    /* the headers of the stored response, but those about its body */
+    if ((p = memchr(hdr, '\n', hdr_len)) == NULL) {
+        return -1;
+    }
+    for (p++; p < end; p = next) {
+        if ((next = memchr(p, '\n', end - p)) == NULL) {
+            break;
+        }
+        next++;
+        if (*p == '\r' || *p == '\n') {
+            break;
+        }
+        /* a folded line goes with the header before it */
+        if (*p != ' ' && *p != '\t') {
+            drop = strncasecmp(p, "Content-Length:", 15) == 0 ||
+                   strncasecmp(p, "Content-Range:", 14) == 0 ||
+                   (count != 1 && strncasecmp(p, "Content-Type:", 13) == 0);
+        }
+        if (!drop && append(buf, size, &len, p, next - p) == -1) {
+            return -1;
+        }
+    }
+
+    if (count == 0) {
+        n = snprintf(line, MAXLINE, "Content-Range: bytes */%ld\r\n"
+                     "Content-Length: 0\r\n", length);
+    } else if (count == 1) {
+        n = snprintf(line, MAXLINE, "Content-Range: bytes %ld-%ld/%ld\r\n"
+                     "Content-Length: %ld\r\n", ranges[0].first,
+                     ranges[0].last, length,
+                     ranges[0].last - ranges[0].first + 1);
+    } else {
+        for (i = 0; i < count; i++) {
+            body += part_header(line, type, &ranges[i], length, boundary) +
+                    ranges[i].last - ranges[i].first + 1;
+        }
+        body += strlen(boundary) + 8;  /* \r\n--boundary--\r\n */
+        n = snprintf(line, MAXLINE, "Content-Type: multipart/byteranges; "
+                     "boundary=%s\r\nContent-Length: %ld\r\n",
+                     boundary, body);
+    }
+    if (append(buf, size, &len, line, n) == -1) {
+        return -1;
+    }
+    n = age >= 0 ? snprintf(line, MAXLINE, "Age: %ld\r\n\r\n", age)
+                 : snprintf(line, MAXLINE, "\r\n");
+    if (append(buf, size, &len, line, n) == -1) {
+        return -1;
+    }
+    return len;
+}
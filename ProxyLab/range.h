@@ -0,0 +1,35 @@
+/*
+ * range.h
+ *
+ * byte range requests: parsing Range against the length of a stored body,
+ * checking If-Range against its validators, and rewriting its header block
+ * into the one of a 206 Partial Content response, a single part or a
+ * multipart/byteranges with several, or of a 416 if no range is in the
+ * body.
+ */
+
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+/* most ranges served from one request, more and the whole body is sent */
+#define RANGE_MAX 16
+/* a boundary of a multipart response and its dashes fit in this */
+#define BOUNDARY_MAX 64
+
+/* one satisfiable range, both ends included */
+typedef struct byte_range {
+    long first;
+    long last;
+} byte_range;
+
+int parse_ranges(char *spec, long length, byte_range *ranges, int max);
+int header_value(char *hdr, int len, char *name, char *value, int size);
+int response_status(char *hdr);
+int if_range_matches(char *if_range, char *hdr, int len);
+int part_header(char *buf, char *type, byte_range *range, long length,
+                char *boundary);
+int range_header(char *buf, int size, char *hdr, int hdr_len,
+                 byte_range *ranges, int count, long length,
+                 char *boundary, long age);
+
+#endif /* __RANGE_H__ */
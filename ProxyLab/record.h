@@ -0,0 +1,34 @@
+/*
+ * record.h
+ *
+ * the request record, a compact binary trace of the traffic the proxy
+ * served, to replay it offline, see replay.c. The log thread appends an
+ * entry for every request to the file, after a header the process that
+ * created the file wrote. The worker processes of the proxy append to the
+ * same file, so the entries are only roughly in order of time.
+ */
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#define RECORD_MAGIC 0x72707872
+#define RECORD_VERSION 2
+
+/* start of the file */
+typedef struct record_header {
+    unsigned int magic;        /* RECORD_MAGIC */
+    unsigned int version;      /* RECORD_VERSION */
+} record_header;
+
+/* one request */
+typedef struct record_entry {
+    long when_us;              /* wall clock it came in, in us */
+    unsigned int key;          /* cache_hash of its request line */
+    unsigned int size;         /* bytes of body of the object asked for */
+    unsigned int latency_us;   /* it took until the last byte was sent */
+    unsigned short status;     /* of the response, 0 if none was sent */
+    unsigned char hit;         /* answered from the cache */
+    unsigned char unused;
+} record_entry;
+
+#endif /* __RECORD_H__ */
@@ -0,0 +1,319 @@
+/*
+ * replay.c
+ *
+ * Replays a request record of the proxy, see record.h, against a running
+ * proxy, to size its cache or try eviction changes on the shape of real
+ * traffic. An origin stub in this process answers every request with a
+ * body of the recorded size and the recorded status, so the objects are
+ * made up but their keys, their sizes and the order they are asked for
+ * are the recorded ones. Requests are sent at the recorded times, sped up
+ * SPEED times, 0 as fast as they go, by up to CONNS clients at once. The
+ * end shows the hit ratio and the latencies of the record next to those
+ * of the replay. A replayed request was a hit if the proxy put an Age
+ * line into the response, the stub never sends one. Recorded latencies
+ * are the time in the proxy, replayed ones the time at the client, with
+ * the connect.
+ *
+ * How to use: ./replay RECORD PROXY_PORT [SPEED [CONNS]]
+ */
+
+#include <stdatomic.h>
+#include <time.h>
+#include "csapp.h"
+#include "record.h"
+
+#define REPLAY_MAX_CONNS 256
+/* a request sent this late is counted as late */
+#define REPLAY_LATE_US 10000
+/* bytes of body the stub writes at once */
+#define STUB_CHUNK (64 << 10)
+
+/* the outcome of one replayed request */
+typedef struct replay_result {
+    unsigned int latency_us;   /* until the last byte */
+    int hit;                   /* the proxy answered from its cache */
+    int ok;                    /* a response came */
+} replay_result;
+
+static record_entry *entries;  /* the record, sorted by time */
+static replay_result *results;
+static long count;
+static atomic_long next_entry; /* next one to send */
+static atomic_long stub_requests; /* requests the stub got, misses */
+static atomic_long late;       /* sent more than REPLAY_LATE_US late */
+static int proxy_port, stub_port;
+static double speed = 1;
+static long first_us;          /* time of the first entry */
+static double start_us;        /* monotonic time the replay started */
+
+static char zeros[STUB_CHUNK];
+
+static double now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * stub_serve
+ *
+ * answer one request for /KEY/SIZE/STATUS with SIZE bytes and STATUS.
+ */
+static void *stub_serve(void *vargp) {
+    int fd = *(int *)vargp;
+    char buf[MAXLINE], path[MAXLINE];
+    unsigned int key;
+    long size, n;
+    int status;
+    rio_t rio;
+
+    Free(vargp);
+    Pthread_detach(pthread_self());
+    Rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0 ||
+        sscanf(buf, "GET %s", path) != 1 ||
+        sscanf(path, "/%x/%ld/%d", &key, &size, &status) != 3) {
+        close(fd);
+        return NULL;
+    }
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+        ;
+    }
+    atomic_fetch_add(&stub_requests, 1);
+    n = sprintf(buf, "HTTP/1.0 %d Replayed\r\nContent-Type: "
+                "application/octet-stream\r\nContent-Length: %ld\r\n\r\n",
+                status, size);
+    if (rio_writen(fd, buf, n) != -1) {
+        for (; size > 0; size -= n) {
+            n = size < STUB_CHUNK ? size : STUB_CHUNK;
+            if (rio_writen(fd, zeros, n) == -1) {
+                break;
+            }
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/*
+ * stub_thread
+ *
+ * the origin stub, a thread per connection.
+ */
+static void *stub_thread(void *vargp) {
+    int listenfd = *(int *)vargp;
+    pthread_t tid;
+    int *fdp;
+
+    while (1) {
+        if ((fdp = (int *)Malloc(sizeof(int))) == NULL) {
+            continue;
+        }
+        if ((*fdp = accept(listenfd, NULL, NULL)) < 0) {
+            Free(fdp);
+            continue;
+        }
+        Pthread_create(&tid, NULL, stub_serve, fdp);
+    }
+    return NULL;
+}
+
+/*
+ * replay_one
+ *
+ * send one recorded request through the proxy and read the response.
+ */
+static void replay_one(record_entry *e, replay_result *r) {
+    char buf[MAXLINE];
+    double start;
+    rio_t rio;
+    int fd, n;
+
+    start = now_us();
+    if ((fd = open_clientfd("127.0.0.1", proxy_port)) < 0) {
+        return;
+    }
+    n = sprintf(buf, "GET http://127.0.0.1:%d/%08x/%u/%u HTTP/1.0\r\n\r\n",
+                stub_port, e->key, e->size, e->status);
+    if (rio_writen(fd, buf, n) == -1) {
+        close(fd);
+        return;
+    }
+    Rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
+        close(fd);
+        return;
+    }
+    while (rio_readlineb(&rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n")) {
+        if (strncasecmp(buf, "Age:", 4) == 0) {
+            r->hit = 1;
+        }
+    }
+    while (rio_readnb(&rio, buf, MAXLINE) > 0) {
+        ;
+    }
+    close(fd);
+    r->latency_us = now_us() - start;
+    r->ok = 1;
+}
+
+/*
+ * client
+ *
+ * take the next entry, wait for its time and replay it, until none are
+ * left.
+ */
+static void *client(void *vargp) {
+    double at, now;
+    long i;
+
+    while ((i = atomic_fetch_add(&next_entry, 1)) < count) {
+        if (speed > 0) {
+            at = start_us + (entries[i].when_us - first_us) / speed;
+            if ((now = now_us()) < at) {
+                usleep(at - now);
+            } else if (now - at > REPLAY_LATE_US) {
+                atomic_fetch_add(&late, 1);
+            }
+        }
+        replay_one(&entries[i], &results[i]);
+    }
+    return NULL;
+}
+
+static int by_time(const void *a, const void *b) {
+    long x = ((record_entry *)a)->when_us, y = ((record_entry *)b)->when_us;
+
+    return x < y ? -1 : x > y;
+}
+
+static int by_value(const void *a, const void *b) {
+    unsigned int x = *(unsigned int *)a, y = *(unsigned int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * load
+ *
+ * read the entries of a record that got a response. return -1 if it is
+ * no record.
+ */
+static int load(char *path) {
+    record_header header;
+    record_entry e;
+    long max = 1024;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL ||
+        fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != RECORD_MAGIC || header.version != RECORD_VERSION) {
+        fprintf(stderr, "%s is no request record\n", path);
+        return -1;
+    }
+    entries = (record_entry *)Malloc(max * sizeof(record_entry));
+    while (entries != NULL && fread(&e, sizeof(e), 1, fp) == 1) {
+        if (e.status == 0) {
+            continue;
+        }
+        if (count == max) {
+            max *= 2;
+            entries = (record_entry *)Realloc(entries,
+                                              max * sizeof(record_entry));
+        }
+        if (entries != NULL) {
+            entries[count++] = e;
+        }
+    }
+    fclose(fp);
+    if (entries == NULL) {
+        return -1;
+    }
+    qsort(entries, count, sizeof(record_entry), by_time);
+    return 1;
+}
+
+/*
+ * report
+ *
+ * print the hit ratio and latencies of one side, from n latencies.
+ */
+static void report(char *name, unsigned int *lat, long n, long hits) {
+    qsort(lat, n, sizeof(unsigned int), by_value);
+    printf("%-10s %10ld %9.3f %9.3f %9.3f %9.3f\n", name, n,
+           n ? (double)hits / n : 0, n ? lat[n / 2] / 1e3 : 0,
+           n ? lat[n * 9 / 10] / 1e3 : 0, n ? lat[n * 99 / 100] / 1e3 : 0);
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t tids[REPLAY_MAX_CONNS];
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    unsigned int *lat;
+    long i, n, hits, errors;
+    int listenfd, conns = 16;
+    double wall;
+    pthread_t tid;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s RECORD PROXY_PORT [SPEED [CONNS]]\n",
+                argv[0]);
+        exit(1);
+    }
+    proxy_port = atoi(argv[2]);
+    if (argc > 3) {
+        speed = atof(argv[3]);
+    }
+    if (argc > 4 && (conns = atoi(argv[4])) > REPLAY_MAX_CONNS) {
+        conns = REPLAY_MAX_CONNS;
+    }
+    if (load(argv[1]) == -1 || count == 0 || conns <= 0 ||
+        (results = (replay_result *)Calloc(count,
+                                           sizeof(replay_result))) == NULL ||
+        (lat = (unsigned int *)Malloc(count * sizeof(int))) == NULL) {
+        exit(1);
+    }
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* the stub listens on a port of its own choosing */
+    if ((listenfd = open_listenfd(0)) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0) {
+        fprintf(stderr, "can not start the origin stub\n");
+        exit(1);
+    }
+    stub_port = ntohs(addr.sin_port);
+    Pthread_create(&tid, NULL, stub_thread, &listenfd);
+
+    printf("replaying %ld requests over %.1f s at x%g with %d clients\n",
+           count, (entries[count - 1].when_us - entries[0].when_us) / 1e6,
+           speed, conns);
+    first_us = entries[0].when_us;
+    start_us = now_us();
+    for (i = 0; i < conns; i++) {
+        Pthread_create(&tids[i], NULL, client, NULL);
+    }
+    for (i = 0; i < conns; i++) {
+        Pthread_join(tids[i], NULL);
+    }
+    wall = (now_us() - start_us) / 1e6;
+
+    printf("%-10s %10s %9s %9s %9s %9s\n", "", "requests", "hit ratio",
+           "p50 ms", "p90 ms", "p99 ms");
+    for (i = 0, hits = 0; i < count; i++) {
+        lat[i] = entries[i].latency_us;
+        hits += entries[i].hit;
+    }
+    report("recorded", lat, count, hits);
+    for (i = 0, n = 0, hits = 0; i < count; i++) {
+        if (results[i].ok) {
+            lat[n++] = results[i].latency_us;
+            hits += results[i].hit;
+        }
+    }
+    errors = count - n;
+    report("replay", lat, n, hits);
+    printf("origin fetches %ld, errors %ld, late %ld, in %.1f s\n",
+           atomic_load(&stub_requests), errors, atomic_load(&late), wall);
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * sbuf.h
+ *
+ * bounded buffer of connected descriptors shared by the acceptor and the
+ * worker threads (the producer-consumer buffer from the CS:APP text).
+ */
+
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* number of connections that can wait for a worker */
+#define SBUF_SIZE 1024
+
+typedef struct {
+    int *buf;                  /* buffer array */
+    int n;                     /* maximum number of slots */
+    int front;                 /* buf[(front+1)%n] is first item */
+    int rear;                  /* buf[rear%n] is last item */
+    sem_t mutex;               /* protects accesses to buf */
+    sem_t slots;               /* counts available slots */
+    sem_t items;               /* counts available items */
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+
+#endif /* __SBUF_H__ */
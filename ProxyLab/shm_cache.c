@@ -0,0 +1,577 @@
+/*
+ * shm_cache.c
+ *
+ * a cache shared by the worker processes, in one MAP_SHARED region made
+ * before they are forked. The region starts with a shm_header, the rest
+ * is a heap of blocks of SHM_MAX_BLOCK, split in halves by a buddy
+ * allocator down to SHM_MIN_BLOCK. An entry is one block: a shm_entry,
+ * the cache id with its terminating 0, and the content.
+ *
+ * The region is mapped at a different address in each process that maps
+ * it later, so nothing in it is a pointer: every link is the offset of a
+ * block from the start of the region, and 0 is the end of a list. Every
+ * block starts with a shm_block, which is what the allocator looks at
+ * when it merges a freed block with its buddy.
+ *
+ * The robust mutex in the header guards everything. Whoever changes the
+ * lists sets dirty while doing it, so if it dies halfway through, the next
+ * one to take the lock knows the lists can not be trusted and wipes the
+ * region. A process that dies while only reading leaves it as it was.
+ *
+ * Hits are sent to the client straight from the region, without the lock,
+ * so no process waits for another one's send of a large object. The
+ * entry is pinned meanwhile: if it is dropped, its block is only freed by
+ * the last one to unpin it. A process that dies while sending leaves the
+ * block pinned until the region is wiped, an unpin after a wipe is
+ * ignored.
+ *
+ * The region is a memfd when the kernel has them, so it can also be
+ * passed to a process that is not forked from us, like the new binary of
+ * a hot upgrade, which maps it with shm_attach.
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "shm_cache.h"
+#include "cache.h"
+
+/* start of every block, free or in use */
+typedef struct shm_block {
+    int free;                  /* on a free list */
+    int order;                 /* size is SHM_MIN_BLOCK << order */
+    long next;                 /* next on the free list or the LRU list */
+    long prev;                 /* previous one */
+} shm_block;
+
+/* a block in use, the id and the content follow */
+typedef struct shm_entry {
+    shm_block block;           /* in the LRU list, head is most recent */
+    long hnext;                /* next entry in the same bucket */
+    unsigned int hash;         /* hash of the id */
+    int id_len;                /* length of the id, without the 0 */
+    long size;                 /* size of the content */
+    int pins;                  /* sends being made from it */
+    int dropped;               /* out of the lists, free it when unpinned */
+    cache_meta meta;           /* meta of the content */
+} shm_entry;
+
+/* start of the region */
+typedef struct shm_header {
+    unsigned int magic;        /* SHM_MAGIC once set up */
+    int layout;                /* SHM_LAYOUT of the build that made it */
+    int header_size;           /* sizeof of this, */
+    int entry_size;            /* of shm_entry */
+    int meta_size;             /* and of cache_meta in that build */
+    int dirty;                 /* the lists are being changed */
+    long size;                 /* size of the region */
+    long heap;                 /* offset of the first block */
+    long nblocks;              /* blocks of SHM_MAX_BLOCK in the heap */
+    pthread_mutex_t lock;      /* robust and process shared */
+    long lru_head;             /* most recently used entry */
+    long lru_tail;             /* least recently used entry */
+    long free[SHM_ORDERS];     /* free blocks of each order */
+    long entries;              /* entries in the region */
+    long used;                 /* bytes of the blocks in use */
+    long hits;                 /* lookups that found their entry */
+    long misses;               /* lookups that did not */
+    long inserts;              /* entries added */
+    long evictions;            /* entries evicted to make room */
+    long recoveries;           /* times the owner of the lock died */
+    long wipes;                /* times the region was wiped */
+    long buckets[SHM_BUCKETS]; /* the hash index */
+} shm_header;
+
+static shm_header *region = NULL;
+static int region_fd = -1;     /* the memfd of the region, -1 if none */
+
+/* the block at an offset */
+static shm_block *block_at(long off) {
+    return (shm_block *)((char *)region + off);
+}
+
+/* the id of an entry */
+static char *entry_id(shm_entry *entry) {
+    return (char *)(entry + 1);
+}
+
+/*
+ * push_free
+ *
+ * put a block on the free list of an order.
+ */
+static void push_free(long off, int order) {
+    shm_block *block = block_at(off);
+
+    block->free = 1;
+    block->order = order;
+    block->prev = 0;
+    block->next = region->free[order];
+    if (block->next != 0) {
+        block_at(block->next)->prev = off;
+    }
+    region->free[order] = off;
+}
+
+/*
+ * unlink_free
+ *
+ * take a block off its free list.
+ */
+static void unlink_free(long off) {
+    shm_block *block = block_at(off);
+
+    if (block->prev != 0) {
+        block_at(block->prev)->next = block->next;
+    } else {
+        region->free[block->order] = block->next;
+    }
+    if (block->next != 0) {
+        block_at(block->next)->prev = block->prev;
+    }
+    block->free = 0;
+}
+
+/*
+ * wipe
+ *
+ * empty the region: no entries, every block of SHM_MAX_BLOCK free.
+ */
+static void wipe() {
+    long i;
+
+    for (i = 0; i < SHM_ORDERS; i++) {
+        region->free[i] = 0;
+    }
+    for (i = 0; i < SHM_BUCKETS; i++) {
+        region->buckets[i] = 0;
+    }
+    region->lru_head = region->lru_tail = 0;
+    region->entries = region->used = 0;
+    region->wipes++;
+    for (i = region->nblocks - 1; i >= 0; i--) {
+        push_free(region->heap + i * SHM_MAX_BLOCK, SHM_ORDERS - 1);
+    }
+    region->dirty = 0;
+}
+
+/*
+ * alloc_block
+ *
+ * take a block of an order, splitting a larger one if there is none.
+ * return its offset, 0 if no block is large enough.
+ */
+static long alloc_block(int order) {
+    long off;
+    int k;
+
+    for (k = order; k < SHM_ORDERS && region->free[k] == 0; k++)
+        ;
+    if (k == SHM_ORDERS) {
+        return 0;
+    }
+    off = region->free[k];
+    unlink_free(off);
+    /* the upper halves go back to the free lists */
+    while (k > order) {
+        k--;
+        push_free(off + (SHM_MIN_BLOCK << k), k);
+    }
+    block_at(off)->order = order;
+    region->used += SHM_MIN_BLOCK << order;
+    return off;
+}
+
+/*
+ * free_block
+ *
+ * give a block back, merged with its buddy as long as that is free too.
+ */
+static void free_block(long off) {
+    int k = block_at(off)->order;
+    shm_block *buddy;
+    long other;
+
+    region->used -= SHM_MIN_BLOCK << k;
+    for (; k < SHM_ORDERS - 1; k++) {
+        other = region->heap + ((off - region->heap) ^ (SHM_MIN_BLOCK << k));
+        buddy = block_at(other);
+        if (!buddy->free || buddy->order != k) {
+            break;
+        }
+        unlink_free(other);
+        if (other < off) {
+            off = other;
+        }
+    }
+    push_free(off, k);
+}
+
+/*
+ * lru_unlink
+ *
+ * take an entry off the LRU list.
+ */
+static void lru_unlink(long off) {
+    shm_block *block = block_at(off);
+
+    if (block->prev != 0) {
+        block_at(block->prev)->next = block->next;
+    } else {
+        region->lru_head = block->next;
+    }
+    if (block->next != 0) {
+        block_at(block->next)->prev = block->prev;
+    } else {
+        region->lru_tail = block->prev;
+    }
+}
+
+/*
+ * lru_push
+ *
+ * put an entry at the head of the LRU list, most recently used.
+ */
+static void lru_push(long off) {
+    shm_block *block = block_at(off);
+
+    block->prev = 0;
+    block->next = region->lru_head;
+    if (block->next != 0) {
+        block_at(block->next)->prev = off;
+    } else {
+        region->lru_tail = off;
+    }
+    region->lru_head = off;
+}
+
+/*
+ * find_entry
+ *
+ * offset of the entry of an id, 0 if there is none.
+ */
+static long find_entry(char *cache_id, unsigned int hash) {
+    shm_entry *entry;
+    long off;
+
+    for (off = region->buckets[hash % SHM_BUCKETS]; off != 0;
+         off = entry->hnext) {
+        entry = (shm_entry *)block_at(off);
+        if (entry->hash == hash && strcmp(entry_id(entry), cache_id) == 0) {
+            return off;
+        }
+    }
+    return 0;
+}
+
+/*
+ * drop_entry
+ *
+ * unlink an entry from its bucket and the LRU list and free its block,
+ * or if it is pinned leave that to the last unpin.
+ */
+static void drop_entry(long off) {
+    shm_entry *entry = (shm_entry *)block_at(off);
+    long *link = &region->buckets[entry->hash % SHM_BUCKETS];
+
+    while (*link != off) {
+        link = &((shm_entry *)block_at(*link))->hnext;
+    }
+    *link = entry->hnext;
+    lru_unlink(off);
+    region->entries--;
+    if (entry->pins > 0) {
+        entry->dropped = 1;
+        return;
+    }
+    free_block(off);
+}
+
+/*
+ * shm_lock
+ *
+ * take the lock of the region. If its owner died, the region is wiped
+ * when the owner was changing it. return -1 if failed.
+ */
+static int shm_lock() {
+    int rc = pthread_mutex_lock(&region->lock);
+
+    if (rc == EOWNERDEAD) {
+        if (region->dirty) {
+            wipe();
+        }
+        region->recoveries++;
+        pthread_mutex_consistent(&region->lock);
+        rc = 0;
+    }
+    return rc == 0 ? 1 : -1;
+}
+
+/*
+ * shm_unlock
+ *
+ * release the lock of the region.
+ */
+static void shm_unlock() {
+    pthread_mutex_unlock(&region->lock);
+}
+
+/*
+ * shm_init
+ *
+ * map a shared region of size bytes and set it up, before the processes
+ * that share it are forked. return -1 if failed.
+ */
+int shm_init(long size) {
+    pthread_mutexattr_t attr;
+    int flags = MAP_SHARED;
+    void *addr;
+
+    if (size < 2 * SHM_MAX_BLOCK) {
+        fprintf(stderr, "shm_init: at least %ld KB are needed\n",
+                2 * SHM_MAX_BLOCK >> 10);
+        return -1;
+    }
+    /* without memfd the region can only be shared with our children */
+    if ((region_fd = memfd_create("proxylab-shared", MFD_CLOEXEC)) >= 0 &&
+        ftruncate(region_fd, size) < 0) {
+        Close(region_fd);
+        region_fd = -1;
+    }
+    if (region_fd < 0) {
+        flags |= MAP_ANONYMOUS;
+    }
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, region_fd, 0);
+    if (addr == MAP_FAILED) {
+        unix_error("shm_init mmap error");
+        return -1;
+    }
+    region = (shm_header *)addr;
+    region->size = size;
+    region->heap = (sizeof(shm_header) + SHM_MIN_BLOCK - 1) &
+                   ~(SHM_MIN_BLOCK - 1);
+    region->nblocks = (size - region->heap) / SHM_MAX_BLOCK;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&region->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    wipe();
+    region->layout = SHM_LAYOUT;
+    region->header_size = sizeof(shm_header);
+    region->entry_size = sizeof(shm_entry);
+    region->meta_size = sizeof(cache_meta);
+    region->magic = SHM_MAGIC;
+    return 1;
+}
+
+/*
+ * shm_attach
+ *
+ * map the region another process made, from its memfd, and use it as it
+ * is. A region laid out by a build with other structures is not read.
+ * return -1 if it is not a region, or not one of this layout.
+ */
+int shm_attach(int fd) {
+    struct stat st;
+    void *addr;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (long)sizeof(shm_header)) {
+        return -1;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        unix_error("shm_attach mmap error");
+        return -1;
+    }
+    if (((shm_header *)addr)->magic != SHM_MAGIC ||
+        ((shm_header *)addr)->layout != SHM_LAYOUT ||
+        ((shm_header *)addr)->header_size != sizeof(shm_header) ||
+        ((shm_header *)addr)->entry_size != sizeof(shm_entry) ||
+        ((shm_header *)addr)->meta_size != sizeof(cache_meta) ||
+        ((shm_header *)addr)->size != st.st_size) {
+        munmap(addr, st.st_size);
+        return -1;
+    }
+    region = (shm_header *)addr;
+    region_fd = fd;
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return 1;
+}
+
+/*
+ * shm_fd
+ *
+ * the memfd of the region, to pass it on. return -1 if there is none.
+ */
+int shm_fd() {
+    return region_fd;
+}
+
+/*
+ * shm_enabled
+ *
+ * return 1 if there is a shared region.
+ */
+int shm_enabled() {
+    return region != NULL;
+}
+
+/*
+ * shm_insert
+ *
+ * copy an object into the region, in place of one with the same id, and
+ * evict the least recently used entries until it fits. return -1 if it
+ * is too large for a block or failed.
+ */
+int shm_insert(char *cache_id, struct iovec *iov, int iovcnt, long size,
+               cache_meta *meta) {
+    int id_len = strlen(cache_id), order = 0, i;
+    long need = sizeof(shm_entry) + id_len + 1 + size, off;
+    unsigned int hash = cache_hash(cache_id);
+    shm_entry *entry;
+    char *p;
+
+    if (region == NULL || need > SHM_MAX_BLOCK) {
+        return -1;
+    }
+    while ((SHM_MIN_BLOCK << order) < need) {
+        order++;
+    }
+    if (shm_lock() == -1) {
+        return -1;
+    }
+    region->dirty = 1;
+    if ((off = find_entry(cache_id, hash)) != 0) {
+        drop_entry(off);
+    }
+    while ((off = alloc_block(order)) == 0 && region->lru_tail != 0) {
+        drop_entry(region->lru_tail);
+        region->evictions++;
+    }
+    if (off == 0) {
+        region->dirty = 0;
+        shm_unlock();
+        return -1;
+    }
+
+    entry = (shm_entry *)block_at(off);
+    entry->hash = hash;
+    entry->id_len = id_len;
+    entry->size = size;
+    entry->pins = 0;
+    entry->dropped = 0;
+    entry->meta = *meta;
+    memcpy(entry_id(entry), cache_id, id_len + 1);
+    p = entry_id(entry) + id_len + 1;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    entry->hnext = region->buckets[hash % SHM_BUCKETS];
+    region->buckets[hash % SHM_BUCKETS] = off;
+    lru_push(off);
+    region->entries++;
+    region->inserts++;
+    region->dirty = 0;
+    shm_unlock();
+    return 1;
+}
+
+/*
+ * shm_pin
+ *
+ * find the object of an id and make it the most recently used. It is
+ * pinned and put in ref, to be read from the region without the lock
+ * until shm_unpin. return -1 if it is not in the region or failed.
+ */
+int shm_pin(char *cache_id, shm_ref *ref) {
+    unsigned int hash = cache_hash(cache_id);
+    shm_entry *entry;
+    long off;
+
+    if (region == NULL || shm_lock() == -1) {
+        return -1;
+    }
+    if ((off = find_entry(cache_id, hash)) == 0) {
+        region->misses++;
+        shm_unlock();
+        return -1;
+    }
+    entry = (shm_entry *)block_at(off);
+    entry->pins++;
+    region->hits++;
+    region->dirty = 1;
+    lru_unlink(off);
+    lru_push(off);
+    region->dirty = 0;
+    ref->off = off;
+    ref->wipes = region->wipes;
+    ref->data = entry_id(entry) + entry->id_len + 1;
+    ref->size = entry->size;
+    ref->meta = entry->meta;
+    shm_unlock();
+    return 1;
+}
+
+/*
+ * shm_unpin
+ *
+ * done reading an entry pinned by shm_pin. The last one to unpin an entry
+ * that was dropped meanwhile frees it.
+ */
+void shm_unpin(shm_ref *ref) {
+    shm_entry *entry;
+
+    if (region == NULL || shm_lock() == -1) {
+        return;
+    }
+    entry = (shm_entry *)block_at(ref->off);
+    if (region->wipes == ref->wipes && --entry->pins == 0 && 
+        entry->dropped) {
+        region->dirty = 1;
+        free_block(ref->off);
+        region->dirty = 0;
+    }
+    shm_unlock();
+}
+
+/*
+ * shm_remove
+ *
+ * drop the entry of an id. return -1 if there is none.
+ */
+int shm_remove(char *cache_id) {
+    unsigned int hash = cache_hash(cache_id);
+    long off;
+
+    if (region == NULL || shm_lock() == -1) {
+        return -1;
+    }
+    if ((off = find_entry(cache_id, hash)) != 0) {
+        region->dirty = 1;
+        drop_entry(off);
+        region->dirty = 0;
+    }
+    shm_unlock();
+    return off != 0 ? 1 : -1;
+}
+
+/*
+ * shm_report
+ *
+ * print how full the shared region is and how it is used.
+ */
+void shm_report(FILE *fp) {
+    if (region == NULL || shm_lock() == -1) {
+        return;
+    }
+    fprintf(fp, "shared: %ld objects, %ld of %ld KB used, hits %ld "
+            "misses %ld inserts %ld evictions %ld recoveries %ld\n",
+            region->entries, region->used >> 10,
+            (region->nblocks * SHM_MAX_BLOCK) >> 10, region->hits,
+            region->misses, region->inserts, region->evictions,
+            region->recoveries);
+    shm_unlock();
+}
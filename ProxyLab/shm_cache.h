@@ -0,0 +1,64 @@
+/*
+ * shm_cache.h
+ *
+ * a cache shared by the worker processes of --processes, between the
+ * memory cache of each process and the origin. It is one region mapped
+ * MAP_SHARED, made before the workers are forked, so it holds no pointers:
+ * entries, hash chains, the LRU list and the free lists are all offsets
+ * from the start of the region. Space comes from a buddy allocator over
+ * blocks of SHM_MAX_BLOCK, and the least recently used entries are
+ * evicted until a new one fits.
+ *
+ * One robust, process shared mutex guards the region. A process that dies
+ * holding it does not block the others: the next one to lock it is told,
+ * and if the region was being changed it is wiped and starts empty.
+ *
+ * A hit is sent from the region itself, not copied into the memory cache
+ * of the process, so an object is kept once for all the workers. The
+ * entry is pinned while it is sent, which is done without the lock.
+ *
+ * The region outlives the process that made it if its memfd is passed
+ * on: a hot upgrade hands it to the new binary, which attaches to it and
+ * has every object the old one had.
+ */
+
+#ifndef __SHM_CACHE_H__
+#define __SHM_CACHE_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+/* marks a region that is set up */
+#define SHM_MAGIC 0x73686d63
+/* version of the layout of the region, raised whenever it changes. The
+ * builds before it had 0 or 1 where it is */
+#define SHM_LAYOUT 3
+/* hash buckets of the region */
+#define SHM_BUCKETS 8192
+/* smallest block of the allocator */
+#define SHM_MIN_BLOCK 1024L
+/* orders of blocks, the largest is SHM_MIN_BLOCK << (SHM_ORDERS - 1) */
+#define SHM_ORDERS 11
+#define SHM_MAX_BLOCK (SHM_MIN_BLOCK << (SHM_ORDERS - 1))
+
+/* an entry pinned to be read from the region */
+typedef struct shm_ref {
+    long off;                  /* offset of its block */
+    long wipes;                /* wipes of the region when it was pinned */
+    char *data;                /* the object, in the region */
+    long size;                 /* its size */
+    cache_meta meta;           /* its meta */
+} shm_ref;
+
+int shm_init(long size);
+int shm_attach(int fd);
+int shm_fd();
+int shm_enabled();
+int shm_insert(char *cache_id, struct iovec *iov, int iovcnt, long size,
+               cache_meta *meta);
+int shm_pin(char *cache_id, shm_ref *ref);
+void shm_unpin(shm_ref *ref);
+int shm_remove(char *cache_id);
+void shm_report(FILE *fp);
+
+#endif /* __SHM_CACHE_H__ */
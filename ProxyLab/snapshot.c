@@ -0,0 +1,191 @@
+/*
+ * snapshot.c
+ *
+ * save the memory cache to a file and load it back at startup, so a
+ * restarted proxy serves warm hits right away. The file is an index of
+ * all items followed by their ids and contents. Loading maps the file and
+ * points the items into the mapping, nothing is copied or checked until
+ * the first hit of an item.
+ *
+ * A snapshot is written to a temporary file first and renamed over the
+ * old one, so a crash while saving never leaves half a snapshot behind.
+ */
+
+#include "snapshot.h"
+#include "negative.h"
+
+/*
+ * write_items
+ *
+ * write the pinned items to path through a temporary file. return -1 if
+ * failed.
+ */
+static int write_items(cache_item **items, int count, char *path) {
+    char tmp_path[MAXLINE];
+    snapshot_header header;
+    snapshot_entry *entries;
+    cache_chunk *chunk;
+    FILE *fp;
+    long offset;
+    int i, rc = -1;
+
+    if ((entries = (snapshot_entry *)Calloc(count + 1,
+                                sizeof(snapshot_entry))) == NULL) {
+        return -1;
+    }
+
+    /* lay out the ids and contents after the index */
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.count = count;
+    offset = sizeof(header) + count * sizeof(snapshot_entry);
+    for (i = 0; i < count; i++) {
+        entries[i].id_len = strlen(items[i]->id);
+        entries[i].id_offset = offset;
+        offset += entries[i].id_len + 1;
+        entries[i].size = items[i]->size;
+        entries[i].content_offset = offset;
+        offset += items[i]->size;
+        entries[i].checksum = cache_checksum(items[i]);
+        entries[i].meta = items[i]->meta;
+    }
+
+    snprintf(tmp_path, MAXLINE, "%s.tmp", path);
+    if ((fp = fopen(tmp_path, "w")) == NULL) {
+        unix_error("snapshot_save fopen error");
+        Free(entries);
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(entries, sizeof(snapshot_entry), count, fp);
+    for (i = 0; i < count; i++) {
+        fwrite(items[i]->id, 1, entries[i].id_len + 1, fp);
+        for (chunk = items[i]->chunks; chunk != NULL; chunk = chunk->next) {
+            fwrite(chunk->data, 1, chunk->len, fp);
+        }
+    }
+    /* on disk before it replaces the old one */
+    if (fflush(fp) == 0 && !ferror(fp) && fsync(fileno(fp)) == 0) {
+        rc = 1;
+    }
+    if (fclose(fp) != 0 || (rc == 1 && rename(tmp_path, path) != 0)) {
+        rc = -1;
+    }
+    if (rc == -1) {
+        unix_error("snapshot_save write error");
+        unlink(tmp_path);
+    }
+    Free(entries);
+    return rc;
+}
+
+/*
+ * snapshot_save
+ *
+ * write all items of the cache to path, oldest first. return the number
+ * of items saved, -1 if failed.
+ */
+int snapshot_save(cache *pcache, char *path) {
+    cache_item **items;
+    int i, count, rc;
+
+    if ((items = cache_pin_all(pcache, &count)) == NULL) {
+        return -1;
+    }
+    rc = write_items(items, count, path);
+    for (i = 0; i < count; i++) {
+        cache_unpin(items[i]);
+    }
+    Free(items);
+    return rc == -1 ? -1 : count;
+}
+
+/*
+ * snapshot_load_fd
+ *
+ * map a snapshot and insert its items. Only the index is checked here,
+ * the contents are checked on their first hit. return the number of items
+ * loaded, -1 if the snapshot is not valid.
+ */
+static int snapshot_load_fd(cache *pcache, int fd) {
+    struct stat st;
+    snapshot_header *header;
+    snapshot_entry *entries, *entry;
+    cache_map *map;
+    char *base;
+    long i;
+    int count = 0;
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(snapshot_header)) {
+        return -1;
+    }
+    if ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                     fd, 0)) == MAP_FAILED) {
+        unix_error("snapshot_load mmap error");
+        return -1;
+    }
+    header = (snapshot_header *)base;
+    if (header->magic != SNAPSHOT_MAGIC ||
+        header->version != SNAPSHOT_VERSION || header->count < 0 ||
+        header->count > (st.st_size - sizeof(snapshot_header)) /
+                        sizeof(snapshot_entry)) {
+        Munmap(base, st.st_size);
+        return -1;
+    }
+
+    if ((map = (cache_map *)Malloc(sizeof(cache_map))) == NULL) {
+        Munmap(base, st.st_size);
+        return -1;
+    }
+    map->addr = base;
+    map->len = st.st_size;
+    atomic_init(&map->refcnt, 1);
+
+    entries = (snapshot_entry *)(base + sizeof(snapshot_header));
+    for (i = 0; i < header->count; i++) {
+        entry = &entries[i];
+        /* skip entries that point outside of the file */
+        if (entry->id_len < 0 || entry->size < 0 ||
+            entry->size > pcache->max_size || entry->id_offset < 0 ||
+            entry->id_offset + entry->id_len >= st.st_size ||
+            base[entry->id_offset + entry->id_len] != '\0' ||
+            entry->content_offset < 0 ||
+            entry->content_offset + entry->size > st.st_size ||
+            entry->meta.header_len < 0 ||
+            entry->meta.header_len > entry->size ||
+            entry->meta.raw_size < 0 ||
+            (entry->meta.vary != 0 && entry->meta.vary != 1)) {
+            continue;
+        }
+        /* errors cached before the restart may be due again */
+        if (negative_expired(&entry->meta)) {
+            continue;
+        }
+        if (insert_mapped(base + entry->id_offset,
+                          base + entry->content_offset, entry->size,
+                          entry->checksum, &entry->meta, map,
+                          pcache) == 1) {
+            count++;
+        }
+    }
+    /* the items keep it mapped from now on */
+    cache_map_put(map);
+    return count;
+}
+
+/*
+ * snapshot_load
+ *
+ * load the snapshot at path into the cache. return the number of items
+ * loaded, -1 if there is no valid snapshot.
+ */
+int snapshot_load(cache *pcache, char *path) {
+    int fd, count;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    }
+    count = snapshot_load_fd(pcache, fd);
+    close(fd);
+    return count;
+}
@@ -0,0 +1,39 @@
+/*
+ * snapshot.h
+ *
+ * save the memory cache to a file and load it back at startup, so a
+ * restarted proxy serves warm hits right away. The file is an index of
+ * all items followed by their ids and contents. Loading maps the file and
+ * points the items into the mapping, nothing is copied or checked until
+ * the first hit of an item.
+ */
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include "cache.h"
+
+#define SNAPSHOT_MAGIC 0x70736e70
+#define SNAPSHOT_VERSION 5
+
+/* start of the file */
+typedef struct snapshot_header {
+    unsigned int magic;        /* SNAPSHOT_MAGIC */
+    unsigned int version;      /* SNAPSHOT_VERSION */
+    long count;                /* number of entries that follow */
+} snapshot_header;
+
+/* one item, offsets are from the start of the file */
+typedef struct snapshot_entry {
+    long id_offset;            /* where the id is, NUL terminated */
+    long content_offset;       /* where the content is */
+    int id_len;                /* length of the id without the NUL */
+    int size;                  /* size of the content */
+    unsigned long checksum;    /* cache_checksum of the content */
+    cache_meta meta;           /* meta of the item */
+} snapshot_entry;
+
+int snapshot_save(cache *pcache, char *path);
+int snapshot_load(cache *pcache, char *path);
+
+#endif /* __SNAPSHOT_H__ */
@@ -0,0 +1,202 @@
+/*
+ * stats.c
+ *
+ * counters of the proxy. Every thread adds to its own block of counters,
+ * so counting never writes a cache line another thread uses. A report sums
+ * the blocks of the live threads and what the exited ones left behind.
+ */
+
+#include <stdatomic.h>
+#include "csapp.h"
+#include "stats.h"
+
+/* the counters of one thread */
+typedef struct stat_block {
+    atomic_long count[STAT_COUNT];
+    struct stat_block *next;
+} stat_block;
+
+static stat_block *blocks = NULL;      /* blocks of live threads */
+static long retired[STAT_COUNT];       /* sums of exited threads */
+static sem_t mutex;                    /* protects the two above */
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t block_key;
+static __thread stat_block *my_block = NULL;
+
+/*
+ * release_block
+ *
+ * thread exit destructor, fold the counters into the retired sums.
+ */
+static void release_block(void *arg) {
+    stat_block *block = (stat_block *)arg;
+    stat_block **link;
+    int i;
+
+    P(&mutex);
+    for (i = 0; i < STAT_COUNT; i++) {
+        retired[i] += atomic_load(&block->count[i]);
+    }
+    for (link = &blocks; *link != block; link = &(*link)->next) {
+        ;
+    }
+    *link = block->next;
+    V(&mutex);
+    Free(block);
+}
+
+static void init_stats() {
+    Sem_init(&mutex, 0, 1);
+    pthread_key_create(&block_key, release_block);
+}
+
+/*
+ * new_block
+ *
+ * give the calling thread its own block of counters.
+ */
+static stat_block *new_block() {
+    stat_block *block;
+    int i;
+
+    Pthread_once(&stats_once, init_stats);
+    if ((block = (stat_block *)Malloc(sizeof(stat_block))) == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < STAT_COUNT; i++) {
+        atomic_init(&block->count[i], 0);
+    }
+    P(&mutex);
+    block->next = blocks;
+    blocks = block;
+    V(&mutex);
+    pthread_setspecific(block_key, block);
+    return block;
+}
+
+/*
+ * stat_add
+ *
+ * add n to a counter of the calling thread. Only this thread writes the
+ * block, so a plain load and store is enough.
+ */
+void stat_add(int id, long n) {
+    if (my_block == NULL && (my_block = new_block()) == NULL) {
+        return;
+    }
+    atomic_store_explicit(&my_block->count[id],
+        atomic_load_explicit(&my_block->count[id], memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+/*
+ * stat_get
+ *
+ * sum of one counter over all threads.
+ */
+long stat_get(int id) {
+    stat_block *block;
+    long sum;
+
+    Pthread_once(&stats_once, init_stats);
+    P(&mutex);
+    sum = retired[id];
+    for (block = blocks; block != NULL; block = block->next) {
+        sum += atomic_load_explicit(&block->count[id], memory_order_relaxed);
+    }
+    V(&mutex);
+    return sum;
+}
+
+/* percentage of part in total, 0 if there is no total */
+static double percent(long part, long total) {
+    return total > 0 ? 100.0 * part / total : 0.0;
+}
+
+/*
+ * stats_report
+ *
+ * print all counters in a human readable form.
+ */
+void stats_report(FILE *fp) {
+    long hits = stat_get(STAT_CACHE_HITS);
+    long misses = stat_get(STAT_CACHE_MISSES);
+    long l1_hits = stat_get(STAT_L1_HITS);
+    long l1_misses = stat_get(STAT_L1_MISSES);
+    long disk_hits = stat_get(STAT_DISK_HITS);
+    long disk_misses = stat_get(STAT_DISK_MISSES);
+    long raw = stat_get(STAT_COMPRESS_RAW);
+    long stored = stat_get(STAT_COMPRESS_STORED);
+    long decompressed = stat_get(STAT_DECOMPRESS_HITS);
+    long holds, prefetched;
+
+    fprintf(fp, "requests: %ld\n", stat_get(STAT_REQUESTS));
+    fprintf(fp, "cache: hits %ld misses %ld hit rate %.1f%%\n",
+            hits, misses, percent(hits, hits + misses));
+    fprintf(fp, "l1: hits %ld misses %ld stale %ld hit rate %.1f%%\n",
+            l1_hits, l1_misses, stat_get(STAT_L1_STALE),
+            percent(l1_hits, l1_hits + l1_misses));
+    fprintf(fp, "disk: hits %ld misses %ld hit rate %.1f%% promoted %ld\n",
+            disk_hits, disk_misses, percent(disk_hits, disk_hits + disk_misses),
+            stat_get(STAT_DISK_PROMOTED));
+    fprintf(fp, "disk: writes %ld (%ld KB) segments reclaimed %ld "
+            "objects dropped %ld refused %ld\n",
+            stat_get(STAT_DISK_WRITES), stat_get(STAT_DISK_BYTES) / 1024,
+            stat_get(STAT_DISK_RECLAIMED), stat_get(STAT_DISK_DROPPED),
+            stat_get(STAT_DISK_FULL));
+    fprintf(fp, "compress: objects %ld (%ld KB as %ld KB, ratio %.2f) "
+            "skipped %ld no gain %ld\n",
+            stat_get(STAT_COMPRESSED), raw / 1024, stored / 1024,
+            stored > 0 ? (double)raw / stored : 0.0,
+            stat_get(STAT_COMPRESS_SKIPPED), stat_get(STAT_COMPRESS_NO_GAIN));
+    fprintf(fp, "decompress: hits %ld %.1f us per hit\n", decompressed,
+            decompressed > 0 ? stat_get(STAT_DECOMPRESS_NS) / 1000.0 /
+                               decompressed : 0.0);
+    fprintf(fp, "range: served %ld from cache, blocks hit %ld fetched %ld\n",
+            stat_get(STAT_RANGE_HITS), stat_get(STAT_RANGE_BLOCK_HITS),
+            stat_get(STAT_RANGE_BLOCK_FETCHES));
+    fprintf(fp, "vary: variant hits %ld misses %ld replaced %ld "
+            "refused %ld\n",
+            stat_get(STAT_VARY_HITS), stat_get(STAT_VARY_MISSES),
+            stat_get(STAT_VARY_REPLACED), stat_get(STAT_VARY_REFUSED));
+    fprintf(fp, "negative: stored %ld hits %ld expired %ld refused %ld\n",
+            stat_get(STAT_NEG_STORED), stat_get(STAT_NEG_HITS),
+            stat_get(STAT_NEG_EXPIRED), stat_get(STAT_NEG_REFUSED));
+    fprintf(fp, "admit: queued %ld shed %ld backoffs %ld\n",
+            stat_get(STAT_ADMIT_QUEUED), stat_get(STAT_ADMIT_SHED),
+            stat_get(STAT_ADMIT_BACKOFFS));
+    fprintf(fp, "hedge: sent %ld won %ld over budget %ld at limit %ld\n",
+            stat_get(STAT_HEDGES), stat_get(STAT_HEDGE_WINS),
+            stat_get(STAT_HEDGE_DENIED), stat_get(STAT_HEDGE_LIMITED));
+    prefetched = stat_get(STAT_PREFETCHED);
+    fprintf(fp, "prefetch: queued %ld dropped %ld busy %ld fetched %ld "
+            "used %ld (%.1f%%)\n", stat_get(STAT_PREFETCH_QUEUED), 
+            stat_get(STAT_PREFETCH_DROPPED), stat_get(STAT_PREFETCH_BUSY),
+            prefetched, stat_get(STAT_PREFETCH_USED), prefetched ? 
+            100.0 * stat_get(STAT_PREFETCH_USED) / prefetched : 0.0);
+    fprintf(fp, "prefetch pages: inflated %ld other encoding %ld\n",
+            stat_get(STAT_PREFETCH_INFLATED),
+            stat_get(STAT_PREFETCH_ENCODED));
+    fprintf(fp, "slow: requests %ld\n", stat_get(STAT_SLOW_REQUESTS));
+    fprintf(fp, "shared cache: hits %ld misses %ld\n",
+            stat_get(STAT_SHM_HITS), stat_get(STAT_SHM_MISSES));
+    fprintf(fp, "timeouts: header %ld connect %ld first byte %ld idle %ld\n",
+            stat_get(STAT_TIMEOUT_HEADER), stat_get(STAT_TIMEOUT_CONNECT),
+            stat_get(STAT_TIMEOUT_FIRST_BYTE), stat_get(STAT_TIMEOUT_IDLE));
+    holds = stat_get(STAT_ORIGIN_HOLDS);
+    fprintf(fp, "origin hold: connections %ld avg %.3f ms, buffered %ld "
+            "spilled %ld (%ld KB)\n", holds, holds ? 
+            stat_get(STAT_ORIGIN_HOLD_US) / 1e3 / holds : 0.0,
+            stat_get(STAT_RELAY_BUFFERED), stat_get(STAT_RELAY_SPILLED),
+            stat_get(STAT_RELAY_SPILL_BYTES) >> 10);
+    fprintf(fp, "log: lines %ld dropped %ld\n", stat_get(STAT_LOG_LINES),
+            stat_get(STAT_LOG_DROPPED));
+    fprintf(fp, "purge: removed %ld marked stale %ld, revalidated %ld "
+            "changed %ld\n", stat_get(STAT_PURGED), 
+            stat_get(STAT_PURGE_STALE), stat_get(STAT_REVALIDATED),
+            stat_get(STAT_REVALIDATE_CHANGED));
+    fprintf(fp, "peer: asked %ld answered %ld unreachable %ld\n",
+            stat_get(STAT_PEER_FETCHES), stat_get(STAT_PEER_SERVED),
+            stat_get(STAT_PEER_FAILED));
+    fflush(fp);
+}
@@ -0,0 +1,90 @@
+/*
+ * stats.h
+ *
+ * counters of the proxy. Every thread adds to its own block of counters,
+ * so counting never writes a cache line another thread uses. A report sums
+ * the blocks of the live threads and what the exited ones left behind.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+
+/* every counter the proxy keeps */
+enum stat_id {
+    STAT_REQUESTS,             /* requests parsed */
+    STAT_CACHE_HITS,           /* hits in the shared cache */
+    STAT_CACHE_MISSES,         /* misses in the shared cache */
+    STAT_L1_HITS,              /* hits in the per-thread front cache */
+    STAT_L1_MISSES,            /* lookups the front cache passed on */
+    STAT_L1_STALE,             /* front entries dropped by generation */
+    STAT_DISK_HITS,            /* hits in the disk tier */
+    STAT_DISK_MISSES,          /* misses in the disk tier */
+    STAT_DISK_WRITES,          /* objects written to disk */
+    STAT_DISK_BYTES,           /* bytes written to disk */
+    STAT_DISK_PROMOTED,        /* disk hits copied back to memory */
+    STAT_DISK_RECLAIMED,       /* segments reclaimed */
+    STAT_DISK_DROPPED,         /* objects dropped with their segment */
+    STAT_DISK_FULL,            /* writes refused, all segments in use */
+    STAT_COMPRESSED,           /* objects stored compressed */
+    STAT_COMPRESS_RAW,         /* their bytes before compression */
+    STAT_COMPRESS_STORED,      /* and after */
+    STAT_COMPRESS_SKIPPED,     /* objects of a compressed type */
+    STAT_COMPRESS_NO_GAIN,     /* objects that did not get smaller */
+    STAT_DECOMPRESS_HITS,      /* hits that decompressed */
+    STAT_DECOMPRESS_NS,        /* nanoseconds they spent on it */
+    STAT_RANGE_HITS,           /* range requests answered from the cache */
+    STAT_RANGE_BLOCK_HITS,     /* blocks of ranges found cached */
+    STAT_RANGE_BLOCK_FETCHES,  /* blocks of ranges fetched */
+    STAT_VARY_HITS,            /* variants found for the request */
+    STAT_VARY_MISSES,          /* ids with Vary but not this variant */
+    STAT_VARY_REPLACED,        /* variants that took the slot of another */
+    STAT_VARY_REFUSED,         /* responses with Vary that were not cached */
+    STAT_NEG_STORED,           /* errors and origin failures cached */
+    STAT_NEG_HITS,             /* requests answered with one of them */
+    STAT_NEG_EXPIRED,          /* of them found past their time to live */
+    STAT_NEG_REFUSED,          /* error responses not to be cached */
+    STAT_ADMIT_QUEUED,         /* fetches that waited for room */
+    STAT_ADMIT_SHED,           /* fetches refused with 503 */
+    STAT_ADMIT_BACKOFFS,       /* limits shrunk after a slow fetch */
+    STAT_HEDGES,               /* fetches sent a second time */
+    STAT_HEDGE_WINS,           /* of them that answered first */
+    STAT_HEDGE_DENIED,         /* hedges over the budget */
+    STAT_HEDGE_LIMITED,        /* hedges with the origin at its limit */
+    STAT_PREFETCH_QUEUED,      /* links of pages queued to prefetch */
+    STAT_PREFETCH_DROPPED,     /* not queued, the queue was full */
+    STAT_PREFETCH_BUSY,        /* not prefetched, the proxy was busy */
+    STAT_PREFETCHED,           /* prefetches done */
+    STAT_PREFETCH_USED,        /* prefetched items hit later */
+    STAT_PREFETCH_INFLATED,    /* compressed pages inflated to scan */
+    STAT_PREFETCH_ENCODED,     /* not scanned, in an unknown encoding */
+    STAT_SLOW_REQUESTS,        /* requests over the slow threshold */
+    STAT_SHM_HITS,             /* objects copied from the shared cache */
+    STAT_SHM_MISSES,           /* lookups the shared cache did not have */
+    STAT_TIMEOUT_HEADER,       /* clients too slow to send the request */
+    STAT_TIMEOUT_CONNECT,      /* origins too slow to connect to */
+    STAT_TIMEOUT_FIRST_BYTE,   /* origins too slow to start answering */
+    STAT_TIMEOUT_IDLE,         /* transfers that stalled */
+    STAT_ORIGIN_HOLDS,         /* origin connections given back */
+    STAT_ORIGIN_HOLD_US,       /* us they were held in all */
+    STAT_RELAY_BUFFERED,       /* bodies buffered for the client */
+    STAT_RELAY_SPILLED,        /* of them that spilled to a file */
+    STAT_RELAY_SPILL_BYTES,    /* bytes that went there */
+    STAT_LOG_LINES,            /* lines the log thread wrote */
+    STAT_LOG_DROPPED,          /* records dropped with their ring full */
+    STAT_PURGED,               /* ids purged from the caches */
+    STAT_PURGE_STALE,          /* ids soft purged */
+    STAT_REVALIDATED,          /* stale items the origin said are fresh */
+    STAT_REVALIDATE_CHANGED,   /* and those it sent again */
+    STAT_PEER_FETCHES,         /* misses asked of the peer owning them */
+    STAT_PEER_SERVED,          /* requests of peers served here */
+    STAT_PEER_FAILED,          /* peers that could not be reached */
+    STAT_COUNT
+};
+
+void stat_add(int id, long n);
+long stat_get(int id);
+void stats_report(FILE *fp);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,333 @@
+/*
+ * timer.c
+ *
+ * the timing wheel and the io_timers of the blocking threads. A slot is a
+ * circular list with the slot head as its sentinel. The slot of a timer
+ * is picked by the bits of its expiry tick for its level, so a timer of
+ * level 1 sits in the slot its expiry falls in, and is spread over level
+ * 0 exactly when the wheel gets to the start of that slot. Expiries beyond
+ * the last level wait in its farthest slot and go round again.
+ *
+ * The io_timers share one wheel under one mutex. Their callbacks run with
+ * the mutex held, so once io_timer_cancel returns the timer is not firing
+ * anymore, and the socket can be closed without another thread shutting
+ * down whatever gets its descriptor next.
+ */
+
+#include <sys/socket.h>
+#include "csapp.h"
+#include "timer.h"
+#include "stats.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+static timer_wheel wheel;      /* of the io_timers */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /* guards it */
+static pthread_cond_t armed = PTHREAD_COND_INITIALIZER; /* it got a timer */
+static int enabled = 0;
+
+/* ms of the monotonic clock */
+static long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * slot_insert
+ *
+ * add a timer at the end of a slot.
+ */
+static void slot_insert(timer *head, timer *t) {
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/*
+ * slot_unlink
+ *
+ * take a timer out of its slot.
+ */
+static void slot_unlink(timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+/*
+ * place
+ *
+ * put a timer into the slot of the lowest level its expiry fits in. One
+ * that is due now is only placed by a cascade, before the slot of now is
+ * fired.
+ */
+static void place(timer_wheel *w, timer *t) {
+    unsigned long delta, at;
+    int level;
+
+    delta = t->expires - w->now;
+    at = t->expires;
+    for (level = 0; level < TIMER_LEVELS - 1 &&
+         delta >= 1UL << ((level + 1) * TIMER_BITS); level++)
+        ;
+    if (delta >= 1UL << (TIMER_LEVELS * TIMER_BITS)) {
+        at = w->now + (1UL << (TIMER_LEVELS * TIMER_BITS)) - 1;
+    }
+    slot_insert(&w->slots[level][(at >> (level * TIMER_BITS)) & TIMER_MASK],
+                t);
+}
+
+/*
+ * cascade
+ *
+ * spread the slot of a level the wheel just got to over the levels below.
+ */
+static void cascade(timer_wheel *w, int level) {
+    timer *head = &w->slots[level][(w->now >> (level * TIMER_BITS)) &
+                                   TIMER_MASK];
+    timer *t;
+
+    while ((t = head->next) != head) {
+        slot_unlink(t);
+        place(w, t);
+    }
+}
+
+/*
+ * wheel_init
+ *
+ * make an empty wheel that is at tick now.
+ */
+void wheel_init(timer_wheel *w, unsigned long now) {
+    int i, j;
+
+    w->now = now;
+    w->count = 0;
+    for (i = 0; i < TIMER_LEVELS; i++) {
+        for (j = 0; j < TIMER_SLOTS; j++) {
+            w->slots[i][j].next = w->slots[i][j].prev = &w->slots[i][j];
+        }
+    }
+}
+
+/*
+ * wheel_add
+ *
+ * arm a timer to fire at tick expires, or move it there if it is armed.
+ */
+void wheel_add(timer_wheel *w, timer *t, unsigned long expires) {
+    wheel_del(w, t);
+    /* the slot of now is done, a timer that is due fires on the next tick */
+    t->expires = expires > w->now ? expires : w->now + 1;
+    place(w, t);
+    t->armed = 1;
+    w->count++;
+}
+
+/*
+ * wheel_del
+ *
+ * cancel a timer, nothing happens if it is not armed.
+ */
+void wheel_del(timer_wheel *w, timer *t) {
+    if (!t->armed) {
+        return;
+    }
+    slot_unlink(t);
+    t->armed = 0;
+    w->count--;
+}
+
+/*
+ * wheel_advance
+ *
+ * move the wheel to tick now, firing every timer that expires on the way.
+ * A timer fn may arm timers again. return the number fired.
+ */
+int wheel_advance(timer_wheel *w, unsigned long now) {
+    timer due, *head, *t;
+    int level, fired = 0;
+
+    /* nothing to fire, nothing to cascade */
+    if (w->count == 0) {
+        w->now = now > w->now ? now : w->now;
+        return 0;
+    }
+    while (w->now < now) {
+        w->now++;
+        /* the levels that turned over take the next slot of the one above */
+        for (level = 1; level < TIMER_LEVELS &&
+             (w->now & ((1UL << (level * TIMER_BITS)) - 1)) == 0; level++)
+            ;
+        while (--level >= 1) {
+            cascade(w, level);
+        }
+
+        /* take the slot off first, the timers may be armed into it again */
+        head = &w->slots[0][w->now & TIMER_MASK];
+        if (head->next == head) {
+            continue;
+        }
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = due.prev->next = &due;
+        head->next = head->prev = head;
+        while ((t = due.next) != &due) {
+            slot_unlink(t);
+            t->armed = 0;
+            w->count--;
+            t->fn(t);
+            fired++;
+        }
+    }
+    return fired;
+}
+
+/*
+ * timer_thread
+ *
+ * advance the shared wheel every tick while it has timers.
+ */
+static void *timer_thread(void *vargp) {
+    struct timespec ts;
+
+    Pthread_detach(pthread_self());
+    ts.tv_sec = 0;
+    ts.tv_nsec = TIMER_TICK * 1000000L;
+    while (1) {
+        pthread_mutex_lock(&lock);
+        while (wheel.count == 0) {
+            pthread_cond_wait(&armed, &lock);
+        }
+        wheel_advance(&wheel, now_ms() / TIMER_TICK);
+        pthread_mutex_unlock(&lock);
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * timers_init
+ *
+ * start the thread of the shared wheel. return -1 if failed.
+ */
+int timers_init() {
+    pthread_t tid;
+
+    wheel_init(&wheel, now_ms() / TIMER_TICK);
+    if (pthread_create(&tid, NULL, timer_thread, NULL) != 0) {
+        fprintf(stderr, "timers_init: can not start the timer thread\n");
+        return -1;
+    }
+    enabled = 1;
+    return 1;
+}
+
+/*
+ * timers_enabled
+ *
+ * return 1 if io_timers are armed at all.
+ */
+int timers_enabled() {
+    return enabled;
+}
+
+/*
+ * io_timer_fire
+ *
+ * fn of an io_timer. An idle timer with progress since it was armed is
+ * pushed back to its new deadline, otherwise its socket is shut down.
+ */
+static void io_timer_fire(timer *t) {
+    io_timer *it = (io_timer *)t;
+    long left;
+
+    if (it->idle > 0 &&
+        (left = atomic_load(&it->touched) + it->idle - now_ms()) > 0) {
+        wheel_add(&wheel, t, wheel.now + (left + TIMER_TICK - 1) / TIMER_TICK);
+        return;
+    }
+    /* set before, the thread wakes up as soon as the socket is shut */
+    atomic_store(&it->fired, 1);
+    shutdown(it->fd, SHUT_RDWR);
+    stat_add(it->stat, 1);
+}
+
+/*
+ * io_timer_init
+ *
+ * set up an io_timer that is not armed.
+ */
+void io_timer_init(io_timer *it) {
+    memset(&it->t, 0, sizeof(it->t));
+    it->t.fn = io_timer_fire;
+    it->fd = -1;
+    it->idle = 0;
+    atomic_init(&it->touched, 0);
+    atomic_init(&it->fired, 0);
+}
+
+/*
+ * io_timer_arm
+ *
+ * shut fd down if ms pass, or with idle, if ms pass without a touch. An
+ * armed timer is moved. stat is the counter to add to if it fires.
+ * Nothing happens if ms is 0.
+ */
+void io_timer_arm(io_timer *it, int fd, long ms, int idle, int stat) {
+    long now;
+
+    if (!enabled || ms <= 0) {
+        return;
+    }
+    now = now_ms();
+    pthread_mutex_lock(&lock);
+    it->fd = fd;
+    it->stat = stat;
+    it->idle = idle ? ms : 0;
+    atomic_store(&it->touched, now);
+    /* an empty wheel was left behind, it catches up at once */
+    if (wheel.count == 0) {
+        wheel_advance(&wheel, now / TIMER_TICK);
+        pthread_cond_signal(&armed);
+    }
+    wheel_add(&wheel, &it->t, (now + ms + TIMER_TICK - 1) / TIMER_TICK);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * io_timer_touch
+ *
+ * there was progress, an idle timer starts over.
+ */
+void io_timer_touch(io_timer *it) {
+    if (it->idle > 0) {
+        atomic_store_explicit(&it->touched, now_ms(), memory_order_relaxed);
+    }
+}
+
+/*
+ * io_timer_cancel
+ *
+ * disarm an io_timer. Once this returns it does not fire anymore.
+ */
+void io_timer_cancel(io_timer *it) {
+    if (!enabled) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    wheel_del(&wheel, &it->t);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * io_timer_fired
+ *
+ * return 1 if the timer shut its socket down.
+ */
+int io_timer_fired(io_timer *it) {
+    return atomic_load(&it->fired);
+}
@@ -0,0 +1,72 @@
+/*
+ * timer.h
+ *
+ * timeouts, on a hierarchical timing wheel. The wheel has TIMER_LEVELS
+ * levels of TIMER_SLOTS slots, a slot of level 0 is one tick of TIMER_TICK
+ * ms and a slot of every next level spans a whole turn of the level
+ * below. A timer goes into the slot of the lowest level its expiry fits,
+ * and when a level turns over, the next slot of the level above is spread
+ * over it. Timers are linked into their slot through themselves, so arming,
+ * cancelling and expiring are all O(1) and need no memory.
+ *
+ * A wheel alone takes no lock and keeps no time, whoever owns it advances
+ * it, e.g. an event loop from its poll timeout. The blocking threads of the
+ * proxy share one wheel that a thread of its own advances every tick, and
+ * io_timers on it: a deadline on one socket that shuts the socket down when
+ * it passes, which wakes the thread blocked on it with an error or EOF. An
+ * idle io_timer is only pushed back when it fires, touching it on progress
+ * is one atomic store.
+ */
+
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdatomic.h>
+
+/* ms of one tick */
+#define TIMER_TICK 10
+/* levels of the wheel and slots in each, a power of 2 */
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+
+/* a timer, owned by whoever arms it */
+typedef struct timer {
+    struct timer *next;        /* in its slot */
+    struct timer *prev;
+    unsigned long expires;     /* tick it fires at */
+    int armed;                 /* in a slot */
+    void (*fn)(struct timer *t); /* called when it fires, no longer armed */
+} timer;
+
+/* a wheel of timers */
+typedef struct timer_wheel {
+    unsigned long now;         /* tick the wheel is at */
+    long count;                /* timers armed */
+    timer slots[TIMER_LEVELS][TIMER_SLOTS]; /* heads of the slot lists */
+} timer_wheel;
+
+/* a deadline on the blocking I/O of one socket */
+typedef struct io_timer {
+    timer t;                   /* on the shared wheel, first */
+    int fd;                    /* shut down when it passes */
+    int stat;                  /* counter to add to then */
+    long idle;                 /* ms without progress, 0 for a deadline */
+    atomic_long touched;       /* ms of the last progress */
+    atomic_int fired;          /* fd was shut down */
+} io_timer;
+
+void wheel_init(timer_wheel *w, unsigned long now);
+void wheel_add(timer_wheel *w, timer *t, unsigned long expires);
+void wheel_del(timer_wheel *w, timer *t);
+int wheel_advance(timer_wheel *w, unsigned long now);
+
+int timers_init();
+int timers_enabled();
+void io_timer_init(io_timer *it);
+void io_timer_arm(io_timer *it, int fd, long ms, int idle, int stat);
+void io_timer_touch(io_timer *it);
+void io_timer_cancel(io_timer *it);
+int io_timer_fired(io_timer *it);
+
+#endif /* __TIMER_H__ */
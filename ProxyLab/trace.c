@@ -0,0 +1,196 @@
+/*
+ * trace.c
+ *
+ * timing of every request by phase. A log line looks like
+ *
+ *   slow 812.402 ms miss "GET http://a/b HTTP/1.1" request=0.051
+ *   cache=0.012 admit=0.003 dns=0.540 connect=0.204 header=800.117 ...
+ *
+ * with the milliseconds each phase took, from the end of the one marked
+ * before it. A phase that was not reached is left out, and a sampled
+ * trace, tagged "trace", shows those as "-", so every phase is there.
+ */
+
+#include <stdatomic.h>
+#include "csapp.h"
+#include "trace.h"
+#include "stats.h"
+#include "logger.h"
+
+static const char *names[TRACE_PHASES] = {
+    "start", "request", "cache", "admit", "dns", "connect", "header",
+    "body", "store", "end"
+};
+
+static long slow_ns;           /* log requests slower than this, 0 never */
+static int every;              /* log one request in every, 0 never */
+static int phases;             /* time every phase, not just the whole */
+static __thread req_trace *current = NULL;  /* request of this thread */
+static atomic_uint count;      /* requests begun, for sampling */
+
+/*
+ * trace_init
+ *
+ * log requests that take longer than slow_ms, and one in every sample
+ * requests. 0 turns either off.
+ */
+void trace_init(long slow_ms, int sample) {
+    slow_ns = slow_ms * 1000000L;
+    every = sample;
+    phases = slow_ns > 0 || every > 0;
+}
+
+/*
+ * trace_begin
+ *
+ * start the trace of the request the thread is about to serve.
+ */
+void trace_begin(req_trace *trace) {
+    if (!phases && !log_enabled()) {
+        return;
+    }
+    trace->marked = 1U << TRACE_START;
+    trace->line[0] = '\0';
+    trace->outcome = "none";
+    trace->status = 0;
+    trace->sent = 0;
+    trace->object = -1;
+    trace->sampled = every > 0 && atomic_fetch_add(&count, 1) % every == 0;
+    current = trace;
+    clock_gettime(CLOCK_MONOTONIC, &trace->at[TRACE_START]);
+}
+
+/*
+ * trace_line
+ *
+ * keep the request line of the request, without its line end.
+ */
+void trace_line(char *line) {
+    if (current == NULL) {
+        return;
+    }
+    snprintf(current->line, TRACE_LINE_MAX, "%.*s",
+             (int)strcspn(line, "\r\n"), line);
+}
+
+/*
+ * trace_outcome
+ *
+ * say how the request was served, outcome is a constant string.
+ */
+void trace_outcome(char *outcome) {
+    if (current != NULL) {
+        current->outcome = outcome;
+    }
+}
+
+/*
+ * trace_mark
+ *
+ * the request reached the end of phase.
+ */
+void trace_mark(int phase) {
+    if (current == NULL || !phases) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &current->at[phase]);
+    current->marked |= 1U << phase;
+}
+
+/*
+ * trace_status
+ *
+ * a response with this header block is being sent. Only the first one
+ * counts, the status of an object cached with it, say, is not.
+ */
+void trace_status(char *header) {
+    if (current == NULL || current->status != 0) {
+        return;
+    }
+    /* HTTP/1.x NNN */
+    if (strncmp(header, "HTTP/", 5) == 0 && (header = strchr(header, ' '))) {
+        current->status = atoi(header + 1);
+    }
+}
+
+/*
+ * trace_sent
+ *
+ * n bytes were sent to the client, nothing if n is -1.
+ */
+void trace_sent(long n) {
+    if (current != NULL && n > 0) {
+        current->sent += n;
+    }
+}
+
+/*
+ * trace_object
+ *
+ * the response is of an object with n bytes of body, whatever part of it
+ * was sent. Only the first one counts, like the status.
+ */
+void trace_object(long n) {
+    if (current != NULL && current->object < 0 && n >= 0) {
+        current->object = n;
+    }
+}
+
+/* ns from a to b */
+static long elapsed(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000000L + (b->tv_nsec - a->tv_nsec);
+}
+
+/*
+ * trace_end
+ *
+ * the request is done, log it to the access log, and with its phases if
+ * it was slow or sampled.
+ */
+void trace_end() {
+    req_trace *trace = current;
+    char buf[MAXLINE];
+    struct timespec *prev;
+    long total;
+    int phase, n;
+
+    if (trace == NULL) {
+        return;
+    }
+    current = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &trace->at[TRACE_END]);
+    trace->marked |= 1U << TRACE_END;
+    total = elapsed(&trace->at[TRACE_START], &trace->at[TRACE_END]);
+    if (log_enabled()) {
+        log_access(trace->line, trace->status, trace->sent, trace->object,
+                   trace->outcome, total / 1000, (trace->marked & (1U << TRACE_HEADER)) ?
+                   elapsed(&trace->at[TRACE_START],
+                           &trace->at[TRACE_HEADER]) / 1000 : -1);
+    }
+    if (slow_ns > 0 && total >= slow_ns) {
+        stat_add(STAT_SLOW_REQUESTS, 1);
+    } else if (!trace->sampled) {
+        return;
+    }
+
+    n = snprintf(buf, MAXLINE, "%s %.3f ms %s \"%s\"",
+                 trace->sampled ? "trace" : "slow", total / 1e6,
+                 trace->outcome, trace->line);
+    prev = &trace->at[TRACE_START];
+    for (phase = TRACE_START + 1; phase < TRACE_PHASES && n < MAXLINE;
+         phase++) {
+        if (trace->marked & (1U << phase)) {
+            n += snprintf(buf + n, MAXLINE - n, " %s=%.3f", names[phase],
+                          elapsed(prev, &trace->at[phase]) / 1e6);
+            prev = &trace->at[phase];
+        } else if (trace->sampled) {
+            n += snprintf(buf + n, MAXLINE - n, " %s=-", names[phase]);
+        }
+    }
+    if (n > MAXLINE - 2) {
+        n = MAXLINE - 2;
+    }
+    buf[n++] = '\n';
+    buf[n] = '\0';
+    fputs(buf, stderr);
+}
@@ -0,0 +1,60 @@
+/*
+ * trace.h
+ *
+ * timing of every request by phase: each boundary between two phases is
+ * marked with the monotonic clock as the request gets there, in the
+ * trace of the thread serving it, so the functions deep in the path mark
+ * it without being passed anything. A request slower than a threshold is
+ * logged with the time of each of its phases, and one in every so many
+ * is logged whatever its time. With neither, marking costs one test.
+ * With an access log, every request is logged with its status, the bytes
+ * sent and its time, see logger.h, and only the start and end are timed
+ * unless the phases are logged too.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <time.h>
+
+/* the phases, each marked when it ends */
+enum trace_phase {
+    TRACE_START,               /* the connection was taken */
+    TRACE_REQUEST,             /* its request line and headers are read */
+    TRACE_CACHE,               /* looked up in the cache, a hit was sent */
+    TRACE_ADMIT,               /* let in to fetch from the origin */
+    TRACE_DNS,                 /* the origin is resolved */
+    TRACE_CONNECT,             /* connected to it, the request is sent */
+    TRACE_HEADER,              /* its response header has arrived */
+    TRACE_BODY,                /* the body is passed on to the client */
+    TRACE_STORE,               /* the response is in the cache */
+    TRACE_END,                 /* done */
+    TRACE_PHASES
+};
+
+/* most of the request line a log line shows */
+#define TRACE_LINE_MAX 256
+
+/* the trace of one request */
+typedef struct req_trace {
+    struct timespec at[TRACE_PHASES]; /* when each phase ended */
+    unsigned int marked;       /* bit of every phase that did */
+    char line[TRACE_LINE_MAX]; /* the request line */
+    char *outcome;             /* hit, miss, ... */
+    int status;                /* of the response sent, 0 before one */
+    long sent;                 /* bytes sent to the client */
+    long object;               /* bytes of body of the object, -1 unknown */
+    int sampled;               /* logged whatever its time */
+} req_trace;
+
+void trace_init(long slow_ms, int sample);
+void trace_begin(req_trace *trace);
+void trace_line(char *line);
+void trace_outcome(char *outcome);
+void trace_mark(int phase);
+void trace_status(char *header);
+void trace_sent(long n);
+void trace_object(long n);
+void trace_end();
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,245 @@
+/*
+ * upgrade.c
+ *
+ * hand the port and the shared cache over to a new binary. The old
+ * process makes a socket pair, forks and runs its binary again with one
+ * end as UPGRADE_FD, named in UPGRADE_ENV. It sends an upgrade_msg with
+ * the listening sockets and the memfd of the shared cache as SCM_RIGHTS,
+ * and waits for one byte back, which the new process sends once it is set
+ * up. If that byte does not come, the new process is killed and the old
+ * one goes on serving as if nothing happened.
+ *
+ * The sockets are the same ones in both processes, connections that
+ * arrive while both run wait in the same accept queue, and the old
+ * process stops taking them as soon as the new one is ready.
+ */
+
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include "csapp.h"
+#include "upgrade.h"
+#include "listener.h"
+#include "shm_cache.h"
+
+/* what is sent along with the descriptors */
+typedef struct upgrade_msg {
+    int nlisteners;            /* listening sockets, the first descriptors */
+    int shared;                /* the memfd of the shared cache follows */
+} upgrade_msg;
+
+extern char **environ;
+
+static char **args;            /* our arguments, the new binary gets them */
+static int channel = -1;       /* socket to the old process, -1 if none */
+
+/*
+ * upgrade_init
+ *
+ * remember the arguments the proxy was run with.
+ */
+void upgrade_init(char *argv[]) {
+    args = argv;
+}
+
+/*
+ * upgrade_inherit
+ *
+ * if we were run by a hot upgrade, take the listening sockets of the old
+ * process into fds, at most max, and the memfd of its shared cache into
+ * shared_fd, -1 if it had none. return the number of sockets, 0 if this
+ * is no upgrade, -1 if nothing usable came.
+ */
+int upgrade_inherit(int *fds, int max, int *shared_fd) {
+    char control[CMSG_SPACE(sizeof(int) * (UPGRADE_MAX_FDS + 1))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    upgrade_msg um;
+    int *received;
+    char *env;
+    int n = 0, i;
+
+    *shared_fd = -1;
+    if ((env = getenv(UPGRADE_ENV)) == NULL) {
+        return 0;
+    }
+    channel = atoi(env);
+    unsetenv(UPGRADE_ENV);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &um;
+    iov.iov_len = sizeof(um);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(channel, &msg, MSG_CMSG_CLOEXEC) == sizeof(um) &&
+        (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+        cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        received = (int *)CMSG_DATA(cmsg);
+        if (um.nlisteners > 0 && um.nlisteners <= max &&
+            um.nlisteners + (um.shared != 0) == n) {
+            memcpy(fds, received, um.nlisteners * sizeof(int));
+            if (um.shared) {
+                *shared_fd = received[um.nlisteners];
+            }
+            fprintf(stderr, "upgrade: took over %d sockets%s\n",
+                    um.nlisteners, um.shared ? " and the shared cache" : "");
+            return um.nlisteners;
+        }
+        for (i = 0; i < n; i++) {
+            Close(received[i]);
+        }
+    }
+    fprintf(stderr, "upgrade: nothing usable from the old process\n");
+    Close(channel);
+    channel = -1;
+    return -1;
+}
+
+/*
+ * upgrade_ready
+ *
+ * tell the old process we serve now, if we took over from one.
+ */
+void upgrade_ready() {
+    char c = 'R';
+
+    if (channel < 0) {
+        return;
+    }
+    if (write(channel, &c, 1) != 1) {
+        unix_error("upgrade_ready write error");
+    }
+    Close(channel);
+    channel = -1;
+}
+
+/*
+ * run_new
+ *
+ * in the forked child, run our binary again with the socket to the old
+ * process as UPGRADE_FD, and no other descriptor of the old process but
+ * the standard ones. Never returns.
+ */
+static void run_new(int fd, char **envp) {
+    sigset_t none;
+
+    /* the signal mask survives exec, the new proxy sets its own */
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (dup2(fd, UPGRADE_FD) < 0 || fcntl(UPGRADE_FD, F_SETFD, 0) < 0) {
+        _exit(127);
+    }
+    close_range(UPGRADE_FD + 1, ~0U, 0);
+    execvpe(args[0], args, envp);
+    _exit(127);
+}
+
+/*
+ * send_fds
+ *
+ * send msg with count descriptors. return -1 if failed.
+ */
+static int send_fds(int sock, upgrade_msg *um, int *fds, int count) {
+    char control[CMSG_SPACE(sizeof(int) * (UPGRADE_MAX_FDS + 1))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = um;
+    iov.iov_len = sizeof(*um);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    return sendmsg(sock, &msg, 0) == sizeof(*um) ? 1 : -1;
+}
+
+/*
+ * upgrade_start
+ *
+ * run the new binary and hand it the sockets and the shared cache. Once
+ * it is ready, stop accepting, serve the connections accepted so far, for
+ * at most UPGRADE_DRAIN seconds, and exit. return -1 if the new binary
+ * did not take over, we go on serving then.
+ */
+int upgrade_start() {
+    int fds[UPGRADE_MAX_FDS + 1];
+    char env[MAXLINE], ready;
+    struct timeval tv;
+    upgrade_msg um;
+    char **envp;
+    int sv[2], count, nenv, i;
+    pid_t pid;
+
+    if ((um.nlisteners = listeners_fds(fds, UPGRADE_MAX_FDS)) == 0) {
+        return -1;
+    }
+    count = um.nlisteners;
+    if ((um.shared = shm_fd() >= 0)) {
+        fds[count++] = shm_fd();
+    }
+
+    /* the environment of the new process, built before forking */
+    for (nenv = 0; environ[nenv] != NULL; nenv++)
+        ;
+    if ((envp = (char **)Malloc((nenv + 2) * sizeof(char *))) == NULL) {
+        return -1;
+    }
+    memcpy(envp, environ, nenv * sizeof(char *));
+    snprintf(env, MAXLINE, "%s=%d", UPGRADE_ENV, UPGRADE_FD);
+    envp[nenv] = env;
+    envp[nenv + 1] = NULL;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        unix_error("upgrade socketpair error");
+        Free(envp);
+        return -1;
+    }
+    if ((pid = fork()) < 0) {
+        unix_error("upgrade fork error");
+        Free(envp);
+        Close(sv[0]);
+        Close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        run_new(sv[1], envp);
+    }
+    Free(envp);
+    Close(sv[1]);
+
+    /* wait for the new process to be set up */
+    tv.tv_sec = UPGRADE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (send_fds(sv[0], &um, fds, count) == -1 ||
+        read(sv[0], &ready, 1) != 1) {
+        fprintf(stderr, "upgrade: new process %d did not take over, "
+                "still serving\n", (int)pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        Close(sv[0]);
+        return -1;
+    }
+    Close(sv[0]);
+
+    fprintf(stderr, "upgrade: handed over to pid %d, draining %ld "
+            "connections\n", (int)pid, listeners_active());
+    listeners_stop();
+    for (i = 0; listeners_active() > 0 && i < UPGRADE_DRAIN * 10; i++) {
+        usleep(100000);
+    }
+    fprintf(stderr, "upgrade: exiting with %ld connections left\n",
+            listeners_active());
+    exit(0);
+}
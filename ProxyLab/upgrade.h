@@ -0,0 +1,32 @@
+/*
+ * upgrade.h
+ *
+ * hot upgrade to a new binary without closing the port. On SIGHUP the
+ * proxy runs its binary again, with the same arguments, and passes it the
+ * listening sockets and the memfd of the shared cache over a UNIX socket
+ * with SCM_RIGHTS. Once the new process says it is ready, the old one
+ * stops accepting, serves the connections it accepted already and exits.
+ * The new one accepts from the same sockets, so no connection is refused,
+ * and serves hits from the shared cache it took over right away.
+ */
+
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+/* environment variable with the descriptor of the socket to the old one */
+#define UPGRADE_ENV "PROXYLAB_UPGRADE_FD"
+/* the descriptor that socket gets in the new process */
+#define UPGRADE_FD 3
+/* most listening sockets that are passed on */
+#define UPGRADE_MAX_FDS 64
+/* seconds the new process has to get ready */
+#define UPGRADE_TIMEOUT 10
+/* seconds the old one serves what it accepted before it exits anyway */
+#define UPGRADE_DRAIN 30
+
+void upgrade_init(char *argv[]);
+int upgrade_inherit(int *fds, int max, int *shared_fd);
+void upgrade_ready();
+int upgrade_start();
+
+#endif /* __UPGRADE_H__ */
@@ -0,0 +1,547 @@
+/*
+ * uring.c
+ *
+ * optional io_uring backend for the network I/O of the proxy, see uring.h.
+ * Built with HAVE_IO_URING only, otherwise every call fails and the proxy
+ * keeps to the plain system calls.
+ *
+ * The rings are shared with the kernel, so their head and tail indexes are
+ * read with acquire and written with release ordering. New entries are
+ * published to the kernel just before io_uring_enter.
+ */
+
+#include "csapp.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* what a completion belongs to, kept in user_data */
+enum { OP_ACCEPT = 1, OP_CONNECT, OP_TIMEOUT, OP_SEND, OP_RECV, OP_CANCEL };
+
+/* buffer group of the provided buffers */
+#define URING_BGID 0
+
+/* the ring of one thread */
+typedef struct uring {
+    int fd;                    /* the io_uring instance */
+    unsigned entries;          /* submission queue entries */
+    unsigned tail;             /* submission tail not yet published */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes; /* submission entries */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes; /* completion entries */
+    void *rings;               /* mapping of both queues */
+    size_t rings_len;          /* length of that mapping */
+    size_t sqes_len;           /* length of the sqes mapping */
+    struct io_uring_buf_ring *br; /* provided buffers, NULL until needed */
+    char *bufs;                /* memory of the provided buffers */
+    int accept_fd;             /* socket of the armed accept, -1 if none */
+} uring;
+
+static int enabled = 0;
+static pthread_key_t ring_key;
+static __thread uring *my_ring = NULL;
+
+/*
+ * ring_free
+ *
+ * tear down a ring, also the thread exit destructor. Nothing may be in
+ * flight on it but the multishot accept.
+ */
+static void ring_free(void *arg) {
+    uring *r = (uring *)arg;
+
+    close(r->fd);
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->rings, r->rings_len);
+    if (r->br != NULL) {
+        munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+        Free(r->bufs);
+    }
+    Free(r);
+}
+
+/*
+ * ring_setup
+ *
+ * create a ring and map its queues. return NULL if failed.
+ */
+static uring *ring_setup() {
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *base;
+    uring *r;
+
+    if ((r = (uring *)Calloc(1, sizeof(uring))) == NULL) {
+        return NULL;
+    }
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        Free(r);
+        return NULL;
+    }
+
+    /* both queues are in one mapping, every kernel with the multishot
+     * operations has IORING_FEAT_SINGLE_MMAP */
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->rings_len = sq_len > cq_len ? sq_len : cq_len;
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    base = MAP_FAILED;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        (base = mmap(NULL, r->rings_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd,
+                     IORING_OFF_SQ_RING)) == MAP_FAILED ||
+        (r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, r->fd,
+                        IORING_OFF_SQES)) == MAP_FAILED) {
+        if (base != MAP_FAILED) {
+            munmap(base, r->rings_len);
+        }
+        close(r->fd);
+        Free(r);
+        return NULL;
+    }
+
+    r->rings = base;
+    r->entries = p.sq_entries;
+    r->sq_head = (unsigned *)(base + p.sq_off.head);
+    r->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(base + p.sq_off.array);
+    r->cq_head = (unsigned *)(base + p.cq_off.head);
+    r->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+    r->accept_fd = -1;
+    return r;
+}
+
+/*
+ * get_ring
+ *
+ * the ring of the calling thread, set up on first use. return NULL if it
+ * can not be set up.
+ */
+static uring *get_ring() {
+    if (my_ring == NULL && (my_ring = ring_setup()) != NULL) {
+        pthread_setspecific(ring_key, my_ring);
+    }
+    return my_ring;
+}
+
+/*
+ * get_sqe
+ *
+ * a cleared submission entry. The operations never queue more than a few
+ * entries, far below URING_ENTRIES, so there always is one.
+ */
+static struct io_uring_sqe *get_sqe(uring *r, int opcode, int fd,
+                                    unsigned long user_data) {
+    unsigned index = r->tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    r->tail++;
+    return sqe;
+}
+
+/*
+ * ring_enter
+ *
+ * submit what is queued and wait for at least wait completions. return -1
+ * if failed.
+ */
+static int ring_enter(uring *r, unsigned wait) {
+    unsigned queued;
+
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    while (1) {
+        queued = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, r->fd, queued, wait,
+                    wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0) {
+            return 1;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/* the next completion, NULL if there is none yet */
+static struct io_uring_cqe *peek_cqe(uring *r) {
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+/* done with the completion peek_cqe gave */
+static void cqe_seen(uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * wait_cqe
+ *
+ * submit what is queued and wait for the next completion. return NULL if
+ * the ring failed.
+ */
+static struct io_uring_cqe *wait_cqe(uring *r) {
+    struct io_uring_cqe *cqe;
+
+    /* entries queued meanwhile are submitted by the enter that waits */
+    while ((cqe = peek_cqe(r)) == NULL) {
+        if (ring_enter(r, 1) == -1) {
+            return NULL;
+        }
+    }
+    return cqe;
+}
+
+/* give provided buffer bid back to the kernel */
+static void buf_return(uring *r, int bid) {
+    unsigned short tail = r->br->tail;
+    struct io_uring_buf *buf = &r->br->bufs[tail & (URING_BUFS - 1)];
+
+    buf->addr = (unsigned long)(r->bufs + bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&r->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * buf_ring_setup
+ *
+ * register the provided buffers of a ring and hand them all to the
+ * kernel. return -1 if failed.
+ */
+static int buf_ring_setup(uring *r) {
+    struct io_uring_buf_reg reg;
+    size_t len = URING_BUFS * sizeof(struct io_uring_buf);
+    int i;
+
+    if ((r->br = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if ((r->bufs = (char *)Malloc(URING_BUFS * URING_BUF_SIZE)) == NULL ||
+        syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        munmap(r->br, len);
+        r->br = NULL;
+        Free(r->bufs);
+        return -1;
+    }
+    for (i = 0; i < URING_BUFS; i++) {
+        buf_return(r, i);
+    }
+    return 1;
+}
+
+/* queue a multishot recv from fd into the provided buffers */
+static void arm_recv(uring *r, int fd) {
+    struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_RECV, fd, OP_RECV);
+
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+}
+
+/*
+ * probe
+ *
+ * check on a throwaway ring that the running kernel does what the backend
+ * needs: provided buffer rings and multishot recv. return -1 if not.
+ */
+static int probe() {
+    struct io_uring_cqe *cqe;
+    int sv[2], rc = -1;
+    uring *r;
+
+    if ((r = ring_setup()) == NULL) {
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        ring_free(r);
+        return -1;
+    }
+    if (buf_ring_setup(r) == 1 && write(sv[1], "x", 1) == 1) {
+        arm_recv(r, sv[0]);
+        if ((cqe = wait_cqe(r)) != NULL && cqe->res == 1 &&
+            (cqe->flags & IORING_CQE_F_BUFFER)) {
+            rc = 1;
+        }
+    }
+    /* closing the ring cancels the recv still armed */
+    ring_free(r);
+    close(sv[0]);
+    close(sv[1]);
+    return rc;
+}
+
+/*
+ * uring_init
+ *
+ * turn the backend on if the kernel supports it. Call once before any
+ * other thread uses it. return -1 if it stays off.
+ */
+int uring_init() {
+    if (probe() == -1) {
+        return -1;
+    }
+    pthread_key_create(&ring_key, ring_free);
+    enabled = 1;
+    return 1;
+}
+
+/*
+ * uring_enabled
+ *
+ * return 1 if the backend is on.
+ */
+int uring_enabled() {
+    return enabled;
+}
+
+/*
+ * uring_accept
+ *
+ * wait for new connections on listenfd, keeping one multishot accept armed
+ * on the ring of the calling thread. Fills at most max accepted sockets in
+ * fds. return how many, -1 if the kernel can not do it.
+ */
+int uring_accept(int listenfd, int *fds, int max) {
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    int n = 0, failed = 0;
+    uring *r;
+
+    if ((r = get_ring()) == NULL) {
+        return -1;
+    }
+    if (r->accept_fd != listenfd) {
+        sqe = get_sqe(r, IORING_OP_ACCEPT, listenfd, OP_ACCEPT);
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        r->accept_fd = listenfd;
+    }
+    if ((cqe = wait_cqe(r)) == NULL) {
+        return -1;
+    }
+    do {
+        /* the accept is no longer armed, arm it again next time */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            r->accept_fd = -1;
+        }
+        if (cqe->res >= 0) {
+            fds[n++] = cqe->res;
+        } else if (cqe->res == -EINVAL) {
+            failed = 1;
+        }
+        cqe_seen(r);
+    } while (n < max && (cqe = peek_cqe(r)) != NULL);
+    return n == 0 && failed ? -1 : n;
+}
+
+/*
+ * uring_connect_send
+ *
+ * connect fd to addr and send the n bytes of buf, as one chain: the
+ * connect, a timeout for it, and the send that only runs once connected.
+ * return -1 if failed to connect, -2 if failed to send.
+ */
+int uring_connect_send(int fd, struct sockaddr *addr, socklen_t addrlen,
+                       char *buf, size_t n) {
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    int i, rc = 1;
+    uring *r;
+
+    if ((r = get_ring()) == NULL) {
+        return -1;
+    }
+    ts.tv_sec = URING_CONNECT_TIMEOUT;
+    ts.tv_nsec = 0;
+    sqe = get_sqe(r, IORING_OP_CONNECT, fd, OP_CONNECT);
+    sqe->addr = (unsigned long)addr;
+    sqe->off = addrlen;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = get_sqe(r, IORING_OP_LINK_TIMEOUT, -1, OP_TIMEOUT);
+    sqe->addr = (unsigned long)&ts;
+    sqe->len = 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = get_sqe(r, IORING_OP_SEND, fd, OP_SEND);
+    sqe->addr = (unsigned long)buf;
+    sqe->len = n;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+
+    /* every one of the three completes, failed links with -ECANCELED */
+    for (i = 0; i < 3; i++) {
+        if ((cqe = wait_cqe(r)) == NULL) {
+            return -1;
+        }
+        if (cqe->user_data == OP_CONNECT && cqe->res < 0) {
+            rc = -1;
+        } else if (cqe->user_data == OP_SEND && cqe->res != (int)n &&
+                   rc == 1) {
+            rc = -2;
+        }
+        cqe_seen(r);
+    }
+    return rc;
+}
+
+/*
+ * uring_relay
+ *
+ * copy from from_fd to to_fd until the end of from_fd. A multishot recv
+ * fills the provided buffers, and whatever arrived while the last send
+ * was in flight goes out with the next sendmsg, so one io_uring_enter
+ * does the work of many reads and writes. on_data sees every piece in
+ * order as it arrives. return the number of bytes copied, -1 if failed,
+ * -2 if only writing to_fd did.
+ */
+long uring_relay(int from_fd, int to_fd,
+                 void (*on_data)(void *arg, char *buf, int len), void *arg) {
+    struct iovec iov[URING_BUFS];
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    struct msghdr msg;
+    int ready[URING_BUFS];     /* buffers received, not yet sent, in order */
+    int lens[URING_BUFS];      /* bytes in each of them */
+    int nready = 0;            /* buffers in ready */
+    int nsending = 0;          /* first ones of ready being sent */
+    int armed = 0, canceling = 0, eof = 0;
+    int failed = 0;            /* 1 if the recv failed, 2 if only a send */
+    long total = 0, sending = 0;
+    int i, bid;
+    uring *r;
+
+    if ((r = get_ring()) == NULL ||
+        (r->br == NULL && buf_ring_setup(r) == -1)) {
+        return -1;
+    }
+    while (1) {
+        /* receive while there are free buffers */
+        if (!armed && !eof && !failed && nready < URING_BUFS) {
+            arm_recv(r, from_fd);
+            armed = 1;
+        }
+        /* send everything that came in so far */
+        if (nsending == 0 && nready > 0 && !failed) {
+            sending = 0;
+            for (i = 0; i < nready; i++) {
+                iov[i].iov_base = r->bufs + ready[i] * URING_BUF_SIZE;
+                iov[i].iov_len = lens[i];
+                sending += lens[i];
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nready;
+            sqe = get_sqe(r, IORING_OP_SENDMSG, to_fd, OP_SEND);
+            sqe->addr = (unsigned long)&msg;
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            nsending = nready;
+        }
+        /* on failure, stop the recv */
+        if (failed && armed && !canceling) {
+            sqe = get_sqe(r, IORING_OP_ASYNC_CANCEL, -1, OP_CANCEL);
+            sqe->addr = OP_RECV;
+            canceling = 1;
+        }
+        if (!armed && !canceling && nsending == 0 &&
+            (nready == 0 || failed)) {
+            break;
+        }
+
+        if ((cqe = wait_cqe(r)) == NULL) {
+            return -1;
+        }
+        if (cqe->user_data == OP_RECV) {
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                armed = 0;
+            }
+            if (cqe->res > 0) {
+                bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                ready[nready] = bid;
+                lens[nready++] = cqe->res;
+                total += cqe->res;
+                on_data(arg, r->bufs + bid * URING_BUF_SIZE, cqe->res);
+            } else if (cqe->res == 0) {
+                eof = 1;
+            } else if (cqe->res != -ENOBUFS) {
+                /* no buffers just means they all wait to be sent */
+                failed = 1;
+            }
+        } else if (cqe->user_data == OP_SEND) {
+            if (cqe->res != sending && !failed) {
+                failed = 2;
+            }
+            for (i = 0; i < nsending; i++) {
+                buf_return(r, ready[i]);
+            }
+            for (i = nsending; i < nready; i++) {
+                ready[i - nsending] = ready[i];
+                lens[i - nsending] = lens[i];
+            }
+            nready -= nsending;
+            nsending = 0;
+        } else if (cqe->user_data == OP_CANCEL) {
+            canceling = 0;
+        }
+        cqe_seen(r);
+    }
+
+    /* buffers never sent go back too */
+    for (i = 0; i < nready; i++) {
+        buf_return(r, ready[i]);
+    }
+    if (failed) {
+        return failed == 2 ? -2 : -1;
+    }
+    return total;
+}
+
+#else /* !HAVE_IO_URING */
+
+/* built without io_uring, the backend is always off */
+int uring_init() {
+    return -1;
+}
+
+int uring_enabled() {
+    return 0;
+}
+
+int uring_accept(int listenfd, int *fds, int max) {
+    return -1;
+}
+
+int uring_connect_send(int fd, struct sockaddr *addr, socklen_t addrlen,
+                       char *buf, size_t n) {
+    return -1;
+}
+
+long uring_relay(int from_fd, int to_fd,
+                 void (*on_data)(void *arg, char *buf, int len), void *arg) {
+    return -1;
+}
+
+#endif /* HAVE_IO_URING */
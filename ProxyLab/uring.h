@@ -0,0 +1,43 @@
+/*
+ * uring.h
+ *
+ * optional io_uring backend for the network I/O of the proxy, on the raw
+ * system calls. Every thread gets its own ring on first use. A listener
+ * keeps one multishot accept armed that takes every new connection, a miss
+ * connects to the origin and sends the request in one submission with a
+ * linked timeout, and the response body is received with a multishot recv
+ * into a ring of provided buffers while what came in so far is sent on to
+ * the client with one sendmsg.
+ *
+ * The Makefile only builds the backend if the kernel headers have it, and
+ * uring_init checks that the running kernel does, otherwise
+ * uring_enabled() stays 0 and the proxy uses the plain system calls.
+ *
+ * A thread has at most one operation in progress on its ring, and each of
+ * them waits for all of its completions before it returns, except the
+ * multishot accept of a listener, which stays armed across calls.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/socket.h>
+
+/* submission queue entries of a ring */
+#define URING_ENTRIES 64
+/* provided buffers of a ring for recv, a power of 2 */
+#define URING_BUFS 16
+/* size of each provided buffer */
+#define URING_BUF_SIZE 16384
+/* seconds a connect to the origin may take */
+#define URING_CONNECT_TIMEOUT 10
+
+int uring_init();
+int uring_enabled();
+int uring_accept(int listenfd, int *fds, int max);
+int uring_connect_send(int fd, struct sockaddr *addr, socklen_t addrlen,
+                       char *buf, size_t n);
+long uring_relay(int from_fd, int to_fd,
+                 void (*on_data)(void *arg, char *buf, int len), void *arg);
+
+#endif /* __URING_H__ */